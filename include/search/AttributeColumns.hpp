@@ -0,0 +1,126 @@
+//
+//  AttributeColumns.hpp
+//
+//  Created by Ignac Banic on 18/10/26.
+//  Copyright © 2026 Ignac Banic. All rights reserved.
+//
+
+#pragma once
+
+#include <search/Bitmap.hpp>
+
+#include <boost/iostreams/device/mapped_file.hpp>
+#include <cstdint>
+#include <filesystem>
+#include <limits>
+#include <optional>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace Search {
+
+// Document class with std::vector<int64_t> attributes() const has columns
+// of integer attributes, eg. tenant, enum or timestamp. Value of each column
+// is at same row for all documents. Ids must be unsigned integers.
+template <class T, class = void>
+struct HasAttributes : std::false_type {};
+template <class T>
+struct HasAttributes<
+    T, std::void_t<decltype(std::declval<const T&>().attributes())>>
+    : std::true_type {};
+
+// Condition on one column of attributes, value must be in range and in
+// values when they are given.
+struct AttributeFilter {
+  size_t column = 0;
+  int64_t min = std::numeric_limits<int64_t>::min();
+  int64_t max = std::numeric_limits<int64_t>::max();
+  // sorted
+  std::vector<int64_t> values;
+
+  static AttributeFilter eq(size_t column, int64_t value);
+  // min and max are included
+  static AttributeFilter range(size_t column, int64_t min, int64_t max);
+  static AttributeFilter in(size_t column, std::vector<int64_t> values);
+
+  bool matches(int64_t value) const;
+};
+
+// Columns of attributes in mapped file, changed in place. Each document
+// has a row, rows of documents are first and removed row is replaced by last
+// one, so ids can be sparse. Column has value and bit of presence of each
+// row, value is not present in columns which document doesn't have and no
+// filter matches it. File is copied to bigger one when rows or columns run
+// out.
+class AttributeColumns {
+public:
+  static const uint64_t Version = 2;
+  // version, number of columns, number of rows and rows of documents
+  static const uint64_t HeaderSize = 4 * sizeof(uint64_t);
+  // multiple of 64, so presence of column is in whole words
+  static const uint64_t MinRows = 1024;
+
+private:
+  fs::path path_;
+  boost::iostreams::mapped_file file_;
+  // without path columns are in memory
+  std::vector<uint64_t> memory_;
+  uint64_t numColumns_ = 0;
+  uint64_t numRows_ = 0;
+  uint64_t numUsed_ = 0;
+  // row of each id
+  std::unordered_map<uint64_t, uint64_t> rows_;
+
+  /*
+  - - - - - - - - - - -
+  Data after header:
+  - - - - - - - - - - -
+   * id of each row (numRows * 8)
+   * values of each column (numColumns * numRows * 8)
+   * presence bits of each column (numColumns * numRows / 8)
+  - - - - - - - - - - -
+  */
+  const uint64_t* data() const;
+  uint64_t* data();
+  static uint64_t dataWords(uint64_t numColumns, uint64_t numRows);
+  const uint64_t* ids() const { return data(); }
+  uint64_t* ids() { return data(); }
+  const uint64_t* column(size_t i) const;
+  uint64_t* column(size_t i);
+  const uint64_t* presence(size_t i) const;
+  uint64_t* presence(size_t i);
+  void setNumUsed(uint64_t n);
+  void resize(uint64_t numColumns, uint64_t numRows);
+  void openFile();
+
+public:
+  // only in memory
+  AttributeColumns() = default;
+  // missing file has no columns
+  explicit AttributeColumns(const fs::path& path);
+  AttributeColumns(const AttributeColumns&) = delete;
+  AttributeColumns& operator=(const AttributeColumns&) = delete;
+  AttributeColumns(AttributeColumns&&) = default;
+  AttributeColumns& operator=(AttributeColumns&&) = default;
+
+  static bool isFileVersionOk(const fs::path& path);
+
+  void set(uint64_t id, const std::vector<int64_t>& values);
+  void remove(uint64_t id);
+  // empty for columns the document doesn't have
+  std::vector<std::optional<int64_t>> get(uint64_t id) const;
+  // ids which pass all filters, filters are not empty
+  Bitmap find(const std::vector<AttributeFilter>& filters) const;
+  // writes changed pages of mapped file to disk
+  void flush();
+  void clear();
+  uint64_t numColumns() const { return numColumns_; }
+  // number of documents
+  uint64_t numRows() const { return numUsed_; }
+};
+
+} // namespace Search
@@ -0,0 +1,131 @@
+//
+//  Bitmap.hpp
+//
+//  Created by Ignac Banic on 18/10/26.
+//  Copyright © 2026 Ignac Banic. All rights reserved.
+//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace Search {
+
+inline int popCount(uint64_t x) {
+#ifdef _MSC_VER
+  return (int)__popcnt64(x);
+#else
+  return __builtin_popcountll(x);
+#endif
+}
+
+// x must not be 0
+inline int countTrailingZeros64(uint64_t x) {
+#ifdef _MSC_VER
+  unsigned long n;
+  _BitScanForward64(&n, x);
+  return (int)n;
+#else
+  return __builtin_ctzll(x);
+#endif
+}
+
+// Compressed set of numbers. Numbers are split into containers by upper 48
+// bits. Sparse container is sorted array, dense is bitset and container with
+// long sequences stores runs.
+class Bitmap {
+public:
+  static const size_t ContainerWords = 1024;
+  static const size_t ArrayMaxSize = 4096;
+
+  class Container {
+  public:
+    enum class Type : uint8_t { Array, Bitset, Run };
+
+    uint64_t key = 0;
+    Type type = Type::Array;
+    uint32_t cardinality = 0;
+    // Array: sorted numbers, Run: pairs of start and length - 1
+    std::vector<uint16_t> array;
+    // Bitset: ContainerWords words
+    std::vector<uint64_t> words;
+
+    bool contains(uint16_t n) const;
+    // fills ContainerWords words
+    void toWords(uint64_t* w) const;
+    // chooses smallest type
+    void fromWords(const uint64_t* w);
+    size_t sizeInBytes() const;
+
+    template <class TFunc>
+    void forEach(TFunc func) const {
+      uint64_t base = key << 16;
+      if (type == Type::Array) {
+        for (auto n : array) {
+          func(base + n);
+        }
+      } else if (type == Type::Bitset) {
+        for (size_t i = 0; i < ContainerWords; ++i) {
+          uint64_t w = words[i];
+          while (w) {
+            func(base + i * 64 + countTrailingZeros64(w));
+            w &= w - 1;
+          }
+        }
+      } else {
+        for (size_t i = 0; i < array.size(); i += 2) {
+          uint64_t start = base + array[i];
+          for (uint64_t n = start; n <= start + array[i + 1]; ++n) {
+            func(n);
+          }
+        }
+      }
+    }
+  };
+
+private:
+  // sorted by key
+  std::vector<Container> containers_;
+
+public:
+  static Bitmap fromSorted(const uint64_t* begin, const uint64_t* end);
+
+  void add(uint64_t n);
+  bool contains(uint64_t n) const;
+  bool empty() const { return containers_.empty(); }
+  uint64_t cardinality() const;
+  size_t sizeInBytes() const;
+  void clear() { containers_.clear(); }
+
+  // key must be bigger than keys of all containers
+  void appendWords(uint64_t key, const uint64_t* words);
+  // converts containers to smallest type
+  void optimize();
+  const std::vector<Container>& containers() const { return containers_; }
+
+  void andWith(const Bitmap& b);
+  void orWith(const Bitmap& b);
+  void andNotWith(const Bitmap& b);
+
+  template <class T>
+  std::vector<T> values() const {
+    std::vector<T> arr;
+    arr.reserve(cardinality());
+    for (const auto& c : containers_) {
+      c.forEach([&](uint64_t n) { arr.push_back((T)n); });
+    }
+    return arr;
+  }
+};
+
+Bitmap bitmapAnd(const Bitmap& a, const Bitmap& b);
+Bitmap bitmapOr(const Bitmap& a, const Bitmap& b);
+Bitmap bitmapAndNot(const Bitmap& a, const Bitmap& b);
+
+} // namespace Search
@@ -0,0 +1,180 @@
+//
+//  Compaction.hpp
+//
+//  Created by Ignac Banic on 18/10/26.
+//  Copyright © 2026 Ignac Banic. All rights reserved.
+//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+
+namespace fs = std::filesystem;
+
+namespace Search {
+
+class Compactor;
+
+// Background compaction of KeyValueFile or KeyValueFileList. Live keys are
+// copied to new file in small steps by Compactor. Writers hold the mutex,
+// keys they change after their bucket was copied are copied again. When
+// everything is copied new file replaces old one in Compactor thread if it
+// has mutex of readers, otherwise on next write.
+//
+// File gives createCompactTarget(), copyBucketToCompacted() and
+// copyToCompacted(), which return number of copied bytes.
+template <class TFile>
+struct Compaction {
+  // when fewer keys are left, they are copied at once and file is replaced
+  static const size_t MaxDirty = 1000;
+
+  std::mutex mutex;
+  Compactor* compactor = nullptr;
+  // readers of file hold it shared and writers unique
+  std::shared_mutex* readersMutex = nullptr;
+  std::unique_ptr<TFile> target;
+  uint64_t nextBucket = 0;
+  bool copied = false;
+  std::unordered_set<std::string> dirty;
+
+  static void setCompactor(std::unique_ptr<Compaction>& c, TFile& file,
+                           Compactor* compactor,
+                           std::shared_mutex* readersMutex) {
+    if (compactor) {
+      if (!c) {
+        c.reset(new Compaction());
+      }
+      c->compactor = compactor;
+      c->readersMutex = readersMutex;
+      return;
+    }
+    if (c) {
+      {
+        std::lock_guard<std::mutex> lock(c->mutex);
+        c->abort(file);
+      }
+      c.reset();
+    }
+  }
+
+  static std::unique_lock<std::mutex> lock(std::unique_ptr<Compaction>& c) {
+    if (!c) {
+      return {};
+    }
+    return std::unique_lock<std::mutex>(c->mutex);
+  }
+
+  static fs::path targetPath(const TFile& file) {
+    auto pth = file.path_;
+    pth += ".compact";
+    return pth;
+  }
+
+  // returns true when there is more work, mutex must be locked
+  bool step(TFile& file, uint64_t minWasted, size_t maxBytes) {
+    if (file.importing_ || file.locked_ || file.buffer_) {
+      return false;
+    }
+    if (!target) {
+      if (file.wasted() < minWasted) {
+        return false;
+      }
+      target = file.createCompactTarget(targetPath(file));
+      target->locked_ = true;
+      reset();
+    }
+
+    size_t n = 0;
+    if (!copied) {
+      auto numB = file.numBuckets();
+      while (nextBucket < numB && n < maxBytes) {
+        n += file.copyBucketToCompacted(nextBucket);
+        nextBucket++;
+      }
+      copied = nextBucket == numB;
+      return true;
+    }
+
+    while (dirty.size() > MaxDirty && n < maxBytes) {
+      auto ptr = dirty.begin();
+      n += file.copyToCompacted(*ptr);
+      dirty.erase(ptr);
+    }
+    return dirty.size() > MaxDirty;
+  }
+
+  bool isReady() const { return target && copied && dirty.size() <= MaxDirty; }
+
+  // key was changed by writer, mutex must be locked
+  void markChanged(TFile& file, std::string_view key) {
+    if (!target) {
+      return;
+    }
+    if (!copied && file.calcBucket(key) >= nextBucket) {
+      // not copied yet
+      return;
+    }
+    dirty.insert(std::string(key));
+    if (isReady()) {
+      install(file);
+    }
+  }
+
+  // readers of file must not run, mutex must be locked
+  void install(TFile& file) {
+    for (const auto& key : dirty) {
+      file.copyToCompacted(key);
+    }
+    target.reset();
+    file.file_.close();
+    fs::rename(targetPath(file), file.path_);
+    file.openFile();
+    reset();
+  }
+
+  // called by Compactor without mutex, waits for readers
+  void installReady(TFile& file) {
+    if (!readersMutex) {
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock2(mutex);
+      if (!isReady()) {
+        return;
+      }
+    }
+    // writers lock readers first, so order is same
+    std::unique_lock<std::shared_mutex> readers(*readersMutex);
+    std::lock_guard<std::mutex> lock2(mutex);
+    if (isReady()) {
+      install(file);
+    }
+  }
+
+  // mutex must be locked
+  void abort(const TFile& file) {
+    if (!target) {
+      return;
+    }
+    target.reset();
+    fs::remove(targetPath(file));
+    reset();
+  }
+
+private:
+  void reset() {
+    dirty.clear();
+    copied = false;
+    nextBucket = 0;
+  }
+};
+
+} // namespace Search
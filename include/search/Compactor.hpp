@@ -0,0 +1,72 @@
+//
+//  Compactor.hpp
+//
+//  Created by Ignac Banic on 18/10/26.
+//  Copyright © 2026 Ignac Banic. All rights reserved.
+//
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <vector>
+
+namespace Search {
+
+class KeyValueFile;
+class KeyValueFileList;
+
+// Reclaims wasted space of registered files in background thread. Each step
+// copies at most bytesPerStep bytes to new file, between steps thread sleeps
+// so writers are not blocked for long. Registered files don't rewrite
+// themselves when wasted space grows. Copied file replaces old one in this
+// thread when readersMutex is given, which readers of file hold shared and
+// writers unique, otherwise on next write.
+class Compactor {
+public:
+  struct Settings {
+    // files with less wasted bytes are not compacted
+    uint64_t minWasted = 30'000'000;
+    size_t bytesPerStep = 4'000'000;
+    // pause between steps of running compaction
+    std::chrono::milliseconds pause{5};
+    // how often are files checked
+    std::chrono::milliseconds interval{500};
+  };
+
+private:
+  Settings settings_;
+  std::vector<KeyValueFile*> files_;
+  std::vector<KeyValueFileList*> fileLists_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  bool stop_;
+  std::thread thread_;
+
+public:
+  Compactor();
+  explicit Compactor(const Settings& settings);
+  ~Compactor();
+  Compactor(const Compactor&) = delete;
+  Compactor& operator=(const Compactor&) = delete;
+
+  // files are not added or removed while their readersMutex is locked
+  void add(KeyValueFile& file, std::shared_mutex* readersMutex = nullptr);
+  void add(KeyValueFileList& file, std::shared_mutex* readersMutex = nullptr);
+  void remove(KeyValueFile& file);
+  void remove(KeyValueFileList& file);
+  // copies all files in calling thread, those without readersMutex are
+  // replaced on next write
+  void compactAll();
+
+private:
+  bool step();
+  void run();
+};
+
+} // namespace Search
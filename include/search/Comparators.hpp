@@ -10,23 +10,42 @@
 #include <search/SearchSettings.hpp>
 #include <search/Tokenize.hpp>
 
+#include <algorithm>
 #include <atomic>
+#include <cstring>
 #include <functional>
 #include <limits>
 #include <map>
+#include <optional>
 #include <string>
+#include <string_view>
+#include <utility>
 #include <vector>
 
 namespace Search {
 
+// same as joinTokens, for Result and ResultView
+template <class T>
+std::string joinResultTokens(const T& d) {
+  std::string txt;
+  d.forEachToken([&](std::string_view tk) {
+    if (!txt.empty() && !tk.empty()) {
+      txt += " ";
+    }
+    txt += tk;
+  });
+  return txt;
+}
+
 template <class TRes>
 class CompIsWhole {
 private:
   const std::vector<std::string>* tokens_;
   mutable std::vector<uint8_t> cache;
 
-  bool calc(const std::vector<std::string>& tks) const {
-    auto tks2 = joinTokens(tks);
+  template <class T>
+  bool calc(const T& d) const {
+    auto tks2 = joinResultTokens(d);
     for (const auto& tk : *tokens_) {
       if (!tokensOverlap(tks2, tk)) {
         return false;
@@ -36,9 +55,18 @@ private:
   }
 
 public:
+  // bits of key, smaller key is sorted first
+  static const int KeyBits = 1;
+  // reads only tokens, documents of ResultView are not loaded
+  static const bool UsesView = true;
+
+  // same for comparators which give same order, pages are cached by it
+  std::string cacheKey() const { return "whole"; }
+
   CompIsWhole() = default;
 
-  void init(const std::vector<TRes>& all,
+  template <class T>
+  void init(const std::vector<T>& all,
             const SearchSettings<typename TRes::TDoc>& sett) {
     tokens_ = &sett.tokens;
     cache = std::vector<uint8_t>(all.size(), 0);
@@ -46,12 +74,18 @@ public:
 
   void clean() {}
 
-  int compare(const TRes& d1, const TRes& d2) const {
+  template <class T>
+  uint64_t key(const T& d) const {
+    return calc(d) ? 0 : 1;
+  }
+
+  template <class T>
+  int compare(const T& d1, const T& d2) const {
     if (!cache[d1.index]) {
-      cache[d1.index] = calc(d1.tokens) ? 10 : 8;
+      cache[d1.index] = calc(d1) ? 10 : 8;
     }
     if (!cache[d2.index]) {
-      cache[d2.index] = calc(d2.tokens) ? 10 : 8;
+      cache[d2.index] = calc(d2) ? 10 : 8;
     }
     auto h1 = cache[d1.index] == 10;
     auto h2 = cache[d2.index] == 10;
@@ -73,9 +107,15 @@ private:
   std::vector<size_t> lens_;
 
 public:
+  static const int KeyBits = 8;
+  static const bool UsesView = true;
+
   CompWordsTogether() = default;
 
-  void init(const std::vector<TRes>& all,
+  std::string cacheKey() const { return "together"; }
+
+  template <class T>
+  void init(const std::vector<T>& all,
             const SearchSettings<typename TRes::TDoc>& sett) {
     cache = std::vector<uint8_t>(all.size(), 0);
     tokensSearch_ = joinTokens(sett.tokens);
@@ -97,8 +137,9 @@ public:
 
   void clean() {}
 
-  uint8_t calc(const std::vector<std::string>& tokensAll2) const {
-    auto tokensAll = joinTokens(tokensAll2);
+  template <class T>
+  uint8_t calc(const T& d) const {
+    auto tokensAll = joinResultTokens(d);
     for (uint8_t i = lens_.size(); i > 0; --i) {
       std::string_view tks2(tokensSearch_.data(), lens_[i - 1]);
       if (tokensOverlap(tokensAll, tks2)) {
@@ -108,12 +149,18 @@ public:
     return 0;
   }
 
-  int compare(const TRes& d1, const TRes& d2) const {
+  template <class T>
+  uint64_t key(const T& d) const {
+    return 255 - calc(d);
+  }
+
+  template <class T>
+  int compare(const T& d1, const T& d2) const {
     if (!cache[d1.index]) {
-      cache[d1.index] = calc(d1.tokens) + 1;
+      cache[d1.index] = calc(d1) + 1;
     }
     if (!cache[d2.index]) {
-      cache[d2.index] = calc(d2.tokens) + 1;
+      cache[d2.index] = calc(d2) + 1;
     }
     auto n1 = cache[d1.index] - 1;
     auto n2 = cache[d2.index] - 1;
@@ -127,19 +174,186 @@ public:
   }
 };
 
+// Sorts by BM25 score. Scores are calculated by findMany from frequencies
+// in postings before documents are loaded, so only documents of requested
+// page are loaded.
+template <class TRes>
+class CompBM25 {
+private:
+  float k1_;
+  float b_;
+
+public:
+  static const int KeyBits = 32;
+  // comparator doesn't need documents, only score
+  static const bool UsesScore = true;
+  // best results can be found without scoring all matches
+  static const bool FindsTop = true;
+  // index of score in results, set by findMany
+  size_t scoreSlot = 0;
+
+  CompBM25(float k1 = 1.2f, float b = 0.75f) : k1_(k1), b_(b) {}
+
+  std::string cacheKey() const {
+    return "bm25 " + std::to_string(k1_) + ' ' + std::to_string(b_);
+  }
+
+  template <class T>
+  void init(const std::vector<T>&,
+            const SearchSettings<typename TRes::TDoc>&) {}
+
+  void clean() {}
+
+  template <class TDb>
+  std::vector<float>
+  score(const TDb& db, const SearchSettings<typename TRes::TDoc>& sett,
+        const std::vector<typename TRes::TDoc::TId>& ids,
+        const typename TDb::ReadLock& lock) const {
+    return db.scoreBM25(sett, ids, lock, k1_, b_);
+  }
+
+  // best k ids with scores, nullopt when all ids must be scored
+  template <class TDb>
+  std::optional<std::vector<std::pair<typename TRes::TDoc::TId, float>>>
+  findTop(const TDb& db, const SearchSettings<typename TRes::TDoc>& sett,
+          size_t k, const typename TDb::ReadLock& lock) const {
+    return db.findTopBM25(sett, k, lock, k1_, b_);
+  }
+
+  // bits of positive float are in same order as floats
+  template <class T>
+  uint64_t key(const T& d) const {
+    uint32_t bits;
+    float score = std::max(d.scores[scoreSlot], 0.0f);
+    std::memcpy(&bits, &score, sizeof(bits));
+    return 0xFFFFFFFF - bits;
+  }
+
+  template <class T>
+  int compare(const T& d1, const T& d2) const {
+    auto s1 = d1.scores[scoreSlot];
+    auto s2 = d2.scores[scoreSlot];
+    if (s1 > s2) {
+      return -1;
+    }
+    if (s2 > s1) {
+      return 1;
+    }
+    return 0;
+  }
+};
+
+// Same order as CompWordsTogether, number of first query tokens which are
+// next to each other in one text. It is calculated from positions in index
+// when Db stores them, otherwise from tokens of documents.
+template <class TRes>
+class CompProximity {
+public:
+  static const int KeyBits = 8;
+  static const bool UsesScore = true;
+  // index of score in results, set by findMany
+  size_t scoreSlot = 0;
+
+  std::string cacheKey() const { return "proximity"; }
+
+  template <class T>
+  void init(const std::vector<T>&,
+            const SearchSettings<typename TRes::TDoc>&) {}
+
+  void clean() {}
+
+  template <class TDb>
+  std::vector<float>
+  score(const TDb& db, const SearchSettings<typename TRes::TDoc>& sett,
+        const std::vector<typename TRes::TDoc::TId>& ids,
+        const typename TDb::ReadLock& lock) const {
+    return db.scoreProximity(sett, ids, lock);
+  }
+
+  template <class T>
+  uint64_t key(const T& d) const {
+    return 255 - (uint64_t)std::min(d.scores[scoreSlot], 255.0f);
+  }
+
+  template <class T>
+  int compare(const T& d1, const T& d2) const {
+    auto s1 = d1.scores[scoreSlot];
+    auto s2 = d2.scores[scoreSlot];
+    if (s1 > s2) {
+      return -1;
+    }
+    if (s2 > s1) {
+      return 1;
+    }
+    return 0;
+  }
+};
+
+// Sorts by sum of edit distances between query tokens and closest tokens
+// of document, with SearchSettings::fuzzyDistance. Exact matches are first.
+template <class TRes>
+class CompFuzzy {
+public:
+  static const int KeyBits = 8;
+  static const bool UsesScore = true;
+  // index of score in results, set by findMany
+  size_t scoreSlot = 0;
+
+  std::string cacheKey() const { return "fuzzy"; }
+
+  template <class T>
+  void init(const std::vector<T>&,
+            const SearchSettings<typename TRes::TDoc>&) {}
+
+  void clean() {}
+
+  template <class TDb>
+  std::vector<float>
+  score(const TDb& db, const SearchSettings<typename TRes::TDoc>& sett,
+        const std::vector<typename TRes::TDoc::TId>& ids,
+        const typename TDb::ReadLock& lock) const {
+    return db.scoreFuzzy(sett, ids, lock);
+  }
+
+  template <class T>
+  uint64_t key(const T& d) const {
+    return (uint64_t)std::min(d.scores[scoreSlot], 255.0f);
+  }
+
+  template <class T>
+  int compare(const T& d1, const T& d2) const {
+    auto s1 = d1.scores[scoreSlot];
+    auto s2 = d2.scores[scoreSlot];
+    if (s1 < s2) {
+      return -1;
+    }
+    if (s2 < s1) {
+      return 1;
+    }
+    return 0;
+  }
+};
+
 // comparator that requires function for callback
-// callback should update array with text priorities
+// callback should update array with text priorities, with inThreads it can
+// be called from more threads at once
 template <class TRes>
 class CompPriorityTextsCallback {
 private:
   const SearchSettings<typename TRes::TDoc>* sett_;
   mutable std::vector<uint8_t> cache_;
   std::function<void(const typename TRes::TDoc, std::vector<uint8_t>&)> cb_;
+  bool inThreads_;
 
 public:
+  static const int KeyBits = 8;
+
   CompPriorityTextsCallback(
-      std::function<void(const typename TRes::TDoc&, std::vector<uint8_t>&)> cb)
-      : cb_(cb) {}
+      std::function<void(const typename TRes::TDoc&, std::vector<uint8_t>&)> cb,
+      bool inThreads = false)
+      : cb_(cb), inThreads_(inThreads) {}
+
+  bool keysInThreads() const { return inThreads_; }
 
   void init(const std::vector<TRes>& all,
             const SearchSettings<typename TRes::TDoc>& sett) {
@@ -149,6 +363,8 @@ public:
 
   void clean() {}
 
+  uint64_t key(const TRes& d) const { return 255 - calc(d.doc, d.tokens); }
+
   int compare(const TRes& d1, const TRes& d2) const {
     if (!cache_[d1.index]) {
       cache_[d1.index] = calc(d1.doc, d1.tokens) + 1;
@@ -7,23 +7,34 @@
 
 #pragma once
 
+#include <search/Bitmap.hpp>
 #include <search/FindMany.hpp>
+#include <search/Intersect.hpp>
+#include <search/Query.hpp>
 #include <search/Tokenize.hpp>
 #include <search/Types.hpp>
 
 #include <boost/iostreams/device/mapped_file.hpp>
 #include <algorithm>
 #include <assert.h>
+#include <atomic>
 #include <chrono>
+#include <cmath>
 #include <filesystem>
 #include <fstream>
+#include <iterator>
+#include <limits>
 #include <map>
 #include <mutex>
+#include <optional>
 #include <random>
 #include <set>
+#include <shared_mutex>
 #include <sstream>
 #include <string>
 #include <thread>
+#include <type_traits>
+#include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
@@ -47,29 +58,69 @@ public:
 
 namespace Search {
 
+// ids of Db instances, unique in process
+inline uint64_t nextDbInstance() {
+  static std::atomic<uint64_t> num(0);
+  return ++num;
+}
+
 template <class TStore2>
 class Db {
 public:
   typedef TStore2 TStore;
   struct Settings {
     bool autocomplete = true;
+    // longer prefixes are not stored, they are resolved to whole tokens by
+    // dictionary of store, 0 is no limit
     uint8_t autocompleteMaxLen = 0;
+    // with autocompleteMaxLen 0 no prefix is stored and all are resolved by
+    // dictionary
+    bool prefixDictionary = false;
+    // positions of whole tokens are stored for phrases and CompProximity
+    bool positions = false;
   };
   Settings settings;
 
+  // Queries hold it while they read ids and documents, so they see store
+  // without changes of writers. Many queries can hold it at once.
+  typedef std::shared_lock<std::shared_mutex> ReadLock;
+
 private:
   TStore& store_;
-  mutable std::mutex mutex_;
+  mutable std::shared_mutex mutex_;
+  // writer waits for lock while holding it, so new readers don't starve it
+  mutable std::mutex writerGate_;
+  std::atomic<uint64_t> generation_;
+  uint64_t instance_;
 
 public:
-  Db(TStore& store) : store_(store) {}
+  Db(TStore& store)
+      : store_(store), generation_(0), instance_(nextDbInstance()) {}
 
   TStore& store() { return store_; }
   const TStore& store() const { return store_; }
 
+  ReadLock lockRead() const {
+    std::lock_guard<std::mutex> gate(writerGate_);
+    return ReadLock(mutex_);
+  }
+  // incremented by each write, results of queries with same generation are
+  // same
+  uint64_t generation() const { return generation_.load(); }
+  // differs also for Db created at address of destroyed one
+  uint64_t instance() const { return instance_; }
+  // settings which change results, queries are cached by them too
+  std::string settingsKey() const {
+    return std::to_string(settings.autocomplete) + ' ' +
+           std::to_string(settings.autocompleteMaxLen) + ' ' +
+           std::to_string(settings.prefixDictionary) + ' ' +
+           std::to_string(settings.positions);
+  }
+
   void add(const typename TStore::TDoc& doc) {
     // lock with mutex
-    std::lock_guard<std::mutex> lock(mutex_);
+    auto lock = lockWrite();
+    generation_++;
 
     auto id = doc.docId();
 
@@ -90,12 +141,32 @@ public:
       auto tks = splitTokens(txt);
       tokensRemove.insert(tks.begin(), tks.end());
     }
-    // difference
-    tokensDifference(tokensAdd, tokensRemove);
+    // partial tokens are calculated from all tokens, prefix can still be
+    // needed by token which is not changed
+    {
+      auto tokensAddPartial = partialTokens(tokensAdd);
+      auto tokensRemovePartial = partialTokens(tokensRemove);
+      if (!isSegmented) {
+        tokensDifference(tokensAddPartial, tokensRemovePartial);
+      }
+      for (const auto& tk : tokensRemovePartial) {
+        typename TStore::TTokenInfo ti;
+        ti.docId = id;
+        ti.isWhole = false;
+        store_.removeToken(std::string(tk), ti);
+      }
+      for (const auto& tk : tokensAddPartial) {
+        typename TStore::TTokenInfo ti;
+        ti.docId = id;
+        ti.isWhole = false;
+        store_.addToken(std::string(tk), ti);
+      }
+    }
 
-    auto tokensAddPartial = partialTokens(tokensAdd);
-    auto tokensRemovePartial = partialTokens(tokensRemove);
-    tokensDifference(tokensAddPartial, tokensRemovePartial);
+    // difference, segmented store deletes old version with all its tokens
+    if (!isSegmented) {
+      tokensDifference(tokensAdd, tokensRemove);
+    }
 
     for (const auto& tk : tokensRemove) {
       typename TStore::TTokenInfo ti;
@@ -103,30 +174,56 @@ public:
       ti.isWhole = true;
       store_.removeToken(std::string(tk), ti);
     }
-    for (const auto& tk : tokensRemovePartial) {
-      typename TStore::TTokenInfo ti;
-      ti.docId = id;
-      ti.isWhole = false;
-      store_.removeToken(std::string(tk), ti);
-    }
     for (const auto& tk : tokensAdd) {
       typename TStore::TTokenInfo ti;
       ti.docId = id;
       ti.isWhole = true;
       store_.addToken(std::string(tk), ti);
     }
-    for (const auto& tk : tokensAddPartial) {
-      typename TStore::TTokenInfo ti;
-      ti.docId = id;
-      ti.isWhole = false;
-      store_.addToken(std::string(tk), ti);
+
+    // frequencies, all of them change with length of document
+    {
+      uint32_t lengthOld = 0;
+      auto freqsOld = tokenFreqs(arrOld, lengthOld);
+      uint32_t length = 0;
+      auto freqs = tokenFreqs(tokensJoined, length);
+      bool sameLength = !isSegmented && length == lengthOld;
+      for (const auto& pair : freqsOld) {
+        if (!isSameFreq(freqs, pair, sameLength)) {
+          store_.removeTokenFreq(pair.first, {id, pair.second, lengthOld});
+        }
+      }
+      for (const auto& pair : freqs) {
+        if (!isSameFreq(freqsOld, pair, sameLength)) {
+          store_.addTokenFreq(pair.first, {id, pair.second, length});
+        }
+      }
+    }
+    if (usePositions()) {
+      auto positionsOld = tokenPositions(arrOld, id);
+      auto positions = tokenPositions(tokensJoined, id);
+      for (const auto& pair : positionsOld) {
+        auto ptr = positions.find(pair.first);
+        if (isSegmented || ptr == positions.end() ||
+            ptr->second != pair.second) {
+          store_.removeTokenPositions(pair.first, pair.second);
+        }
+      }
+      for (const auto& pair : positions) {
+        auto ptr = positionsOld.find(pair.first);
+        if (isSegmented || ptr == positionsOld.end() ||
+            ptr->second != pair.second) {
+          store_.addTokenPositions(pair.first, pair.second);
+        }
+      }
     }
     store_.addDoc(id, doc, tokensJoined);
   }
 
   void remove(const typename TStore::TDoc::TId& id) {
     // lock with mutex
-    std::lock_guard<std::mutex> lock(mutex_);
+    auto lock = lockWrite();
+    generation_++;
 
     auto opt = store_.findDoc(id);
     if (!opt) {
@@ -155,126 +252,764 @@ public:
       ti.isWhole = false;
       store_.removeToken(std::string(tk), ti);
     }
+    uint32_t length = 0;
+    for (const auto& pair : tokenFreqs(tokensJoinedArr, length)) {
+      store_.removeTokenFreq(pair.first, {id, pair.second, length});
+    }
+    if (usePositions()) {
+      for (const auto& pair : tokenPositions(tokensJoinedArr, id)) {
+        store_.removeTokenPositions(pair.first, pair.second);
+      }
+    }
     store_.removeDoc(id);
   }
 
-  std::unordered_set<typename TStore::TDoc::TId>
+  // returns ids sorted ascending
+  std::vector<typename TStore::TDoc::TId>
   findMatchAll(const SearchSettings<typename TStore::TDoc>& searchSett) const {
-    // lock with mutex
-    std::lock_guard<std::mutex> lock(mutex_);
+    auto lock = lockRead();
+    return findMatchAll(searchSett, lock);
+  }
+
+  // for caller that already holds read lock
+  std::vector<typename TStore::TDoc::TId>
+  findMatchAll(const SearchSettings<typename TStore::TDoc>& searchSett,
+               const ReadLock& lock) const {
+    assert(lock.owns_lock() && lock.mutex() == &mutex_);
+    (void)lock;
+    typedef typename TStore::TDoc::TId TId;
+    std::optional<QueryNode> query;
+    if (!searchSett.queryTree) {
+      query = flatQuery(searchSett);
+      if (!query) {
+        return {};
+      }
+    }
+    auto plan = planNode(query ? *query : *searchSett.queryTree, searchSett);
+
+    // documents which pass filters are candidates when there are fewer of
+    // them than postings of query, otherwise they are intersected with matches
+    std::vector<TId> filtered;
+    const std::vector<TId>* docIds = nullptr;
+    if (!searchSett.filters.empty()) {
+      filtered = findFiltered(searchSett);
+      if (filtered.empty()) {
+        return {};
+      }
+      if (filtered.size() < plan.count && plan.count != UnknownCount) {
+        docIds = &filtered;
+      }
+    }
+    auto all = findMatchNode(plan, docIds);
+    if (!searchSett.filters.empty() && !docIds) {
+      intersectSorted(all, filtered);
+    }
+    for (const auto& phrase : searchSett.phrases) {
+      if (all.empty()) {
+        break;
+      }
+      filterPhrase(all, phrase);
+    }
+    return all;
+  }
+
+private:
+  struct PlanToken {
+    std::string token;
+    bool isPartial = false;
+    uint64_t count = 0;
+    // token is union of these whole tokens, with same prefix or fuzzy
+    bool isDictionary = false;
+    std::vector<std::string> tokens;
+  };
+
+  // node of query with its tokens found in index, count estimates number of
+  // its postings
+  struct PlanNode {
+    QueryNode::Type type;
+    // of Token and Prefix
+    PlanToken token;
+    // tokens of Phrase, children are same tokens
+    std::vector<std::string> phrase;
+    std::vector<PlanNode> children;
+    uint64_t count = 0;
+  };
 
-    std::unordered_set<typename TStore::TDoc::TId> all;
+  // query without operators, all tokens or any of them must match
+  std::optional<QueryNode>
+  flatQuery(const SearchSettings<typename TStore::TDoc>& searchSett) const {
+    QueryNode res{searchSett.matchAnyToken ? QueryNode::Or : QueryNode::And,
+                  {}, {}};
     for (size_t i = 0; i < searchSett.tokens.size(); ++i) {
-      bool isPartial = searchSett.autocomplete &&
-                       i + 1 == searchSett.tokens.size() &&
-                       settings.autocomplete;
-      std::string token = searchSett.tokens[i];
+      bool isPartial = isPartialToken(searchSett, i);
+      const auto& token = searchSett.tokens[i];
       if (isPartial && token.size() == 1) {
         continue;
       }
+      res.children.push_back(
+          {isPartial ? QueryNode::Prefix : QueryNode::Token, {token}, {}});
+    }
+    if (res.children.empty()) {
+      return std::nullopt;
+    }
+    return res;
+  }
 
-      if (isPartial) {
-        if (token.size() > settings.autocompleteMaxLen &&
-            settings.autocompleteMaxLen > 0) {
-          size_t newSize = 0;
-          for (;;) {
-            auto l = charLen(token[newSize]);
-            if (newSize + l > settings.autocompleteMaxLen) {
-              break;
-            }
-            newSize += l;
+  // whole tokens of index which token matches and number of their postings
+  PlanToken planToken(std::string token, bool isPartial, bool canBeFuzzy,
+                      const SearchSettings<typename TStore::TDoc>& searchSett)
+      const {
+    PlanToken pt;
+    pt.token = std::move(token);
+    pt.isPartial = isPartial;
+    bool isFuzzy = !isPartial && canBeFuzzy && searchSett.fuzzyDistance > 0;
+    if (!isFuzzy && !(isPartial && isDictionaryPrefix(pt.token))) {
+      pt.count = store_.tokenCount(pt.token);
+      return pt;
+    }
+    pt.isDictionary = true;
+    if (isFuzzy) {
+      for (auto& pair :
+           store_.findTokensFuzzy(pt.token, searchSett.fuzzyDistance,
+                                  searchSett.fuzzyPrefixLen)) {
+        pt.tokens.push_back(std::move(pair.first));
+      }
+    } else {
+      pt.tokens = store_.findTokensWithPrefix(pt.token);
+    }
+    for (const auto& tk : pt.tokens) {
+      pt.count += store_.tokenCount(tk);
+    }
+    return pt;
+  }
+
+  // tokens of query are looked up and children which must all match are
+  // ordered from the cheapest
+  PlanNode planNode(const QueryNode& node,
+                    const SearchSettings<typename TStore::TDoc>& searchSett)
+      const {
+    PlanNode res{node.type, {}, {}, {}, 0};
+    if (node.type == QueryNode::Token || node.type == QueryNode::Prefix) {
+      bool isPartial = node.type == QueryNode::Prefix && settings.autocomplete;
+      res.token = planToken(node.tokens.front(), isPartial, true, searchSett);
+      res.count = res.token.count;
+      return res;
+    }
+    if (node.type == QueryNode::Phrase) {
+      // tokens of phrase are exact, at the end they are checked to be next
+      // to each other
+      res.phrase = node.tokens;
+      for (const auto& token : node.tokens) {
+        PlanNode child{QueryNode::Token, {}, {}, {}, 0};
+        child.token = planToken(token, false, false, searchSett);
+        child.count = child.token.count;
+        res.children.push_back(std::move(child));
+      }
+    } else {
+      for (const auto& child : node.children) {
+        res.children.push_back(planNode(child, searchSett));
+      }
+    }
+
+    // excluded documents are known only for candidates, so Not is last
+    if (node.type == QueryNode::Not) {
+      res.count = UnknownCount;
+    } else if (node.type == QueryNode::Or) {
+      for (const auto& child : res.children) {
+        res.count = child.count > UnknownCount - res.count
+                        ? UnknownCount
+                        : res.count + child.count;
+      }
+    } else {
+      std::stable_sort(res.children.begin(), res.children.end(),
+                       [](const PlanNode& a, const PlanNode& b) {
+                         return a.count < b.count;
+                       });
+      res.count = res.children.front().count;
+    }
+    return res;
+  }
+
+  // ids of documents matched by node sorted ascending, only of docIds when
+  // they are given
+  std::vector<typename TStore::TDoc::TId>
+  findMatchNode(const PlanNode& node,
+                const std::vector<typename TStore::TDoc::TId>* docIds) const {
+    typedef typename TStore::TDoc::TId TId;
+    if (docIds && docIds->empty()) {
+      return {};
+    }
+    if (node.type == QueryNode::Token || node.type == QueryNode::Prefix) {
+      return findMatchToken(node.token, docIds);
+    }
+    if (node.type == QueryNode::Not) {
+      // without candidates all documents are excluded from
+      std::vector<TId> all;
+      if (docIds) {
+        all = *docIds;
+      } else {
+        all = store_.allIds();
+        std::sort(all.begin(), all.end());
+      }
+      differenceSorted(all, findMatchNode(node.children.front(), docIds));
+      return all;
+    }
+
+    std::vector<TId> all;
+    // long posting lists are combined as bitmaps
+    bool useBitmap = false;
+    if constexpr (std::is_integral_v<TId> && std::is_unsigned_v<TId>) {
+      useBitmap = !docIds && isBitmapNode(node);
+    }
+    if (useBitmap) {
+      all = findMatchAllBitmap(node);
+    } else if (node.type == QueryNode::Or) {
+      for (const auto& child : node.children) {
+        auto ids = findMatchNode(child, docIds);
+        std::vector<TId> all2;
+        all2.reserve(all.size() + ids.size());
+        std::set_union(all.begin(), all.end(), ids.begin(), ids.end(),
+                       std::back_inserter(all2));
+        all.swap(all2);
+      }
+    } else {
+      // postings of next children are read only for candidates
+      for (size_t i = 0; i < node.children.size(); ++i) {
+        all = findMatchNode(node.children[i], i == 0 ? docIds : &all);
+        if (all.empty()) {
+          return {};
+        }
+      }
+    }
+    if (node.type == QueryNode::Phrase && !all.empty()) {
+      filterPhrase(all, node.phrase);
+    }
+    return all;
+  }
+
+  std::vector<typename TStore::TDoc::TId>
+  findMatchToken(const PlanToken& pt,
+                 const std::vector<typename TStore::TDoc::TId>* docIds) const {
+    std::vector<typename TStore::TTokenInfo> vec;
+    if (pt.isDictionary) {
+      vec = findTokensPostings(pt.tokens, docIds);
+    } else if (docIds) {
+      vec = store_.findToken(pt.token, *docIds);
+    } else {
+      vec = store_.findToken(pt.token);
+    }
+    std::vector<typename TStore::TDoc::TId> ids;
+    ids.reserve(vec.size());
+    if (pt.isPartial) {
+      // keep one id, whole and partial of same id are next to each other
+      for (const auto& tki : vec) {
+        if (ids.empty() || ids.back() != tki.docId) {
+          ids.push_back(tki.docId);
+        }
+      }
+    } else {
+      // remove non whole
+      for (const auto& tki : vec) {
+        if (tki.isWhole) {
+          ids.push_back(tki.docId);
+        }
+      }
+    }
+    return ids;
+  }
+
+public:
+  // BM25 score of each document from frequencies in postings, documents are
+  // not loaded. ids must be sorted ascending.
+  std::vector<float>
+  scoreBM25(const SearchSettings<typename TStore::TDoc>& searchSett,
+            const std::vector<typename TStore::TDoc::TId>& ids,
+            const ReadLock& lock, float k1, float b) const {
+    assert(lock.owns_lock() && lock.mutex() == &mutex_);
+    (void)lock;
+    std::vector<float> scores(ids.size(), 0.0f);
+    double numDocs = (double)store_.sizeDocuments();
+    if (ids.empty() || numDocs == 0) {
+      return scores;
+    }
+    double avgLength =
+        std::max(1.0, (double)store_.sumDocLengths() / numDocs);
+
+    std::unordered_set<std::string> done;
+    for (const auto& token : searchSett.tokens) {
+      if (!done.insert(token).second) {
+        continue;
+      }
+      double df = std::min(numDocs, (double)store_.tokenFreqCount(token));
+      if (df == 0) {
+        continue;
+      }
+      double idf = std::log(1.0 + (numDocs - df + 0.5) / (df + 0.5));
+      size_t k = 0;
+      for (const auto& info : store_.findTokenFreqs(token, ids)) {
+        while (k < ids.size() && ids[k] < info.docId) {
+          k++;
+        }
+        if (k == ids.size()) {
+          break;
+        }
+        scores[k] +=
+            termBM25(idf, info.freq, info.docLength, avgLength, k1, b);
+      }
+    }
+    return scores;
+  }
+
+  // Best k documents by BM25 with same scores as scoreBM25, sorted by id.
+  // Postings are read by blocks in order of upper bound of score, which is
+  // calculated from max frequency and min length in block. Reading stops
+  // when no other block can beat k-th score. Returns nullopt when query
+  // can't be answered from frequencies, then all ids must be scored.
+  std::optional<std::vector<std::pair<typename TStore::TDoc::TId, float>>>
+  findTopBM25(const SearchSettings<typename TStore::TDoc>& searchSett,
+              size_t k, const ReadLock& lock, float k1, float b) const {
+    typedef typename TStore::TDoc::TId TId;
+    typedef typename TStore::TTokenFreq TTokenFreq;
+    assert(lock.owns_lock() && lock.mutex() == &mutex_);
+    (void)lock;
+    // fuzzy matches are not scored by frequencies of query tokens, operators
+    // of query tree are not followed
+    if (k == 0 || !searchSett.phrases.empty() || searchSett.fuzzyDistance > 0 ||
+        searchSett.queryTree) {
+      return std::nullopt;
+    }
+    bool matchAny = searchSett.matchAnyToken;
+    bool hasPartial = searchSett.autocomplete && settings.autocomplete;
+    std::vector<std::pair<TId, float>> res;
+    double numDocs = (double)store_.sizeDocuments();
+    if (numDocs == 0) {
+      return res;
+    }
+    // candidates which don't pass filters are not scored
+    Bitmap filtered;
+    if (!searchSett.filters.empty()) {
+      if constexpr (std::is_integral_v<TId> && std::is_unsigned_v<TId>) {
+        filtered = store_.findAttributes(searchSett.filters);
+      }
+      if (filtered.empty()) {
+        return res;
+      }
+    }
+    double avgLength =
+        std::max(1.0, (double)store_.sumDocLengths() / numDocs);
+
+    // tokens in same order as in scoreBM25, documents are matched by
+    // postings of source tokens
+    struct ScoreToken {
+      std::string token;
+      double df;
+      double idf;
+      bool isSource;
+      std::vector<TTokenFreq> freqs;
+    };
+    std::vector<ScoreToken> tokens;
+    size_t numSources = 0;
+    for (size_t i = 0; i < searchSett.tokens.size(); ++i) {
+      const auto& token = searchSett.tokens[i];
+      bool isPartial = hasPartial && i + 1 == searchSett.tokens.size();
+      bool isSource = !isPartial || (matchAny && token.size() > 1);
+      auto ptr = std::find_if(
+          tokens.begin(), tokens.end(),
+          [&](const ScoreToken& st) { return st.token == token; });
+      if (ptr != tokens.end()) {
+        numSources += isSource && !ptr->isSource ? 1 : 0;
+        ptr->isSource = ptr->isSource || isSource;
+        continue;
+      }
+      double df = std::min(numDocs, (double)store_.tokenFreqCount(token));
+      double idf =
+          df == 0 ? 0 : std::log(1.0 + (numDocs - df + 0.5) / (df + 0.5));
+      tokens.push_back({token, df, idf, isSource, {}});
+      numSources += isSource ? 1 : 0;
+    }
+    std::string partial;
+    std::vector<std::string> prefixTokens;
+    if (hasPartial && !matchAny && searchSett.tokens.back().size() > 1) {
+      partial = searchSett.tokens.back();
+      if (isDictionaryPrefix(partial)) {
+        prefixTokens = store_.findTokensWithPrefix(partial);
+      }
+    }
+    if (numSources == 0) {
+      if (matchAny) {
+        return res;
+      }
+      return std::nullopt;
+    }
+
+    // upper bound of score of each block
+    std::map<uint64_t, std::pair<float, size_t>> bounds;
+    for (const auto& st : tokens) {
+      if (st.idf == 0) {
+        if (st.isSource && !matchAny) {
+          return res;
+        }
+        continue;
+      }
+      for (const auto& bm : store_.findTokenBlockMax(st.token)) {
+        auto& bound = bounds[bm.block];
+        bound.first +=
+            termBM25(st.idf, bm.maxFreq, bm.minDocLength, avgLength, k1, b);
+        bound.second += st.isSource ? 1 : 0;
+      }
+    }
+    std::vector<std::pair<float, uint64_t>> blocks;
+    for (const auto& pair : bounds) {
+      auto numBlockSources = pair.second.second;
+      if (matchAny ? numBlockSources > 0 : numBlockSources == numSources) {
+        blocks.push_back({pair.second.first, pair.first});
+      }
+    }
+    std::sort(blocks.begin(), blocks.end(),
+              [](const auto& a, const auto& b) {
+                return a.first > b.first ||
+                       (a.first == b.first && a.second < b.second);
+              });
+
+    // when all must match, rarest token is read by blocks and others only
+    // for its documents
+    std::vector<ScoreToken*> sources;
+    for (auto& st : tokens) {
+      if (st.isSource && st.idf != 0) {
+        sources.push_back(&st);
+      }
+    }
+    if (!matchAny) {
+      std::stable_sort(sources.begin(), sources.end(),
+                       [](const ScoreToken* a, const ScoreToken* b) {
+                         return a->df < b->df;
+                       });
+    }
+
+    // top of heap is worst result, same score is ordered by id
+    auto isBetter = [](const std::pair<TId, float>& a,
+                       const std::pair<TId, float>& b) {
+      return a.second > b.second || (a.second == b.second && a.first < b.first);
+    };
+    // margin covers rounding of bounds
+    auto canBeat = [&](float bound) {
+      return res.size() < k ||
+             (double)bound * (1.0 + 1e-5) + 1e-6 >= res.front().second;
+    };
+
+    std::vector<uint64_t> batch;
+    std::vector<TId> ids;
+    std::vector<TId> ids2;
+    size_t pos = 0;
+    // batches grow when pruning doesn't stop reading
+    size_t batchSize = BlockMaxBatch;
+    while (pos < blocks.size() && canBeat(blocks[pos].first)) {
+      batch.clear();
+      for (; pos < blocks.size() && batch.size() < batchSize &&
+             canBeat(blocks[pos].first);
+           ++pos) {
+        batch.push_back(blocks[pos].second);
+      }
+      std::sort(batch.begin(), batch.end());
+      batchSize *= 2;
+
+      // candidates of blocks
+      for (auto& st : tokens) {
+        st.freqs.clear();
+      }
+      ids.clear();
+      for (size_t i = 0; i < sources.size(); ++i) {
+        auto& st = *sources[i];
+        if (i == 0 || matchAny) {
+          st.freqs = store_.findTokenFreqsInBlocks(st.token, batch);
+        } else {
+          st.freqs = store_.findTokenFreqs(st.token, ids);
+        }
+        ids2.clear();
+        for (const auto& info : st.freqs) {
+          ids2.push_back(info.docId);
+        }
+        if (i == 0 || !matchAny) {
+          ids.swap(ids2);
+          if (ids.empty() && !matchAny) {
+            break;
           }
-          token.resize(newSize);
-        }
-      }
-
-      auto vec = store_.findToken(token);
-
-      std::unordered_set<typename TStore::TDoc::TId> allIds;
-
-      if (isPartial) {
-        if (token.size() != searchSett.tokens[i].size()) {
-          // delete documents that do not contain full phrase
-          token = searchSett.tokens[i];
-          vec.erase(
-              std::remove_if(vec.begin(), vec.end(),
-                             [=](const typename TStore::TTokenInfo& mtc) {
-                               auto opt = store().findDoc(mtc.docId);
-                               if (!opt) {
-                                 return true;
-                               }
-                               auto& pair = *opt;
-                               auto& tokens = pair.second;
-
-                               auto tokensJoined = joinTokens(tokens);
-                               if (tokensJoined.empty()) {
-                                 return true;
-                               }
-                               size_t pos = 0;
-                               for (;;) {
-                                 pos = tokensJoined.find(token, pos);
-                                 if (pos == std::string::npos) {
-                                   return true;
-                                 }
-                                 if (pos == 0) {
-                                   if (tokensJoined.size() == token.size()) {
-                                     return false;
-                                   }
-                                   if (tokensJoined[token.size()] == ' ') {
-                                     return false;
-                                   }
-                                   pos += 1;
-                                   continue;
-                                 }
-                                 if (tokensJoined[pos - 1] == ' ') {
-                                   return false;
-                                 }
-                                 pos += 1;
-                                 continue;
-                               }
-                             }),
-              vec.end());
-        }
-        // keep one id
-        for (auto& tki : vec) {
-          allIds.insert(tki.docId);
+        } else {
+          std::vector<TId> all;
+          all.reserve(ids.size() + ids2.size());
+          std::set_union(ids.begin(), ids.end(), ids2.begin(), ids2.end(),
+                         std::back_inserter(all));
+          ids.swap(all);
         }
-      } else {
-        // remove non whole
-        for (const auto& tki : vec) {
-          if (tki.isWhole) {
-            allIds.insert(tki.docId);
+      }
+      if (!partial.empty() && !ids.empty()) {
+        ids2.clear();
+        auto infos = isDictionaryPrefix(partial)
+                         ? findTokensPostings(prefixTokens, &ids)
+                         : store_.findToken(partial, ids);
+        for (const auto& info : infos) {
+          if (ids2.empty() || ids2.back() != info.docId) {
+            ids2.push_back(info.docId);
           }
         }
+        ids.swap(ids2);
+      }
+      if constexpr (std::is_integral_v<TId> && std::is_unsigned_v<TId>) {
+        if (!filtered.empty()) {
+          ids.erase(std::remove_if(ids.begin(), ids.end(),
+                                   [&](const TId& id) {
+                                     return !filtered.contains(id);
+                                   }),
+                    ids.end());
+        }
       }
 
-      if (allIds.empty() && !searchSett.matchAnyToken) {
-        return {};
+      for (auto& st : tokens) {
+        if (!st.isSource && st.idf != 0 && !ids.empty()) {
+          st.freqs = store_.findTokenFreqs(st.token, ids);
+        }
       }
 
-      if (!searchSett.matchAnyToken) {
-        if (i == 0) {
-          // copy
-          all = allIds;
-        } else {
-          // remove from all, which isnt in vec
-          std::unordered_set<typename TStore::TDoc::TId> all2;
-          for (const auto& id : all) {
-            auto ptr = allIds.find(id);
-            if (ptr != allIds.end()) {
-              all2.insert(id);
-            }
+      // scores are added in order of tokens
+      std::vector<float> scores(ids.size(), 0.0f);
+      for (const auto& st : tokens) {
+        if (st.idf == 0) {
+          continue;
+        }
+        size_t n = 0;
+        for (const auto& info : st.freqs) {
+          while (n < ids.size() && ids[n] < info.docId) {
+            n++;
+          }
+          if (n == ids.size()) {
+            break;
+          }
+          if (ids[n] == info.docId) {
+            scores[n] += termBM25(st.idf, info.freq, info.docLength,
+                                  avgLength, k1, b);
           }
-          all = all2;
         }
-      } else {
-        all.insert(allIds.begin(), allIds.end());
+      }
+      for (size_t n = 0; n < ids.size(); ++n) {
+        std::pair<TId, float> x{ids[n], scores[n]};
+        if (res.size() < k) {
+          res.push_back(x);
+          std::push_heap(res.begin(), res.end(), isBetter);
+        } else if (isBetter(x, res.front())) {
+          std::pop_heap(res.begin(), res.end(), isBetter);
+          res.back() = x;
+          std::push_heap(res.begin(), res.end(), isBetter);
+        }
       }
     }
-    return all;
+
+    // documents with only prefix of last token have score 0 and are not in
+    // frequencies
+    if (matchAny && hasPartial && searchSett.tokens.back().size() > 1 &&
+        (res.size() < k || res.front().second <= 0)) {
+      return std::nullopt;
+    }
+    std::sort(res.begin(), res.end());
+    return res;
+  }
+
+  // Sum of edit distances between tokens of query and closest tokens of
+  // document, token which is not in document adds fuzzyDistance + 1. Prefix
+  // for autocomplete is not counted. ids must be sorted ascending.
+  std::vector<float>
+  scoreFuzzy(const SearchSettings<typename TStore::TDoc>& searchSett,
+             const std::vector<typename TStore::TDoc::TId>& ids,
+             const ReadLock& lock) const {
+    assert(lock.owns_lock() && lock.mutex() == &mutex_);
+    (void)lock;
+    std::vector<float> scores(ids.size(), 0.0f);
+    if (ids.empty() || searchSett.fuzzyDistance == 0) {
+      return scores;
+    }
+    std::vector<uint8_t> best;
+    for (size_t i = 0; i < searchSett.tokens.size(); ++i) {
+      if (isPartialToken(searchSett, i)) {
+        continue;
+      }
+      best.assign(ids.size(), searchSett.fuzzyDistance + 1);
+      for (const auto& pair : store_.findTokensFuzzy(
+               searchSett.tokens[i], searchSett.fuzzyDistance,
+               searchSett.fuzzyPrefixLen)) {
+        for (const auto& info : store_.findToken(pair.first, ids)) {
+          auto it = std::lower_bound(ids.begin(), ids.end(), info.docId);
+          if (info.isWhole && it != ids.end() && *it == info.docId) {
+            auto& b = best[it - ids.begin()];
+            b = std::min(b, pair.second);
+          }
+        }
+      }
+      for (size_t k = 0; k < ids.size(); ++k) {
+        scores[k] += best[k];
+      }
+    }
+    return scores;
+  }
+
+private:
+  static float termBM25(double idf, double tf, double docLength,
+                        double avgLength, double k1, double b) {
+    double norm = 1.0 - b + b * docLength / avgLength;
+    return (float)(idf * tf * (k1 + 1.0) / (tf + k1 * norm));
+  }
+
+public:
+  // Number of first query tokens which are next to each other in one text
+  // of document. Without stored positions tokens of documents are loaded.
+  // ids must be sorted ascending.
+  std::vector<float>
+  scoreProximity(const SearchSettings<typename TStore::TDoc>& searchSett,
+                 const std::vector<typename TStore::TDoc::TId>& ids,
+                 const ReadLock& lock) const {
+    assert(lock.owns_lock() && lock.mutex() == &mutex_);
+    (void)lock;
+    std::vector<float> scores(ids.size(), 0.0f);
+    if (ids.empty() || searchSett.tokens.empty()) {
+      return scores;
+    }
+    size_t n = std::min<size_t>(searchSett.tokens.size(), 255);
+    std::vector<std::string> tokens(searchSett.tokens.begin(),
+                                    searchSett.tokens.begin() + n);
+
+    if (!usePositions()) {
+      for (size_t k = 0; k < ids.size(); ++k) {
+        auto opt = store_.findDoc(ids[k]);
+        if (opt) {
+          scores[k] = (float)numTokensTogether(opt->second, tokens);
+        }
+      }
+      return scores;
+    }
+
+    forEachPositions(ids, tokens, [&](size_t k, const auto& ranges) {
+      scores[k] = (float)positionsTogether(ranges);
+    });
+    return scores;
   }
 
 private:
+  std::unique_lock<std::shared_mutex> lockWrite() {
+    std::lock_guard<std::mutex> gate(writerGate_);
+    return std::unique_lock<std::shared_mutex>(mutex_);
+  }
+
+  // store with IsSegmented replaces whole documents
+  template <class T, class = void>
+  struct IsSegmentedStore : std::false_type {};
+  template <class T>
+  struct IsSegmentedStore<T, std::void_t<decltype(T::IsSegmented)>>
+      : std::bool_constant<T::IsSegmented> {};
+  static constexpr bool isSegmented = IsSegmentedStore<TStore>::value;
+  template <class T, class = void>
+  struct StoresPositions : std::true_type {};
+  template <class T>
+  struct StoresPositions<T, std::void_t<decltype(T::StoresPositions)>>
+      : std::bool_constant<T::StoresPositions> {};
+
+  // store which can't keep positions of its ids is used like without them
+  bool usePositions() const {
+    return StoresPositions<TStore>::value && settings.positions;
+  }
+
+  static const uint64_t BitmapMinPostings = 4096;
+  // count of plan node which has no postings of its own
+  static const uint64_t UnknownCount = std::numeric_limits<uint64_t>::max();
+  // blocks of postings first read at once by findTopBM25
+  static const size_t BlockMaxBatch = 16;
+
+  // children are tokens and are long enough for bitmaps
+  bool isBitmapNode(const PlanNode& node) const {
+    uint64_t maxCount = 0;
+    for (const auto& child : node.children) {
+      if (child.type != QueryNode::Token && child.type != QueryNode::Prefix) {
+        return false;
+      }
+      maxCount = std::max(maxCount, child.count);
+    }
+    auto count = node.type == QueryNode::Or ? maxCount : node.count;
+    return !node.children.empty() && count >= BitmapMinPostings;
+  }
+
+  std::vector<typename TStore::TDoc::TId>
+  findMatchAllBitmap(const PlanNode& node) const {
+    bool matchAnyToken = node.type == QueryNode::Or;
+    Bitmap all;
+    for (size_t i = 0; i < node.children.size(); ++i) {
+      const auto& pt = node.children[i].token;
+      Bitmap bm;
+      if (pt.isDictionary) {
+        for (const auto& token : pt.tokens) {
+          bm.orWith(store_.findTokenBitmap(token, true));
+        }
+      } else {
+        bm = store_.findTokenBitmap(pt.token, !pt.isPartial);
+      }
+      if (matchAnyToken) {
+        all.orWith(bm);
+      } else if (i == 0) {
+        all = std::move(bm);
+      } else {
+        all.andWith(bm);
+      }
+      if (all.empty() && !matchAnyToken) {
+        return {};
+      }
+    }
+    return all.values<typename TStore::TDoc::TId>();
+  }
+
+  // last token of query is prefix for autocomplete, in query tree prefixes
+  // are marked
+  bool isPartialToken(const SearchSettings<typename TStore::TDoc>& searchSett,
+                      size_t i) const {
+    if (searchSett.queryTree) {
+      return settings.autocomplete &&
+             searchSett.queryTree->hasPrefix(searchSett.tokens[i]);
+    }
+    return searchSett.autocomplete && settings.autocomplete &&
+           i + 1 == searchSett.tokens.size();
+  }
+
+  // prefix which is not stored as partial token
+  bool isDictionaryPrefix(const std::string& token) const {
+    return (settings.prefixDictionary || settings.autocompleteMaxLen > 0) &&
+           token.size() > settings.autocompleteMaxLen;
+  }
+
+  // ids of documents whose attributes pass filters of search, sorted
+  // ascending
+  std::vector<typename TStore::TDoc::TId>
+  findFiltered(const SearchSettings<typename TStore::TDoc>& searchSett) const {
+    typedef typename TStore::TDoc::TId TId;
+    if constexpr (std::is_integral_v<TId> && std::is_unsigned_v<TId>) {
+      return store_.findAttributes(searchSett.filters).template values<TId>();
+    } else {
+      // only documents with integer ids have attributes
+      (void)searchSett;
+      return {};
+    }
+  }
+
+  // postings of all tokens sorted by document, only of docIds when they are
+  // given
+  std::vector<typename TStore::TTokenInfo>
+  findTokensPostings(const std::vector<std::string>& tokens,
+                     const std::vector<typename TStore::TDoc::TId>* docIds)
+      const {
+    std::vector<typename TStore::TTokenInfo> res;
+    for (const auto& token : tokens) {
+      auto vec =
+          docIds ? store_.findToken(token, *docIds) : store_.findToken(token);
+      res.insert(res.end(), vec.begin(), vec.end());
+    }
+    std::sort(res.begin(), res.end());
+    return res;
+  }
+
   struct BulkThreadRes {
     size_t numDocs;
     fs::path pathTokens;
@@ -301,8 +1036,8 @@ private:
     for (size_t i = 0; i < numThreads; ++i) {
       const std::byte* dt = datas[i].first;
       while (dt < datas[i].second) {
-        store_.bulkTokensReadAdd(dt, nthThread, numThreads);
         store_.bulkTokensReadRemove(dt, nthThread, numThreads);
+        store_.bulkTokensReadAdd(dt, nthThread, numThreads);
       }
     }
   }
@@ -314,6 +1049,8 @@ public:
   private:
     Db<TStore>& db_;
     size_t numDocs;
+    // change of sum of lengths of documents
+    int64_t docLengths = 0;
     fs::path pathTokens;
     fs::path pathDocs;
     std::unordered_set<std::string> tokens;
@@ -355,59 +1092,118 @@ public:
       std::unordered_set<std::string> tokensAdd = std::get<0>(resTokens);
       std::vector<std::string> tokensJoined = std::get<1>(resTokens);
 
-      // check what to remove
+      // check what to remove, segmented store deletes whole old version
       std::unordered_set<std::string> tokensRemove;
-      auto res123 = db_.store().findDoc(doc.docId());
+      std::optional<std::pair<typename TStore::TDoc, std::vector<std::string>>>
+          res123;
+      if (!isSegmented) {
+        res123 = db_.store().findDoc(doc.docId());
+      }
       if (res123) {
         for (const auto& txt : res123->second) {
           auto tks = splitTokens(txt);
           tokensRemove.insert(tks.begin(), tks.end());
         }
-        tokensDifference(tokensAdd, tokensRemove);
+      }
+
+      // frequencies
+      std::vector<std::pair<std::string, typename TStore::TTokenFreq>>
+          freqsAdd;
+      std::vector<std::pair<std::string, typename TStore::TTokenFreq>>
+          freqsRemove;
+      {
+        uint32_t lengthOld = 0;
+        std::unordered_map<std::string, uint32_t> freqsOld;
+        if (res123) {
+          freqsOld = tokenFreqs(res123->second, lengthOld);
+        }
+        uint32_t length = 0;
+        auto freqs = tokenFreqs(tokensJoined, length);
+        for (const auto& pair : freqsOld) {
+          if (!isSameFreq(freqs, pair, length == lengthOld)) {
+            freqsRemove.push_back(
+                {pair.first, {id, pair.second, lengthOld}});
+          }
+        }
+        for (const auto& pair : freqs) {
+          if (!isSameFreq(freqsOld, pair, length == lengthOld)) {
+            freqsAdd.push_back({pair.first, {id, pair.second, length}});
+          }
+        }
+        docLengths += (int64_t)length - lengthOld;
+      }
+
+      // positions
+      std::vector<std::pair<std::string,
+                            std::vector<typename TStore::TTokenPosition>>>
+          positionsAdd;
+      std::vector<std::pair<std::string,
+                            std::vector<typename TStore::TTokenPosition>>>
+          positionsRemove;
+      if (db_.usePositions()) {
+        decltype(tokenPositions(tokensJoined, id)) positionsOld;
+        if (res123) {
+          positionsOld = tokenPositions(res123->second, id);
+        }
+        auto positions = tokenPositions(tokensJoined, id);
+        for (const auto& pair : positionsOld) {
+          auto ptr = positions.find(pair.first);
+          if (ptr == positions.end() || ptr->second != pair.second) {
+            positionsRemove.push_back(pair);
+          }
+        }
+        for (const auto& pair : positions) {
+          auto ptr = positionsOld.find(pair.first);
+          if (ptr == positionsOld.end() || ptr->second != pair.second) {
+            positionsAdd.push_back(pair);
+          }
+        }
       }
 
       // write to file DOC
       TStore::bulkDocWrite(oDocs, id, doc, tokensJoined);
 
-      auto tokensAddPartial = db_.partialTokens(tokensAdd);
-      auto tokensRemovePartial = db_.partialTokens(tokensRemove);
-      tokensDifference(tokensAddPartial, tokensRemovePartial);
-
-      // write to file Tokens
-      // add
+      // partial tokens are calculated from all tokens, before difference
+      std::vector<std::pair<std::string, typename TStore::TTokenInfo>> arrAdd;
+      std::vector<std::pair<std::string, typename TStore::TTokenInfo>>
+          arrRemove;
       {
-        std::vector<std::pair<std::string, typename TStore::TTokenInfo>> arr;
-        for (const auto& tk : tokensAdd) {
-          typename TStore::TTokenInfo ti;
-          ti.docId = id;
-          ti.isWhole = true;
-          arr.push_back({std::string(tk), ti});
-        }
+        auto tokensAddPartial = db_.partialTokens(tokensAdd);
+        auto tokensRemovePartial = db_.partialTokens(tokensRemove);
+        tokensDifference(tokensAddPartial, tokensRemovePartial);
         for (const auto& tk : tokensAddPartial) {
           typename TStore::TTokenInfo ti;
           ti.docId = id;
           ti.isWhole = false;
-          arr.push_back({std::string(tk), ti});
-        }
-        TStore::bulkTokensWrite(oTokens, arr);
-      }
-      // remove
-      {
-        std::vector<std::pair<std::string, typename TStore::TTokenInfo>> arr;
-        for (const auto& tk : tokensRemove) {
-          typename TStore::TTokenInfo ti;
-          ti.docId = id;
-          ti.isWhole = true;
-          arr.push_back({std::string(tk), ti});
+          arrAdd.push_back({std::string(tk), ti});
         }
         for (const auto& tk : tokensRemovePartial) {
           typename TStore::TTokenInfo ti;
           ti.docId = id;
           ti.isWhole = false;
-          arr.push_back({std::string(tk), ti});
+          arrRemove.push_back({std::string(tk), ti});
         }
-        TStore::bulkTokensWrite(oTokens, arr);
       }
+      tokensDifference(tokensAdd, tokensRemove);
+
+      // write to file Tokens, old frequency is removed before new is added
+      // remove
+      for (const auto& tk : tokensRemove) {
+        typename TStore::TTokenInfo ti;
+        ti.docId = id;
+        ti.isWhole = true;
+        arrRemove.push_back({tk, ti});
+      }
+      TStore::bulkTokensWrite(oTokens, arrRemove, freqsRemove,
+                              positionsRemove);
+      // add
+      for (const auto& tk : tokensAdd) {
+        typename TStore::TTokenInfo ti;
+        ti.docId = id;
+        ti.isWhole = true;
+        arrAdd.push_back({tk, ti});
+      }
+      TStore::bulkTokensWrite(oTokens, arrAdd, freqsAdd, positionsAdd);
 
       // combine all tokens
       tokens.insert(tokensAdd.begin(), tokensAdd.end());
@@ -435,15 +1231,21 @@ public:
     // calc num docs and tokens
     size_t numDocs = 0;
     size_t numTokens;
+    int64_t docLengths = 0;
     {
       std::unordered_set<std::string_view> allTokens;
+      std::unordered_set<std::string_view> wholeTokens;
       for (auto& w : writers) {
         numDocs += w.numDocs;
+        docLengths += w.docLengths;
         allTokens.insert(w.tokens.begin(), w.tokens.end());
+        wholeTokens.insert(w.tokens.begin(), w.tokens.end());
         auto partial = partialTokens(w.tokens, &allTokens);
         allTokens.insert(partial.begin(), partial.end());
       }
-      numTokens = allTokens.size();
+      // whole tokens have also frequencies and positions
+      numTokens = allTokens.size() + wholeTokens.size() *
+                                         (usePositions() ? 2 : 1);
       for (auto& w : writers) {
         w.tokens.clear();
       }
@@ -456,7 +1258,8 @@ public:
         << "Counted " << numTokens << " tokens in " << d2.count() << " sec\n";
 
     // lock with mutex
-    std::lock_guard<std::mutex> lock(mutex_);
+    auto lock = lockWrite();
+    generation_++;
 
     std::vector<std::thread> pool;
     std::vector<boost::iostreams::mapped_file> files;
@@ -534,6 +1337,7 @@ public:
     pool.clear();
 
     store_.bulkTokensUnlock();
+    store_.bulkDocLengths(docLengths);
     for (size_t i = 0; i < numThreads; ++i) {
       if (fs::file_size(writers[i].pathTokens) == 0) {
         continue;
@@ -584,10 +1388,150 @@ private:
     }
     return {tokensFull, tokensJoined};
   }
+  // occurrences of each token in joined texts and number of all tokens
+  static std::unordered_map<std::string, uint32_t>
+  tokenFreqs(const std::vector<std::string>& tokensJoined, uint32_t& length) {
+    std::unordered_map<std::string, uint32_t> freqs;
+    length = 0;
+    for (const auto& txt : tokensJoined) {
+      for (auto& tk : splitTokens(txt)) {
+        freqs[std::move(tk)]++;
+        length++;
+      }
+    }
+    return freqs;
+  }
+
+  // positions of whole tokens in each text
+  static std::unordered_map<std::string,
+                            std::vector<typename TStore::TTokenPosition>>
+  tokenPositions(const std::vector<std::string>& tokensJoined,
+                 const typename TStore::TDoc::TId& id) {
+    std::unordered_map<std::string,
+                       std::vector<typename TStore::TTokenPosition>>
+        positions;
+    for (size_t field = 0; field < tokensJoined.size(); ++field) {
+      auto tks = splitTokens(tokensJoined[field]);
+      for (size_t pos = 0; pos < tks.size(); ++pos) {
+        positions[tks[pos]].push_back(
+            {id, (uint32_t)field, (uint32_t)pos});
+      }
+    }
+    return positions;
+  }
+
+  // Calls func(k, ranges) for each ids[k], ranges are positions of each
+  // token in that document.
+  template <class TFunc>
+  void forEachPositions(const std::vector<typename TStore::TDoc::TId>& ids,
+                        const std::vector<std::string>& tokens,
+                        TFunc func) const {
+    typedef typename TStore::TTokenPosition TPos;
+    std::vector<std::vector<TPos>> lists;
+    lists.reserve(tokens.size());
+    for (const auto& tk : tokens) {
+      lists.push_back(store_.findTokenPositions(tk, ids));
+    }
+    std::vector<size_t> cur(tokens.size(), 0);
+    std::vector<std::pair<const TPos*, const TPos*>> ranges(tokens.size());
+    for (size_t k = 0; k < ids.size(); ++k) {
+      for (size_t t = 0; t < tokens.size(); ++t) {
+        const auto& list = lists[t];
+        size_t c = cur[t];
+        while (c < list.size() && list[c].docId < ids[k]) {
+          c++;
+        }
+        size_t e = c;
+        while (e < list.size() && !(ids[k] < list[e].docId)) {
+          e++;
+        }
+        ranges[t] = {list.data() + c, list.data() + e};
+        cur[t] = e;
+      }
+      func(k, ranges);
+    }
+  }
+
+  // number of first tokens which follow each other, ranges are sorted
+  // positions of tokens in one document
+  template <class TPos>
+  static size_t positionsTogether(
+      const std::vector<std::pair<const TPos*, const TPos*>>& ranges) {
+    size_t best = 0;
+    for (auto it = ranges[0].first; it != ranges[0].second; ++it) {
+      size_t l = 1;
+      while (l < ranges.size()) {
+        TPos next = *it;
+        next.pos += (uint32_t)l;
+        if (!std::binary_search(ranges[l].first, ranges[l].second, next)) {
+          break;
+        }
+        l++;
+      }
+      best = std::max(best, l);
+      if (best == ranges.size()) {
+        break;
+      }
+    }
+    return best;
+  }
+
+  // same as positionsTogether, but from joined tokens of each text
+  static size_t numTokensTogether(const std::vector<std::string>& texts,
+                                  const std::vector<std::string>& tokens) {
+    for (size_t n = tokens.size(); n > 0; --n) {
+      auto joined = joinTokens(std::vector<std::string>(
+          tokens.begin(), tokens.begin() + n));
+      for (const auto& txt : texts) {
+        if (tokensOverlap(txt, joined)) {
+          return n;
+        }
+      }
+    }
+    return 0;
+  }
+
+  // keeps documents with phrase in one text
+  void filterPhrase(std::vector<typename TStore::TDoc::TId>& ids,
+                    const std::vector<std::string>& phrase) const {
+    std::vector<bool> keep(ids.size(), false);
+    if (usePositions()) {
+      forEachPositions(ids, phrase, [&](size_t k, const auto& ranges) {
+        keep[k] = positionsTogether(ranges) == phrase.size();
+      });
+    } else {
+      for (size_t k = 0; k < ids.size(); ++k) {
+        auto opt = store_.findDoc(ids[k]);
+        keep[k] = opt && numTokensTogether(opt->second, phrase) ==
+                             phrase.size();
+      }
+    }
+    size_t n = 0;
+    for (size_t k = 0; k < ids.size(); ++k) {
+      if (keep[k]) {
+        ids[n++] = ids[k];
+      }
+    }
+    ids.resize(n);
+  }
+
+  // frequency is not written again when it and length are not changed
+  static bool
+  isSameFreq(const std::unordered_map<std::string, uint32_t>& freqs,
+             const std::pair<const std::string, uint32_t>& pair,
+             bool sameLength) {
+    if (!sameLength) {
+      return false;
+    }
+    auto ptr = freqs.find(pair.first);
+    return ptr != freqs.end() && ptr->second == pair.second;
+  }
+
   std::unordered_set<std::string_view>
   partialTokens(const std::unordered_set<std::string>& tokens,
                 std::unordered_set<std::string_view>* allTokens = nullptr) {
-    if (!settings.autocomplete) {
+    if (!settings.autocomplete ||
+        (settings.prefixDictionary && settings.autocompleteMaxLen == 0)) {
       return {};
     }
 
@@ -0,0 +1,66 @@
+//
+//  DocView.hpp
+//
+//  Created by Ignac Banic on 18/10/26.
+//  Copyright © 2026 Ignac Banic. All rights reserved.
+//
+
+#pragma once
+
+#include <search/CompressSize.hpp>
+#include <search/Types.hpp>
+
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace Search {
+
+// Serialized document with its tokens, as FileStore keeps it: size of
+// document, document and then size and text of each tokens. Nothing is
+// copied until doc or tokens are asked for.
+template <class TDoc>
+class DocView {
+private:
+  BytesView doc_;
+  BytesView tokens_;
+
+public:
+  DocView() = default;
+  explicit DocView(BytesView bytes) {
+    auto dt = bytes.data();
+    auto l = readSize(dt);
+    auto sizeLen = dt - bytes.data();
+    if (sizeLen + l > bytes.size()) {
+      throw std::runtime_error("DocView() overflow");
+    }
+    doc_ = BytesView(dt, l);
+    tokens_ = BytesView(dt + l, bytes.size() - sizeLen - l);
+  }
+
+  TDoc doc(const typename TDoc::TId& id) const { return TDoc(id, doc_); }
+
+  // func(std::string_view) for each tokens, views point to store
+  template <class TFunc>
+  void forEachToken(TFunc func) const {
+    const std::byte* cur = tokens_.data();
+    const std::byte* end = cur + tokens_.size();
+    while (cur < end) {
+      auto l = readSize(cur);
+      if (l > (size_t)(end - cur)) {
+        throw std::runtime_error("DocView::forEachToken() overflow");
+      }
+      func(std::string_view((const char*)cur, l));
+      cur += l;
+    }
+  }
+
+  std::vector<std::string> tokens() const {
+    std::vector<std::string> arr;
+    forEachToken([&](std::string_view txt) { arr.emplace_back(txt); });
+    return arr;
+  }
+};
+
+} // namespace Search
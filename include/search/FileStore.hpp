@@ -7,18 +7,30 @@
 
 #pragma once
 
+#include <search/AttributeColumns.hpp>
+#include <search/Bitmap.hpp>
 #include <search/CompressSize.hpp>
+#include <search/DocView.hpp>
 #include <search/KeyValueFile.hpp>
 #include <search/KeyValueFileList.hpp>
 #include <search/KeyValueMemory.hpp>
+#include <search/PrefixDictionary.hpp>
 #include <search/TokenInfo.hpp>
+#include <search/Tokenize.hpp>
 #include <search/Types.hpp>
+#include <search/WriteAheadLog.hpp>
 
+#include <algorithm>
 #include <cstring>
 #include <filesystem>
+#include <iterator>
 #include <map>
+#include <memory>
 #include <optional>
 #include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 namespace fs = std::filesystem;
@@ -30,20 +42,88 @@ class FileStore {
 public:
   typedef TDoc2 TDoc;
   typedef TokenInfo<typename TDoc::TId> TTokenInfo;
+  typedef TokenFreq<typename TDoc::TId> TTokenFreq;
+  typedef TokenPosition<typename TDoc::TId> TTokenPosition;
+
+  // posting lists pack serialized id with isWhole flag or with frequency and
+  // length of document into one number, wider ids like std::string are only
+  // in MemoryStore
+  static_assert(sizeof(typename TDoc::TIdSerialized) <= 6,
+                "FileStore supports serialized ids up to 6 bytes, map wider "
+                "ids to integers or use MemoryStore");
 
 private:
   fs::path path_;
   fs::path path1_;
   fs::path path2_;
+  // changes of files, replayed on them after crash
+  std::unique_ptr<WriteAheadLog> log_;
   KeyValueFile db;
   KeyValueFileList db2;
+  // whole tokens for autocomplete from prefix
+  PrefixDictionary dict_;
+  AttributeColumns attrs_;
   uint64_t numBucketsImport1_, numBucketsImport2_;
+  int64_t bulkDocLengths_ = 0;
+  // counted from documents when store is opened
+  uint64_t sumDocLengths_ = 0;
+  // blocks of frequencies changed by each thread of bulk import
+  std::vector<std::unordered_map<std::string, std::vector<uint64_t>>>
+      bulkBlocks_;
+  // attributes of documents imported by each thread
+  std::vector<std::vector<std::pair<uint64_t, std::vector<int64_t>>>>
+      bulkAttributes_;
+
+  enum LogType : uint8_t {
+    LogDocSet = 1,
+    LogDocRemove,
+    LogTokenSet,
+    LogTokenRemove,
+    LogTokenSetAll,
+    LogClear
+  };
 
 public:
-  FileStore(const fs::path& path)
+  // log is emptied after files are saved when it grows bigger
+  static const uint64_t MaxLogSize = 64'000'000;
+
+  // With writeAheadLog changes are also written to <path>.wal. After crash
+  // its idempotent records are replayed on files, so committed changes
+  // survive crash of process.
+  FileStore(const fs::path& path, bool writeAheadLog = false)
       : path_(path), path1_(path.string() + ".docs"),
-        path2_(path.string() + ".tokens"), db(path1_), db2(path2_) {}
-  //~FileStore() = default;
+        path2_(path.string() + ".tokens"),
+        log_(writeAheadLog ? new WriteAheadLog(path.string() + ".wal",
+                                               logFiles(path))
+                           : nullptr),
+        db(path1_), db2(path2_),
+        dict_(path.string() + ".dict"), attrs_(path.string() + ".attrs") {
+    // files from before dictionary and attributes
+    if (!fs::is_regular_file(path.string() + ".dict") && db2.numItems() > 0) {
+      rebuildDictionary();
+    }
+    if (!fs::is_regular_file(path.string() + ".attrs") && db.numItems() > 0) {
+      rebuildAttributes();
+    }
+    if (log_ && log_->needsReplay()) {
+      replayLog();
+    }
+    for (const auto& pair : db.allDocuments()) {
+      sumDocLengths_ += docLength(pair.second);
+    }
+  }
+  ~FileStore() {
+    try {
+      if (log_) {
+        log_->commit();
+        flushFiles();
+        log_->close();
+      } else {
+        dict_.flush();
+      }
+    } catch (...) {
+    }
+  }
   FileStore(const FileStore&) = delete;
   FileStore& operator=(const FileStore&) = delete;
   FileStore(FileStore&&) = default;
@@ -51,20 +131,42 @@ public:
 
   static bool isFileVersionOk(const fs::path& path) {
     return KeyValueFile::isFileVersionOk(path.string() + ".docs") &&
-           KeyValueFileList::isFileVersionOk(path.string() + ".tokens");
+           KeyValueFileList::isFileVersionOk(path.string() + ".tokens") &&
+           PrefixDictionary::isFileVersionOk(path.string() + ".dict") &&
+           AttributeColumns::isFileVersionOk(path.string() + ".attrs");
   }
 
   void addDoc(const typename TDoc::TId& id2, const TDoc& doc,
               const std::vector<std::string>& tokens) {
     auto id = TDoc::serializeId(id2);
     auto cmb = docSerialize(doc, tokens);
-    db.set(std::string_view((const char*)&id[0], sizeof(id)),
-           {cmb.data(), cmb.size()});
+    std::string_view key((const char*)&id[0], sizeof(id));
+    int64_t diff = docLength(tokens);
+    auto old = db.get(key);
+    if (old.data()) {
+      diff -= docLength(old);
+    }
+    log(LogDocSet, key, {cmb.data(), cmb.size()});
+    db.set(key, {cmb.data(), cmb.size()});
+    sumDocLengths_ += diff;
+    if constexpr (HasAttributes<TDoc>::value) {
+      attrs_.set(attributesRow(id2), doc.attributes());
+    }
   }
 
   void removeDoc(const typename TDoc::TId& id) {
     auto key2 = TDoc::serializeId(id);
-    db.remove(std::string_view((const char*)&key2[0], sizeof(key2)));
+    std::string_view key((const char*)&key2[0], sizeof(key2));
+    auto old = db.get(key);
+    if (!old.data()) {
+      return;
+    }
+    log(LogDocRemove, key, {});
+    sumDocLengths_ -= docLength(old);
+    db.remove(key);
+    if constexpr (HasAttributes<TDoc>::value) {
+      attrs_.remove(attributesRow(id));
+    }
   }
 
   std::optional<std::pair<TDoc, std::vector<std::string>>>
@@ -81,6 +183,35 @@ public:
     return docDeserialize(id, res);
   }
 
+  // document in mapped file, valid until next change of store
+  std::optional<DocView<TDoc>>
+  findDocView(const typename TDoc::TId& id) const {
+    auto key2 = TDoc::serializeId(id);
+    auto res = db.get(std::string_view((const char*)&key2[0], sizeof(key2)));
+    if (!res.data()) {
+      return std::nullopt;
+    }
+    return DocView<TDoc>(res);
+  }
+
+  bool hasDoc(const typename TDoc::TId& id) const {
+    auto key2 = TDoc::serializeId(id);
+    return db.get(std::string_view((const char*)&key2[0], sizeof(key2)))
+               .data() != nullptr;
+  }
+
+  std::vector<typename TDoc::TId> allIds() const {
+    auto arr2 = db.allDocuments();
+    std::vector<typename TDoc::TId> arr;
+    arr.reserve(arr2.size());
+    for (const auto& pair : arr2) {
+      typename TDoc::TIdSerialized id2;
+      std::memcpy(&id2[0], pair.first.data(), pair.first.size());
+      arr.push_back(TDoc::deserializeId(id2));
+    }
+    return arr;
+  }
+
   std::vector<TDoc> allDocuments() const {
     auto arr2 = db.allDocuments();
     std::vector<TDoc> arr;
@@ -95,31 +226,389 @@ public:
     return arr;
   }
 
+  // ids of documents whose attributes pass all filters
+  Bitmap findAttributes(const std::vector<AttributeFilter>& filters) const {
+    return attrs_.find(filters);
+  }
+
   void addToken(std::string_view token, const TTokenInfo& info) {
-    db2.set(token, tokenInfoToString(info));
+    auto value = tokenInfoToValue(info);
+    log(LogTokenSet, token, valuesToBytes(&value, 1));
+    db2.set(token, value);
   }
 
   void removeToken(std::string_view token, const TTokenInfo& info) {
-    db2.remove(token, tokenInfoToString(info));
+    auto value = tokenInfoToValue(info);
+    log(LogTokenRemove, token, valuesToBytes(&value, 1));
+    db2.remove(token, value);
   }
 
-  std::vector<TTokenInfo> findToken(const std::string& token) {
-    auto res = db2.get(token);
-    std::vector<TTokenInfo> arr(res.size());
-    for (size_t i = 0; i < res.size(); ++i) {
-      arr[i] = tokenInfoFromString(res[i]);
+  // all postings of token at once, token must not exist yet
+  void addTokens(std::string_view token, const std::vector<TTokenInfo>& arr) {
+    std::vector<uint64_t> values;
+    values.reserve(arr.size());
+    for (const auto& info : arr) {
+      values.push_back(tokenInfoToValue(info));
+    }
+    std::sort(values.begin(), values.end());
+    log(LogTokenSetAll, token, valuesToBytes(values.data(), values.size()));
+    db2.set(token, values);
+  }
+
+  void addTokenFreq(std::string_view token, const TTokenFreq& info) {
+    auto key = freqKey(token);
+    auto value = tokenFreqToValue(info);
+    log(LogTokenSet, key, valuesToBytes(&value, 1));
+    db2.set(key, value);
+    dict_.add(token);
+
+    // block max only grows
+    auto block = value >> (16 + BlockMaxBits);
+    auto keyMax = blockMaxKey(token);
+    auto old = db2.getInRanges(keyMax, {{block << 16, (block << 16) | 0xFFFF}});
+    uint64_t maxFreq = value & 0xFF;
+    uint64_t minCode = (value >> 8) & 0xFF;
+    for (auto v : old) {
+      maxFreq = std::max(maxFreq, (v >> 8) & 0xFF);
+      minCode = std::min(minCode, v & 0xFF);
+    }
+    uint64_t valueMax = (block << 16) | (maxFreq << 8) | minCode;
+    if (old.size() == 1 && old[0] == valueMax) {
+      return;
+    }
+    for (auto v : old) {
+      log(LogTokenRemove, keyMax, valuesToBytes(&v, 1));
+      db2.remove(keyMax, v);
+    }
+    log(LogTokenSet, keyMax, valuesToBytes(&valueMax, 1));
+    db2.set(keyMax, valueMax);
+  }
+
+  // value must be same as when it was added
+  void removeTokenFreq(std::string_view token, const TTokenFreq& info) {
+    auto key = freqKey(token);
+    auto value = tokenFreqToValue(info);
+    log(LogTokenRemove, key, valuesToBytes(&value, 1));
+    db2.remove(key, value);
+    rebuildBlockMax(token, {value >> (16 + BlockMaxBits)});
+  }
+
+  // all frequencies of token at once, they must not exist yet
+  void addTokenFreqs(std::string_view token,
+                     const std::vector<TTokenFreq>& arr) {
+    auto key = freqKey(token);
+    std::vector<uint64_t> values;
+    values.reserve(arr.size());
+    for (const auto& info : arr) {
+      values.push_back(tokenFreqToValue(info));
+    }
+    std::sort(values.begin(), values.end());
+    log(LogTokenSetAll, key, valuesToBytes(values.data(), values.size()));
+    db2.set(key, values);
+    dict_.add(token);
+    auto keyMax = blockMaxKey(token);
+    auto valuesMax = blockMaxValues(values);
+    log(LogTokenSetAll, keyMax,
+        valuesToBytes(valuesMax.data(), valuesMax.size()));
+    db2.set(keyMax, valuesMax);
+  }
+
+  // sorted by block
+  std::vector<BlockMax> findTokenBlockMax(const std::string& token) const {
+    std::vector<BlockMax> arr;
+    for (auto value : db2.get(blockMaxKey(token))) {
+      BlockMax bm{value >> 16, (uint32_t)((value >> 8) & 0xFF),
+                  decodeDocLength(value & 0xFF)};
+      if (!arr.empty() && arr.back().block == bm.block) {
+        arr.back().maxFreq = std::max(arr.back().maxFreq, bm.maxFreq);
+        arr.back().minDocLength =
+            std::min(arr.back().minDocLength, bm.minDocLength);
+      } else {
+        arr.push_back(bm);
+      }
     }
     return arr;
   }
 
+  // frequencies of token in documents of sorted blocks
+  std::vector<TTokenFreq>
+  findTokenFreqsInBlocks(const std::string& token,
+                         const std::vector<uint64_t>& blocks) const {
+    auto values = db2.getInRanges(freqKey(token), blockRanges(blocks));
+    std::vector<TTokenFreq> arr(values.size());
+    for (size_t i = 0; i < values.size(); ++i) {
+      arr[i] = tokenFreqFromValue(values[i]);
+    }
+    if (!std::is_sorted(arr.begin(), arr.end())) {
+      std::sort(arr.begin(), arr.end());
+    }
+    return arr;
+  }
+
+  // frequencies of token in given documents
+  std::vector<TTokenFreq>
+  findTokenFreqs(const std::string& token,
+                 const std::vector<typename TDoc::TId>& docIds) const {
+    std::vector<std::pair<uint64_t, uint64_t>> ranges;
+    ranges.reserve(docIds.size());
+    for (const auto& id : docIds) {
+      auto value = tokenFreqToValue({id, 0, 0});
+      ranges.push_back({value, value | 0xFFFF});
+    }
+    if (!std::is_sorted(ranges.begin(), ranges.end())) {
+      std::sort(ranges.begin(), ranges.end());
+    }
+    auto values = db2.getInRanges(freqKey(token), ranges);
+    std::vector<TTokenFreq> arr(values.size());
+    for (size_t i = 0; i < values.size(); ++i) {
+      arr[i] = tokenFreqFromValue(values[i]);
+    }
+    if (!std::is_sorted(arr.begin(), arr.end())) {
+      std::sort(arr.begin(), arr.end());
+    }
+    return arr;
+  }
+
+  // number of documents with whole token
+  uint64_t tokenFreqCount(const std::string& token) const {
+    return db2.count(freqKey(token));
+  }
+
+  uint64_t sumDocLengths() const { return sumDocLengths_; }
+
+  // Positions after MaxPositionField text or MaxPosition token are not
+  // stored, phrases there are not found.
+  static const uint32_t MaxPositionField = 255;
+  static const uint32_t MaxPosition = 65535;
+  // Values of positions have 5 bytes for id. Positions of wider ids are not
+  // stored, Db checks tokens of documents for them like without positions.
+  static constexpr bool StoresPositions =
+      sizeof(typename TDoc::TIdSerialized) <= 5;
+
+  void addTokenPositions(std::string_view token,
+                         const std::vector<TTokenPosition>& arr) {
+    if constexpr (!StoresPositions) {
+      return;
+    }
+    auto values = tokenPositionsToValues(arr);
+    if (values.empty()) {
+      return;
+    }
+    auto key = positionsKey(token);
+    log(LogTokenSetAll, key, valuesToBytes(values.data(), values.size()));
+    db2.set(key, values);
+  }
+
+  void removeTokenPositions(std::string_view token,
+                            const std::vector<TTokenPosition>& arr) {
+    if constexpr (!StoresPositions) {
+      return;
+    }
+    auto key = positionsKey(token);
+    for (auto value : tokenPositionsToValues(arr)) {
+      log(LogTokenRemove, key, valuesToBytes(&value, 1));
+      db2.remove(key, value);
+    }
+  }
+
+  // positions of token in given documents
+  std::vector<TTokenPosition>
+  findTokenPositions(const std::string& token,
+                     const std::vector<typename TDoc::TId>& docIds) const {
+    if constexpr (!StoresPositions) {
+      return {};
+    }
+    std::vector<std::pair<uint64_t, uint64_t>> ranges;
+    ranges.reserve(docIds.size());
+    for (const auto& id : docIds) {
+      auto value = tokenPositionToValue({id, 0, 0});
+      ranges.push_back({value, value | 0xFFFFFF});
+    }
+    if (!std::is_sorted(ranges.begin(), ranges.end())) {
+      std::sort(ranges.begin(), ranges.end());
+    }
+    auto values = db2.getInRanges(positionsKey(token), ranges);
+    std::vector<TTokenPosition> arr(values.size());
+    for (size_t i = 0; i < values.size(); ++i) {
+      arr[i] = tokenPositionFromValue(values[i]);
+    }
+    if (!std::is_sorted(arr.begin(), arr.end())) {
+      std::sort(arr.begin(), arr.end());
+    }
+    return arr;
+  }
+
+  // writes logged changes to log file, they survive crash of process
+  void commit() {
+    if (log_) {
+      log_->commit();
+    }
+  }
+
+  // commit and wait until log is on disk
+  void sync() {
+    if (log_) {
+      log_->sync();
+    }
+  }
+
+  // saves changed pages of files to disk and empties log
+  void checkpoint() {
+    if (log_) {
+      log_->commit();
+    }
+    flushFiles();
+    if (log_) {
+      log_->checkpoint();
+    }
+  }
+
+  // Copies documents and postings from stores into this one. isLive(i, id)
+  // tells if document from stores[i] is copied.
+  template <class TFunc>
+  void merge(const std::vector<const FileStore*>& stores, TFunc isLive) {
+    int64_t sumLengths = 0;
+    for (size_t i = 0; i < stores.size(); ++i) {
+      for (const auto& pair : stores[i]->db.allDocuments()) {
+        typename TDoc::TIdSerialized id2;
+        std::memcpy(&id2[0], pair.first.data(), pair.first.size());
+        if (isLive(i, TDoc::deserializeId(id2))) {
+          db.set(pair.first, pair.second);
+          sumLengths += docLength(pair.second);
+          setAttributes(pair.first, pair.second);
+        }
+      }
+    }
+    sumDocLengths_ += sumLengths;
+
+    std::unordered_set<std::string_view> tokens;
+    for (const auto* store : stores) {
+      auto keys = store->db2.allKeys();
+      tokens.insert(keys.begin(), keys.end());
+    }
+    std::vector<uint64_t> values;
+    for (const auto& token : tokens) {
+      // block max is calculated again from frequencies
+      if (isBlockMaxKey(token)) {
+        continue;
+      }
+      values.clear();
+      for (size_t i = 0; i < stores.size(); ++i) {
+        for (auto value : stores[i]->db2.get(token)) {
+          if (isLive(i, docIdFromValue(token, value))) {
+            values.push_back(value);
+          }
+        }
+      }
+      if (!values.empty()) {
+        std::sort(values.begin(), values.end());
+        db2.set(token, values);
+        if (isFreqKey(token)) {
+          db2.set(blockMaxKey(token.substr(0, token.size() - 1)),
+                  blockMaxValues(values));
+        }
+      }
+    }
+    rebuildDictionary();
+    // merge is not logged
+    if (log_) {
+      checkpoint();
+    }
+  }
+
+  std::vector<TTokenInfo> findToken(const std::string& token) {
+    return tokenInfosFromValues(db2.get(token));
+  }
+
+  // only postings of given documents
+  std::vector<TTokenInfo>
+  findToken(const std::string& token,
+            const std::vector<typename TDoc::TId>& docIds) {
+    std::vector<std::pair<uint64_t, uint64_t>> ranges;
+    ranges.reserve(docIds.size());
+    for (const auto& id : docIds) {
+      TTokenInfo info;
+      info.docId = id;
+      info.isWhole = false;
+      auto value = tokenInfoToValue(info);
+      ranges.push_back({value, value | 1});
+    }
+    if (!std::is_sorted(ranges.begin(), ranges.end())) {
+      std::sort(ranges.begin(), ranges.end());
+    }
+    return tokenInfosFromValues(db2.getInRanges(token, ranges));
+  }
+
+  uint64_t tokenCount(const std::string& token) const {
+    return db2.count(token);
+  }
+
+  // sorted whole tokens which start with prefix, tokens of removed
+  // documents can stay until optimize()
+  std::vector<std::string>
+  findTokensWithPrefix(std::string_view prefix) const {
+    return dict_.findPrefix(prefix);
+  }
+
+  // sorted whole tokens within edit distance, with their distances
+  std::vector<std::pair<std::string, uint8_t>>
+  findTokensFuzzy(std::string_view token, uint8_t maxDistance,
+                  size_t prefixLen) const {
+    return dict_.findFuzzy(token, maxDistance, prefixLen);
+  }
+
+  // ids of documents with token, only for unsigned integer ids
+  Bitmap findTokenBitmap(const std::string& token, bool onlyWhole) {
+    if (!isIdPackedAsNumber()) {
+      Bitmap res;
+      for (const auto& info : findToken(token)) {
+        if (!onlyWhole || info.isWhole) {
+          res.add(info.docId);
+        }
+      }
+      return res;
+    }
+
+    // value is id * 2 + isWhole, so each pair of bits becomes one bit
+    auto packed = db2.getBitmap(token);
+    Bitmap res;
+    uint64_t words[Bitmap::ContainerWords];
+    uint64_t words2[Bitmap::ContainerWords];
+    uint64_t key2 = 0;
+    bool hasKey2 = false;
+    for (const auto& c : packed.containers()) {
+      if (hasKey2 && (c.key >> 1) != key2) {
+        res.appendWords(key2, words2);
+        hasKey2 = false;
+      }
+      if (!hasKey2) {
+        std::memset(words2, 0, sizeof(words2));
+        key2 = c.key >> 1;
+        hasKey2 = true;
+      }
+      c.toWords(words);
+      size_t offset = (c.key & 1) * Bitmap::ContainerWords / 2;
+      for (size_t i = 0; i < Bitmap::ContainerWords; ++i) {
+        uint64_t w = onlyWhole ? words[i] >> 1 : words[i] | (words[i] >> 1);
+        words2[offset + i / 2] |= evenBits(w) << ((i & 1) * 32);
+      }
+    }
+    if (hasKey2) {
+      res.appendWords(key2, words2);
+    }
+    return res;
+  }
+
   void optimize() {
     db.optimize();
     db2.optimize();
+    rebuildDictionary();
   }
 
   void optimizeFreeData() {
     db.ensureOptimalWaste();
     db2.ensureOptimalWaste();
+    dict_.flush();
   }
 
   size_t fileSize() const { return db.fileSize() + db2.fileSize(); }
@@ -138,24 +627,79 @@ public:
     if (fs::is_regular_file(pth3)) {
       fs::remove(pth3);
     }
+    pth3 = pth2;
+    pth3 += ".dict";
+    if (fs::is_regular_file(pth3)) {
+      fs::remove(pth3);
+    }
+    pth3 = pth2;
+    pth3 += ".attrs";
+    if (fs::is_regular_file(pth3)) {
+      fs::remove(pth3);
+    }
+    WriteAheadLog::removeFiles(pth2.string() + ".wal");
   }
 
   void clear() {
+    if (log_) {
+      log_->append(LogClear, {}, {});
+      log_->commit();
+    }
     db.clear();
     db2.clear();
+    dict_.clear();
+    attrs_.clear();
+    sumDocLengths_ = 0;
+    if (log_) {
+      checkpoint();
+    }
   }
 
   size_t sizeDocuments() { return db.numItems(); }
 
   size_t sizeTokens() { return db2.numItems(); }
 
+  // bulk import is not logged, files are saved before and after it
   void bulkStart(size_t numThreads) {
+    if (log_) {
+      checkpoint();
+    }
+    bulkBlocks_.clear();
+    bulkBlocks_.resize(numThreads);
+    bulkAttributes_.clear();
+    bulkAttributes_.resize(numThreads);
     db.bulkStart(numThreads);
     db2.bulkStart(numThreads);
   }
   void bulkStop() {
     db.bulkStop();
     db2.bulkStop();
+    rebuildDictionary();
+    sumDocLengths_ += bulkDocLengths_;
+    bulkDocLengths_ = 0;
+    std::unordered_map<std::string, std::vector<uint64_t>> blocks;
+    for (auto& map : bulkBlocks_) {
+      for (auto& pair : map) {
+        auto& arr = blocks[pair.first];
+        arr.insert(arr.end(), pair.second.begin(), pair.second.end());
+      }
+    }
+    bulkBlocks_.clear();
+    for (const auto& arr : bulkAttributes_) {
+      for (const auto& pair : arr) {
+        attrs_.set(pair.first, pair.second);
+      }
+    }
+    bulkAttributes_.clear();
+    for (auto& pair : blocks) {
+      std::sort(pair.second.begin(), pair.second.end());
+      pair.second.erase(std::unique(pair.second.begin(), pair.second.end()),
+                        pair.second.end());
+      rebuildBlockMax(pair.first, pair.second);
+    }
+    if (log_) {
+      checkpoint();
+    }
   }
   static void bulkDocWrite(std::ofstream& out, const typename TDoc::TId& id2,
                            const TDoc& doc,
@@ -176,6 +720,12 @@ public:
 
     db.bulkInsert(bucket, std::get<1>(r1), std::get<2>(r1), nthThread,
                   numThreads);
+    if constexpr (HasAttributes<TDoc>::value) {
+      auto id = docIdFromKey(std::get<1>(r1));
+      auto doc = DocView<TDoc>(std::get<2>(r1)).doc(id);
+      bulkAttributes_[nthThread].push_back(
+          {attributesRow(id), doc.attributes()});
+    }
   }
   void bulkTokensReadAdd(const std::byte*& dt, size_t nthThread,
                          size_t numThreads) {
@@ -193,6 +743,7 @@ public:
 
       db2.bulkInsert(bucket, std::get<1>(r1), std::get<2>(r1), nthThread,
                      numThreads);
+      bulkChangedBlock(std::get<1>(r1), std::get<2>(r1), nthThread);
     }
   }
   void bulkTokensReadRemove(const std::byte*& dt, size_t nthThread,
@@ -209,18 +760,38 @@ public:
 
       db2.bulkRemove(bucket, std::get<1>(r1), std::get<2>(r1), nthThread,
                      numThreads);
+      bulkChangedBlock(std::get<1>(r1), std::get<2>(r1), nthThread);
     }
   }
-  static void
-  bulkTokensWrite(std::ofstream& out,
-                  const std::vector<std::pair<std::string, TTokenInfo>>& arr) {
-    auto buff = writeSizeString(arr.size());
+  static void bulkTokensWrite(
+      std::ofstream& out,
+      const std::vector<std::pair<std::string, TTokenInfo>>& arr,
+      const std::vector<std::pair<std::string, TTokenFreq>>& freqs,
+      const std::vector<std::pair<std::string, std::vector<TTokenPosition>>>&
+          positions) {
+    std::vector<std::pair<std::string, uint64_t>> positions2;
+    for (const auto& pair : positions) {
+      auto key = positionsKey(pair.first);
+      for (auto value : tokenPositionsToValues(pair.second)) {
+        positions2.push_back({key, value});
+      }
+    }
+    auto buff = writeSizeString(arr.size() + freqs.size() + positions2.size());
     out.write((const char*)buff.data(), buff.size());
     for (const auto& pair : arr) {
       KeyValueFileList::bulkWrite(out, pair.first,
-                                  tokenInfoToString(pair.second));
+                                  tokenInfoToValue(pair.second));
+    }
+    for (const auto& pair : freqs) {
+      KeyValueFileList::bulkWrite(out, freqKey(pair.first),
+                                  tokenFreqToValue(pair.second));
+    }
+    for (const auto& pair : positions2) {
+      KeyValueFileList::bulkWrite(out, pair.first, pair.second);
     }
   }
+  // change of sum of lengths of imported documents, it is saved in bulkStop
+  void bulkDocLengths(int64_t diff) { bulkDocLengths_ += diff; }
   void bulkTokensLock(size_t numItems) {
     db2.lockTableForNumKeys(numItems);
     numBucketsImport2_ = db2.numBuckets();
@@ -239,6 +810,268 @@ public:
   }
 
 private:
+  // Tokens don't have zero bytes, so keys of frequencies, block max and
+  // positions are separate from postings.
+  // Frequencies are separate list next to postings of whole token. Length of
+  // document changes them all, postings stay same and are updated only by
+  // difference of tokens.
+  static std::string freqKey(std::string_view token) {
+    std::string key(token);
+    key += '\0';
+    return key;
+  }
+
+  static std::string blockMaxKey(std::string_view token) {
+    std::string key(token);
+    key += '\0';
+    key += 'm';
+    return key;
+  }
+
+  static bool isFreqKey(std::string_view key) {
+    return key.size() >= 2 && key.back() == '\0';
+  }
+
+  // whole tokens are tokens of frequencies
+  void rebuildDictionary() {
+    std::vector<std::string> tokens;
+    for (const auto& key : db2.allKeys()) {
+      if (isFreqKey(key)) {
+        tokens.emplace_back(key.substr(0, key.size() - 1));
+      }
+    }
+    dict_.reset(std::move(tokens));
+  }
+
+  static typename TDoc::TId docIdFromKey(std::string_view key) {
+    typename TDoc::TIdSerialized id2;
+    std::memcpy(&id2[0], key.data(), key.size());
+    return TDoc::deserializeId(id2);
+  }
+
+  static uint64_t attributesRow(const typename TDoc::TId& id) {
+    static_assert(std::is_integral_v<typename TDoc::TId> &&
+                      std::is_unsigned_v<typename TDoc::TId>,
+                  "attributes need unsigned integer ids");
+    return (uint64_t)id;
+  }
+
+  void setAttributes(std::string_view key, BytesView value) {
+    if constexpr (HasAttributes<TDoc>::value) {
+      auto id = docIdFromKey(key);
+      attrs_.set(attributesRow(id), DocView<TDoc>(value).doc(id).attributes());
+    }
+  }
+
+  void rebuildAttributes() {
+    if constexpr (HasAttributes<TDoc>::value) {
+      attrs_.clear();
+      for (const auto& pair : db.allDocuments()) {
+        setAttributes(pair.first, pair.second);
+      }
+    }
+  }
+
+  static bool isBlockMaxKey(std::string_view key) {
+    return key.size() >= 2 && key[key.size() - 2] == '\0' &&
+           key.back() == 'm';
+  }
+
+  static bool isPositionsKey(std::string_view key) {
+    return key.size() >= 2 && key[key.size() - 2] == '\0' &&
+           key.back() == 'p';
+  }
+
+  // value is block * 65536 + frequency * 256 + encoded length, from sorted
+  // values of frequencies
+  static std::vector<uint64_t>
+  blockMaxValues(const std::vector<uint64_t>& values) {
+    std::vector<uint64_t> arr;
+    for (auto value : values) {
+      uint64_t block = value >> (16 + BlockMaxBits);
+      uint64_t freq = value & 0xFF;
+      uint64_t code = (value >> 8) & 0xFF;
+      if (!arr.empty() && (arr.back() >> 16) == block) {
+        freq = std::max(freq, (arr.back() >> 8) & 0xFF);
+        code = std::min(code, arr.back() & 0xFF);
+        arr.back() = (block << 16) | (freq << 8) | code;
+      } else {
+        arr.push_back((block << 16) | (freq << 8) | code);
+      }
+    }
+    return arr;
+  }
+
+  // ranges of frequency values of sorted blocks
+  static std::vector<std::pair<uint64_t, uint64_t>>
+  blockRanges(const std::vector<uint64_t>& blocks) {
+    std::vector<std::pair<uint64_t, uint64_t>> ranges;
+    for (auto block : blocks) {
+      uint64_t first = block << (16 + BlockMaxBits);
+      uint64_t last = ((block + 1) << (16 + BlockMaxBits)) - 1;
+      if (!ranges.empty() && ranges.back().second + 1 == first) {
+        ranges.back().second = last;
+      } else {
+        ranges.push_back({first, last});
+      }
+    }
+    return ranges;
+  }
+
+  // block max of sorted blocks is calculated from frequencies
+  void rebuildBlockMax(std::string_view token,
+                       const std::vector<uint64_t>& blocks) {
+    auto keyMax = blockMaxKey(token);
+    std::vector<std::pair<uint64_t, uint64_t>> ranges;
+    for (auto block : blocks) {
+      ranges.push_back({block << 16, (block << 16) | 0xFFFF});
+    }
+    auto old = db2.getInRanges(keyMax, ranges);
+    auto values = blockMaxValues(
+        db2.getInRanges(freqKey(token), blockRanges(blocks)));
+    std::vector<uint64_t> removed, added;
+    std::set_difference(old.begin(), old.end(), values.begin(), values.end(),
+                        std::back_inserter(removed));
+    std::set_difference(values.begin(), values.end(), old.begin(), old.end(),
+                        std::back_inserter(added));
+    for (auto value : removed) {
+      log(LogTokenRemove, keyMax, valuesToBytes(&value, 1));
+      db2.remove(keyMax, value);
+    }
+    for (auto value : added) {
+      log(LogTokenSet, keyMax, valuesToBytes(&value, 1));
+      db2.set(keyMax, value);
+    }
+  }
+
+  void bulkChangedBlock(std::string_view key, uint64_t value,
+                        size_t nthThread) {
+    if (!isFreqKey(key)) {
+      return;
+    }
+    auto& arr = bulkBlocks_[nthThread][std::string(key.substr(
+        0, key.size() - 1))];
+    uint64_t block = value >> (16 + BlockMaxBits);
+    if (arr.empty() || arr.back() != block) {
+      arr.push_back(block);
+    }
+  }
+
+  static std::string positionsKey(std::string_view token) {
+    std::string key(token);
+    key += '\0';
+    key += 'p';
+    return key;
+  }
+
+  static typename TDoc::TId docIdFromValue(std::string_view key,
+                                           uint64_t value) {
+    if (isFreqKey(key)) {
+      return tokenFreqFromValue(value).docId;
+    }
+    if (isPositionsKey(key)) {
+      return tokenPositionFromValue(value).docId;
+    }
+    return tokenInfoFromValue(value).docId;
+  }
+
+  // number of tokens in serialized document
+  static uint64_t docLength(BytesView txt) {
+    auto dt = txt.data();
+    auto l = readSize(dt);
+    dt += l;
+    const std::byte* end = txt.data() + txt.size();
+    uint64_t n = 0;
+    while (dt < end) {
+      auto l2 = readSize(dt);
+      n += countTokens(std::string_view((const char*)dt, l2));
+      dt += l2;
+    }
+    return n;
+  }
+
+  static uint64_t docLength(const std::vector<std::string>& tokens) {
+    uint64_t n = 0;
+    for (const auto& txt : tokens) {
+      n += countTokens(txt);
+    }
+    return n;
+  }
+
+  void log(LogType type, std::string_view key, BytesView value) {
+    if (!log_) {
+      return;
+    }
+    // previous changes are already in files
+    if (log_->size() > MaxLogSize) {
+      checkpoint();
+    }
+    log_->append(type, key, value);
+  }
+
+  void replayLog() {
+    log_->replay([this](uint8_t type, std::string_view key, BytesView value) {
+      // values of tokens, documents are not whole words
+      std::vector<uint64_t> values(value.size() / sizeof(uint64_t));
+      if (!values.empty()) {
+        std::memcpy(values.data(), value.data(),
+                    values.size() * sizeof(uint64_t));
+      }
+      switch (type) {
+      case LogDocSet:
+        db.set(key, value);
+        setAttributes(key, value);
+        break;
+      case LogDocRemove:
+        db.remove(key);
+        if constexpr (HasAttributes<TDoc>::value) {
+          attrs_.remove(attributesRow(docIdFromKey(key)));
+        }
+        break;
+      case LogTokenSet:
+        db2.set(key, values.at(0));
+        if (isFreqKey(key)) {
+          dict_.add(key.substr(0, key.size() - 1));
+        }
+        break;
+      case LogTokenRemove:
+        db2.remove(key, values.at(0));
+        break;
+      case LogTokenSetAll:
+        db2.set(key, values);
+        if (isFreqKey(key)) {
+          dict_.add(key.substr(0, key.size() - 1));
+        }
+        break;
+      case LogClear:
+        db.clear();
+        db2.clear();
+        dict_.clear();
+        attrs_.clear();
+        break;
+      default:
+        throw std::runtime_error("Unknown log record");
+      }
+    });
+  }
+
+  // files synced by checkpoint of log
+  static std::vector<fs::path> logFiles(const fs::path& path) {
+    return {path.string() + ".docs", path.string() + ".tokens",
+            path.string() + ".dict", path.string() + ".attrs"};
+  }
+
+  void flushFiles() {
+    db.flush();
+    db2.flush();
+    dict_.flush();
+    attrs_.flush();
+  }
+
+  static BytesView valuesToBytes(const uint64_t* values, size_t num) {
+    return {(const std::byte*)values, num * sizeof(uint64_t)};
+  }
+
   static Bytes docSerialize(const TDoc& doc,
                             const std::vector<std::string>& tokens) {
     auto val = doc.serialize();
@@ -257,30 +1090,119 @@ private:
 
   static std::pair<TDoc, std::vector<std::string>>
   docDeserialize(const typename TDoc::TId& id, BytesView txt) {
-    auto dt = txt.data();
-    auto l = readSize(dt);
-    auto sizeLen = dt - txt.data();
-    TDoc doc(id, BytesView(dt, l));
-    auto vec = docTocsDeserialize(BytesView(dt + l, txt.size() - sizeLen - l));
-    return {doc, vec};
+    DocView<TDoc> view(txt);
+    return {view.doc(id), view.tokens()};
   }
 
-  static TTokenInfo tokenInfoFromString(BytesView txt) {
+  static TTokenInfo tokenInfoFromValue(uint64_t value) {
     TTokenInfo info;
     typename TDoc::TIdSerialized tmp;
-    std::memcpy(&tmp[0], txt.data(), sizeof(tmp));
+    uint64_t n = value >> 1;
+    std::memcpy(&tmp[0], &n, sizeof(tmp));
     info.docId = TDoc::deserializeId(tmp);
-    info.isWhole = txt[sizeof(tmp)] == (std::byte)'1';
+    info.isWhole = (value & 1) != 0;
     return info;
   }
 
-  static Bytes tokenInfoToString(const TTokenInfo& info) {
-    Bytes txt(sizeof(typename TDoc::TIdSerialized) + 1, (std::byte)'\0');
-    std::byte* cur = &txt[0];
+  // bits 0, 2, 4... moved to lower 32 bits
+  static uint64_t evenBits(uint64_t x) {
+    x &= 0x5555555555555555ULL;
+    x = (x | (x >> 1)) & 0x3333333333333333ULL;
+    x = (x | (x >> 2)) & 0x0F0F0F0F0F0F0F0FULL;
+    x = (x | (x >> 4)) & 0x00FF00FF00FF00FFULL;
+    x = (x | (x >> 8)) & 0x0000FFFF0000FFFFULL;
+    x = (x | (x >> 16)) & 0x00000000FFFFFFFFULL;
+    return x;
+  }
+
+  // is value of token info same as id * 2 + isWhole
+  static bool isIdPackedAsNumber() {
+    static const bool res = [] {
+      typename TDoc::TId ids[] = {1, 0x1234, (typename TDoc::TId)0x12345678};
+      for (auto id : ids) {
+        TTokenInfo info;
+        info.docId = id;
+        info.isWhole = true;
+        if (tokenInfoToValue(info) != ((uint64_t)id << 1 | 1)) {
+          return false;
+        }
+      }
+      return true;
+    }();
+    return res;
+  }
+
+  static std::vector<TTokenInfo>
+  tokenInfosFromValues(const std::vector<uint64_t>& values) {
+    std::vector<TTokenInfo> arr(values.size());
+    for (size_t i = 0; i < values.size(); ++i) {
+      arr[i] = tokenInfoFromValue(values[i]);
+    }
+    // values are sorted by serialized id, which is not always order of id
+    if (!std::is_sorted(arr.begin(), arr.end())) {
+      std::sort(arr.begin(), arr.end());
+    }
+    return arr;
+  }
+
+  // value is id * 65536 + encoded length * 256 + frequency
+  static uint64_t tokenFreqToValue(const TTokenFreq& info) {
     auto tmp = TDoc::serializeId(info.docId);
-    std::memcpy(txt.data(), &tmp[0], sizeof(tmp));
-    txt[sizeof(tmp)] = info.isWhole ? (std::byte)'1' : (std::byte)'0';
-    return txt;
+    uint64_t n = 0;
+    std::memcpy(&n, &tmp[0], sizeof(tmp));
+    return (n << 16) | ((uint64_t)encodeDocLength(info.docLength) << 8) |
+           std::min<uint32_t>(info.freq, 255);
+  }
+
+  static TTokenFreq tokenFreqFromValue(uint64_t value) {
+    TTokenFreq info;
+    typename TDoc::TIdSerialized tmp;
+    uint64_t n = value >> 16;
+    std::memcpy(&tmp[0], &n, sizeof(tmp));
+    info.docId = TDoc::deserializeId(tmp);
+    info.docLength = decodeDocLength((uint8_t)(value >> 8));
+    info.freq = value & 0xFF;
+    return info;
+  }
+
+  // value is id * 2^24 + field * 65536 + position
+  static uint64_t tokenPositionToValue(const TTokenPosition& info) {
+    auto tmp = TDoc::serializeId(info.docId);
+    uint64_t n = 0;
+    std::memcpy(&n, &tmp[0], sizeof(tmp));
+    return (n << 24) | ((uint64_t)info.field << 16) | info.pos;
+  }
+
+  static TTokenPosition tokenPositionFromValue(uint64_t value) {
+    TTokenPosition info;
+    typename TDoc::TIdSerialized tmp;
+    uint64_t n = value >> 24;
+    std::memcpy(&tmp[0], &n, sizeof(tmp));
+    info.docId = TDoc::deserializeId(tmp);
+    info.field = (value >> 16) & 0xFF;
+    info.pos = value & 0xFFFF;
+    return info;
+  }
+
+  // positions which can't be stored are skipped
+  static std::vector<uint64_t>
+  tokenPositionsToValues(const std::vector<TTokenPosition>& arr) {
+    std::vector<uint64_t> values;
+    values.reserve(arr.size());
+    for (const auto& info : arr) {
+      if (info.field <= MaxPositionField && info.pos <= MaxPosition) {
+        values.push_back(tokenPositionToValue(info));
+      }
+    }
+    std::sort(values.begin(), values.end());
+    return values;
+  }
+
+  static uint64_t tokenInfoToValue(const TTokenInfo& info) {
+    auto tmp = TDoc::serializeId(info.docId);
+    uint64_t n = 0;
+    std::memcpy(&n, &tmp[0], sizeof(tmp));
+    return (n << 1) | (info.isWhole ? 1 : 0);
   }
 
   static Bytes docTocsSerialize(const std::vector<std::string>& arr) {
@@ -303,25 +1225,6 @@ private:
     }
     return dt;
   }
-
-  static std::vector<std::string> docTocsDeserialize(BytesView dt) {
-    if (dt.size() == 0) {
-      return {};
-    }
-
-    const std::byte* cur = dt.data();
-    const std::byte* end = cur + dt.size();
-    std::vector<std::string> arr;
-    while (cur < end) {
-      auto l = readSize(cur);
-      arr.emplace_back((const char*)cur, l);
-      cur += l;
-    }
-    if (cur > end) {
-      throw std::runtime_error("docTocsDeserialize() overflow");
-    }
-    return arr;
-  }
 };
 
 } // namespace Search
@@ -7,14 +7,523 @@
 
 #pragma once
 
+#include <search/Query.hpp>
+#include <search/QueryCache.hpp>
 #include <search/SearchSettings.hpp>
 #include <search/Sort.hpp>
+#include <search/ThreadPool.hpp>
 #include <search/Tokenize.hpp>
 
 #include <algorithm>
+#include <atomic>
+#include <limits>
+#include <optional>
+#include <string>
+#include <type_traits>
 
 namespace Search {
 
+// comparator with UsesScore sorts by score calculated from index
+template <class T, class = void>
+struct UsesScore : std::false_type {};
+template <class T>
+struct UsesScore<T, std::void_t<decltype(T::UsesScore)>>
+    : std::bool_constant<T::UsesScore> {};
+
+// comparator with FindsTop returns best ids without scoring all of them
+template <class T, class = void>
+struct FindsTop : std::false_type {};
+template <class T>
+struct FindsTop<T, std::void_t<decltype(T::FindsTop)>>
+    : std::bool_constant<T::FindsTop> {};
+
+// comparator with UsesView sorts ResultView, it doesn't need documents
+template <class T, class = void>
+struct UsesView : std::false_type {};
+template <class T>
+struct UsesView<T, std::void_t<decltype(T::UsesView)>>
+    : std::bool_constant<T::UsesView> {};
+
+// store with findDocView gives documents without copying them
+template <class T, class = void>
+struct HasDocView : std::false_type {};
+template <class T>
+struct HasDocView<T, std::void_t<decltype(std::declval<const T&>()
+                                              .findDocView(std::declval<
+                                                  typename T::TDoc::TId>()))>>
+    : std::true_type {};
+
+// scores of ids for each comparator which uses score
+template <class DbType, class... Ts>
+std::vector<std::vector<float>>
+calcScores(const DbType& db,
+           const SearchSettings<typename DbType::TStore::TDoc>& sett,
+           const std::vector<typename DbType::TStore::TDoc::TId>& ids,
+           const typename DbType::ReadLock& lock, const Ts&... cmps) {
+  std::vector<std::vector<float>> scores;
+  auto calc = [&](const auto& cmp) {
+    if constexpr (UsesScore<std::decay_t<decltype(cmp)>>::value) {
+      scores.push_back(cmp.score(db, sett, ids, lock));
+    }
+  };
+  (calc(cmps), ...);
+  return scores;
+}
+
+template <class TRes>
+void setScores(TRes& res, const std::vector<std::vector<float>>& scores,
+               size_t k) {
+  for (size_t n = 0; n < scores.size(); ++n) {
+    res.scores[n] = scores[n][k];
+  }
+}
+
+inline void checkCanceled(const SearchManager* manager) {
+  if (manager && !manager->shouldContinue()) {
+    throw SearchCanceledException();
+  }
+}
+
+// results each db must keep for page
+template <class TDoc>
+size_t pageEnd(const SearchSettings<TDoc>& sett) {
+  if (sett.limit == 0) {
+    return std::numeric_limits<size_t>::max();
+  }
+  return sett.offset + sett.limit;
+}
+
+// func(i) for each db, with more dbs in threads of pool
+template <class TDoc, class TFunc>
+void forEachDb(const SearchSettings<TDoc>& sett, size_t numDbs, TFunc func) {
+  if (numDbs <= 1) {
+    for (size_t i = 0; i < numDbs; ++i) {
+      func(i);
+    }
+    return;
+  }
+  searchPool(sett).forEach(numDbs, func);
+}
+
+// documents taken at once by thread while loading
+static const size_t LoadChunkSize = 1024;
+
+// func(chunk, begin, end) for chunks of n documents, with loadThreads other
+// than 1 chunks are taken by threads of pool. Caller holds read lock for
+// all threads, they must not lock db.
+template <class TDoc, class TFunc>
+void forEachChunk(const SearchSettings<TDoc>& sett, size_t n, TFunc func) {
+  size_t numChunks = (n + LoadChunkSize - 1) / LoadChunkSize;
+  auto run = [&](size_t c) {
+    checkCanceled(sett.manager);
+    func(c, c * LoadChunkSize, std::min(n, (c + 1) * LoadChunkSize));
+  };
+  if (numChunks <= 1 || sett.loadThreads == 1) {
+    for (size_t c = 0; c < numChunks; ++c) {
+      run(c);
+    }
+    return;
+  }
+  searchPool(sett).forEach(numChunks, run, sett.loadThreads);
+}
+
+// Results of ids are made, scored and filtered in chunks. load(k) returns
+// result of ids[k], nothing when document was removed, and keep(res) tells
+// if it stays, they are in order of ids.
+template <class T, class DbType, class TLoad, class TKeep, class... Ts>
+std::vector<T>
+loadChunks(const DbType& db,
+           const SearchSettings<typename DbType::TStore::TDoc>& sett,
+           const std::vector<typename DbType::TStore::TDoc::TId>& ids,
+           const typename DbType::ReadLock& lock, TLoad load, TKeep keep,
+           const Ts&... cmps) {
+  constexpr bool hasScore = (false || ... || UsesScore<Ts>::value);
+  // each chunk has its own buffer
+  std::vector<std::vector<T>> chunks((ids.size() + LoadChunkSize - 1) /
+                                     LoadChunkSize);
+  forEachChunk(sett, ids.size(), [&](size_t c, size_t begin, size_t end) {
+    std::vector<std::vector<float>> scores;
+    if constexpr (hasScore) {
+      std::vector<typename DbType::TStore::TDoc::TId> part(
+          ids.begin() + begin, ids.begin() + end);
+      scores = calcScores(db, sett, part, lock, cmps...);
+    }
+    auto& out = chunks[c];
+    out.reserve(end - begin);
+    for (size_t k = begin; k < end; ++k) {
+      auto res = load(k);
+      if (!res) {
+        continue;
+      }
+      out.push_back(std::move(*res));
+      if constexpr (hasScore) {
+        setScores(out.back(), scores, k - begin);
+      }
+      if (!keep(out.back())) {
+        out.pop_back();
+      }
+    }
+  });
+  size_t num = 0;
+  for (const auto& out : chunks) {
+    num += out.size();
+  }
+  std::vector<T> arr;
+  arr.reserve(num);
+  for (auto& out : chunks) {
+    for (auto& x : out) {
+      arr.push_back(std::move(x));
+      arr.back().index = arr.size() - 1;
+    }
+  }
+  return arr;
+}
+
+// Documents of arr from begin are loaded, removed after ranking are
+// skipped. With generations nothing is returned when any db has changed.
+template <class DbType>
+std::optional<std::vector<Result<typename DbType::TStore::TDoc>>>
+loadPage(const std::vector<const DbType*>& dbs,
+         const SearchSettings<typename DbType::TStore::TDoc>& sett,
+         const std::vector<ScoredId<typename DbType::TStore::TDoc>>& arr,
+         size_t begin, const std::vector<uint64_t>* generations) {
+  typedef typename DbType::TStore::TDoc TDoc;
+  std::vector<std::vector<size_t>> pageOfDb(dbs.size());
+  for (size_t k = begin; k < arr.size(); ++k) {
+    pageOfDb[arr[k].dbIndex].push_back(k);
+  }
+  std::vector<std::optional<Result<TDoc>>> loaded(arr.size());
+  std::atomic<bool> changed(false);
+  forEachDb(sett, dbs.size(), [&](size_t i) {
+    for (auto k : pageOfDb[i]) {
+      checkCanceled(sett.manager);
+      const auto& x = arr[k];
+      auto lock = dbs[i]->lockRead();
+      if (generations && dbs[i]->generation() != (*generations)[i]) {
+        changed = true;
+        return;
+      }
+      auto pair = dbs[i]->store().findDoc(x.id);
+      if (!pair) {
+        continue;
+      }
+      loaded[k].emplace(x.dbIndex, x.id, 0, std::move(pair->first),
+                        std::move(pair->second));
+      loaded[k]->scores = x.scores;
+    }
+  });
+  if (changed) {
+    return std::nullopt;
+  }
+  std::vector<Result<TDoc>> res;
+  res.reserve(arr.size() - begin);
+  for (size_t k = begin; k < arr.size(); ++k) {
+    if (loaded[k]) {
+      res.push_back(std::move(*loaded[k]));
+      res.back().index = res.size() - 1;
+    }
+  }
+  return res;
+}
+
+// all comparators use score, ids are ranked and only documents of page are
+// loaded
+template <class DbType, class... Ts>
+std::vector<Result<typename DbType::TStore::TDoc>>
+findManyByScore(const std::vector<const DbType*>& dbs,
+                SearchSettings<typename DbType::TStore::TDoc>& sett,
+                Ts&... cmps) {
+  typedef typename DbType::TStore::TDoc TDoc;
+  auto end = pageEnd(sett);
+
+  // each db ranks its ids, best of them are merged
+  std::vector<std::vector<ScoredId<TDoc>>> parts(dbs.size());
+  forEachDb(sett, dbs.size(), [&](size_t i) {
+    checkCanceled(sett.manager);
+    auto& arr = parts[i];
+    auto lock = dbs[i]->lockRead();
+    bool isRanked = false;
+    // single comparator ranks only best offset + limit of each db
+    if constexpr (sizeof...(Ts) == 1 && (FindsTop<Ts>::value && ...)) {
+      if (sett.limit > 0) {
+        std::optional<std::vector<std::pair<typename TDoc::TId, float>>> top;
+        ((top = cmps.findTop(*dbs[i], sett, end, lock)), ...);
+        if (top) {
+          for (const auto& pair : *top) {
+            arr.push_back({i, pair.first, arr.size(), {}});
+            arr.back().scores[0] = pair.second;
+          }
+          isRanked = true;
+        }
+      }
+    }
+    if (!isRanked) {
+      auto ids = dbs[i]->findMatchAll(sett, lock);
+      arr.resize(ids.size());
+      forEachChunk(sett, ids.size(), [&](size_t, size_t begin, size_t end) {
+        std::vector<typename TDoc::TId> part(ids.begin() + begin,
+                                             ids.begin() + end);
+        auto scores = calcScores(*dbs[i], sett, part, lock, cmps...);
+        for (size_t k = begin; k < end; ++k) {
+          arr[k] = {i, ids[k], k, {}};
+          setScores(arr[k], scores, k - begin);
+        }
+      });
+    }
+    lock.unlock();
+    checkCanceled(sett.manager);
+    sortDocsCopy<ScoredId<TDoc>>(arr, sett, cmps...);
+    if (arr.size() > end) {
+      arr.erase(arr.begin() + end, arr.end());
+    }
+  });
+  auto arr = mergeSortedDocs<ScoredId<TDoc>>(parts, end, sett, cmps...);
+  auto begin = std::min(sett.offset, arr.size());
+
+  return *loadPage(dbs, sett, arr, begin, nullptr);
+}
+
+// tokens of query, false when nothing can be found
+template <class TDoc>
+bool tokenizeQuery(SearchSettings<TDoc>& sett) {
+  if (sett.booleanQuery) {
+    // phrases are in tree, query only of NOT has no tokens
+    sett.queryTree = parseQuery(sett.query);
+    sett.tokens.clear();
+    if (sett.queryTree) {
+      sett.queryTree->positiveTokens(sett.tokens);
+    }
+    sett.phrases.clear();
+  } else {
+    sett.queryTree.reset();
+    sett.tokens = tokenize(sett.query);
+    sett.phrases = sett.phraseQuery
+                       ? tokenizePhrases(sett.query)
+                       : std::vector<std::vector<std::string>>();
+  }
+  sett.tokensJoined = joinTokens(sett.tokens);
+  return (sett.queryTree || !sett.tokens.empty()) && sett.tokens.size() <= 50;
+}
+
+template <class T>
+void setScoreSlot(T& cmp, size_t& slot) {
+  if constexpr (UsesScore<T>::value) {
+    cmp.scoreSlot = slot++;
+  }
+}
+
+// comparators which use score get their slots in Result::scores
+template <class... Ts>
+void setScoreSlots(Ts&... cmps) {
+  constexpr size_t numScores = (0 + ... + (UsesScore<Ts>::value ? 1 : 0));
+  static_assert(numScores <= MaxScores, "too many comparators with score");
+  [[maybe_unused]] size_t slot = 0;
+  (setScoreSlot(cmps, slot), ...);
+}
+
+// comparator with cacheKey() gives same order as others with same key,
+// results of queries with other comparators are not cached
+template <class T, class = void>
+struct HasCacheKey : std::false_type {};
+template <class T>
+struct HasCacheKey<T,
+                   std::void_t<decltype(std::declval<const T&>().cacheKey())>>
+    : std::true_type {};
+
+template <class T>
+std::string comparatorCacheKey(const T& cmp) {
+  if constexpr (HasCacheKey<T>::value) {
+    return cmp.cacheKey();
+  } else {
+    return {};
+  }
+}
+
+// query, its settings which change results, comparators and dbs
+template <class DbType, class... Ts>
+std::string
+queryCacheKey(const std::vector<const DbType*>& dbs,
+              const SearchSettings<typename DbType::TStore::TDoc>& sett,
+              const Ts&... cmps) {
+  std::string key = sett.tokensJoined;
+  for (const auto& phrase : sett.phrases) {
+    key += '\0';
+    key += joinTokens(phrase);
+  }
+  if (sett.queryTree) {
+    key += '\0';
+    key += sett.queryTree->key();
+  }
+  for (const auto& f : sett.filters) {
+    key += '\0';
+    key += std::to_string(f.column) + ' ' + std::to_string(f.min) + ' ' +
+           std::to_string(f.max);
+    for (auto value : f.values) {
+      key += ' ' + std::to_string(value);
+    }
+  }
+  key += '\0';
+  key += sett.autocomplete ? 'a' : '-';
+  key += sett.matchAnyToken ? 'o' : '-';
+  key += std::to_string(sett.fuzzyDistance) + ' ' +
+         std::to_string(sett.fuzzyPrefixLen) + ' ';
+  key += std::to_string(sett.offset) + ' ' + std::to_string(sett.limit);
+  ((key += '\0', key += comparatorCacheKey(cmps)), ...);
+  for (const auto* db : dbs) {
+    key += '\0';
+    key += std::to_string(db->instance()) + ' ' + db->settingsKey();
+  }
+  return key;
+}
+
+template <class DbType, class... Ts>
+std::vector<Result<typename DbType::TStore::TDoc>>
+findManyUncached(const std::vector<const DbType*>& dbs,
+                 SearchSettings<typename DbType::TStore::TDoc>& sett,
+                 Ts&... cmps) {
+  typedef typename DbType::TStore::TDoc TDoc;
+  typedef Result<TDoc> TRes;
+
+  constexpr bool hasScore = (false || ... || UsesScore<Ts>::value);
+  constexpr bool onlyScore = (true && ... && UsesScore<Ts>::value);
+  if constexpr (hasScore && onlyScore) {
+    if (!sett.funcFilter) {
+      return findManyByScore(dbs, sett, cmps...);
+    }
+  }
+
+  // without filter and comparators results stay in order of ids, so only
+  // documents of requested page are loaded
+  if (!sett.funcFilter && sizeof...(Ts) == 0) {
+    std::vector<std::vector<typename TDoc::TId>> ids(dbs.size());
+    forEachDb(sett, dbs.size(), [&](size_t i) {
+      checkCanceled(sett.manager);
+      auto lock = dbs[i]->lockRead();
+      ids[i] = dbs[i]->findMatchAll(sett, lock);
+    });
+    // range of page in each db
+    std::vector<std::pair<size_t, size_t>> ranges(dbs.size(), {0, 0});
+    size_t skip = sett.offset;
+    size_t left = sett.limit > 0 ? sett.limit
+                                 : std::numeric_limits<size_t>::max();
+    for (size_t i = 0; i < dbs.size() && left > 0; ++i) {
+      if (skip >= ids[i].size()) {
+        skip -= ids[i].size();
+        continue;
+      }
+      auto n = std::min(left, ids[i].size() - skip);
+      ranges[i] = {skip, skip + n};
+      left -= n;
+      skip = 0;
+    }
+    // document removed after match is skipped
+    std::vector<std::vector<TRes>> parts(dbs.size());
+    forEachDb(sett, dbs.size(), [&](size_t i) {
+      if (ranges[i].first == ranges[i].second) {
+        return;
+      }
+      auto lock = dbs[i]->lockRead();
+      for (size_t k = ranges[i].first; k < ranges[i].second; ++k) {
+        if (k % 1024 == 0) {
+          checkCanceled(sett.manager);
+        }
+        auto pair = dbs[i]->store().findDoc(ids[i][k]);
+        if (pair) {
+          parts[i].emplace_back(i, ids[i][k], 0, std::move(pair->first),
+                                std::move(pair->second));
+        }
+      }
+    });
+    std::vector<TRes> arr;
+    for (auto& part : parts) {
+      for (auto& x : part) {
+        arr.push_back(std::move(x));
+        arr.back().index = arr.size() - 1;
+      }
+    }
+    return arr;
+  }
+
+  // comparators which read only tokens sort documents in store, so only
+  // best of them are loaded
+  constexpr bool useViews =
+      HasDocView<typename DbType::TStore>::value &&
+      (true && ... && (UsesView<Ts>::value || UsesScore<Ts>::value));
+
+  // each db loads, filters and sorts its results
+  auto end = pageEnd(sett);
+  std::vector<std::vector<TRes>> parts(dbs.size());
+  forEachDb(sett, dbs.size(), [&](size_t i) {
+    checkCanceled(sett.manager);
+    auto& arr = parts[i];
+    const auto& store = dbs[i]->store();
+    if constexpr (useViews) {
+      // filter needs documents, without it views are sorted and lock is
+      // kept until best of them are loaded
+      if (!sett.funcFilter) {
+        typedef ResultView<TDoc> TView;
+        auto lock = dbs[i]->lockRead();
+        auto res = dbs[i]->findMatchAll(sett, lock);
+        auto views = loadChunks<TView>(
+            *dbs[i], sett, res, lock,
+            [&](size_t k) -> std::optional<TView> {
+              auto view = store.findDocView(res[k]);
+              if (!view) {
+                return std::nullopt;
+              }
+              return TView(i, res[k], k, *view);
+            },
+            [](const TView&) { return true; }, cmps...);
+        checkCanceled(sett.manager);
+        sortDocsCopy<TView>(views, sett, cmps...);
+        arr.reserve(std::min(views.size(), end));
+        for (size_t k = 0; k < views.size() && k < end; ++k) {
+          arr.push_back(views[k].load());
+        }
+        return;
+      }
+    }
+    {
+      // ids and documents are from same version of db
+      auto lock = dbs[i]->lockRead();
+      auto res = dbs[i]->findMatchAll(sett, lock);
+      arr = loadChunks<TRes>(
+          *dbs[i], sett, res, lock,
+          [&](size_t k) -> std::optional<TRes> {
+            auto pair = store.findDoc(res[k]);
+            if (!pair) {
+              return std::nullopt;
+            }
+            return TRes(i, res[k], k, std::move(pair->first),
+                        std::move(pair->second));
+          },
+          // filter before sort
+          [&](const TRes& r) {
+            return !sett.funcFilter || sett.funcFilter(r);
+          },
+          cmps...);
+    }
+
+    checkCanceled(sett.manager);
+    sortDocsCopy<TRes>(arr, sett, cmps...);
+    if (arr.size() > end) {
+      arr.erase(arr.begin() + end, arr.end());
+    }
+  });
+
+  auto arr = mergeSortedDocs<TRes>(parts, end, sett, cmps...);
+  auto begin = std::min(sett.offset, arr.size());
+  arr.erase(arr.begin(), arr.begin() + begin);
+  // index is position in page, same as in page loaded from cache
+  for (size_t k = 0; k < arr.size(); ++k) {
+    arr[k].index = k;
+  }
+  return arr;
+}
+
+// Databases are searched in threads of pool, each one keeps only its best
+// results for page and they are merged at end. Cancel of manager stops all
+// of them.
 template <class DbType, class... Ts>
 std::vector<Result<typename DbType::TStore::TDoc>>
 findMany(const std::vector<const DbType*>& dbs,
@@ -24,44 +533,43 @@ findMany(const std::vector<const DbType*>& dbs,
   // Load docs: 28 %
   // Sort: 10 %
 
-  sett.tokens = tokenize(sett.query);
-  sett.tokensJoined = joinTokens(sett.tokens);
-  if (sett.tokens.empty()) {
-    return {};
-  }
-  if (sett.tokens.size() > 50) {
+  if (!tokenizeQuery(sett)) {
     return {};
   }
 
-  typedef Result<typename DbType::TStore::TDoc> TRes;
+  typedef typename DbType::TStore::TDoc TDoc;
 
-  // load
-  std::vector<TRes> arr;
+  setScoreSlots(cmps...);
+  if (!sett.cache || sett.funcFilter || !(HasCacheKey<Ts>::value && ...)) {
+    return findManyUncached(dbs, sett, cmps...);
+  }
+
+  // cached page is used while no db has changed, its documents are loaded
+  auto key = queryCacheKey(dbs, sett, cmps...);
+  std::vector<uint64_t> generations(dbs.size());
   for (size_t i = 0; i < dbs.size(); ++i) {
-    auto res = dbs[i]->findMatchAll(sett);
-    for (const auto& id : res) {
-      auto pair = dbs[i]->store().findDoc(id);
-      arr.emplace_back(i, id, arr.size(), pair->first, pair->second);
+    generations[i] = dbs[i]->generation();
+  }
+  typename QueryCache<TDoc>::TIds ids;
+  if (sett.cache->find(key, generations, ids)) {
+    auto res = loadPage(dbs, sett, ids, 0, &generations);
+    if (res) {
+      return std::move(*res);
     }
   }
-
-  // filter before sort
-  if (sett.funcFilter) {
-    arr.erase(std::remove_if(
-                  arr.begin(), arr.end(),
-                  [&sett](const TRes& doc) { return !sett.funcFilter(doc); }),
-              arr.end());
-    // update index
-    size_t i = 0;
-    for (auto& x : arr) {
-      x.index = i;
-      i++;
+  auto res = findManyUncached(dbs, sett, cmps...);
+  // page is kept only when no write was made while searching
+  for (size_t i = 0; i < dbs.size(); ++i) {
+    if (dbs[i]->generation() != generations[i]) {
+      return res;
     }
   }
-
-  // sort
-  sortDocs<TRes>(arr, sett, cmps...);
-
-  return arr;
+  ids.clear();
+  ids.reserve(res.size());
+  for (const auto& r : res) {
+    ids.push_back({r.dbIndex, r.id, r.index, r.scores});
+  }
+  sett.cache->insert(key, generations, ids);
+  return res;
 }
 } // namespace Search
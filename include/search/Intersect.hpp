@@ -0,0 +1,103 @@
+//
+//  Intersect.hpp
+//
+//  Created by Ignac Banic on 17/10/26.
+//  Copyright © 2026 Ignac Banic. All rights reserved.
+//
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <vector>
+
+namespace Search {
+
+// Intersection of sorted arrays without duplicates. Result is written to
+// out, which can be the same as a. Returns number of written items.
+size_t intersectSortedU32(const uint32_t* a, size_t na, const uint32_t* b,
+                          size_t nb, uint32_t* out);
+size_t intersectSortedScalar(const uint32_t* a, size_t na, const uint32_t* b,
+                             size_t nb, uint32_t* out);
+
+// when one array is this many times bigger, binary search is faster
+const size_t GallopingRatio = 32;
+
+template <class T>
+size_t intersectGalloping(const T* small, size_t nSmall, const T* large,
+                          size_t nLarge, T* out) {
+  size_t k = 0;
+  size_t j = 0;
+  for (size_t i = 0; i < nSmall && j < nLarge; ++i) {
+    const T& x = small[i];
+    // exponential search for range, then binary search in it
+    size_t step = 1;
+    size_t hi = j;
+    while (hi < nLarge && large[hi] < x) {
+      j = hi + 1;
+      hi += step;
+      step *= 2;
+    }
+    hi = std::min(hi + 1, nLarge);
+    j = std::lower_bound(large + j, large + hi, x) - large;
+    if (j < nLarge && !(x < large[j])) {
+      out[k++] = x;
+      j++;
+    }
+  }
+  return k;
+}
+
+template <class T>
+size_t intersectMerge(const T* a, size_t na, const T* b, size_t nb, T* out) {
+  size_t i = 0, j = 0, k = 0;
+  while (i < na && j < nb) {
+    if (a[i] < b[j]) {
+      i++;
+    } else if (b[j] < a[i]) {
+      j++;
+    } else {
+      out[k++] = a[i];
+      i++;
+      j++;
+    }
+  }
+  return k;
+}
+
+// a = a ∩ b
+template <class T>
+void intersectSorted(std::vector<T>& a, const std::vector<T>& b) {
+  size_t n;
+  if (a.size() * GallopingRatio < b.size()) {
+    n = intersectGalloping(a.data(), a.size(), b.data(), b.size(), a.data());
+  } else if (b.size() * GallopingRatio < a.size()) {
+    // items from b are written to a, at most at the position they were found
+    n = intersectGalloping(b.data(), b.size(), a.data(), a.size(), a.data());
+  } else if constexpr (std::is_same_v<T, uint32_t>) {
+    n = intersectSortedU32(a.data(), a.size(), b.data(), b.size(), a.data());
+  } else {
+    n = intersectMerge(a.data(), a.size(), b.data(), b.size(), a.data());
+  }
+  a.resize(n);
+}
+
+// a = a \ b
+template <class T>
+void differenceSorted(std::vector<T>& a, const std::vector<T>& b) {
+  size_t j = 0, k = 0;
+  for (size_t i = 0; i < a.size(); ++i) {
+    while (j < b.size() && b[j] < a[i]) {
+      j++;
+    }
+    if (j < b.size() && !(a[i] < b[j])) {
+      continue;
+    }
+    a[k++] = a[i];
+  }
+  a.resize(k);
+}
+
+} // namespace Search
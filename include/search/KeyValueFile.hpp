@@ -7,22 +7,26 @@
 
 #pragma once
 
+#include <search/Compaction.hpp>
 #include <search/CompressSize.hpp>
 #include <search/Types.hpp>
 
 #include <atomic>
 #include <boost/iostreams/device/mapped_file.hpp>
+#include <cassert>
 #include <climits>
 #include <cstring>
 #include <filesystem>
 #include <fstream>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <optional>
 #include <shared_mutex>
 #include <string>
 #include <string_view>
 #include <tuple>
+#include <unordered_set>
 #include <vector>
 
 // change that file supports both platforms:
@@ -32,9 +36,19 @@ namespace fs = std::filesystem;
 
 namespace Search {
 
+class Compactor;
+
 class KeyValueFile {
+  friend class Compactor;
+  friend struct Compaction<KeyValueFile>;
+
 public:
-  static const uint64_t Version = 1;
+  static const uint64_t Version = 3;
+  // header with linear hashing state and offsets of table extents
+  static const uint64_t HeaderSize = 512;
+  static const uint64_t MaxTableLevels = HeaderSize / sizeof(uint64_t) - 7;
+  // bucket slot has links to first two items of chain
+  static const uint64_t SlotSize = 2 * sizeof(uint64_t);
 
 private:
   boost::iostreams::mapped_file file_;
@@ -50,6 +64,26 @@ private:
   };
   ImportingData* importing_;
 
+  std::unique_ptr<Compaction<KeyValueFile>> compaction_;
+
+  // Link has offset of item in lower 48 bits and fingerprint of its key in
+  // upper 16 bits. Items with other fingerprint are skipped without reading
+  // their key.
+  static const int FingerprintShift = 48;
+  static uint64_t linkOffset(uint64_t link) {
+    return link & ((1ULL << FingerprintShift) - 1);
+  }
+  static uint16_t linkFingerprint(uint64_t link) {
+    return (uint16_t)(link >> FingerprintShift);
+  }
+  static uint64_t makeLink(uint64_t offset, uint16_t fingerprint) {
+    assert(offset == linkOffset(offset));
+    return offset | ((uint64_t)fingerprint << FingerprintShift);
+  }
+  static uint16_t calcFingerprint(uint64_t hash) {
+    return (uint16_t)(hash >> FingerprintShift);
+  }
+
   class Item {
   private:
     std::byte* data_;
@@ -60,13 +94,14 @@ private:
     Item(std::byte* data, uint64_t offset) : data_(data), offset_(offset) {}
     bool valid() const { return offset_ != 0; }
     uint64_t offset() const { return offset_; }
-    uint64_t nextOffset() const {
+    uint64_t nextLink() const {
       uint64_t n;
       std::memcpy(&n, itemData(), sizeof(n));
       return n;
     }
-    void setNextOffset(uint64_t nextOffset) {
-      std::memcpy(itemData(), &nextOffset, sizeof(uint64_t));
+    uint64_t nextOffset() const { return linkOffset(nextLink()); }
+    void setNextLink(uint64_t nextLink) {
+      std::memcpy(itemData(), &nextLink, sizeof(uint64_t));
     }
     std::string_view key() const {
       const std::byte* ptr = itemData() + sizeof(uint64_t);
@@ -85,11 +120,13 @@ private:
       const std::byte* ptr = itemData() + sizeof(uint64_t);
       auto sKey = readSize(ptr);
       const std::byte* ptrValSize = ptr;
-      auto sValue = readSize(ptr);
+      // skip size of old value
+      readSize(ptr);
       ptr += sKey;
 
       std::memcpy(const_cast<std::byte*>(ptr), txt.data(), txt.size());
-      auto numBytes = numBytesSize(sValue);
+      // keep width of size, value could be shrinked before
+      auto numBytes = ptr - sKey - ptrValSize;
       std::byte* ptr2 = const_cast<std::byte*>(ptrValSize);
       writeSize(ptr2, txt.size(), numBytes);
     }
@@ -103,9 +140,9 @@ private:
       return sizeof(uint64_t) + numBytesSize(key.size()) +
              numBytesSize(value.size()) + key.size() + value.size();
     }
-    static void write(std::byte*& buffer, uint64_t nextOffset,
+    static void write(std::byte*& buffer, uint64_t nextLink,
                       std::string_view key, BytesView value) {
-      std::memcpy(buffer, &nextOffset, sizeof(uint64_t));
+      std::memcpy(buffer, &nextLink, sizeof(uint64_t));
       buffer += sizeof(uint64_t);
       writeSize(buffer, key.size());
       writeSize(buffer, value.size());
@@ -145,6 +182,7 @@ public:
   static void createFile(const fs::path& path, uint64_t tabSize = 101,
                          uint64_t contentSize = 1000);
   size_t fileSize() const;
+  void flush();
   static bool isFileVersionOk(const fs::path& pth);
 
   static void bulkWrite(std::ofstream& out, std::string_view key,
@@ -166,7 +204,7 @@ public:
   void bulkStop();
 
   static uint64_t calcHash(std::string_view key);
-  static uint64_t calcBucketFromHash(uint64_t hash, uint64_t numBuckets);
+  uint64_t calcBucketFromHash(uint64_t hash, uint64_t numBuckets) const;
   uint64_t calcBucket(std::string_view key) const;
   uint64_t numBuckets() const;
   void ensureOptimalWaste();
@@ -174,16 +212,37 @@ public:
   uint64_t wasted() const;
   void clear();
 
+  // one step of background compaction, returns true when there is more work
+  bool compactStep(uint64_t minWasted, size_t maxBytes);
+
 private:
-  void setInternal(uint64_t bucket, std::string_view key, BytesView value);
-  void removeInternal(uint64_t bucket, std::string_view key);
+  void setInternal(uint64_t bucket, uint16_t fingerprint,
+                   std::string_view key, BytesView value);
+  void removeInternal(uint64_t bucket, uint16_t fingerprint,
+                      std::string_view key);
   Item firstItem(uint64_t bucket) const;
-  std::pair<uint64_t, Item> findInternal(uint64_t bucket,
+  std::pair<uint64_t, Item> findInternal(uint64_t bucket, uint16_t fingerprint,
                                          std::string_view key) const;
+  uint64_t bucketFromHash(uint64_t hash) const;
 
   std::byte* data() const;
   uint64_t tableOffset(uint64_t bucket) const;
-  void setTableOffset(uint64_t bucket, uint64_t offset) const;
+  uint64_t tableLink(uint64_t bucket) const;
+  void setTableLink(uint64_t bucket, uint64_t link) const;
+  uint64_t secondLink(uint64_t bucket) const;
+  void refreshSlot(uint64_t bucket) const;
+  uint64_t slotOffset(uint64_t bucket) const;
+  uint64_t baseBuckets() const;
+  uint64_t tableLevel() const;
+  void setTableLevel(uint64_t level);
+  uint64_t tableSplit() const;
+  void setTableSplit(uint64_t split);
+  uint64_t extentOffset(uint64_t level) const;
+  void setExtentOffset(uint64_t level, uint64_t offset);
+  uint64_t tableBytes() const;
+  uint64_t contentSize() const;
+  void splitBucket();
+  void mergeBucket();
 
   uint64_t nextDataOffset() const;
   void setNextDataOffset(uint64_t off);
@@ -195,9 +254,26 @@ private:
   void ensureTableSize(int64_t additional);
   fs::path tmpFilePath() const;
   inline static size_t findTabSizePrime(size_t minNum);
-  inline static size_t findTabSizePrimeDouble(size_t minNum);
   void openFile();
   static uint64_t availableMemory();
   void changeTable(uint64_t numBuckets, uint64_t bodySize);
+
+  void setCompactor(Compactor* compactor, std::shared_mutex* readersMutex);
+  std::unique_lock<std::mutex> lockCompaction() {
+    return Compaction<KeyValueFile>::lock(compaction_);
+  }
+  void markChanged(std::string_view key) {
+    if (compaction_) {
+      compaction_->markChanged(*this, key);
+    }
+  }
+  void abortCompaction() {
+    if (compaction_) {
+      compaction_->abort(*this);
+    }
+  }
+  std::unique_ptr<KeyValueFile> createCompactTarget(const fs::path& pth);
+  size_t copyBucketToCompacted(uint64_t bucket);
+  size_t copyToCompacted(std::string_view key);
 };
 } // namespace Search
@@ -7,9 +7,12 @@
 
 #pragma once
 
+#include <search/Bitmap.hpp>
+#include <search/Compaction.hpp>
 #include <search/CompressSize.hpp>
 #include <search/Types.hpp>
 
+#include <algorithm>
 #include <atomic>
 #include <boost/iostreams/device/mapped_file.hpp>
 #include <climits>
@@ -17,27 +20,36 @@
 #include <filesystem>
 #include <fstream>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <optional>
 #include <shared_mutex>
 #include <string>
 #include <string_view>
 #include <tuple>
+#include <unordered_set>
 #include <vector>
 
 namespace fs = std::filesystem;
 
 namespace Search {
 
+class Compactor;
+
 class KeyValueFileList {
+  friend class Compactor;
+  friend struct Compaction<KeyValueFileList>;
+
 public:
-  static const uint64_t Version = 1;
+  static const uint64_t Version = 4;
+  static const size_t MaxBlockCapacity = 512;
 
 private:
   boost::iostreams::mapped_file file_;
   fs::path path_;
   bool locked_;
   std::byte* buffer_;
+  size_t bufferSize_;
 
   struct ImportingData {
     std::atomic<uint64_t> numItems;
@@ -48,16 +60,33 @@ private:
   };
   ImportingData* importing_;
 
-  class ItemValue {
+  // keys are copied with all their values
+  std::unique_ptr<Compaction<KeyValueFileList>> compaction_;
+
+  // Values of one key are stored in a chain of blocks, sorted ascending.
+  // First value in block is written whole, others as difference to previous
+  // value, all with writeSize(). Blocks grow by doubling until they reach
+  // MaxBlockCapacity, after that a full block is split.
+  // When values are dense, all values with same upper 48 bits are stored in
+  // one bitmap block instead. No other block has values from its range.
+  class ItemBlock {
   private:
     std::byte* data_;
     uint64_t offset_;
 
-    // item layout: nextOffset(8), valueSize(1-8), value(...)
+    // item layout: nextOffset(8), capacity(2), used(2), numValues(2),
+    // values(capacity)
+    // bitmap has flag in capacity, values are: base(8), words(8 * 1024)
 
   public:
-    ItemValue() : data_(nullptr), offset_(0) {}
-    ItemValue(std::byte* data, uint64_t offset)
+    static const size_t HeaderSize =
+        sizeof(uint64_t) + 3 * sizeof(uint16_t);
+    static const uint16_t BitmapFlag = 0x8000;
+    static const size_t BitmapSize =
+        sizeof(uint64_t) + Bitmap::ContainerWords * sizeof(uint64_t);
+
+    ItemBlock() : data_(nullptr), offset_(0) {}
+    ItemBlock(std::byte* data, uint64_t offset)
         : data_(data), offset_(offset) {}
     bool valid() const { return offset_ != 0; }
     uint64_t offset() const { return offset_; }
@@ -69,31 +98,176 @@ private:
     void setNextOffset(uint64_t nextOffset) {
       std::memcpy(itemData(), &nextOffset, sizeof(uint64_t));
     }
-    BytesView value() const {
-      const std::byte* ptr = itemData() + sizeof(uint64_t);
-      auto sValue = readSize(ptr);
-      return {ptr, sValue};
+    uint16_t capacity() const { return readHeader(0) & ~BitmapFlag; }
+    uint16_t used() const { return readHeader(1); }
+    size_t numValues() const {
+      if (isBitmap()) {
+        size_t n = 0;
+        for (size_t i = 0; i < Bitmap::ContainerWords; ++i) {
+          n += popCount(bitmapWord(i));
+        }
+        return n;
+      }
+      return readHeader(2);
     }
-    size_t calcSize() const {
-      const std::byte* ptr = itemData() + sizeof(uint64_t);
-      auto sValue = readSize(ptr);
-      return ptr - itemData() + sValue;
+    uint64_t firstValue() const {
+      if (isBitmap()) {
+        for (size_t i = 0; i < Bitmap::ContainerWords; ++i) {
+          auto w = bitmapWord(i);
+          if (w) {
+            return bitmapBase() + i * 64 + countTrailingZeros64(w);
+          }
+        }
+        return bitmapBase();
+      }
+      const std::byte* ptr = itemData() + HeaderSize;
+      return readSize(ptr);
+    }
+    bool isBitmap() const { return (readHeader(0) & BitmapFlag) != 0; }
+    uint64_t bitmapBase() const {
+      uint64_t n;
+      std::memcpy(&n, itemData() + HeaderSize, sizeof(n));
+      return n;
+    }
+    bool inBitmap(uint64_t value) const {
+      return (value >> 16) == (bitmapBase() >> 16);
     }
-    static size_t calcSize(BytesView value) {
-      return sizeof(uint64_t) + numBytesSize(value.size()) + value.size();
+    bool bitmapTest(uint64_t value) const {
+      auto n = value - bitmapBase();
+      return (bitmapWord(n >> 6) >> (n & 63)) & 1;
+    }
+    void bitmapChange(uint64_t value, bool isSet) {
+      auto n = value - bitmapBase();
+      std::byte* ptr = bitmapData() + (n >> 6) * sizeof(uint64_t);
+      uint64_t w;
+      std::memcpy(&w, ptr, sizeof(w));
+      if (isSet) {
+        w |= 1ULL << (n & 63);
+      } else {
+        w &= ~(1ULL << (n & 63));
+      }
+      std::memcpy(ptr, &w, sizeof(w));
+    }
+    uint64_t bitmapWord(size_t i) const {
+      uint64_t w;
+      std::memcpy(&w, bitmapData() + i * sizeof(uint64_t), sizeof(w));
+      return w;
+    }
+    // appends values from [first, last]
+    void bitmapValues(uint64_t first, uint64_t last,
+                      std::vector<uint64_t>& arr) const {
+      auto base = bitmapBase();
+      first = std::max(first, base) - base;
+      last = std::min(last, base + 0xFFFF) - base;
+      for (size_t i = first >> 6; i <= (last >> 6); ++i) {
+        auto w = bitmapWord(i);
+        if (i == first >> 6) {
+          w &= ~0ULL << (first & 63);
+        }
+        if (i == last >> 6) {
+          w &= ~0ULL >> (63 - (last & 63));
+        }
+        while (w) {
+          arr.push_back(base + i * 64 + countTrailingZeros64(w));
+          w &= w - 1;
+        }
+      }
+    }
+    void values(std::vector<uint64_t>& arr) const {
+      if (isBitmap()) {
+        auto base = bitmapBase();
+        bitmapValues(base, base + 0xFFFF, arr);
+        return;
+      }
+      const std::byte* ptr = itemData() + HeaderSize;
+      const std::byte* end = ptr + used();
+      uint64_t n = 0;
+      while (ptr < end) {
+        n += readSize(ptr);
+        arr.push_back(n);
+      }
+    }
+    // writes values if they fit in capacity
+    bool setValues(const uint64_t* begin, const uint64_t* end) {
+      auto s = calcValuesSize(begin, end);
+      if (s > capacity()) {
+        return false;
+      }
+      std::byte* ptr = itemData() + HeaderSize;
+      writeValues(ptr, begin, end);
+      writeHeader(1, s);
+      writeHeader(2, end - begin);
+      return true;
+    }
+    size_t calcSize() const { return HeaderSize + capacity(); }
+    static size_t calcSize(size_t capacity) { return HeaderSize + capacity; }
+    static size_t calcValuesSize(const uint64_t* begin, const uint64_t* end) {
+      size_t s = 0;
+      uint64_t prev = 0;
+      for (auto it = begin; it != end; ++it) {
+        s += numBytesSize(*it - prev);
+        prev = *it;
+      }
+      return s;
     }
     static void write(std::byte*& buffer, uint64_t nextOffset,
-                      BytesView value) {
+                      size_t capacity, const uint64_t* begin,
+                      const uint64_t* end) {
+      std::byte* start = buffer;
+      std::memcpy(buffer, &nextOffset, sizeof(uint64_t));
+      buffer += HeaderSize;
+      std::byte* ptr = buffer;
+      writeValues(ptr, begin, end);
+      uint16_t header[3] = {(uint16_t)capacity, (uint16_t)(ptr - buffer),
+                            (uint16_t)(end - begin)};
+      std::memcpy(start + sizeof(uint64_t), header, sizeof(header));
+      buffer += capacity;
+    }
+    // all values must have same upper 48 bits
+    static void writeBitmap(std::byte*& buffer, uint64_t nextOffset,
+                            const uint64_t* begin, const uint64_t* end) {
       std::memcpy(buffer, &nextOffset, sizeof(uint64_t));
+      uint16_t header[3] = {(uint16_t)(BitmapSize | BitmapFlag),
+                            (uint16_t)BitmapSize, 0};
+      std::memcpy(buffer + sizeof(uint64_t), header, sizeof(header));
+      buffer += HeaderSize;
+      uint64_t base = *begin & ~(uint64_t)0xFFFF;
+      std::memcpy(buffer, &base, sizeof(uint64_t));
       buffer += sizeof(uint64_t);
-      writeSize(buffer, value.size());
-      std::memcpy(buffer, value.data(), value.size());
-      buffer += value.size();
+      uint64_t words[Bitmap::ContainerWords] = {};
+      for (auto it = begin; it != end; ++it) {
+        auto n = *it - base;
+        words[n >> 6] |= 1ULL << (n & 63);
+      }
+      std::memcpy(buffer, words, sizeof(words));
+      buffer += sizeof(words);
     }
-    ItemValue next() const { return ItemValue(data_, nextOffset()); }
+    ItemBlock next() const { return ItemBlock(data_, nextOffset()); }
 
   private:
     std::byte* itemData() const { return data_ + offset_; }
+    std::byte* bitmapData() const {
+      return itemData() + HeaderSize + sizeof(uint64_t);
+    }
+    uint16_t readHeader(size_t i) const {
+      uint16_t n;
+      std::memcpy(&n, itemData() + sizeof(uint64_t) + i * sizeof(uint16_t),
+                  sizeof(n));
+      return n;
+    }
+    void writeHeader(size_t i, size_t n) {
+      uint16_t n2 = (uint16_t)n;
+      std::memcpy(itemData() + sizeof(uint64_t) + i * sizeof(uint16_t), &n2,
+                  sizeof(n2));
+    }
+    static void writeValues(std::byte*& ptr, const uint64_t* begin,
+                            const uint64_t* end) {
+      uint64_t prev = 0;
+      for (auto it = begin; it != end; ++it) {
+        writeSize(ptr, *it - prev);
+        prev = *it;
+      }
+    }
   };
 
   class ItemKey {
@@ -102,7 +276,8 @@ private:
     uint64_t offset_;
 
     // item layout:
-    // nextOffset(8), firstValueOffset(8), keySize(1-8), key(...)
+    // nextOffset(8), firstBlockOffset(8), numValues(8), keySize(1-8), key(...)
+    static const size_t KeyOffset = 3 * sizeof(uint64_t);
 
   public:
     ItemKey() : data_(nullptr), offset_(0) {}
@@ -118,34 +293,44 @@ private:
       std::memcpy(itemData(), &nextOffset, sizeof(uint64_t));
     }
     std::string_view key() const {
-      const std::byte* ptr = itemData() + sizeof(uint64_t) + sizeof(uint64_t);
+      const std::byte* ptr = itemData() + KeyOffset;
       auto sKey = readSize(ptr);
       return {(const char*)ptr, sKey};
     }
-    ItemValue value() const { return ItemValue(data_, valueOffset()); }
-    uint64_t valueOffset() const {
+    ItemBlock block() const { return ItemBlock(data_, blockOffset()); }
+    uint64_t blockOffset() const {
       uint64_t n;
       std::memcpy(&n, itemData() + sizeof(uint64_t), sizeof(n));
       return n;
     }
-    void setValueOffset(uint64_t nextOffset) {
+    void setBlockOffset(uint64_t nextOffset) {
       std::byte* dt = itemData() + sizeof(uint64_t);
       std::memcpy(dt, &nextOffset, sizeof(uint64_t));
     }
+    uint64_t numValues() const {
+      uint64_t n;
+      std::memcpy(&n, itemData() + 2 * sizeof(uint64_t), sizeof(n));
+      return n;
+    }
+    void setNumValues(uint64_t n) {
+      std::memcpy(itemData() + 2 * sizeof(uint64_t), &n, sizeof(n));
+    }
     size_t calcSize() const {
-      const std::byte* ptr = itemData() + sizeof(uint64_t) + sizeof(uint64_t);
+      const std::byte* ptr = itemData() + KeyOffset;
       auto sKey = readSize(ptr);
       return ptr - itemData() + sKey;
     }
     static size_t calcSize(std::string_view key) {
-      return sizeof(uint64_t) + sizeof(uint64_t) + numBytesSize(key.size()) +
-             key.size();
+      return KeyOffset + numBytesSize(key.size()) + key.size();
     }
     static void write(std::byte*& buffer, uint64_t nextOffset,
-                      std::string_view key, uint64_t value) {
+                      std::string_view key, uint64_t blockOffset,
+                      uint64_t numValues) {
       std::memcpy(buffer, &nextOffset, sizeof(uint64_t));
       buffer += sizeof(uint64_t);
-      std::memcpy(buffer, &value, sizeof(uint64_t));
+      std::memcpy(buffer, &blockOffset, sizeof(uint64_t));
+      buffer += sizeof(uint64_t);
+      std::memcpy(buffer, &numValues, sizeof(uint64_t));
       buffer += sizeof(uint64_t);
       writeSize(buffer, key.size());
       std::memcpy(buffer, key.data(), key.size());
@@ -165,41 +350,49 @@ public:
   KeyValueFileList(KeyValueFileList&&) = default;
   KeyValueFileList& operator=(KeyValueFileList&&) = default;
 
-  void set(const std::string& key, const Bytes& value);
-  void set(std::string_view key, BytesView value);
+  void set(std::string_view key, uint64_t value);
   void set(const KeyValueFileList& db2);
-  std::vector<BytesView> get(std::string_view key) const;
-  std::vector<BytesView> get(const std::string& key) const;
-  std::vector<BytesView> getWithBucket(uint64_t bucket,
-                                       std::string_view key) const;
-  bool exists(std::string_view key, BytesView value) const;
+  // values must be sorted
+  void set(std::string_view key, const std::vector<uint64_t>& values);
+  std::vector<uint64_t> get(std::string_view key) const;
+  std::vector<uint64_t> getWithBucket(uint64_t bucket,
+                                      std::string_view key) const;
+  // values inside sorted ranges [first, second], only blocks which can
+  // contain them are decoded
+  std::vector<uint64_t>
+  getInRanges(std::string_view key,
+              const std::vector<std::pair<uint64_t, uint64_t>>& ranges) const;
+  uint64_t count(std::string_view key) const;
+  Bitmap getBitmap(std::string_view key) const;
+  bool exists(std::string_view key, uint64_t value) const;
   bool existsWithBucket(uint64_t bucket, std::string_view key,
-                        BytesView value) const;
-  void remove(std::string_view key, BytesView value);
-  void remove(const std::string& key, const Bytes& value);
+                        uint64_t value) const;
+  void remove(std::string_view key, uint64_t value);
   void optimize();
   void lockTableForNumKeys(uint64_t n);
   void unlockTable();
-  std::vector<std::pair<std::string_view, BytesView>> allDocuments() const;
+  std::vector<std::pair<std::string_view, uint64_t>> allDocuments() const;
+  std::vector<std::string_view> allKeys() const;
 
   const fs::path& path() const { return path_; }
   static void createFile(const fs::path& path, uint64_t tabSize = 101,
                          uint64_t contentSize = 1000);
   size_t fileSize() const;
+  void flush();
   static bool isFileVersionOk(const fs::path& pth);
 
   static void bulkWrite(std::ofstream& out, std::string_view key,
-                        BytesView value);
+                        uint64_t value);
 
 private:
   void bulkInsertEnlarge(size_t nthThread, size_t numThreads);
 
 public:
-  void bulkInsert(uint64_t bucket, std::string_view key, BytesView value,
+  void bulkInsert(uint64_t bucket, std::string_view key, uint64_t value,
                   size_t nthThread, size_t numThreads);
-  void bulkRemove(uint64_t bucket, std::string_view key, BytesView value,
+  void bulkRemove(uint64_t bucket, std::string_view key, uint64_t value,
                   size_t nthThread, size_t numThreads);
-  static std::tuple<uint64_t, std::string_view, BytesView>
+  static std::tuple<uint64_t, std::string_view, uint64_t>
   bulkRead(const std::byte*& dt);
   static bool bulkIsInThread(uint64_t bucket, size_t nthThread,
                              size_t numThreads, uint64_t numBuckets);
@@ -216,10 +409,51 @@ public:
   uint64_t numKeys() const;
   void clear();
 
+  // one step of background compaction, returns true when there is more work
+  bool compactStep(uint64_t minWasted, size_t maxBytes);
+
 private:
-  void setInternal(uint64_t bucket, std::string_view key, BytesView value);
-  void removeInternal(uint64_t bucket, std::string_view key, BytesView value);
+  void setInternal(uint64_t bucket, std::string_view key, uint64_t value,
+                   size_t nthThread = 0);
+  void removeInternal(uint64_t bucket, std::string_view key, uint64_t value,
+                      size_t nthThread = 0);
+  void setAllInternal(uint64_t bucket, std::string_view key,
+                      const std::vector<uint64_t>& values);
+  struct BlockPlan {
+    size_t begin;
+    size_t end;
+    size_t capacity;
+    bool isBitmap;
+  };
+  static std::vector<BlockPlan> planBlocks(const uint64_t* begin,
+                                           const uint64_t* end);
+  static size_t calcBlocksSize(const std::vector<BlockPlan>& plans);
+  uint64_t writeBlocks(const uint64_t* values,
+                       const std::vector<BlockPlan>& plans,
+                       uint64_t nextOffset, size_t nthThread);
+  void convertToBitmap(ItemKey& itKey, uint64_t value, size_t nthThread);
+  void convertFromBitmap(ItemKey& itKey, uint64_t prevBlockOffset,
+                         const ItemBlock& itBlock,
+                         const std::vector<uint64_t>& values,
+                         size_t nthThread);
   ItemKey firstKey(uint64_t bucket) const;
+  std::pair<uint64_t, ItemKey> findKey(uint64_t bucket,
+                                       std::string_view key) const;
+  std::pair<uint64_t, ItemBlock> findBlock(const ItemKey& itKey,
+                                           uint64_t value) const;
+  bool storeBlock(ItemKey& itKey, uint64_t prevBlockOffset, ItemBlock itBlock,
+                  const std::vector<uint64_t>& values, bool isAppend,
+                  size_t nthThread);
+  uint64_t writeBlock(uint64_t nextOffset, size_t capacity,
+                      const uint64_t* begin, const uint64_t* end,
+                      size_t nthThread);
+  void unlinkBlock(ItemKey& itKey, uint64_t prevBlockOffset,
+                   const ItemBlock& itBlock);
+  uint64_t allocate(size_t size, size_t nthThread);
+  static size_t maxInsertSize(std::string_view key);
+  void changeNumItems(int64_t diff);
+  void changeNumKeys(int64_t diff);
+  void addWasted(uint64_t w);
 
   std::byte* data() const;
   uint64_t tableOffset(uint64_t bucket) const;
@@ -239,5 +473,23 @@ private:
   void openFile();
   static uint64_t availableMemory();
   void changeTable(uint64_t numBuckets, uint64_t bodySize);
+
+  void setCompactor(Compactor* compactor, std::shared_mutex* readersMutex);
+  std::unique_lock<std::mutex> lockCompaction() {
+    return Compaction<KeyValueFileList>::lock(compaction_);
+  }
+  void markChanged(std::string_view key) {
+    if (compaction_) {
+      compaction_->markChanged(*this, key);
+    }
+  }
+  void abortCompaction() {
+    if (compaction_) {
+      compaction_->abort(*this);
+    }
+  }
+  std::unique_ptr<KeyValueFileList> createCompactTarget(const fs::path& pth);
+  size_t copyBucketToCompacted(uint64_t bucket);
+  size_t copyToCompacted(std::string_view key);
 };
 } // namespace Search
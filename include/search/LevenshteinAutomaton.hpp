@@ -0,0 +1,48 @@
+//
+//  LevenshteinAutomaton.hpp
+//
+//  Created by Ignac Banic on 18/10/26.
+//  Copyright © 2026 Ignac Banic. All rights reserved.
+//
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace Search {
+
+// Finds tokens of sorted dictionary within edit distance of token, first
+// prefixLen characters must be same. State after characters of dictionary
+// token is row of distances to all prefixes of token. Rows are kept for
+// prefix shared with next token, and when no distance in row is small
+// enough all tokens with that prefix are skipped by one seek.
+class LevenshteinAutomaton {
+public:
+  // sets token to first one not before key, false at end of dictionary
+  typedef std::function<bool(std::string_view key, std::string& token)>
+      TSeek;
+
+private:
+  // characters are utf8 bytes packed into number
+  std::vector<uint32_t> token_;
+  std::string prefix_;
+  uint8_t maxDistance_;
+
+  // characters and offset after each of them
+  static void decode(std::string_view txt, std::vector<uint32_t>& chars,
+                     std::vector<size_t>* ends);
+
+public:
+  LevenshteinAutomaton(std::string_view token, uint8_t maxDistance,
+                       size_t prefixLen);
+
+  // tokens with their distances, sorted
+  std::vector<std::pair<std::string, uint8_t>> find(const TSeek& seek) const;
+};
+
+} // namespace Search
@@ -7,11 +7,17 @@
 
 #pragma once
 
+#include <search/AttributeColumns.hpp>
+#include <search/Bitmap.hpp>
+#include <search/LevenshteinAutomaton.hpp>
 #include <search/TokenInfo.hpp>
+#include <search/Tokenize.hpp>
 
+#include <algorithm>
 #include <map>
 #include <optional>
 #include <string>
+#include <type_traits>
 #include <vector>
 
 namespace Search {
@@ -20,18 +26,35 @@ template <class TDoc2>
 class MemoryStore {
 public:
   typedef TokenInfo<typename TDoc2::TId> TTokenInfo;
+  typedef TokenFreq<typename TDoc2::TId> TTokenFreq;
+  typedef TokenPosition<typename TDoc2::TId> TTokenPosition;
   typedef TDoc2 TDoc;
 
 private:
   std::map<typename TDoc2::TId, TDoc> docs_;
   std::map<typename TDoc2::TId, std::vector<std::string>> docTokens_;
   std::map<std::string, std::vector<TTokenInfo>> index_;
+  std::map<std::string, std::vector<TTokenFreq>> freqs_;
+  std::map<std::string, std::vector<TTokenPosition>> positions_;
+  uint64_t sumDocLengths_ = 0;
+  AttributeColumns attrs_;
 
 public:
   void addDoc(const typename TDoc2::TId& id, const TDoc& doc,
               const std::vector<std::string>& tokens) {
-    docs_.insert({id, doc});
-    docTokens_.insert({id, tokens});
+    auto ptr = docTokens_.find(id);
+    if (ptr != docTokens_.end()) {
+      sumDocLengths_ -= docLength(ptr->second);
+    }
+    sumDocLengths_ += docLength(tokens);
+    docs_.insert_or_assign(id, doc);
+    docTokens_.insert_or_assign(id, tokens);
+    if constexpr (HasAttributes<TDoc>::value) {
+      static_assert(std::is_integral_v<typename TDoc::TId> &&
+                        std::is_unsigned_v<typename TDoc::TId>,
+                    "attributes need unsigned integer ids");
+      attrs_.set(id, doc.attributes());
+    }
   }
 
   void removeDoc(const typename TDoc2::TId& id) {
@@ -42,8 +65,12 @@ public:
 
     auto ptr2 = docTokens_.find(id);
     if (ptr2 != docTokens_.end()) {
+      sumDocLengths_ -= docLength(ptr2->second);
       docTokens_.erase(ptr2);
     }
+    if constexpr (HasAttributes<TDoc>::value) {
+      attrs_.remove(id);
+    }
   }
 
   std::vector<TDoc> allDocuments() const {
@@ -55,6 +82,20 @@ public:
     return arr;
   }
 
+  // sorted ascending
+  std::vector<typename TDoc2::TId> allIds() const {
+    std::vector<typename TDoc2::TId> arr;
+    arr.reserve(docs_.size());
+    for (const auto& pair : docs_) {
+      arr.push_back(pair.first);
+    }
+    return arr;
+  }
+
+  bool hasDoc(const typename TDoc2::TId& id) const {
+    return docs_.count(id) > 0;
+  }
+
   std::optional<std::pair<TDoc, std::vector<std::string>>>
   findDoc(const typename TDoc2::TId& id) const {
     auto ptr = docs_.find(id);
@@ -66,9 +107,11 @@ public:
   }
 
   void addToken(std::string_view token, const TTokenInfo& info) {
-    auto res = index_.insert({std::string(token), {info}});
-    if (!res.second) {
-      res.first->second.push_back(info);
+    // keep sorted by id
+    auto& vec = index_[std::string(token)];
+    auto ptr = std::lower_bound(vec.begin(), vec.end(), info);
+    if (ptr == vec.end() || *ptr != info) {
+      vec.insert(ptr, info);
     }
   }
 
@@ -78,8 +121,8 @@ public:
       return;
     }
     std::vector<TTokenInfo>& vec = ptr->second;
-    auto ptr2 = std::find(vec.begin(), vec.end(), info);
-    if (ptr2 != vec.end()) {
+    auto ptr2 = std::lower_bound(vec.begin(), vec.end(), info);
+    if (ptr2 != vec.end() && *ptr2 == info) {
       vec.erase(ptr2);
       if (vec.empty()) {
         index_.erase(ptr);
@@ -95,15 +138,288 @@ public:
     return ptr->second;
   }
 
+  // only postings of given documents
+  std::vector<TTokenInfo>
+  findToken(const std::string& token,
+            const std::vector<typename TDoc2::TId>& docIds) {
+    auto ptr = index_.find(token);
+    if (ptr == index_.end()) {
+      return {};
+    }
+    std::vector<TTokenInfo> arr;
+    auto it = ptr->second.begin();
+    for (const auto& id : docIds) {
+      it = std::lower_bound(
+          it, ptr->second.end(), id,
+          [](const TTokenInfo& a, const typename TDoc2::TId& b) {
+            return a.docId < b;
+          });
+      while (it != ptr->second.end() && !(id < it->docId)) {
+        arr.push_back(*it);
+        ++it;
+      }
+    }
+    return arr;
+  }
+
+  // ids of documents with token, only for unsigned integer ids
+  Bitmap findTokenBitmap(const std::string& token, bool onlyWhole) {
+    Bitmap res;
+    for (const auto& info : findToken(token)) {
+      if (!onlyWhole || info.isWhole) {
+        res.add(info.docId);
+      }
+    }
+    return res;
+  }
+
+  // ids of documents whose attributes pass all filters
+  Bitmap findAttributes(const std::vector<AttributeFilter>& filters) const {
+    return attrs_.find(filters);
+  }
+
+  uint64_t tokenCount(const std::string& token) const {
+    auto ptr = index_.find(token);
+    if (ptr == index_.end()) {
+      return 0;
+    }
+    return ptr->second.size();
+  }
+
+  // sorted whole tokens which start with prefix
+  std::vector<std::string>
+  findTokensWithPrefix(std::string_view prefix) const {
+    std::vector<std::string> res;
+    for (auto it = freqs_.lower_bound(std::string(prefix));
+         it != freqs_.end() && it->first.compare(0, prefix.size(), prefix) == 0;
+         ++it) {
+      res.push_back(it->first);
+    }
+    return res;
+  }
+
+  // sorted whole tokens within edit distance, with their distances
+  std::vector<std::pair<std::string, uint8_t>>
+  findTokensFuzzy(std::string_view token, uint8_t maxDistance,
+                  size_t prefixLen) const {
+    LevenshteinAutomaton automaton(token, maxDistance, prefixLen);
+    return automaton.find([&](std::string_view key, std::string& res) {
+      auto it = freqs_.lower_bound(std::string(key));
+      if (it == freqs_.end()) {
+        return false;
+      }
+      res = it->first;
+      return true;
+    });
+  }
+
+  // document has one frequency of token
+  void addTokenFreq(std::string_view token, const TTokenFreq& info) {
+    auto& vec = freqs_[std::string(token)];
+    auto ptr = std::lower_bound(vec.begin(), vec.end(), info);
+    if (ptr != vec.end() && ptr->docId == info.docId) {
+      *ptr = info;
+    } else {
+      vec.insert(ptr, info);
+    }
+  }
+
+  void removeTokenFreq(std::string_view token, const TTokenFreq& info) {
+    auto ptr = freqs_.find(std::string(token));
+    if (ptr == freqs_.end()) {
+      return;
+    }
+    auto& vec = ptr->second;
+    auto ptr2 = std::lower_bound(vec.begin(), vec.end(), info);
+    if (ptr2 != vec.end() && ptr2->docId == info.docId) {
+      vec.erase(ptr2);
+      if (vec.empty()) {
+        freqs_.erase(ptr);
+      }
+    }
+  }
+
+  // frequencies of token in given documents, ids must be sorted
+  std::vector<TTokenFreq>
+  findTokenFreqs(const std::string& token,
+                 const std::vector<typename TDoc2::TId>& docIds) const {
+    auto ptr = freqs_.find(token);
+    if (ptr == freqs_.end()) {
+      return {};
+    }
+    std::vector<TTokenFreq> arr;
+    auto it = ptr->second.begin();
+    for (const auto& id : docIds) {
+      it = std::lower_bound(
+          it, ptr->second.end(), id,
+          [](const TTokenFreq& a, const typename TDoc2::TId& b) {
+            return a.docId < b;
+          });
+      if (it != ptr->second.end() && !(id < it->docId)) {
+        arr.push_back(*it);
+      }
+    }
+    return arr;
+  }
+
+  // number of documents with whole token
+  uint64_t tokenFreqCount(const std::string& token) const {
+    auto ptr = freqs_.find(token);
+    if (ptr == freqs_.end()) {
+      return 0;
+    }
+    return ptr->second.size();
+  }
+
+  uint64_t sumDocLengths() const { return sumDocLengths_; }
+
+  // sorted by block
+  std::vector<BlockMax> findTokenBlockMax(const std::string& token) const {
+    auto ptr = freqs_.find(token);
+    if (ptr == freqs_.end()) {
+      return {};
+    }
+    std::map<uint64_t, BlockMax> blocks;
+    for (const auto& info : ptr->second) {
+      auto block = blockOfId<TDoc>(info.docId);
+      auto it = blocks.find(block);
+      if (it == blocks.end()) {
+        blocks[block] = {block, info.freq, info.docLength};
+      } else {
+        it->second.maxFreq = std::max(it->second.maxFreq, info.freq);
+        it->second.minDocLength =
+            std::min(it->second.minDocLength, info.docLength);
+      }
+    }
+    std::vector<BlockMax> arr;
+    arr.reserve(blocks.size());
+    for (const auto& pair : blocks) {
+      arr.push_back(pair.second);
+    }
+    return arr;
+  }
+
+  // frequencies of token in documents of sorted blocks
+  std::vector<TTokenFreq>
+  findTokenFreqsInBlocks(const std::string& token,
+                         const std::vector<uint64_t>& blocks) const {
+    auto ptr = freqs_.find(token);
+    if (ptr == freqs_.end()) {
+      return {};
+    }
+    std::vector<TTokenFreq> arr;
+    for (const auto& info : ptr->second) {
+      if (std::binary_search(blocks.begin(), blocks.end(),
+                             blockOfId<TDoc>(info.docId))) {
+        arr.push_back(info);
+      }
+    }
+    return arr;
+  }
+
+  void addTokenPositions(std::string_view token,
+                         const std::vector<TTokenPosition>& arr) {
+    auto& vec = positions_[std::string(token)];
+    for (const auto& info : arr) {
+      auto ptr = std::lower_bound(vec.begin(), vec.end(), info);
+      if (ptr == vec.end() || *ptr != info) {
+        vec.insert(ptr, info);
+      }
+    }
+  }
+
+  void removeTokenPositions(std::string_view token,
+                            const std::vector<TTokenPosition>& arr) {
+    auto ptr = positions_.find(std::string(token));
+    if (ptr == positions_.end()) {
+      return;
+    }
+    auto& vec = ptr->second;
+    for (const auto& info : arr) {
+      auto ptr2 = std::lower_bound(vec.begin(), vec.end(), info);
+      if (ptr2 != vec.end() && *ptr2 == info) {
+        vec.erase(ptr2);
+      }
+    }
+    if (vec.empty()) {
+      positions_.erase(ptr);
+    }
+  }
+
+  // positions of token in given documents, ids must be sorted
+  std::vector<TTokenPosition>
+  findTokenPositions(const std::string& token,
+                     const std::vector<typename TDoc2::TId>& docIds) const {
+    auto ptr = positions_.find(token);
+    if (ptr == positions_.end()) {
+      return {};
+    }
+    std::vector<TTokenPosition> arr;
+    auto it = ptr->second.begin();
+    for (const auto& id : docIds) {
+      it = std::lower_bound(
+          it, ptr->second.end(), id,
+          [](const TTokenPosition& a, const typename TDoc2::TId& b) {
+            return a.docId < b;
+          });
+      while (it != ptr->second.end() && !(id < it->docId)) {
+        arr.push_back(*it);
+        ++it;
+      }
+    }
+    return arr;
+  }
+
+  template <class TFunc>
+  void forEachDocument(TFunc func) const {
+    for (const auto& pair : docs_) {
+      func(pair.first, pair.second, docTokens_.at(pair.first));
+    }
+  }
+
+  template <class TFunc>
+  void forEachToken(TFunc func) const {
+    for (const auto& pair : index_) {
+      func(pair.first, pair.second);
+    }
+  }
+
+  template <class TFunc>
+  void forEachTokenFreq(TFunc func) const {
+    for (const auto& pair : freqs_) {
+      func(pair.first, pair.second);
+    }
+  }
+
+  template <class TFunc>
+  void forEachTokenPositions(TFunc func) const {
+    for (const auto& pair : positions_) {
+      func(pair.first, pair.second);
+    }
+  }
+
   void clear() {
     docs_.clear();
     docTokens_.clear();
     index_.clear();
+    freqs_.clear();
+    positions_.clear();
+    sumDocLengths_ = 0;
+    attrs_.clear();
   }
 
   size_t sizeDocuments() { return docs_.size(); }
 
   size_t sizeTokens() { return index_.size(); }
+
+private:
+  static uint64_t docLength(const std::vector<std::string>& tokens) {
+    uint64_t n = 0;
+    for (const auto& txt : tokens) {
+      n += countTokens(txt);
+    }
+    return n;
+  }
 };
 
 } // namespace Search
@@ -0,0 +1,93 @@
+//
+//  PrefixDictionary.hpp
+//
+//  Created by Ignac Banic on 18/10/26.
+//  Copyright © 2026 Ignac Banic. All rights reserved.
+//
+
+#pragma once
+
+#include <boost/iostreams/device/mapped_file.hpp>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <set>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace Search {
+
+// Sorted whole tokens, prefix is resolved to range of tokens which start
+// with it. File has blocks of tokens, each token after first one of block
+// stores only length of prefix shared with previous token and rest of it.
+// Offsets of blocks are searched by first tokens. File is mapped and
+// replaced at once by flush(), tokens added since then are kept in memory.
+class PrefixDictionary {
+public:
+  static const uint64_t Version = 1;
+  // version, number of tokens and number of blocks
+  static const uint64_t HeaderSize = 3 * sizeof(uint64_t);
+  static const size_t BlockSize = 16;
+
+private:
+  fs::path path_;
+  boost::iostreams::mapped_file_source file_;
+  std::set<std::string, std::less<>> added_;
+
+  // position of token in file
+  struct Cursor {
+    uint64_t block = 0;
+    uint64_t index = 0;
+    const std::byte* data = nullptr;
+    std::string token;
+  };
+
+  uint64_t headerValue(size_t i) const;
+  uint64_t numBlocks() const;
+  const std::byte* block(uint64_t i) const;
+  std::string_view firstToken(uint64_t i) const;
+  // first block which can contain token
+  uint64_t findBlock(std::string_view token) const;
+  void startBlock(Cursor& cur, uint64_t i) const;
+  bool next(Cursor& cur) const;
+  // moves forward to first token not before key, keys must grow
+  bool seek(Cursor& cur, std::string_view key) const;
+  void forEachInFile(std::string_view prefix,
+                     const std::function<bool(const std::string&)>& func) const;
+  void openFile();
+  void writeFile(const std::vector<std::string>& tokens);
+
+public:
+  // only in memory
+  PrefixDictionary() = default;
+  // missing file is empty dictionary
+  explicit PrefixDictionary(const fs::path& path);
+  PrefixDictionary(const PrefixDictionary&) = delete;
+  PrefixDictionary& operator=(const PrefixDictionary&) = delete;
+  PrefixDictionary(PrefixDictionary&&) = default;
+  PrefixDictionary& operator=(PrefixDictionary&&) = default;
+
+  static bool isFileVersionOk(const fs::path& path);
+
+  void add(std::string_view token);
+  bool contains(std::string_view token) const;
+  // sorted tokens which start with prefix
+  std::vector<std::string> findPrefix(std::string_view prefix) const;
+  // sorted tokens within edit distance, with their distances
+  std::vector<std::pair<std::string, uint8_t>>
+  findFuzzy(std::string_view token, uint8_t maxDistance,
+            size_t prefixLen) const;
+  // replaces all tokens, tokens of removed documents are only removed here
+  void reset(std::vector<std::string> tokens);
+  // writes added tokens to file
+  void flush();
+  void clear();
+  size_t size() const;
+  bool isDirty() const { return !added_.empty(); }
+};
+
+} // namespace Search
@@ -0,0 +1,42 @@
+//
+//  Query.hpp
+//
+//  Created by Ignac Banic on 18/10/26.
+//  Copyright © 2026 Ignac Banic. All rights reserved.
+//
+
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace Search {
+
+// Node of boolean query. Words next to each other must all match, OR matches
+// any of its sides and AND binds stronger. NOT or - before word, phrase or
+// group excludes its documents, * after word makes it prefix. Parentheses
+// group and text in double quotes is phrase.
+struct QueryNode {
+  enum Type : uint8_t { Token, Prefix, Phrase, And, Or, Not };
+
+  Type type;
+  // tokens of Token and Prefix have one
+  std::vector<std::string> tokens;
+  // Not has one
+  std::vector<QueryNode> children;
+
+  // tokens which documents must have, not those under Not
+  void positiveTokens(std::vector<std::string>& res) const;
+  // token is prefix which documents must have
+  bool hasPrefix(std::string_view token) const;
+  // text which is same only for same queries
+  std::string key() const;
+};
+
+// nullopt when query has no tokens
+std::optional<QueryNode> parseQuery(std::string_view txt);
+
+} // namespace Search
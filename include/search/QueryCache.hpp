@@ -0,0 +1,160 @@
+//
+//  QueryCache.hpp
+//
+//  Created by Ignac Banic on 18/10/26.
+//  Copyright © 2026 Ignac Banic. All rights reserved.
+//
+
+#pragma once
+
+#include <search/SearchSettings.hpp>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace Search {
+
+// result which is ranked before its document is loaded
+template <class TDoc2>
+struct ScoredId {
+  typedef TDoc2 TDoc;
+
+  size_t dbIndex;
+  typename TDoc::TId id;
+  size_t index;
+  std::array<float, MaxScores> scores;
+};
+
+// Ranked ids of pages of results, key is made by findMany from query,
+// settings, comparators and dbs. Entry is used only while generations of
+// all its dbs are same. Keys are split into shards, each one has its own
+// lock and least recently used entries are removed from it when it is over
+// its part of memory.
+template <class TDoc>
+class QueryCache {
+public:
+  typedef std::vector<ScoredId<TDoc>> TIds;
+
+private:
+  struct Entry {
+    std::string key;
+    std::vector<uint64_t> generations;
+    TIds ids;
+    size_t bytes;
+  };
+
+  struct Shard {
+    std::mutex mutex;
+    // most recently used first
+    std::list<Entry> entries;
+    std::unordered_map<std::string_view, typename std::list<Entry>::iterator>
+        map;
+    size_t bytes = 0;
+  };
+
+  std::vector<std::unique_ptr<Shard>> shards_;
+  size_t maxBytesShard_;
+  std::atomic<uint64_t> hits_{0};
+  std::atomic<uint64_t> misses_{0};
+
+  Shard& shard(const std::string& key) {
+    return *shards_[std::hash<std::string>()(key) % shards_.size()];
+  }
+
+  static void erase(Shard& sh, typename std::list<Entry>::iterator it) {
+    sh.bytes -= it->bytes;
+    sh.map.erase(it->key);
+    sh.entries.erase(it);
+  }
+
+public:
+  explicit QueryCache(size_t maxBytes, size_t numShards = 16)
+      : maxBytesShard_(maxBytes / std::max<size_t>(numShards, 1)) {
+    for (size_t i = 0; i < std::max<size_t>(numShards, 1); ++i) {
+      shards_.push_back(std::make_unique<Shard>());
+    }
+  }
+  QueryCache(const QueryCache&) = delete;
+  QueryCache& operator=(const QueryCache&) = delete;
+
+  // ids of key when they are from same generations, stale entry is removed
+  bool find(const std::string& key, const std::vector<uint64_t>& generations,
+            TIds& ids) {
+    auto& sh = shard(key);
+    std::lock_guard<std::mutex> lock(sh.mutex);
+    auto ptr = sh.map.find(key);
+    if (ptr == sh.map.end()) {
+      misses_++;
+      return false;
+    }
+    auto it = ptr->second;
+    if (it->generations != generations) {
+      erase(sh, it);
+      misses_++;
+      return false;
+    }
+    sh.entries.splice(sh.entries.begin(), sh.entries, it);
+    ids = it->ids;
+    hits_++;
+    return true;
+  }
+
+  void insert(const std::string& key, const std::vector<uint64_t>& generations,
+              const TIds& ids) {
+    size_t bytes = sizeof(Entry) + key.size() +
+                   generations.size() * sizeof(uint64_t) +
+                   ids.size() * sizeof(ScoredId<TDoc>);
+    if (bytes > maxBytesShard_) {
+      return;
+    }
+    auto& sh = shard(key);
+    std::lock_guard<std::mutex> lock(sh.mutex);
+    auto ptr = sh.map.find(key);
+    if (ptr != sh.map.end()) {
+      erase(sh, ptr->second);
+    }
+    while (!sh.entries.empty() && sh.bytes + bytes > maxBytesShard_) {
+      erase(sh, std::prev(sh.entries.end()));
+    }
+    sh.entries.push_front({key, generations, ids, bytes});
+    sh.map[sh.entries.front().key] = sh.entries.begin();
+    sh.bytes += bytes;
+  }
+
+  void clear() {
+    for (auto& sh : shards_) {
+      std::lock_guard<std::mutex> lock(sh->mutex);
+      sh->entries.clear();
+      sh->map.clear();
+      sh->bytes = 0;
+    }
+  }
+
+  uint64_t hits() const { return hits_.load(); }
+  uint64_t misses() const { return misses_.load(); }
+
+  // estimated memory of entries
+  size_t sizeInBytes() {
+    size_t n = 0;
+    for (auto& sh : shards_) {
+      std::lock_guard<std::mutex> lock(sh->mutex);
+      n += sh->bytes;
+    }
+    return n;
+  }
+};
+
+} // namespace Search
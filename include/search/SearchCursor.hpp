@@ -0,0 +1,297 @@
+//
+//  SearchCursor.hpp
+//
+//  Created by Ignac Banic on 18/10/26.
+//  Copyright © 2026 Ignac Banic. All rights reserved.
+//
+
+#pragma once
+
+#include <search/FindMany.hpp>
+#include <search/Sort.hpp>
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+namespace Search {
+
+// Results of query in order of comparators, returned in batches. Matches of
+// each db are ranked once per its generation and only their keys and scores
+// are kept, about 32 + 8 * comparators bytes for each match and not their
+// documents. Batch seeks after position of last result in them, so it loads
+// only its own documents, write to db ranks its matches again on next batch.
+// token() continues from same place in other cursor. Order is by keys of
+// comparators, then by db and id, same as in findMany.
+template <class DbType, class... Ts>
+class SearchCursor {
+public:
+  typedef typename DbType::TStore::TDoc TDoc;
+  typedef typename TDoc::TId TId;
+
+  static_assert((HasSortKey<Ts>::value && ...),
+                "SearchCursor needs comparators with key");
+
+private:
+  // place of result in order
+  struct Position {
+    std::array<uint64_t, sizeof...(Ts)> keys;
+    size_t dbIndex;
+    TId id;
+
+    bool operator<(const Position& b) const {
+      if (keys != b.keys) {
+        return keys < b.keys;
+      }
+      if (dbIndex != b.dbIndex) {
+        return dbIndex < b.dbIndex;
+      }
+      return id < b.id;
+    }
+  };
+  struct Item {
+    Position pos;
+    std::array<float, MaxScores> scores;
+
+    bool operator<(const Item& b) const { return pos < b.pos; }
+  };
+
+  std::vector<const DbType*> dbs_;
+  SearchSettings<TDoc> sett_;
+  std::tuple<Ts...> cmps_;
+  bool isValid_;
+  bool isDone_;
+  std::optional<Position> after_;
+  // matches of each db in order and generation of db they are from
+  std::vector<std::vector<Item>> ranked_;
+  std::vector<std::optional<uint64_t>> rankedGenerations_;
+
+  // all matches of db in order
+  void rank(size_t i) {
+    constexpr bool hasScore = (false || ... || UsesScore<Ts>::value);
+    constexpr bool useViews =
+        HasDocView<typename DbType::TStore>::value &&
+        (true && ... && (UsesView<Ts>::value || UsesScore<Ts>::value));
+    const auto& db = *dbs_[i];
+    const auto& store = db.store();
+    auto lock = db.lockRead();
+    rankedGenerations_[i] = db.generation();
+    auto ids = db.findMatchAll(sett_, lock);
+
+    auto& ranked = ranked_[i];
+    ranked.clear();
+    std::mutex mutex;
+    forEachChunk(sett_, ids.size(), [&](size_t, size_t begin, size_t end) {
+      std::vector<std::vector<float>> scores;
+      if constexpr (hasScore) {
+        std::vector<TId> part(ids.begin() + begin, ids.begin() + end);
+        scores = std::apply(
+            [&](const auto&... cmps) {
+              return calcScores(db, sett_, part, lock, cmps...);
+            },
+            cmps_);
+      }
+      std::vector<Item> local;
+      // each chunk has its own copies of comparators
+      auto addAll = [&](const auto& arr) {
+        auto cmps = cmps_;
+        std::apply([&](auto&... c) { (c.init(arr, sett_), ...); }, cmps);
+        local.reserve(arr.size());
+        for (const auto& x : arr) {
+          Item item;
+          size_t n = 0;
+          std::apply(
+              [&](const auto&... c) {
+                ((item.pos.keys[n++] = c.key(x)), ...);
+              },
+              cmps);
+          item.pos.dbIndex = i;
+          item.pos.id = x.id;
+          item.scores = x.scores;
+          local.push_back(item);
+        }
+        std::apply([](auto&... c) { (c.clean(), ...); }, cmps);
+        std::lock_guard<std::mutex> guard(mutex);
+        ranked.insert(ranked.end(), local.begin(), local.end());
+      };
+
+      if constexpr (useViews) {
+        if (!sett_.funcFilter) {
+          std::vector<ResultView<TDoc>> arr;
+          arr.reserve(end - begin);
+          for (size_t k = begin; k < end; ++k) {
+            auto view = store.findDocView(ids[k]);
+            if (!view) {
+              continue;
+            }
+            arr.emplace_back(i, ids[k], arr.size(), *view);
+            if constexpr (hasScore) {
+              setScores(arr.back(), scores, k - begin);
+            }
+          }
+          addAll(arr);
+          return;
+        }
+      }
+      std::vector<Result<TDoc>> arr;
+      arr.reserve(end - begin);
+      for (size_t k = begin; k < end; ++k) {
+        auto pair = store.findDoc(ids[k]);
+        if (!pair) {
+          continue;
+        }
+        arr.emplace_back(i, ids[k], arr.size(), std::move(pair->first),
+                         std::move(pair->second));
+        if constexpr (hasScore) {
+          setScores(arr.back(), scores, k - begin);
+        }
+        if (sett_.funcFilter && !sett_.funcFilter(arr.back())) {
+          arr.pop_back();
+        }
+      }
+      addAll(arr);
+    });
+    std::sort(ranked.begin(), ranked.end());
+  }
+
+public:
+  // offset and limit of settings are not used
+  SearchCursor(const std::vector<const DbType*>& dbs,
+               const SearchSettings<TDoc>& sett, const Ts&... cmps)
+      : dbs_(dbs), sett_(sett), cmps_(cmps...), ranked_(dbs.size()),
+        rankedGenerations_(dbs.size()) {
+    sett_.offset = 0;
+    sett_.limit = 0;
+    isValid_ = tokenizeQuery(sett_);
+    isDone_ = !isValid_;
+    std::apply([](auto&... c) { setScoreSlots(c...); }, cmps_);
+  }
+
+  // true when all results were returned
+  bool done() const { return isDone_; }
+
+  // next num results, empty at end
+  std::vector<Result<TDoc>> next(size_t num) {
+    if (isDone_ || num == 0) {
+      return {};
+    }
+    forEachDb(sett_, dbs_.size(), [&](size_t i) {
+      if (rankedGenerations_[i] != dbs_[i]->generation()) {
+        rank(i);
+      }
+    });
+
+    // first result after last position in each db
+    std::vector<size_t> pos(dbs_.size());
+    for (size_t i = 0; i < dbs_.size(); ++i) {
+      const auto& ranked = ranked_[i];
+      if (after_) {
+        pos[i] = std::upper_bound(ranked.begin(), ranked.end(), *after_,
+                                  [](const Position& a, const Item& b) {
+                                    return a < b.pos;
+                                  }) -
+                 ranked.begin();
+      }
+    }
+
+    // document removed since search is skipped
+    std::vector<ScoredId<TDoc>> ids;
+    while (ids.size() < num) {
+      const Item* best = nullptr;
+      size_t bestDb = 0;
+      for (size_t i = 0; i < dbs_.size(); ++i) {
+        if (pos[i] < ranked_[i].size() &&
+            (!best || ranked_[i][pos[i]] < *best)) {
+          best = &ranked_[i][pos[i]];
+          bestDb = i;
+        }
+      }
+      if (!best) {
+        isDone_ = true;
+        break;
+      }
+      ++pos[bestDb];
+      after_ = best->pos;
+      ids.push_back({bestDb, best->pos.id, ids.size(), best->scores});
+    }
+    if (!isDone_) {
+      isDone_ = true;
+      for (size_t i = 0; i < dbs_.size(); ++i) {
+        isDone_ = isDone_ && pos[i] == ranked_[i].size();
+      }
+    }
+    if (ids.empty()) {
+      return {};
+    }
+    return *loadPage(dbs_, sett_, ids, 0, nullptr);
+  }
+
+  // continuation after last returned result, empty before first batch
+  std::string token() const {
+    if (!after_) {
+      return {};
+    }
+    auto id = TDoc::serializeId(after_->id);
+    std::string bytes(sizeof(after_->keys) + sizeof(uint64_t) + sizeof(id),
+                      '\0');
+    uint64_t dbIndex = after_->dbIndex;
+    std::memcpy(&bytes[0], after_->keys.data(), sizeof(after_->keys));
+    std::memcpy(&bytes[sizeof(after_->keys)], &dbIndex, sizeof(dbIndex));
+    std::memcpy(&bytes[sizeof(after_->keys) + sizeof(dbIndex)], &id[0],
+                sizeof(id));
+    static const char* digits = "0123456789abcdef";
+    std::string txt;
+    txt.reserve(bytes.size() * 2);
+    for (auto c : bytes) {
+      txt += digits[(uint8_t)c >> 4];
+      txt += digits[(uint8_t)c & 15];
+    }
+    return txt;
+  }
+
+  // continues after result of token, empty token starts from beginning
+  void resume(const std::string& token) {
+    isDone_ = !isValid_;
+    if (token.empty()) {
+      after_.reset();
+      return;
+    }
+    typename TDoc::TIdSerialized id;
+    size_t size = sizeof(Position::keys) + sizeof(uint64_t) + sizeof(id);
+    if (token.size() != size * 2) {
+      throw std::runtime_error("SearchCursor::resume() invalid token");
+    }
+    auto digit = [](char c) {
+      if (c >= '0' && c <= '9') {
+        return c - '0';
+      }
+      if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+      }
+      throw std::runtime_error("SearchCursor::resume() invalid token");
+    };
+    std::string bytes(size, '\0');
+    for (size_t k = 0; k < size; ++k) {
+      bytes[k] = (char)(digit(token[2 * k]) * 16 + digit(token[2 * k + 1]));
+    }
+    Position pos;
+    uint64_t dbIndex;
+    std::memcpy(pos.keys.data(), &bytes[0], sizeof(pos.keys));
+    std::memcpy(&dbIndex, &bytes[sizeof(pos.keys)], sizeof(dbIndex));
+    std::memcpy(&id[0], &bytes[sizeof(pos.keys) + sizeof(dbIndex)],
+                sizeof(id));
+    pos.dbIndex = dbIndex;
+    pos.id = TDoc::deserializeId(id);
+    after_ = pos;
+  }
+};
+
+} // namespace Search
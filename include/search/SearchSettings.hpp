@@ -7,13 +7,29 @@
 
 #pragma once
 
+#include <search/AttributeColumns.hpp>
+#include <search/DocView.hpp>
+#include <search/Query.hpp>
+
+#include <array>
 #include <atomic>
+#include <cstdint>
 #include <exception>
 #include <functional>
+#include <optional>
 #include <string>
+#include <string_view>
 #include <vector>
 
 namespace Search {
+
+class ThreadPool;
+template <class TDoc>
+class QueryCache;
+
+// most comparators with score in one search
+static const size_t MaxScores = 4;
+
 template <class TDoc2>
 class Result {
 public:
@@ -25,28 +41,73 @@ public:
   size_t index;
   TDoc doc;
   std::vector<std::string> tokens;
+  // set by findMany for comparators which use score, in their order
+  std::array<float, MaxScores> scores{};
 
   Result() = default;
   Result(size_t dbIndex2, typename TDoc::TId id2, size_t index2,
          const TDoc& doc2, const std::vector<std::string>& tokens2)
       : dbIndex(dbIndex2), id(id2), index(index2), doc(doc2), tokens(tokens2) {}
+  Result(size_t dbIndex2, typename TDoc::TId id2, size_t index2, TDoc&& doc2,
+         std::vector<std::string>&& tokens2)
+      : dbIndex(dbIndex2), id(id2), index(index2), doc(std::move(doc2)),
+        tokens(std::move(tokens2)) {}
+
+  template <class TFunc>
+  void forEachToken(TFunc func) const {
+    for (const auto& txt : tokens) {
+      func(std::string_view(txt));
+    }
+  }
 };
 
+// Result of document which is still in store. Comparators which read only
+// tokens sort it, doc and tokens are decoded from view when asked for. It is
+// valid while db is read locked.
+template <class TDoc2>
+class ResultView {
+public:
+  typedef TDoc2 TDoc;
+
+  size_t dbIndex;
+  typename TDoc::TId id;
+  size_t index;
+  DocView<TDoc> view;
+  std::array<float, MaxScores> scores{};
+
+  ResultView(size_t dbIndex2, typename TDoc::TId id2, size_t index2,
+             const DocView<TDoc>& view2)
+      : dbIndex(dbIndex2), id(id2), index(index2), view(view2) {}
+
+  TDoc doc() const { return view.doc(id); }
+  std::vector<std::string> tokens() const { return view.tokens(); }
+
+  template <class TFunc>
+  void forEachToken(TFunc func) const {
+    view.forEachToken(func);
+  }
+
+  Result<TDoc> load() const {
+    Result<TDoc> res(dbIndex, id, index, doc(), tokens());
+    res.scores = scores;
+    return res;
+  }
+};
+
+// Search stops at next check after cancel, all threads of search see it
+// until reset.
 struct SearchManager {
 private:
-  std::atomic_flag continueSearch = ATOMIC_FLAG_INIT;
+  std::atomic<bool> canceled_{false};
 
 public:
   SearchManager() { reset(); }
 
-  inline void cancel() { continueSearch.clear(); }
+  inline void cancel() { canceled_ = true; }
 
-  inline bool shouldContinue() {
-    auto res = continueSearch.test_and_set();
-    return res;
-  }
+  inline bool shouldContinue() const { return !canceled_; }
 
-  inline void reset() { continueSearch.test_and_set(); }
+  inline void reset() { canceled_ = false; }
 };
 
 template <class TDoc>
@@ -55,10 +116,38 @@ public:
   std::string query;
   std::vector<std::string> tokens;
   std::string tokensJoined;
+  // parts of query in double quotes, their tokens must be next to each other
+  std::vector<std::vector<std::string>> phrases;
+  // phrases are parsed from query, otherwise quotes are ignored
+  bool phraseQuery = false;
   bool autocomplete = true;
+  // with several dbs it is called from threads of pool at once
   std::function<bool(const Result<TDoc>&)> funcFilter;
+  // Conditions on attributes of documents which must all pass, they are
+  // checked in columns before documents are loaded.
+  std::vector<AttributeFilter> filters;
   bool matchAnyToken = false;
+  // query has AND, OR, NOT, parentheses, phrases and prefixes with *, see
+  // QueryNode. Last token is prefix only when marked.
+  bool booleanQuery = false;
+  // set from query with booleanQuery, tokens are those documents must have
+  std::optional<QueryNode> queryTree;
+  // Tokens of query except prefix for autocomplete also match tokens within
+  // this edit distance, 1 or 2. First fuzzyPrefixLen characters must be
+  // same.
+  uint8_t fuzzyDistance = 0;
+  size_t fuzzyPrefixLen = 1;
   SearchManager* manager = nullptr;
+  // page of results, limit 0 returns all
+  size_t offset = 0;
+  size_t limit = 0;
+  // threads for dbs and chunks of documents, nullptr is ThreadPool::shared()
+  ThreadPool* pool = nullptr;
+  // threads loading, filtering and scoring documents of one db, 0 uses all
+  // threads of pool
+  size_t loadThreads = 1;
+  // ranked pages of queries without funcFilter are kept in cache
+  QueryCache<TDoc>* cache = nullptr;
 };
 
 class SearchCanceledException : public std::exception {
@@ -0,0 +1,1010 @@
+//
+//  SegmentStore.hpp
+//
+//  Created by Ignac Banic on 18/10/26.
+//  Copyright © 2026 Ignac Banic. All rights reserved.
+//
+
+#pragma once
+
+#include <search/AttributeColumns.hpp>
+#include <search/Bitmap.hpp>
+#include <search/FileStore.hpp>
+#include <search/MemoryStore.hpp>
+#include <search/TokenInfo.hpp>
+
+#include <algorithm>
+#include <condition_variable>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <shared_mutex>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace Search {
+
+// Store made of immutable segments. New documents are kept in memory and
+// after flushDocs of them the buffer is frozen and written to new segment on
+// background thread while fresh buffer takes new documents. Segment files are
+// not changed after they are written, removed documents are only added to
+// tombstones of segment. Segments of similar size are merged on another
+// background thread, so writes never wait for rewrite of whole index.
+template <class TDoc2>
+class SegmentStore {
+public:
+  typedef TDoc2 TDoc;
+  typedef TokenInfo<typename TDoc::TId> TTokenInfo;
+  typedef TokenFreq<typename TDoc::TId> TTokenFreq;
+  typedef TokenPosition<typename TDoc::TId> TTokenPosition;
+  typedef typename TDoc::TId TId;
+
+  // old version of document is only deleted, Db must write all its tokens
+  static const bool IsSegmented = true;
+  // positions are kept when segments can store them
+  static constexpr bool StoresPositions = FileStore<TDoc>::StoresPositions;
+
+private:
+  struct Segment {
+    uint64_t number;
+    fs::path path;
+    std::unique_ptr<FileStore<TDoc>> store;
+    // tombstones, only ids of documents in this segment
+    std::set<TId> deleted;
+    size_t numDocs = 0;
+    // files are removed when segment is not used anymore
+    bool obsolete = false;
+
+    Segment(const fs::path& path2, uint64_t number2)
+        : number(number2), path(path2), store(new FileStore<TDoc>(path2)) {}
+    Segment(const Segment&) = delete;
+    Segment& operator=(const Segment&) = delete;
+    ~Segment() {
+      store.reset();
+      if (obsolete) {
+        std::error_code ec;
+        fs::remove(path.string() + ".docs", ec);
+        fs::remove(path.string() + ".tokens", ec);
+        fs::remove(path.string() + ".dict", ec);
+        fs::remove(path.string() + ".attrs", ec);
+        fs::remove(deletedPath(), ec);
+      }
+    }
+
+    fs::path deletedPath() const { return path.string() + ".deleted"; }
+    size_t numLive() const { return numDocs - deleted.size(); }
+
+    void addDeleted(const TId& id) {
+      if (!deleted.insert(id).second) {
+        return;
+      }
+      std::ofstream out(deletedPath(),
+                        std::ofstream::binary | std::ofstream::app);
+      if (!out.is_open()) {
+        throw std::runtime_error("Cant open tombstones file");
+      }
+      auto id2 = TDoc::serializeId(id);
+      out.write((const char*)&id2[0], sizeof(id2));
+    }
+
+    void loadDeleted() {
+      std::ifstream in(deletedPath(), std::ifstream::binary);
+      typename TDoc::TIdSerialized id2;
+      while (in.read((char*)&id2[0], sizeof(id2))) {
+        deleted.insert(TDoc::deserializeId(id2));
+      }
+    }
+  };
+
+  // buffer of documents which is written to segment, it is not changed
+  struct Frozen {
+    std::shared_ptr<MemoryStore<TDoc>> memory;
+    // documents removed or replaced after buffer was frozen
+    std::set<TId> deleted;
+  };
+
+  // writer waits when more buffers are not written yet, so memory is bounded
+  static const size_t MaxFrozen = 2;
+
+  fs::path path_;
+  size_t flushDocs_;
+  size_t mergeFactor_;
+  MemoryStore<TDoc> memory_;
+  // oldest first, written in this order
+  std::vector<std::shared_ptr<Frozen>> frozen_;
+  // oldest first, live document is in memory, in frozen buffer or in exactly
+  // one segment
+  std::vector<std::shared_ptr<Segment>> segments_;
+  uint64_t nextNumber_ = 1;
+  std::shared_ptr<Segment> bulk_;
+  mutable std::shared_mutex mutex_;
+
+  std::thread flusher_;
+  // only one buffer is written at a time
+  std::mutex flushRunMutex_;
+  std::mutex flushMutex_;
+  std::condition_variable flushCv_;
+  // buffers which are frozen and not written yet
+  size_t numFrozen_ = 0;
+  bool flushPending_ = false;
+  bool flushStop_ = false;
+  // error of last write, buffer is written again after next notify
+  std::exception_ptr flushError_;
+
+  std::thread merger_;
+  // only one merge at a time
+  std::mutex mergeRunMutex_;
+  std::mutex mergeMutex_;
+  std::condition_variable mergeCv_;
+  bool mergePending_ = false;
+  bool merging_ = false;
+  bool stop_ = false;
+
+public:
+  SegmentStore(const fs::path& path, size_t flushDocs = 10000,
+               size_t mergeFactor = 10)
+      : path_(path), flushDocs_(std::max<size_t>(flushDocs, 1)),
+        mergeFactor_(std::max<size_t>(mergeFactor, 2)) {
+    loadManifest();
+    flusher_ = std::thread(&SegmentStore::flushLoop, this);
+    merger_ = std::thread(&SegmentStore::mergeLoop, this);
+    notifyMerge();
+  }
+  // documents in memory are written before threads end, errors are ignored
+  ~SegmentStore() {
+    {
+      std::lock_guard<std::mutex> lock(mergeMutex_);
+      stop_ = true;
+    }
+    mergeCv_.notify_all();
+    merger_.join();
+    try {
+      std::unique_lock<std::shared_mutex> lock(mutex_);
+      freezeInternal();
+    } catch (...) {
+    }
+    {
+      std::lock_guard<std::mutex> lock(flushMutex_);
+      flushStop_ = true;
+      flushPending_ = true;
+    }
+    flushCv_.notify_all();
+    flusher_.join();
+  }
+  SegmentStore(const SegmentStore&) = delete;
+  SegmentStore& operator=(const SegmentStore&) = delete;
+
+  void addDoc(const TId& id, const TDoc& doc,
+              const std::vector<std::string>& tokens) {
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    deleteInSegments(id);
+    memory_.addDoc(id, doc, tokens);
+    if (!bulk_ && memory_.sizeDocuments() >= flushDocs_) {
+      freezeInternal();
+      lock.unlock();
+      notifyFlush();
+      waitForFlushes(MaxFrozen, false);
+    }
+  }
+
+  void removeDoc(const TId& id) {
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    deleteInSegments(id);
+    memory_.removeDoc(id);
+  }
+
+  std::optional<std::pair<TDoc, std::vector<std::string>>>
+  findDoc(const TId& id) const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    auto res = memory_.findDoc(id);
+    if (res) {
+      return res;
+    }
+    for (auto it = frozen_.rbegin(); it != frozen_.rend(); ++it) {
+      if ((*it)->deleted.count(id) == 0) {
+        res = (*it)->memory->findDoc(id);
+        if (res) {
+          return res;
+        }
+      }
+    }
+    for (auto it = segments_.rbegin(); it != segments_.rend(); ++it) {
+      const auto& seg = **it;
+      if (seg.deleted.count(id) == 0) {
+        res = seg.store->findDoc(id);
+        if (res) {
+          return res;
+        }
+      }
+    }
+    return std::nullopt;
+  }
+
+  std::vector<typename TDoc::TId> allIds() const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    auto arr = memory_.allIds();
+    for (const auto& fr : frozen_) {
+      for (const auto& id : fr->memory->allIds()) {
+        if (fr->deleted.count(id) == 0) {
+          arr.push_back(id);
+        }
+      }
+    }
+    for (const auto& seg : segments_) {
+      for (const auto& id : seg->store->allIds()) {
+        if (seg->deleted.count(id) == 0) {
+          arr.push_back(id);
+        }
+      }
+    }
+    return arr;
+  }
+
+  std::vector<TDoc> allDocuments() const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    auto arr = memory_.allDocuments();
+    for (const auto& fr : frozen_) {
+      for (auto& doc : fr->memory->allDocuments()) {
+        if (fr->deleted.count(doc.docId()) == 0) {
+          arr.push_back(std::move(doc));
+        }
+      }
+    }
+    for (const auto& seg : segments_) {
+      for (auto& doc : seg->store->allDocuments()) {
+        if (seg->deleted.count(doc.docId()) == 0) {
+          arr.push_back(std::move(doc));
+        }
+      }
+    }
+    return arr;
+  }
+
+  void addToken(std::string_view token, const TTokenInfo& info) {
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    memory_.addToken(token, info);
+  }
+
+  void removeToken(std::string_view token, const TTokenInfo& info) {
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    memory_.removeToken(token, info);
+  }
+
+  std::vector<TTokenInfo> findToken(const std::string& token) {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    auto arr = memory_.findToken(token);
+    for (const auto& fr : frozen_) {
+      appendLive(arr, fr->deleted, fr->memory->findToken(token));
+    }
+    for (const auto& seg : segments_) {
+      appendLive(arr, seg->deleted, seg->store->findToken(token));
+    }
+    return arr;
+  }
+
+  // only postings of given documents
+  std::vector<TTokenInfo> findToken(const std::string& token,
+                                    const std::vector<TId>& docIds) {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    auto arr = memory_.findToken(token, docIds);
+    for (const auto& fr : frozen_) {
+      appendLive(arr, fr->deleted, fr->memory->findToken(token, docIds));
+    }
+    for (const auto& seg : segments_) {
+      appendLive(arr, seg->deleted, seg->store->findToken(token, docIds));
+    }
+    return arr;
+  }
+
+  // deleted documents are counted too, it is only estimate for planning
+  uint64_t tokenCount(const std::string& token) const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    uint64_t n = memory_.tokenCount(token);
+    for (const auto& fr : frozen_) {
+      n += fr->memory->tokenCount(token);
+    }
+    for (const auto& seg : segments_) {
+      n += seg->store->tokenCount(token);
+    }
+    return n;
+  }
+
+  // sorted whole tokens which start with prefix, from all segments
+  std::vector<std::string>
+  findTokensWithPrefix(std::string_view prefix) const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    auto res = memory_.findTokensWithPrefix(prefix);
+    for (const auto& fr : frozen_) {
+      mergeUnique(res, fr->memory->findTokensWithPrefix(prefix));
+    }
+    for (const auto& seg : segments_) {
+      mergeUnique(res, seg->store->findTokensWithPrefix(prefix));
+    }
+    return res;
+  }
+
+  // sorted whole tokens within edit distance from all segments, with their
+  // distances
+  std::vector<std::pair<std::string, uint8_t>>
+  findTokensFuzzy(std::string_view token, uint8_t maxDistance,
+                  size_t prefixLen) const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    auto res = memory_.findTokensFuzzy(token, maxDistance, prefixLen);
+    for (const auto& fr : frozen_) {
+      mergeUnique(res,
+                  fr->memory->findTokensFuzzy(token, maxDistance, prefixLen));
+    }
+    for (const auto& seg : segments_) {
+      mergeUnique(res,
+                  seg->store->findTokensFuzzy(token, maxDistance, prefixLen));
+    }
+    return res;
+  }
+
+  // ids of documents with token, only for unsigned integer ids
+  Bitmap findTokenBitmap(const std::string& token, bool onlyWhole) {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    auto res = memory_.findTokenBitmap(token, onlyWhole);
+    for (const auto& fr : frozen_) {
+      orLive(res, fr->deleted, fr->memory->findTokenBitmap(token, onlyWhole));
+    }
+    for (const auto& seg : segments_) {
+      orLive(res, seg->deleted, seg->store->findTokenBitmap(token, onlyWhole));
+    }
+    return res;
+  }
+
+  // ids of documents whose attributes pass all filters
+  Bitmap findAttributes(const std::vector<AttributeFilter>& filters) const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    auto res = memory_.findAttributes(filters);
+    for (const auto& fr : frozen_) {
+      orLive(res, fr->deleted, fr->memory->findAttributes(filters));
+    }
+    for (const auto& seg : segments_) {
+      orLive(res, seg->deleted, seg->store->findAttributes(filters));
+    }
+    return res;
+  }
+
+  void addTokenFreq(std::string_view token, const TTokenFreq& info) {
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    memory_.addTokenFreq(token, info);
+  }
+
+  void removeTokenFreq(std::string_view token, const TTokenFreq& info) {
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    memory_.removeTokenFreq(token, info);
+  }
+
+  // frequencies of token in given documents
+  std::vector<TTokenFreq> findTokenFreqs(const std::string& token,
+                                         const std::vector<TId>& docIds) const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    auto arr = memory_.findTokenFreqs(token, docIds);
+    for (const auto& fr : frozen_) {
+      appendLive(arr, fr->deleted, fr->memory->findTokenFreqs(token, docIds));
+    }
+    for (const auto& seg : segments_) {
+      appendLive(arr, seg->deleted, seg->store->findTokenFreqs(token, docIds));
+    }
+    return arr;
+  }
+
+  // bounds of deleted documents are kept until merge
+  std::vector<BlockMax> findTokenBlockMax(const std::string& token) const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    std::map<uint64_t, BlockMax> map;
+    auto append = [&](const std::vector<BlockMax>& arr) {
+      for (const auto& bm : arr) {
+        auto it = map.emplace(bm.block, bm);
+        if (!it.second) {
+          auto& cur = it.first->second;
+          cur.maxFreq = std::max(cur.maxFreq, bm.maxFreq);
+          cur.minDocLength = std::min(cur.minDocLength, bm.minDocLength);
+        }
+      }
+    };
+    append(memory_.findTokenBlockMax(token));
+    for (const auto& fr : frozen_) {
+      append(fr->memory->findTokenBlockMax(token));
+    }
+    for (const auto& seg : segments_) {
+      append(seg->store->findTokenBlockMax(token));
+    }
+    std::vector<BlockMax> arr;
+    arr.reserve(map.size());
+    for (const auto& pair : map) {
+      arr.push_back(pair.second);
+    }
+    return arr;
+  }
+
+  std::vector<TTokenFreq>
+  findTokenFreqsInBlocks(const std::string& token,
+                         const std::vector<uint64_t>& blocks) const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    auto arr = memory_.findTokenFreqsInBlocks(token, blocks);
+    for (const auto& fr : frozen_) {
+      appendLive(arr, fr->deleted,
+                 fr->memory->findTokenFreqsInBlocks(token, blocks));
+    }
+    for (const auto& seg : segments_) {
+      appendLive(arr, seg->deleted,
+                 seg->store->findTokenFreqsInBlocks(token, blocks));
+    }
+    return arr;
+  }
+
+  // deleted documents are counted until their segment is merged
+  uint64_t tokenFreqCount(const std::string& token) const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    uint64_t n = memory_.tokenFreqCount(token);
+    for (const auto& fr : frozen_) {
+      n += fr->memory->tokenFreqCount(token);
+    }
+    for (const auto& seg : segments_) {
+      n += seg->store->tokenFreqCount(token);
+    }
+    return n;
+  }
+
+  // deleted documents are counted until their segment is merged
+  uint64_t sumDocLengths() const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    uint64_t n = memory_.sumDocLengths();
+    for (const auto& fr : frozen_) {
+      n += fr->memory->sumDocLengths();
+    }
+    for (const auto& seg : segments_) {
+      n += seg->store->sumDocLengths();
+    }
+    return n;
+  }
+
+  void addTokenPositions(std::string_view token,
+                         const std::vector<TTokenPosition>& arr) {
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    memory_.addTokenPositions(token, arr);
+  }
+
+  void removeTokenPositions(std::string_view token,
+                            const std::vector<TTokenPosition>& arr) {
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    memory_.removeTokenPositions(token, arr);
+  }
+
+  // positions of token in given documents
+  std::vector<TTokenPosition>
+  findTokenPositions(const std::string& token,
+                     const std::vector<TId>& docIds) const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    auto arr = memory_.findTokenPositions(token, docIds);
+    for (const auto& fr : frozen_) {
+      appendLive(arr, fr->deleted,
+                 fr->memory->findTokenPositions(token, docIds));
+    }
+    for (const auto& seg : segments_) {
+      appendLive(arr, seg->deleted,
+                 seg->store->findTokenPositions(token, docIds));
+    }
+    return arr;
+  }
+
+  // writes documents from memory to new segment and waits for it
+  void flush() {
+    {
+      std::unique_lock<std::shared_mutex> lock(mutex_);
+      freezeInternal();
+    }
+    notifyFlush();
+    waitForFlushes(0, true);
+  }
+
+  // blocks until background writes and merges are finished
+  void waitForMerges() {
+    waitForFlushes(0, false);
+    std::unique_lock<std::mutex> lock(mergeMutex_);
+    mergeCv_.wait(lock,
+                  [this] { return stop_ || (!mergePending_ && !merging_); });
+  }
+
+  // merges everything into one segment without deleted documents
+  void optimize() {
+    flush();
+    std::lock_guard<std::mutex> lock(mergeRunMutex_);
+    std::vector<std::shared_ptr<Segment>> sources;
+    {
+      std::shared_lock<std::shared_mutex> lock2(mutex_);
+      sources = segments_;
+    }
+    if (sources.size() > 1 ||
+        (sources.size() == 1 && !sources[0]->deleted.empty())) {
+      mergeSegments(sources);
+    }
+  }
+
+  void optimizeFreeData() { flush(); }
+
+  size_t numSegments() const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    return segments_.size();
+  }
+
+  void clear() {
+    std::lock_guard<std::mutex> lock(mergeRunMutex_);
+    std::lock_guard<std::mutex> lock2(flushRunMutex_);
+    std::unique_lock<std::shared_mutex> lock3(mutex_);
+    for (auto& seg : segments_) {
+      seg->obsolete = true;
+    }
+    segments_.clear();
+    memory_.clear();
+    frozen_.clear();
+    writeManifest();
+    {
+      std::lock_guard<std::mutex> lock4(flushMutex_);
+      numFrozen_ = 0;
+    }
+    flushCv_.notify_all();
+  }
+
+  size_t sizeDocuments() {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    size_t n = memory_.sizeDocuments();
+    for (const auto& fr : frozen_) {
+      n += fr->memory->sizeDocuments() - fr->deleted.size();
+    }
+    for (const auto& seg : segments_) {
+      n += seg->numLive();
+    }
+    return n;
+  }
+
+  size_t sizeTokens() {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    size_t n = memory_.sizeTokens();
+    for (const auto& fr : frozen_) {
+      n += fr->memory->sizeTokens();
+    }
+    for (const auto& seg : segments_) {
+      n += seg->store->sizeTokens();
+    }
+    return n;
+  }
+
+  // bulk import is written to its own segment
+  void bulkStart(size_t numThreads) {
+    // older versions of documents must be in segments to be deleted
+    flush();
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    bulk_ = newSegment();
+    bulk_->store->bulkStart(numThreads);
+  }
+  void bulkStop() {
+    {
+      std::unique_lock<std::shared_mutex> lock(mutex_);
+      bulk_->store->bulkStop();
+      bulk_->store->optimizeFreeData();
+      bulk_->numDocs = bulk_->store->sizeDocuments();
+      for (const auto& id : bulk_->store->allIds()) {
+        deleteInSegments(id);
+      }
+      if (bulk_->numDocs > 0) {
+        segments_.push_back(bulk_);
+      } else {
+        bulk_->obsolete = true;
+      }
+      bulk_.reset();
+      writeManifest();
+    }
+    notifyMerge();
+  }
+  static void bulkDocWrite(std::ofstream& out, const TId& id2, const TDoc& doc,
+                           const std::vector<std::string>& tokens) {
+    FileStore<TDoc>::bulkDocWrite(out, id2, doc, tokens);
+  }
+  void bulkDocsRead(const std::byte*& dt, size_t nthThread, size_t numThreads) {
+    bulk_->store->bulkDocsRead(dt, nthThread, numThreads);
+  }
+  void bulkTokensReadAdd(const std::byte*& dt, size_t nthThread,
+                         size_t numThreads) {
+    bulk_->store->bulkTokensReadAdd(dt, nthThread, numThreads);
+  }
+  void bulkTokensReadRemove(const std::byte*& dt, size_t nthThread,
+                            size_t numThreads) {
+    bulk_->store->bulkTokensReadRemove(dt, nthThread, numThreads);
+  }
+  static void bulkTokensWrite(
+      std::ofstream& out,
+      const std::vector<std::pair<std::string, TTokenInfo>>& arr,
+      const std::vector<std::pair<std::string, TTokenFreq>>& freqs,
+      const std::vector<std::pair<std::string, std::vector<TTokenPosition>>>&
+          positions) {
+    FileStore<TDoc>::bulkTokensWrite(out, arr, freqs, positions);
+  }
+  void bulkDocLengths(int64_t diff) { bulk_->store->bulkDocLengths(diff); }
+  void bulkTokensLock(size_t numItems) {
+    bulk_->store->bulkTokensLock(numItems);
+  }
+  void bulkTokensUnlock() { bulk_->store->bulkTokensUnlock(); }
+  void bulkDocsLock(size_t numItems) { bulk_->store->bulkDocsLock(numItems); }
+  void bulkDocsUnlock() { bulk_->store->bulkDocsUnlock(); }
+
+private:
+  fs::path manifestPath() const { return path_.string() + ".segments"; }
+
+  fs::path segmentPath(uint64_t number) const {
+    return path_.string() + "." + std::to_string(number);
+  }
+
+  void loadManifest() {
+    std::ifstream in(manifestPath());
+    if (!in.is_open()) {
+      return;
+    }
+    in >> nextNumber_;
+    uint64_t number;
+    while (in >> number) {
+      auto seg = std::make_shared<Segment>(segmentPath(number), number);
+      seg->numDocs = seg->store->sizeDocuments();
+      seg->loadDeleted();
+      segments_.push_back(seg);
+    }
+  }
+
+  // written to tmp file and renamed, so it is always complete
+  void writeManifest() const {
+    fs::path pth = manifestPath();
+    pth += ".tmp";
+    {
+      std::ofstream out(pth, std::ofstream::trunc);
+      if (!out.is_open()) {
+        throw std::runtime_error("Cant open segments file");
+      }
+      out << nextNumber_ << "\n";
+      for (const auto& seg : segments_) {
+        out << seg->number << "\n";
+      }
+    }
+    fs::rename(pth, manifestPath());
+  }
+
+  std::shared_ptr<Segment> newSegment() {
+    auto number = nextNumber_++;
+    auto pth = segmentPath(number);
+    // files of interrupted merge, number was not written to manifest
+    FileStore<TDoc>::removeFiles(pth);
+    fs::remove(pth.string() + ".deleted");
+    return std::make_shared<Segment>(pth, number);
+  }
+
+  // older version of document is added to tombstones
+  void deleteInSegments(const TId& id) {
+    for (const auto& fr : frozen_) {
+      if (fr->memory->hasDoc(id)) {
+        fr->deleted.insert(id);
+      }
+    }
+    for (const auto& seg : segments_) {
+      if (seg->deleted.count(id) == 0 && seg->store->hasDoc(id)) {
+        seg->addDeleted(id);
+      }
+    }
+  }
+
+  // merges postings without deleted documents into sorted arr
+  template <class T>
+  static void appendLive(std::vector<T>& arr, const std::set<TId>& deleted,
+                         const std::vector<T>& infos) {
+    auto mid = arr.size();
+    for (const auto& info : infos) {
+      if (deleted.count(info.docId) == 0) {
+        arr.push_back(info);
+      }
+    }
+    std::inplace_merge(arr.begin(), arr.begin() + mid, arr.end());
+  }
+
+  static void orLive(Bitmap& res, const std::set<TId>& deleted, Bitmap bm) {
+    if (!deleted.empty()) {
+      std::vector<uint64_t> arr(deleted.begin(), deleted.end());
+      bm.andNotWith(Bitmap::fromSorted(arr.data(), arr.data() + arr.size()));
+    }
+    res.orWith(bm);
+  }
+
+  template <class T>
+  static void mergeUnique(std::vector<T>& res, const std::vector<T>& arr) {
+    auto mid = res.size();
+    res.insert(res.end(), arr.begin(), arr.end());
+    std::inplace_merge(res.begin(), res.begin() + mid, res.end());
+    res.erase(std::unique(res.begin(), res.end()), res.end());
+  }
+
+  // buffer is only moved, writer doesn't wait for its segment
+  void freezeInternal() {
+    if (memory_.sizeDocuments() == 0) {
+      return;
+    }
+    auto fr = std::make_shared<Frozen>();
+    fr->memory = std::make_shared<MemoryStore<TDoc>>(std::move(memory_));
+    memory_ = MemoryStore<TDoc>();
+    frozen_.push_back(fr);
+    std::lock_guard<std::mutex> lock(flushMutex_);
+    numFrozen_++;
+  }
+
+  // Writes oldest frozen buffer without lock, it is not changed. Documents
+  // deleted meanwhile are added to tombstones of new segment.
+  bool writeFrozen() {
+    std::lock_guard<std::mutex> lock(flushRunMutex_);
+    std::shared_ptr<Frozen> fr;
+    std::shared_ptr<Segment> seg;
+    {
+      std::unique_lock<std::shared_mutex> lock2(mutex_);
+      if (frozen_.empty()) {
+        return false;
+      }
+      fr = frozen_.front();
+      seg = newSegment();
+    }
+    try {
+      writeSegment(*fr->memory, *seg);
+    } catch (...) {
+      seg->obsolete = true;
+      throw;
+    }
+
+    {
+      std::unique_lock<std::shared_mutex> lock2(mutex_);
+      for (const auto& id : fr->deleted) {
+        seg->addDeleted(id);
+      }
+      if (seg->numLive() > 0) {
+        segments_.push_back(seg);
+      } else {
+        seg->obsolete = true;
+      }
+      frozen_.erase(frozen_.begin());
+      writeManifest();
+    }
+    {
+      std::lock_guard<std::mutex> lock2(flushMutex_);
+      numFrozen_--;
+    }
+    flushCv_.notify_all();
+    notifyMerge();
+    return true;
+  }
+
+  // postings without document are only left by interrupted add, they are
+  // not written
+  static void writeSegment(const MemoryStore<TDoc>& memory, Segment& seg) {
+    std::set<TId> ids;
+    memory.forEachDocument([&](const TId& id, const TDoc& doc,
+                               const std::vector<std::string>& tokens) {
+      seg.store->addDoc(id, doc, tokens);
+      ids.insert(id);
+    });
+
+    std::vector<TTokenInfo> arr;
+    memory.forEachToken(
+        [&](const std::string& token, const std::vector<TTokenInfo>& infos) {
+          arr.clear();
+          for (const auto& info : infos) {
+            if (ids.count(info.docId) > 0) {
+              arr.push_back(info);
+            }
+          }
+          if (!arr.empty()) {
+            seg.store->addTokens(token, arr);
+          }
+        });
+    std::vector<TTokenFreq> freqs;
+    memory.forEachTokenFreq(
+        [&](const std::string& token, const std::vector<TTokenFreq>& infos) {
+          freqs.clear();
+          for (const auto& info : infos) {
+            if (ids.count(info.docId) > 0) {
+              freqs.push_back(info);
+            }
+          }
+          if (!freqs.empty()) {
+            seg.store->addTokenFreqs(token, freqs);
+          }
+        });
+    std::vector<TTokenPosition> positions;
+    memory.forEachTokenPositions(
+        [&](const std::string& token,
+            const std::vector<TTokenPosition>& infos) {
+          positions.clear();
+          for (const auto& info : infos) {
+            if (ids.count(info.docId) > 0) {
+              positions.push_back(info);
+            }
+          }
+          if (!positions.empty()) {
+            seg.store->addTokenPositions(token, positions);
+          }
+        });
+    seg.store->optimizeFreeData();
+    seg.numDocs = ids.size();
+  }
+
+  void notifyFlush() {
+    {
+      std::lock_guard<std::mutex> lock(flushMutex_);
+      flushPending_ = true;
+      flushError_ = nullptr;
+    }
+    flushCv_.notify_all();
+  }
+
+  // waits until at most maxFrozen buffers are not written, error of write
+  // ends waiting
+  void waitForFlushes(size_t maxFrozen, bool throwError) {
+    std::unique_lock<std::mutex> lock(flushMutex_);
+    flushCv_.wait(lock, [&] {
+      return numFrozen_ <= maxFrozen || flushError_ || flushStop_;
+    });
+    if (throwError && flushError_) {
+      std::rethrow_exception(flushError_);
+    }
+  }
+
+  // buffers left at stop are written before thread ends
+  void flushLoop() {
+    std::unique_lock<std::mutex> lock(flushMutex_);
+    for (;;) {
+      flushCv_.wait(lock, [this] { return flushStop_ || flushPending_; });
+      if (!flushPending_) {
+        return;
+      }
+      flushPending_ = false;
+      lock.unlock();
+      std::exception_ptr error;
+      try {
+        while (writeFrozen()) {
+        }
+      } catch (...) {
+        error = std::current_exception();
+      }
+      lock.lock();
+      flushError_ = error;
+      flushCv_.notify_all();
+    }
+  }
+
+  // tier 0 are segments up to flushDocs documents, each next tier is
+  // mergeFactor times bigger
+  size_t tier(size_t numDocs) const {
+    size_t t = 0;
+    size_t size = flushDocs_;
+    while (numDocs > size) {
+      size *= mergeFactor_;
+      t++;
+    }
+    return t;
+  }
+
+  std::vector<std::shared_ptr<Segment>> pickMerge() const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    std::map<size_t, std::vector<std::shared_ptr<Segment>>> tiers;
+    for (const auto& seg : segments_) {
+      // mostly deleted segment is rewritten alone
+      if (seg->deleted.size() * 2 > seg->numDocs) {
+        return {seg};
+      }
+      auto& arr = tiers[tier(seg->numLive())];
+      arr.push_back(seg);
+      if (arr.size() == mergeFactor_) {
+        return arr;
+      }
+    }
+    return {};
+  }
+
+  // Sources are read without lock, their files never change. Documents
+  // deleted during merge are added to tombstones of new segment.
+  void mergeSegments(const std::vector<std::shared_ptr<Segment>>& sources) {
+    std::vector<std::set<TId>> deleted;
+    std::shared_ptr<Segment> seg;
+    {
+      std::unique_lock<std::shared_mutex> lock(mutex_);
+      for (const auto& src : sources) {
+        deleted.push_back(src->deleted);
+      }
+      seg = newSegment();
+    }
+
+    std::vector<const FileStore<TDoc>*> stores;
+    for (const auto& src : sources) {
+      stores.push_back(src->store.get());
+    }
+    try {
+      seg->store->merge(stores, [&](size_t i, const TId& id) {
+        return deleted[i].count(id) == 0;
+      });
+      seg->store->optimizeFreeData();
+    } catch (...) {
+      seg->obsolete = true;
+      throw;
+    }
+    seg->numDocs = seg->store->sizeDocuments();
+
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    for (size_t i = 0; i < sources.size(); ++i) {
+      for (const auto& id : sources[i]->deleted) {
+        if (deleted[i].count(id) == 0) {
+          seg->addDeleted(id);
+        }
+      }
+      sources[i]->obsolete = true;
+    }
+    segments_.erase(std::remove_if(segments_.begin(), segments_.end(),
+                                   [&](const std::shared_ptr<Segment>& s) {
+                                     return s->obsolete;
+                                   }),
+                    segments_.end());
+    if (seg->numDocs > 0) {
+      segments_.push_back(seg);
+    } else {
+      seg->obsolete = true;
+    }
+    writeManifest();
+  }
+
+  void notifyMerge() {
+    {
+      std::lock_guard<std::mutex> lock(mergeMutex_);
+      mergePending_ = true;
+    }
+    mergeCv_.notify_all();
+  }
+
+  bool isStopping() {
+    std::lock_guard<std::mutex> lock(mergeMutex_);
+    return stop_;
+  }
+
+  void mergeLoop() {
+    std::unique_lock<std::mutex> lock(mergeMutex_);
+    for (;;) {
+      mergeCv_.wait(lock, [this] { return stop_ || mergePending_; });
+      if (stop_) {
+        return;
+      }
+      mergePending_ = false;
+      merging_ = true;
+      lock.unlock();
+      try {
+        std::lock_guard<std::mutex> lock2(mergeRunMutex_);
+        while (!isStopping()) {
+          auto sources = pickMerge();
+          if (sources.empty()) {
+            break;
+          }
+          mergeSegments(sources);
+        }
+      } catch (const std::exception&) {
+        // segments stay as they are, merge is tried again after next flush
+      }
+      lock.lock();
+      merging_ = false;
+      mergeCv_.notify_all();
+    }
+  }
+};
+
+} // namespace Search
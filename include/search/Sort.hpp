@@ -9,11 +9,16 @@
 
 #include <search/Comparators.hpp>
 #include <search/SearchSettings.hpp>
+#include <search/ThreadPool.hpp>
 
 #include <algorithm>
 #include <iostream>
+#include <iterator>
 #include <map>
 #include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
 namespace Search {
@@ -36,7 +41,8 @@ struct SortCmp2 {
     if (N + 1 < sizeof...(Ts)) {
       return cmp < N + 1 < sizeof...(Ts) ? N + 1 : N > (d1, d2);
     } else {
-      return false;
+      // equal results keep order of loading, so pages don't overlap
+      return d1.index < d2.index;
     }
   }
 
@@ -45,6 +51,83 @@ struct SortCmp2 {
   }
 };
 
+// comparator with KeyBits and key(res), smaller key is sorted first
+template <class T, class = void>
+struct HasSortKey : std::false_type {};
+template <class T>
+struct HasSortKey<T, std::void_t<decltype(T::KeyBits)>> : std::true_type {};
+
+template <class TDoc>
+ThreadPool& searchPool(const SearchSettings<TDoc>& sett) {
+  return sett.pool ? *sett.pool : ThreadPool::shared();
+}
+
+// comparator with keysInThreads() tells if its key(res) can be called from
+// more threads at once, others can
+template <class T, class = void>
+struct HasKeysInThreads : std::false_type {};
+template <class T>
+struct HasKeysInThreads<
+    T, std::void_t<decltype(std::declval<const T&>().keysInThreads())>>
+    : std::true_type {};
+
+template <class T>
+bool keysInThreads(const T& cmp) {
+  if constexpr (HasKeysInThreads<T>::value) {
+    return cmp.keysInThreads();
+  } else {
+    return true;
+  }
+}
+
+// keys are calculated in threads of pool when there are more results
+static const size_t SortKeysPerThread = 4096;
+
+// Keys of all comparators and index are packed into one number per result,
+// numbers are sorted and results are moved to their place.
+template <class TRes, class... Ts>
+void sortDocsByKeys(std::vector<TRes>& arr,
+                    SearchSettings<typename TRes::TDoc>& sett, Ts&... cmps) {
+  size_t n = arr.size();
+  std::vector<uint64_t> keys(n);
+  auto calcKeys = [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      if ((i - begin) % 1024 == 0 && sett.manager &&
+          !sett.manager->shouldContinue()) {
+        throw SearchCanceledException();
+      }
+      uint64_t key = 0;
+      ((key = (key << Ts::KeyBits) | cmps.key(arr[i])), ...);
+      keys[i] = (key << 32) | i;
+    }
+  };
+
+  size_t numChunks = (n + SortKeysPerThread - 1) / SortKeysPerThread;
+  if (numChunks <= 1 || !(keysInThreads(cmps) && ...)) {
+    calcKeys(0, n);
+  } else {
+    searchPool(sett).forEach(numChunks, [&](size_t c) {
+      size_t begin = c * SortKeysPerThread;
+      calcKeys(begin, std::min(n, begin + SortKeysPerThread));
+    });
+  }
+
+  if (sett.limit > 0 && sett.offset + sett.limit < n) {
+    // only results up to end of page must be in order
+    auto mid = keys.begin() + (sett.offset + sett.limit);
+    std::partial_sort(keys.begin(), mid, keys.end());
+  } else {
+    std::sort(keys.begin(), keys.end());
+  }
+
+  std::vector<TRes> sorted;
+  sorted.reserve(n);
+  for (auto key : keys) {
+    sorted.push_back(std::move(arr[key & 0xFFFFFFFF]));
+  }
+  arr.swap(sorted);
+}
+
 template <class TRes, class... Ts>
 void sortDocs(std::vector<TRes>& arr, SearchSettings<typename TRes::TDoc>& sett,
               Ts&... cmps) {
@@ -53,9 +136,25 @@ void sortDocs(std::vector<TRes>& arr, SearchSettings<typename TRes::TDoc>& sett,
   }
   (cmps.init(arr, sett), ...);
 
+  constexpr bool hasKeys = (HasSortKey<Ts>::value && ...);
+  if constexpr (hasKeys) {
+    // lower 32 bits are for index
+    if ((0 + ... + Ts::KeyBits) <= 32 && arr.size() <= 0xFFFFFFFF) {
+      sortDocsByKeys(arr, sett, cmps...);
+      (cmps.clean(), ...);
+      return;
+    }
+  }
+
   SortCmp2<TRes, Ts...> s1(cmps...);
   s1.sett = &sett;
-  std::sort(arr.begin(), arr.end(), s1);
+  if (sett.limit > 0 && sett.offset + sett.limit < arr.size()) {
+    // only results up to end of page must be in order
+    auto mid = arr.begin() + (sett.offset + sett.limit);
+    std::partial_sort(arr.begin(), mid, arr.end(), s1);
+  } else {
+    std::sort(arr.begin(), arr.end(), s1);
+  }
 
   (cmps.clean(), ...);
 }
@@ -64,4 +163,77 @@ template <class TRes>
 void sortDocs(std::vector<TRes>& arr,
               SearchSettings<typename TRes::TDoc>& sett) {}
 
+// comparators keep caches while sorting, so each thread sorts with copies
+template <class TRes, class... Ts>
+void sortDocsCopy(std::vector<TRes>& arr,
+                  SearchSettings<typename TRes::TDoc>& sett,
+                  const Ts&... cmps) {
+  auto copies = std::make_tuple(cmps...);
+  std::apply([&](auto&... cmps2) { sortDocs<TRes>(arr, sett, cmps2...); },
+             copies);
+}
+
+// Parts sorted by sortDocs are merged into first maxSize results. Equal
+// results are ordered by part and then by their index, same as when all
+// are sorted at once.
+template <class TRes, class... Ts>
+std::vector<TRes> mergeSortedDocs(std::vector<std::vector<TRes>>& parts,
+                                  size_t maxSize,
+                                  SearchSettings<typename TRes::TDoc>& sett,
+                                  Ts&... cmps) {
+  std::vector<TRes> all;
+  std::vector<std::pair<size_t, size_t>> heads;
+  for (auto& part : parts) {
+    if (!part.empty()) {
+      heads.push_back({all.size(), all.size() + part.size()});
+    }
+    std::move(part.begin(), part.end(), std::back_inserter(all));
+    part.clear();
+  }
+
+  // new index is rank of part and old index
+  std::vector<std::pair<size_t, size_t>> order;
+  order.reserve(all.size());
+  for (size_t p = 0; p < heads.size(); ++p) {
+    for (size_t i = heads[p].first; i < heads[p].second; ++i) {
+      order.push_back({all[i].index, i});
+    }
+    std::sort(order.end() - (heads[p].second - heads[p].first), order.end());
+  }
+  for (size_t r = 0; r < order.size(); ++r) {
+    all[order[r].second].index = r;
+  }
+
+  std::vector<TRes> res;
+  if constexpr (sizeof...(Ts) == 0) {
+    // parts are in order of index
+    res.swap(all);
+    if (res.size() > maxSize) {
+      res.erase(res.begin() + maxSize, res.end());
+    }
+  } else {
+    (cmps.init(all, sett), ...);
+    SortCmp2<TRes, Ts...> s1(cmps...);
+    s1.sett = &sett;
+    // heap of next result of each part, best on top
+    auto isWorse = [&](const std::pair<size_t, size_t>& a,
+                       const std::pair<size_t, size_t>& b) {
+      return s1(all[b.first], all[a.first]);
+    };
+    std::make_heap(heads.begin(), heads.end(), isWorse);
+    while (!heads.empty() && res.size() < maxSize) {
+      std::pop_heap(heads.begin(), heads.end(), isWorse);
+      auto& head = heads.back();
+      res.push_back(std::move(all[head.first]));
+      if (++head.first < head.second) {
+        std::push_heap(heads.begin(), heads.end(), isWorse);
+      } else {
+        heads.pop_back();
+      }
+    }
+    (cmps.clean(), ...);
+  }
+  return res;
+}
+
 } // namespace Search
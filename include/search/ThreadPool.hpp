@@ -0,0 +1,105 @@
+//
+//  ThreadPool.hpp
+//
+//  Created by Ignac Banic on 18/10/26.
+//  Copyright © 2026 Ignac Banic. All rights reserved.
+//
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Search {
+
+// Fixed number of threads which run posted tasks in order.
+class ThreadPool {
+private:
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<std::function<void()>> tasks_;
+  bool stop_;
+  std::vector<std::thread> threads_;
+
+public:
+  explicit ThreadPool(size_t numThreads);
+  ~ThreadPool();
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  // pool of findMany, one thread per core
+  static ThreadPool& shared();
+
+  size_t size() const { return threads_.size(); }
+  void post(std::function<void()> task);
+
+  // Calls func(i) for each i in [0, n) and returns when all calls are done.
+  // Threads take next i when they finish previous one, calling thread runs
+  // them too, so it can wait inside task of same pool. At most maxThreads
+  // threads are used, 0 is no limit. First exception is rethrown and calls
+  // which haven't started are skipped.
+  template <class TFunc>
+  void forEach(size_t n, TFunc func, size_t maxThreads = 0) {
+    struct State {
+      std::atomic<size_t> next{0};
+      std::atomic<bool> failed{false};
+      std::mutex mutex;
+      std::condition_variable cv;
+      size_t done = 0;
+      std::exception_ptr error;
+    };
+    auto state = std::make_shared<State>();
+    auto work = [state, n, &func]() {
+      for (;;) {
+        size_t i = state->next++;
+        if (i >= n) {
+          return;
+        }
+        if (!state->failed) {
+          try {
+            func(i);
+          } catch (...) {
+            std::lock_guard<std::mutex> lock(state->mutex);
+            if (!state->error) {
+              state->error = std::current_exception();
+            }
+            state->failed = true;
+          }
+        }
+        std::lock_guard<std::mutex> lock(state->mutex);
+        if (++state->done == n) {
+          state->cv.notify_all();
+        }
+      }
+    };
+    // func is only used before last call is done, tasks which start later
+    // see that all are taken
+    size_t numTasks = n > 0 ? std::min(n - 1, size()) : 0;
+    if (maxThreads > 0) {
+      numTasks = std::min(numTasks, maxThreads - 1);
+    }
+    for (size_t t = 0; t < numTasks; ++t) {
+      post(work);
+    }
+    work();
+    std::unique_lock<std::mutex> lock(state->mutex);
+    state->cv.wait(lock, [&]() { return state->done == n; });
+    if (state->error) {
+      std::rethrow_exception(state->error);
+    }
+  }
+
+private:
+  void run();
+};
+
+} // namespace Search
@@ -7,6 +7,9 @@
 
 #pragma once
 
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
 #include <string>
 
 namespace Search {
@@ -27,4 +30,117 @@ bool operator!=(const TokenInfo<T>& a, const TokenInfo<T>& b) {
   return !(a == b);
 }
 
+// postings are ordered by document
+template <class T>
+bool operator<(const TokenInfo<T>& a, const TokenInfo<T>& b) {
+  if (a.docId < b.docId) {
+    return true;
+  }
+  if (b.docId < a.docId) {
+    return false;
+  }
+  return a.isWhole < b.isWhole;
+}
+
+// whole token in document, how many times it is there and number of all
+// tokens of document
+template <typename T>
+struct TokenFreq {
+  T docId;
+  uint32_t freq;
+  uint32_t docLength;
+};
+
+template <class T>
+bool operator==(const TokenFreq<T>& a, const TokenFreq<T>& b) {
+  return a.docId == b.docId && a.freq == b.freq && a.docLength == b.docLength;
+}
+
+template <class T>
+bool operator!=(const TokenFreq<T>& a, const TokenFreq<T>& b) {
+  return !(a == b);
+}
+
+template <class T>
+bool operator<(const TokenFreq<T>& a, const TokenFreq<T>& b) {
+  return a.docId < b.docId;
+}
+
+// Frequencies of token are split into blocks by serialized id, block keeps
+// highest frequency and lowest length of its documents. Score of any
+// document in block is not higher than score calculated from them.
+static const int BlockMaxBits = 8;
+
+struct BlockMax {
+  uint64_t block;
+  uint32_t maxFreq;
+  uint32_t minDocLength;
+};
+
+template <class TDoc>
+uint64_t blockOfId(const typename TDoc::TId& id) {
+  auto tmp = TDoc::serializeId(id);
+  uint64_t n = 0;
+  std::memcpy(&n, &tmp[0], std::min(sizeof(tmp), sizeof(n)));
+  return n >> BlockMaxBits;
+}
+
+// position of whole token in document
+template <typename T>
+struct TokenPosition {
+  T docId;
+  // index of text from allTexts()
+  uint32_t field;
+  // index of token in text
+  uint32_t pos;
+};
+
+template <class T>
+bool operator==(const TokenPosition<T>& a, const TokenPosition<T>& b) {
+  return a.docId == b.docId && a.field == b.field && a.pos == b.pos;
+}
+
+template <class T>
+bool operator!=(const TokenPosition<T>& a, const TokenPosition<T>& b) {
+  return !(a == b);
+}
+
+template <class T>
+bool operator<(const TokenPosition<T>& a, const TokenPosition<T>& b) {
+  if (a.docId < b.docId) {
+    return true;
+  }
+  if (b.docId < a.docId) {
+    return false;
+  }
+  if (a.field != b.field) {
+    return a.field < b.field;
+  }
+  return a.pos < b.pos;
+}
+
+// Length of document in one byte. Up to 63 it is exact, longer lengths keep
+// 3 bits after highest bit.
+inline uint8_t encodeDocLength(uint32_t length) {
+  if (length < 64) {
+    return (uint8_t)length;
+  }
+  int e = 6;
+  while (e < 29 && (length >> (e + 1)) != 0) {
+    e++;
+  }
+  if ((length >> (e + 1)) != 0) {
+    return 255;
+  }
+  return (uint8_t)(64 + (e - 6) * 8 + ((length >> (e - 3)) & 7));
+}
+
+inline uint32_t decodeDocLength(uint8_t code) {
+  if (code < 64) {
+    return code;
+  }
+  int e = 6 + (code - 64) / 8;
+  return (uint32_t)(8 + (code - 64) % 8) << (e - 3);
+}
+
 } // namespace Search
\ No newline at end of file
@@ -15,8 +15,12 @@ namespace Search {
 uint8_t charLen(char ch);
 std::vector<std::string> tokenize(std::string_view txt);
 std::vector<std::string> tokenize(const std::string& txt);
+// tokens of each part of text in double quotes
+std::vector<std::vector<std::string>> tokenizePhrases(std::string_view txt);
 std::string joinTokens(const std::vector<std::string>& tokens);
 std::vector<std::string> splitTokens(std::string_view txt);
+// number of tokens in joined text
+size_t countTokens(std::string_view txt);
 bool tokensOverlap(std::string_view all, std::string_view search);
 size_t numTokensOverlap(const std::string& all, const std::string& search);
 
@@ -0,0 +1,83 @@
+//
+//  WriteAheadLog.hpp
+//
+//  Created by Ignac Banic on 18/10/26.
+//  Copyright © 2026 Ignac Banic. All rights reserved.
+//
+
+#pragma once
+
+#include <search/Types.hpp>
+
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <functional>
+#include <string_view>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace Search {
+
+// Log of operations with key and value. Records are collected in memory and
+// written as one group on commit. Group has size and checksum, group torn by
+// crash is ignored when log is read.
+//
+// Files of log are changed in place and saved only on checkpoint, so after
+// crash they can miss changes since last checkpoint or have only part of
+// them. Records must be idempotent, replaying them on files in any such
+// state gives the committed state. Checkpoint saves files and empties log,
+// its cost depends on pages changed since previous one, not on file size.
+class WriteAheadLog {
+private:
+  fs::path path_;
+  std::vector<fs::path> files_;
+  std::FILE* file_;
+  Bytes pending_;
+  uint64_t size_;
+  bool needsReplay_;
+
+public:
+  // pending records are written when they reach this size
+  static const size_t MaxPending = 1'000'000;
+  // type of record written by log itself, it is not replayed
+  static const uint8_t StateRecord = 0;
+
+  // files are synced by checkpoint
+  WriteAheadLog(const fs::path& path, const std::vector<fs::path>& files);
+  ~WriteAheadLog();
+  WriteAheadLog(const WriteAheadLog&) = delete;
+  WriteAheadLog& operator=(const WriteAheadLog&) = delete;
+
+  void append(uint8_t type, std::string_view key, BytesView value);
+  // writes pending records as one group
+  void commit();
+  // commit and wait until log is on disk
+  void sync();
+  // syncs files and removes all records, changes must be flushed to files
+  void checkpoint();
+  // files are saved, so records are not replayed on next open
+  void close();
+  // size of log file in bytes
+  uint64_t size() const { return size_; }
+  const fs::path& path() const { return path_; }
+  // log wasn't closed cleanly, records must be replayed on files
+  bool needsReplay() const { return needsReplay_; }
+
+  // calls func(type, key, value) for each record of complete groups
+  void replay(
+      const std::function<void(uint8_t, std::string_view, BytesView)>& func);
+
+  static void removeFiles(const fs::path& path);
+
+private:
+  void open();
+  void truncate();
+  // calls func for each record, torn group at end is removed
+  void readGroups(
+      const std::function<void(uint8_t, std::string_view, BytesView)>& func);
+  void appendState(bool isClean);
+};
+
+} // namespace Search
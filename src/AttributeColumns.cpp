@@ -0,0 +1,360 @@
+#include <search/AttributeColumns.hpp>
+
+#include <algorithm>
+#include <boost/endian/conversion.hpp>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+namespace Search {
+
+AttributeFilter AttributeFilter::eq(size_t column, int64_t value) {
+  return range(column, value, value);
+}
+
+AttributeFilter AttributeFilter::range(size_t column, int64_t min,
+                                       int64_t max) {
+  AttributeFilter f;
+  f.column = column;
+  f.min = min;
+  f.max = max;
+  return f;
+}
+
+AttributeFilter AttributeFilter::in(size_t column,
+                                    std::vector<int64_t> values) {
+  AttributeFilter f;
+  f.column = column;
+  std::sort(values.begin(), values.end());
+  values.erase(std::unique(values.begin(), values.end()), values.end());
+  if (!values.empty()) {
+    f.min = values.front();
+    f.max = values.back();
+  } else {
+    // nothing is in empty set
+    f.min = 1;
+    f.max = 0;
+  }
+  f.values = std::move(values);
+  return f;
+}
+
+bool AttributeFilter::matches(int64_t value) const {
+  if (value < min || value > max) {
+    return false;
+  }
+  return values.empty() ||
+         std::binary_search(values.begin(), values.end(), value);
+}
+
+const uint64_t AttributeColumns::Version;
+const uint64_t AttributeColumns::HeaderSize;
+const uint64_t AttributeColumns::MinRows;
+
+namespace {
+
+uint64_t toFile(int64_t value) {
+  return boost::endian::native_to_little<uint64_t>((uint64_t)value);
+}
+
+int64_t fromFile(uint64_t value) {
+  return (int64_t)boost::endian::little_to_native<uint64_t>(value);
+}
+
+bool hasBit(const uint64_t* words, uint64_t row) {
+  return (boost::endian::little_to_native<uint64_t>(words[row / 64]) >>
+          (row % 64)) &
+         1;
+}
+
+void setBit(uint64_t* words, uint64_t row, bool isSet) {
+  auto w = boost::endian::little_to_native<uint64_t>(words[row / 64]);
+  uint64_t bit = 1ULL << (row % 64);
+  w = isSet ? w | bit : w & ~bit;
+  words[row / 64] = boost::endian::native_to_little<uint64_t>(w);
+}
+
+} // namespace
+
+AttributeColumns::AttributeColumns(const fs::path& path) : path_(path) {
+  if (fs::is_regular_file(path_)) {
+    openFile();
+  }
+}
+
+bool AttributeColumns::isFileVersionOk(const fs::path& path) {
+  if (!fs::is_regular_file(path)) {
+    return true;
+  }
+  if (fs::file_size(path) < HeaderSize) {
+    return false;
+  }
+  boost::iostreams::mapped_file_source f;
+  f.open(path.string());
+  if (!f.is_open() || f.data() == nullptr) {
+    throw std::runtime_error("Cant open file");
+  }
+  uint64_t ver;
+  std::memcpy(&ver, f.data(), sizeof(ver));
+  ver = boost::endian::little_to_native<uint64_t>(ver);
+  f.close();
+  return ver == Version;
+}
+
+void AttributeColumns::set(uint64_t id, const std::vector<int64_t>& values) {
+  if (values.size() > numColumns_ ||
+      (numUsed_ == numRows_ && rows_.count(id) == 0)) {
+    // rows grow twice, so copies take linear time
+    uint64_t numRows = std::max(numRows_, MinRows);
+    if (numUsed_ == numRows) {
+      numRows *= 2;
+    }
+    resize(std::max<uint64_t>(numColumns_, values.size()), numRows);
+  }
+  auto ptr = rows_.find(id);
+  uint64_t row;
+  if (ptr != rows_.end()) {
+    row = ptr->second;
+  } else {
+    row = numUsed_;
+    rows_[id] = row;
+    ids()[row] = boost::endian::native_to_little<uint64_t>(id);
+    setNumUsed(numUsed_ + 1);
+  }
+  for (size_t i = 0; i < numColumns_; ++i) {
+    bool isSet = i < values.size();
+    column(i)[row] = toFile(isSet ? values[i] : 0);
+    setBit(presence(i), row, isSet);
+  }
+}
+
+void AttributeColumns::remove(uint64_t id) {
+  auto ptr = rows_.find(id);
+  if (ptr == rows_.end()) {
+    return;
+  }
+  // last row takes place of removed one
+  uint64_t row = ptr->second;
+  uint64_t last = numUsed_ - 1;
+  rows_.erase(ptr);
+  if (row != last) {
+    ids()[row] = ids()[last];
+    rows_[boost::endian::little_to_native<uint64_t>(ids()[row])] = row;
+    for (size_t i = 0; i < numColumns_; ++i) {
+      column(i)[row] = column(i)[last];
+      setBit(presence(i), row, hasBit(presence(i), last));
+    }
+  }
+  for (size_t i = 0; i < numColumns_; ++i) {
+    setBit(presence(i), last, false);
+  }
+  setNumUsed(last);
+}
+
+std::vector<std::optional<int64_t>> AttributeColumns::get(uint64_t id) const {
+  std::vector<std::optional<int64_t>> res(numColumns_);
+  auto ptr = rows_.find(id);
+  if (ptr == rows_.end()) {
+    return res;
+  }
+  for (size_t i = 0; i < numColumns_; ++i) {
+    if (hasBit(presence(i), ptr->second)) {
+      res[i] = fromFile(column(i)[ptr->second]);
+    }
+  }
+  return res;
+}
+
+Bitmap AttributeColumns::find(const std::vector<AttributeFilter>& filters)
+    const {
+  for (const auto& f : filters) {
+    if (f.column >= numColumns_) {
+      return {};
+    }
+  }
+  // rows of each block are matched by first filter and other filters only
+  // clear their bits, columns are read in order
+  const uint64_t blockRows = Bitmap::ContainerWords * 64;
+  std::vector<uint64_t> words(Bitmap::ContainerWords);
+  std::vector<uint64_t> res;
+  for (uint64_t start = 0; start < numUsed_; start += blockRows) {
+    uint64_t n = std::min(blockRows, numUsed_ - start);
+    size_t numWords = (n + 63) / 64;
+    std::fill(words.begin(), words.end(), 0);
+    const uint64_t* col = column(filters.front().column) + start;
+    const uint64_t* present = presence(filters.front().column) + start / 64;
+    bool any = false;
+    for (uint64_t r = 0; r < n; ++r) {
+      if (hasBit(present, r) && filters.front().matches(fromFile(col[r]))) {
+        words[r / 64] |= 1ULL << (r % 64);
+        any = true;
+      }
+    }
+    for (size_t i = 1; i < filters.size() && any; ++i) {
+      col = column(filters[i].column) + start;
+      present = presence(filters[i].column) + start / 64;
+      any = false;
+      for (size_t k = 0; k < numWords; ++k) {
+        words[k] &= boost::endian::little_to_native<uint64_t>(present[k]);
+        uint64_t w = words[k];
+        while (w) {
+          uint64_t bit = w & (~w + 1);
+          w &= w - 1;
+          auto value = col[k * 64 + countTrailingZeros64(bit)];
+          if (!filters[i].matches(fromFile(value))) {
+            words[k] &= ~bit;
+          }
+        }
+        any = any || words[k] != 0;
+      }
+    }
+    for (size_t k = 0; k < numWords && any; ++k) {
+      uint64_t w = words[k];
+      while (w) {
+        uint64_t bit = w & (~w + 1);
+        w &= w - 1;
+        auto row = start + k * 64 + countTrailingZeros64(bit);
+        res.push_back(boost::endian::little_to_native<uint64_t>(ids()[row]));
+      }
+    }
+  }
+  // rows are not in order of ids
+  std::sort(res.begin(), res.end());
+  return Bitmap::fromSorted(res.data(), res.data() + res.size());
+}
+
+void AttributeColumns::flush() {
+  if (!file_.is_open()) {
+    return;
+  }
+#ifdef _WIN32
+  bool ok = FlushViewOfFile(file_.data(), 0) != 0;
+#else
+  bool ok = msync(file_.data(), file_.size(), MS_SYNC) == 0;
+#endif
+  if (!ok) {
+    throw std::runtime_error("AttributeColumns::flush() Cant flush file");
+  }
+}
+
+void AttributeColumns::clear() {
+  rows_.clear();
+  numUsed_ = 0;
+  resize(0, 0);
+}
+
+const uint64_t* AttributeColumns::data() const {
+  return path_.empty() ? memory_.data()
+                       : (const uint64_t*)(file_.const_data() + HeaderSize);
+}
+
+uint64_t* AttributeColumns::data() {
+  return path_.empty() ? memory_.data()
+                       : (uint64_t*)(file_.data() + HeaderSize);
+}
+
+uint64_t AttributeColumns::dataWords(uint64_t numColumns, uint64_t numRows) {
+  return numRows + numColumns * numRows + numColumns * numRows / 64;
+}
+
+const uint64_t* AttributeColumns::column(size_t i) const {
+  return data() + numRows_ + i * numRows_;
+}
+
+uint64_t* AttributeColumns::column(size_t i) {
+  return data() + numRows_ + i * numRows_;
+}
+
+const uint64_t* AttributeColumns::presence(size_t i) const {
+  return data() + numRows_ + numColumns_ * numRows_ + i * numRows_ / 64;
+}
+
+uint64_t* AttributeColumns::presence(size_t i) {
+  return data() + numRows_ + numColumns_ * numRows_ + i * numRows_ / 64;
+}
+
+void AttributeColumns::setNumUsed(uint64_t n) {
+  numUsed_ = n;
+  if (!path_.empty()) {
+    n = boost::endian::native_to_little<uint64_t>(n);
+    std::memcpy(file_.data() + 3 * sizeof(uint64_t), &n, sizeof(n));
+  }
+}
+
+void AttributeColumns::resize(uint64_t numColumns, uint64_t numRows) {
+  std::vector<uint64_t> dt(dataWords(numColumns, numRows), 0);
+  uint64_t numUsed = std::min(numUsed_, numRows);
+  if (numRows_ > 0) {
+    std::copy(ids(), ids() + numUsed, dt.data());
+  }
+  for (size_t i = 0; i < numColumns_ && i < numColumns; ++i) {
+    std::copy(column(i), column(i) + numUsed,
+              dt.data() + numRows + i * numRows);
+    std::copy(presence(i), presence(i) + (numUsed + 63) / 64,
+              dt.data() + numRows + numColumns * numRows + i * numRows / 64);
+  }
+  numColumns_ = numColumns;
+  numRows_ = numRows;
+  numUsed_ = numUsed;
+  if (path_.empty()) {
+    memory_ = std::move(dt);
+    return;
+  }
+
+  // new file replaces old one at once
+  auto pth = path_;
+  pth += ".tmp";
+  {
+    std::ofstream out(pth.string(), std::ios::binary | std::ios::trunc);
+    if (!out.is_open()) {
+      throw std::runtime_error("AttributeColumns::resize() Cant open file");
+    }
+    for (auto value : {Version, numColumns, numRows, numUsed}) {
+      value = boost::endian::native_to_little<uint64_t>(value);
+      out.write((const char*)&value, sizeof(value));
+    }
+    out.write((const char*)dt.data(), dt.size() * sizeof(uint64_t));
+    if (!out) {
+      throw std::runtime_error("AttributeColumns::resize() Cant write");
+    }
+  }
+  file_.close();
+  fs::rename(pth, path_);
+  openFile();
+}
+
+void AttributeColumns::openFile() {
+  file_.open(path_.string());
+  if (!file_.is_open() || file_.data() == nullptr) {
+    throw std::runtime_error("AttributeColumns::openFile() Cant open file");
+  }
+  uint64_t header[4];
+  if (file_.size() >= HeaderSize) {
+    std::memcpy(header, file_.data(), HeaderSize);
+    for (auto& value : header) {
+      value = boost::endian::little_to_native<uint64_t>(value);
+    }
+  }
+  if (file_.size() < HeaderSize || header[0] != Version ||
+      header[2] % 64 != 0 || header[3] > header[2] ||
+      file_.size() !=
+          HeaderSize + dataWords(header[1], header[2]) * sizeof(uint64_t)) {
+    file_.close();
+    throw std::runtime_error("AttributeColumns::openFile() Different version");
+  }
+  numColumns_ = header[1];
+  numRows_ = header[2];
+  numUsed_ = header[3];
+  rows_.clear();
+  for (uint64_t r = 0; r < numUsed_; ++r) {
+    rows_[boost::endian::little_to_native<uint64_t>(ids()[r])] = r;
+  }
+}
+
+} // namespace Search
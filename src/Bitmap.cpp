@@ -0,0 +1,425 @@
+#include <search/Bitmap.hpp>
+#include <search/Intersect.hpp>
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <iterator>
+
+namespace Search {
+
+const size_t Bitmap::ContainerWords;
+const size_t Bitmap::ArrayMaxSize;
+
+typedef Bitmap::Container::Type ContainerType;
+
+static void setBitRange(uint64_t* w, uint32_t start, uint32_t last) {
+  size_t first = start >> 6;
+  size_t end = last >> 6;
+  uint64_t maskFirst = ~0ULL << (start & 63);
+  uint64_t maskLast = ~0ULL >> (63 - (last & 63));
+  if (first == end) {
+    w[first] |= maskFirst & maskLast;
+    return;
+  }
+  w[first] |= maskFirst;
+  for (size_t i = first + 1; i < end; ++i) {
+    w[i] = ~0ULL;
+  }
+  w[end] |= maskLast;
+}
+
+bool Bitmap::Container::contains(uint16_t n) const {
+  if (type == Type::Array) {
+    return std::binary_search(array.begin(), array.end(), n);
+  }
+  if (type == Type::Bitset) {
+    return (words[n >> 6] >> (n & 63)) & 1;
+  }
+  // last run which starts before n
+  size_t lo = 0;
+  size_t hi = array.size() / 2;
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    if (array[mid * 2] <= n) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo == 0) {
+    return false;
+  }
+  size_t r = (lo - 1) * 2;
+  return n - array[r] <= array[r + 1];
+}
+
+void Bitmap::Container::toWords(uint64_t* w) const {
+  if (type == Type::Bitset) {
+    std::memcpy(w, words.data(), ContainerWords * sizeof(uint64_t));
+    return;
+  }
+  std::memset(w, 0, ContainerWords * sizeof(uint64_t));
+  if (type == Type::Array) {
+    for (auto n : array) {
+      w[n >> 6] |= 1ULL << (n & 63);
+    }
+    return;
+  }
+  for (size_t i = 0; i < array.size(); i += 2) {
+    setBitRange(w, array[i], array[i] + array[i + 1]);
+  }
+}
+
+void Bitmap::Container::fromWords(const uint64_t* w) {
+  uint32_t card = 0;
+  uint32_t numRuns = 0;
+  uint64_t carry = 0;
+  for (size_t i = 0; i < ContainerWords; ++i) {
+    card += popCount(w[i]);
+    // bits which start a run
+    numRuns += popCount(w[i] & ~((w[i] << 1) | carry));
+    carry = w[i] >> 63;
+  }
+  cardinality = card;
+  array.clear();
+  words.clear();
+
+  size_t sizeArray = card * sizeof(uint16_t);
+  size_t sizeRun = numRuns * 2 * sizeof(uint16_t);
+  size_t sizeBitset = ContainerWords * sizeof(uint64_t);
+  if (sizeRun < std::min(sizeArray, sizeBitset)) {
+    type = Type::Run;
+    array.reserve(numRuns * 2);
+    size_t pos = 0;
+    for (;;) {
+      // next set bit
+      size_t i = pos >> 6;
+      uint64_t x = w[i] & (~0ULL << (pos & 63));
+      while (!x && ++i < ContainerWords) {
+        x = w[i];
+      }
+      if (i == ContainerWords) {
+        break;
+      }
+      size_t start = i * 64 + countTrailingZeros64(x);
+      // next unset bit
+      i = start >> 6;
+      x = ~w[i] & (~0ULL << (start & 63));
+      while (!x && ++i < ContainerWords) {
+        x = ~w[i];
+      }
+      size_t end = i == ContainerWords ? ContainerWords * 64
+                                       : i * 64 + countTrailingZeros64(x);
+      array.push_back((uint16_t)start);
+      array.push_back((uint16_t)(end - 1 - start));
+      if (end == ContainerWords * 64) {
+        break;
+      }
+      pos = end;
+    }
+    return;
+  }
+  if (card <= ArrayMaxSize) {
+    type = Type::Array;
+    array.reserve(card);
+    for (size_t i = 0; i < ContainerWords; ++i) {
+      uint64_t x = w[i];
+      while (x) {
+        array.push_back((uint16_t)(i * 64 + countTrailingZeros64(x)));
+        x &= x - 1;
+      }
+    }
+    return;
+  }
+  type = Type::Bitset;
+  words.assign(w, w + ContainerWords);
+}
+
+size_t Bitmap::Container::sizeInBytes() const {
+  if (type == Type::Bitset) {
+    return ContainerWords * sizeof(uint64_t);
+  }
+  return array.size() * sizeof(uint16_t);
+}
+
+static Bitmap::Container containerAnd(const Bitmap::Container& a,
+                                      const Bitmap::Container& b) {
+  Bitmap::Container res;
+  res.key = a.key;
+  if (a.type == ContainerType::Array && b.type == ContainerType::Array) {
+    const auto& small = a.array.size() < b.array.size() ? a.array : b.array;
+    const auto& large = a.array.size() < b.array.size() ? b.array : a.array;
+    res.array.resize(small.size());
+    size_t n;
+    if (small.size() * GallopingRatio < large.size()) {
+      n = intersectGalloping(small.data(), small.size(), large.data(),
+                             large.size(), res.array.data());
+    } else {
+      n = intersectMerge(small.data(), small.size(), large.data(),
+                         large.size(), res.array.data());
+    }
+    res.array.resize(n);
+    res.cardinality = (uint32_t)n;
+    return res;
+  }
+  if (a.type == ContainerType::Array || b.type == ContainerType::Array) {
+    const auto& arr = a.type == ContainerType::Array ? a : b;
+    const auto& other = a.type == ContainerType::Array ? b : a;
+    for (auto n : arr.array) {
+      if (other.contains(n)) {
+        res.array.push_back(n);
+      }
+    }
+    res.cardinality = (uint32_t)res.array.size();
+    return res;
+  }
+  uint64_t wa[Bitmap::ContainerWords];
+  uint64_t wb[Bitmap::ContainerWords];
+  a.toWords(wa);
+  b.toWords(wb);
+  for (size_t i = 0; i < Bitmap::ContainerWords; ++i) {
+    wa[i] &= wb[i];
+  }
+  res.fromWords(wa);
+  return res;
+}
+
+static Bitmap::Container containerOr(const Bitmap::Container& a,
+                                     const Bitmap::Container& b) {
+  Bitmap::Container res;
+  res.key = a.key;
+  if (a.type == ContainerType::Array && b.type == ContainerType::Array &&
+      a.cardinality + b.cardinality <= Bitmap::ArrayMaxSize) {
+    res.array.reserve(a.array.size() + b.array.size());
+    std::set_union(a.array.begin(), a.array.end(), b.array.begin(),
+                   b.array.end(), std::back_inserter(res.array));
+    res.cardinality = (uint32_t)res.array.size();
+    return res;
+  }
+  uint64_t wa[Bitmap::ContainerWords];
+  uint64_t wb[Bitmap::ContainerWords];
+  a.toWords(wa);
+  b.toWords(wb);
+  for (size_t i = 0; i < Bitmap::ContainerWords; ++i) {
+    wa[i] |= wb[i];
+  }
+  res.fromWords(wa);
+  return res;
+}
+
+static Bitmap::Container containerAndNot(const Bitmap::Container& a,
+                                         const Bitmap::Container& b) {
+  Bitmap::Container res;
+  res.key = a.key;
+  if (a.type == ContainerType::Array) {
+    for (auto n : a.array) {
+      if (!b.contains(n)) {
+        res.array.push_back(n);
+      }
+    }
+    res.cardinality = (uint32_t)res.array.size();
+    return res;
+  }
+  uint64_t wa[Bitmap::ContainerWords];
+  uint64_t wb[Bitmap::ContainerWords];
+  a.toWords(wa);
+  b.toWords(wb);
+  for (size_t i = 0; i < Bitmap::ContainerWords; ++i) {
+    wa[i] &= ~wb[i];
+  }
+  res.fromWords(wa);
+  return res;
+}
+
+Bitmap Bitmap::fromSorted(const uint64_t* begin, const uint64_t* end) {
+  Bitmap res;
+  for (auto it = begin; it != end; ++it) {
+    res.add(*it);
+  }
+  return res;
+}
+
+void Bitmap::add(uint64_t n) {
+  uint64_t key = n >> 16;
+  uint16_t low = (uint16_t)(n & 0xFFFF);
+
+  std::vector<Container>::iterator it;
+  if (containers_.empty() || containers_.back().key < key) {
+    containers_.emplace_back();
+    containers_.back().key = key;
+    it = containers_.end() - 1;
+  } else {
+    it = std::lower_bound(
+        containers_.begin(), containers_.end(), key,
+        [](const Container& c, uint64_t k) { return c.key < k; });
+    if (it == containers_.end() || it->key != key) {
+      it = containers_.emplace(it);
+      it->key = key;
+    }
+  }
+
+  Container& c = *it;
+  if (c.type == Container::Type::Array) {
+    if (c.array.empty() || c.array.back() < low) {
+      c.array.push_back(low);
+    } else {
+      auto ptr = std::lower_bound(c.array.begin(), c.array.end(), low);
+      if (*ptr == low) {
+        return;
+      }
+      c.array.insert(ptr, low);
+    }
+    c.cardinality++;
+    if (c.array.size() > ArrayMaxSize) {
+      c.words.resize(ContainerWords);
+      c.toWords(c.words.data());
+      c.type = Container::Type::Bitset;
+      c.array.clear();
+      c.array.shrink_to_fit();
+    }
+    return;
+  }
+  if (c.type == Container::Type::Bitset) {
+    uint64_t& w = c.words[low >> 6];
+    uint64_t bit = 1ULL << (low & 63);
+    if (!(w & bit)) {
+      w |= bit;
+      c.cardinality++;
+    }
+    return;
+  }
+  if (c.contains(low)) {
+    return;
+  }
+  uint64_t w[ContainerWords];
+  c.toWords(w);
+  w[low >> 6] |= 1ULL << (low & 63);
+  c.fromWords(w);
+}
+
+bool Bitmap::contains(uint64_t n) const {
+  uint64_t key = n >> 16;
+  auto it = std::lower_bound(
+      containers_.begin(), containers_.end(), key,
+      [](const Container& c, uint64_t k) { return c.key < k; });
+  if (it == containers_.end() || it->key != key) {
+    return false;
+  }
+  return it->contains((uint16_t)(n & 0xFFFF));
+}
+
+uint64_t Bitmap::cardinality() const {
+  uint64_t n = 0;
+  for (const auto& c : containers_) {
+    n += c.cardinality;
+  }
+  return n;
+}
+
+size_t Bitmap::sizeInBytes() const {
+  size_t n = 0;
+  for (const auto& c : containers_) {
+    n += c.sizeInBytes();
+  }
+  return n;
+}
+
+void Bitmap::appendWords(uint64_t key, const uint64_t* words) {
+  assert(containers_.empty() || containers_.back().key < key);
+  Container c;
+  c.key = key;
+  c.fromWords(words);
+  if (c.cardinality > 0) {
+    containers_.push_back(std::move(c));
+  }
+}
+
+void Bitmap::optimize() {
+  uint64_t w[ContainerWords];
+  for (auto& c : containers_) {
+    c.toWords(w);
+    c.fromWords(w);
+  }
+}
+
+void Bitmap::andWith(const Bitmap& b) {
+  std::vector<Container> res;
+  size_t i = 0, j = 0;
+  while (i < containers_.size() && j < b.containers_.size()) {
+    if (containers_[i].key < b.containers_[j].key) {
+      i++;
+    } else if (b.containers_[j].key < containers_[i].key) {
+      j++;
+    } else {
+      auto c = containerAnd(containers_[i], b.containers_[j]);
+      if (c.cardinality > 0) {
+        res.push_back(std::move(c));
+      }
+      i++;
+      j++;
+    }
+  }
+  containers_.swap(res);
+}
+
+void Bitmap::orWith(const Bitmap& b) {
+  std::vector<Container> res;
+  res.reserve(containers_.size() + b.containers_.size());
+  size_t i = 0, j = 0;
+  while (i < containers_.size() || j < b.containers_.size()) {
+    if (j == b.containers_.size() ||
+        (i < containers_.size() &&
+         containers_[i].key < b.containers_[j].key)) {
+      res.push_back(std::move(containers_[i++]));
+    } else if (i == containers_.size() ||
+               b.containers_[j].key < containers_[i].key) {
+      res.push_back(b.containers_[j++]);
+    } else {
+      res.push_back(containerOr(containers_[i], b.containers_[j]));
+      i++;
+      j++;
+    }
+  }
+  containers_.swap(res);
+}
+
+void Bitmap::andNotWith(const Bitmap& b) {
+  std::vector<Container> res;
+  res.reserve(containers_.size());
+  size_t j = 0;
+  for (auto& c : containers_) {
+    while (j < b.containers_.size() && b.containers_[j].key < c.key) {
+      j++;
+    }
+    if (j == b.containers_.size() || b.containers_[j].key != c.key) {
+      res.push_back(std::move(c));
+      continue;
+    }
+    auto c2 = containerAndNot(c, b.containers_[j]);
+    if (c2.cardinality > 0) {
+      res.push_back(std::move(c2));
+    }
+  }
+  containers_.swap(res);
+}
+
+Bitmap bitmapAnd(const Bitmap& a, const Bitmap& b) {
+  Bitmap res = a;
+  res.andWith(b);
+  return res;
+}
+
+Bitmap bitmapOr(const Bitmap& a, const Bitmap& b) {
+  Bitmap res = a;
+  res.orWith(b);
+  return res;
+}
+
+Bitmap bitmapAndNot(const Bitmap& a, const Bitmap& b) {
+  Bitmap res = a;
+  res.andNotWith(b);
+  return res;
+}
+
+} // namespace Search
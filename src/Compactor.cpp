@@ -0,0 +1,87 @@
+#include <search/Compactor.hpp>
+#include <search/KeyValueFile.hpp>
+#include <search/KeyValueFileList.hpp>
+
+#include <algorithm>
+
+namespace Search {
+
+Compactor::Compactor() : Compactor(Settings()) {}
+
+Compactor::Compactor(const Settings& settings)
+    : settings_(settings), stop_(false) {
+  thread_ = std::thread(&Compactor::run, this);
+}
+
+Compactor::~Compactor() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  cv_.notify_all();
+  thread_.join();
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (auto file : files_) {
+    file->setCompactor(nullptr, nullptr);
+  }
+  for (auto file : fileLists_) {
+    file->setCompactor(nullptr, nullptr);
+  }
+}
+
+void Compactor::add(KeyValueFile& file, std::shared_mutex* readersMutex) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  file.setCompactor(this, readersMutex);
+  files_.push_back(&file);
+}
+
+void Compactor::add(KeyValueFileList& file,
+                    std::shared_mutex* readersMutex) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  file.setCompactor(this, readersMutex);
+  fileLists_.push_back(&file);
+}
+
+void Compactor::remove(KeyValueFile& file) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  file.setCompactor(nullptr, nullptr);
+  files_.erase(std::remove(files_.begin(), files_.end(), &file),
+               files_.end());
+}
+
+void Compactor::remove(KeyValueFileList& file) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  file.setCompactor(nullptr, nullptr);
+  fileLists_.erase(std::remove(fileLists_.begin(), fileLists_.end(), &file),
+                   fileLists_.end());
+}
+
+void Compactor::compactAll() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  while (step()) {
+  }
+}
+
+// mutex_ must be locked
+bool Compactor::step() {
+  bool more = false;
+  for (auto file : files_) {
+    more |= file->compactStep(settings_.minWasted, settings_.bytesPerStep);
+    file->compaction_->installReady(*file);
+  }
+  for (auto file : fileLists_) {
+    more |= file->compactStep(settings_.minWasted, settings_.bytesPerStep);
+    file->compaction_->installReady(*file);
+  }
+  return more;
+}
+
+void Compactor::run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!stop_) {
+    bool more = step();
+    cv_.wait_for(lock, more ? settings_.pause : settings_.interval);
+  }
+}
+
+} // namespace Search
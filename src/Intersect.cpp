@@ -0,0 +1,136 @@
+#include <search/Intersect.hpp>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define SEARCH_INTERSECT_SSE2
+#include <emmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#if defined(__GNUC__)
+#define SEARCH_INTERSECT_AVX2
+#include <immintrin.h>
+#endif
+#endif
+
+namespace Search {
+
+size_t intersectSortedScalar(const uint32_t* a, size_t na, const uint32_t* b,
+                             size_t nb, uint32_t* out) {
+  return intersectMerge(a, na, b, nb, out);
+}
+
+#ifdef SEARCH_INTERSECT_SSE2
+
+static inline int countTrailingZeros(unsigned mask) {
+#ifdef _MSC_VER
+  unsigned long n;
+  _BitScanForward(&n, mask);
+  return (int)n;
+#else
+  return __builtin_ctz(mask);
+#endif
+}
+
+// Compares block of 4 from a with all rotations of block of 4 from b and
+// writes matches. Block with smaller last value is advanced.
+static size_t intersectSSE2(const uint32_t* a, size_t na, const uint32_t* b,
+                            size_t nb, uint32_t* out) {
+  size_t i = 0, j = 0, k = 0;
+  const size_t na4 = na & ~(size_t)3;
+  const size_t nb4 = nb & ~(size_t)3;
+  alignas(16) uint32_t tmp[4];
+  while (i < na4 && j < nb4) {
+    __m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+    __m128i vb = _mm_loadu_si128((const __m128i*)(b + j));
+    __m128i m1 = _mm_cmpeq_epi32(va, vb);
+    __m128i m2 =
+        _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(0, 3, 2, 1)));
+    __m128i m3 =
+        _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(1, 0, 3, 2)));
+    __m128i m4 =
+        _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(2, 1, 0, 3)));
+    __m128i m = _mm_or_si128(_mm_or_si128(m1, m2), _mm_or_si128(m3, m4));
+    unsigned mask = (unsigned)_mm_movemask_ps(_mm_castsi128_ps(m));
+    // read before out is written, out can be a
+    uint32_t aMax = a[i + 3];
+    uint32_t bMax = b[j + 3];
+    if (mask) {
+      _mm_store_si128((__m128i*)tmp, va);
+      while (mask) {
+        out[k++] = tmp[countTrailingZeros(mask)];
+        mask &= mask - 1;
+      }
+    }
+    if (aMax <= bMax) {
+      i += 4;
+    }
+    if (bMax <= aMax) {
+      j += 4;
+    }
+  }
+  return k + intersectMerge(a + i, na - i, b + j, nb - j, out + k);
+}
+
+#endif
+
+#ifdef SEARCH_INTERSECT_AVX2
+
+// same as sse2, but with blocks of 8
+__attribute__((target("avx2"))) static size_t
+intersectAVX2(const uint32_t* a, size_t na, const uint32_t* b, size_t nb,
+              uint32_t* out) {
+  size_t i = 0, j = 0, k = 0;
+  const size_t na8 = na & ~(size_t)7;
+  const size_t nb8 = nb & ~(size_t)7;
+  alignas(32) uint32_t tmp[8];
+  const __m256i rot = _mm256_setr_epi32(1, 2, 3, 4, 5, 6, 7, 0);
+  while (i < na8 && j < nb8) {
+    __m256i va = _mm256_loadu_si256((const __m256i*)(a + i));
+    __m256i vb = _mm256_loadu_si256((const __m256i*)(b + j));
+    __m256i m = _mm256_cmpeq_epi32(va, vb);
+    for (int r = 1; r < 8; ++r) {
+      vb = _mm256_permutevar8x32_epi32(vb, rot);
+      m = _mm256_or_si256(m, _mm256_cmpeq_epi32(va, vb));
+    }
+    unsigned mask = (unsigned)_mm256_movemask_ps(_mm256_castsi256_ps(m));
+    uint32_t aMax = a[i + 7];
+    uint32_t bMax = b[j + 7];
+    if (mask) {
+      _mm256_store_si256((__m256i*)tmp, va);
+      while (mask) {
+        out[k++] = tmp[__builtin_ctz(mask)];
+        mask &= mask - 1;
+      }
+    }
+    if (aMax <= bMax) {
+      i += 8;
+    }
+    if (bMax <= aMax) {
+      j += 8;
+    }
+  }
+  return k + intersectSSE2(a + i, na - i, b + j, nb - j, out + k);
+}
+
+static bool hasAVX2() {
+  static const bool has = __builtin_cpu_supports("avx2");
+  return has;
+}
+
+#endif
+
+size_t intersectSortedU32(const uint32_t* a, size_t na, const uint32_t* b,
+                          size_t nb, uint32_t* out) {
+#if defined(SEARCH_INTERSECT_AVX2)
+  if (hasAVX2()) {
+    return intersectAVX2(a, na, b, nb, out);
+  }
+  return intersectSSE2(a, na, b, nb, out);
+#elif defined(SEARCH_INTERSECT_SSE2)
+  return intersectSSE2(a, na, b, nb, out);
+#else
+  return intersectSortedScalar(a, na, b, nb, out);
+#endif
+}
+
+} // namespace Search
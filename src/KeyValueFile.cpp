@@ -1,3 +1,4 @@
+#include <search/Compactor.hpp>
 #include <search/KeyValueFile.hpp>
 
 #include <boost/endian/conversion.hpp>
@@ -12,6 +13,7 @@
 #ifdef _WIN32
 #include <windows.h>
 #else
+#include <sys/mman.h>
 #include <unistd.h>
 #endif
 
@@ -20,6 +22,9 @@
 namespace Search {
 
 const uint64_t KeyValueFile::Version;
+const uint64_t KeyValueFile::HeaderSize;
+const uint64_t KeyValueFile::MaxTableLevels;
+const uint64_t KeyValueFile::SlotSize;
 
 KeyValueFile::KeyValueFile(const fs::path& path)
     : path_(path), locked_(false), buffer_(nullptr), importing_(nullptr) {
@@ -33,6 +38,9 @@ KeyValueFile::KeyValueFile(const fs::path& path)
 }
 
 KeyValueFile::~KeyValueFile() {
+  if (compaction_ && compaction_->compactor) {
+    compaction_->compactor->remove(*this);
+  }
   if (importing_) {
     delete importing_;
     importing_ = nullptr;
@@ -43,7 +51,7 @@ void KeyValueFile::createFile(const fs::path& path, uint64_t tabSize,
                               uint64_t contentSize) {
   // create
   { std::ofstream output(path.string()); }
-  fs::resize_file(path, 100 + tabSize * sizeof(uint64_t) + contentSize);
+  fs::resize_file(path, HeaderSize + tabSize * SlotSize + contentSize);
 
   boost::iostreams::mapped_file file;
   file.open(path);
@@ -53,7 +61,7 @@ void KeyValueFile::createFile(const fs::path& path, uint64_t tabSize,
   assert(file.data());
 
   uint64_t numWasted = 0;
-  uint64_t nextDataOffset2 = 100 + tabSize * sizeof(uint64_t);
+  uint64_t nextDataOffset2 = HeaderSize + tabSize * SlotSize;
   uint64_t numItems = 0;
 
   /*
@@ -61,11 +69,17 @@ void KeyValueFile::createFile(const fs::path& path, uint64_t tabSize,
   Header structure:
   - - - - - - - - - - -
    * version
-   * number of slots in hash table
+   * number of slots in base hash table
    * number of wasted bytes
    * next data offset
    * num items
+   * level of linear hashing
+   * next bucket to split
+   * offsets of table extents, one for each level
   - - - - - - - - - - -
+  Resized file is filled with zeros, so level, split and extents are 0.
+  Header is followed by slots of base table, each slot has links to first
+  and second item of bucket.
   */
 
   const auto v = boost::endian::native_to_little<uint64_t>(Version);
@@ -86,33 +100,39 @@ void KeyValueFile::set(const std::string& key, const Bytes& value) {
 }
 
 void KeyValueFile::set(std::string_view key, BytesView value) {
+  auto lock = lockCompaction();
   ensureTableSize(1);
-  auto bucket = calcBucket(key);
+  auto hash = calcHash(key);
   auto itemSize = Item::calcSize(key, value);
   ensureFreeSpace(itemSize);
-  setInternal(bucket, key, value);
+  setInternal(bucketFromHash(hash), calcFingerprint(hash), key, value);
+  markChanged(key);
   ensureOptimalWaste();
 }
 
 void KeyValueFile::set(const KeyValueFile& db2) {
+  auto lock = lockCompaction();
+  abortCompaction();
   ensureTableSize(db2.numItems());
 
-  auto num1 = numBuckets();
   auto num2 = db2.numBuckets();
+  bool sameTable =
+      baseBuckets() == db2.baseBuckets() && numBuckets() == num2;
   for (uint64_t i = 0; i < num2; ++i) {
-    auto it = db2.firstItem(i);
-    while (it.valid()) {
+    auto link = db2.tableLink(i);
+    while (link != 0) {
+      Item it(db2.data(), linkOffset(link));
       auto itemSize = Item::calcSize(it.key(), it.value());
       ensureFreeSpace(itemSize);
 
       uint64_t bucket;
-      if (num1 == num2) {
+      if (sameTable) {
         bucket = i;
       } else {
         bucket = calcBucket(it.key());
       }
-      setInternal(bucket, it.key(), it.value());
-      it = it.next();
+      setInternal(bucket, linkFingerprint(link), it.key(), it.value());
+      link = it.nextLink();
     }
   }
 
@@ -120,12 +140,17 @@ void KeyValueFile::set(const KeyValueFile& db2) {
 }
 
 BytesView KeyValueFile::get(std::string_view key) const {
-  return getWithBucket(calcBucket(key), key);
+  auto hash = calcHash(key);
+  auto pair = findInternal(bucketFromHash(hash), calcFingerprint(hash), key);
+  if (pair.second.valid()) {
+    return pair.second.value();
+  }
+  return {};
 }
 
 BytesView KeyValueFile::getWithBucket(uint64_t bucket,
                                       std::string_view key) const {
-  auto pair = findInternal(bucket, key);
+  auto pair = findInternal(bucket, calcFingerprint(calcHash(key)), key);
   if (pair.second.valid()) {
     return pair.second.value();
   }
@@ -138,8 +163,10 @@ BytesView KeyValueFile::get(const std::string& key2) const {
 }
 
 void KeyValueFile::remove(std::string_view key) {
-  auto bucket = calcBucket(key);
-  removeInternal(bucket, key);
+  auto lock = lockCompaction();
+  auto hash = calcHash(key);
+  removeInternal(bucketFromHash(hash), calcFingerprint(hash), key);
+  markChanged(key);
   ensureOptimalWaste();
 }
 
@@ -148,11 +175,11 @@ void KeyValueFile::remove(const std::string& key2) {
   return remove(key);
 }
 
-void KeyValueFile::setInternal(uint64_t bucket, std::string_view key,
-                               BytesView value) {
-  auto pair = findInternal(bucket, key);
+void KeyValueFile::setInternal(uint64_t bucket, uint16_t fingerprint,
+                               std::string_view key, BytesView value) {
+  auto pair = findInternal(bucket, fingerprint, key);
 
-  uint64_t prevOffset, nextOffset;
+  uint64_t prevOffset, nextLink;
   if (pair.second.valid()) {
     // exists
     auto currentSize = pair.second.value().size();
@@ -166,10 +193,10 @@ void KeyValueFile::setInternal(uint64_t bucket, std::string_view key,
     }
     setWasted(wasted() + currentSize);
     prevOffset = pair.first;
-    nextOffset = pair.second.nextOffset();
+    nextLink = pair.second.nextLink();
   } else {
     prevOffset = 0;
-    nextOffset = tableOffset(bucket);
+    nextLink = tableLink(bucket);
     // change numitems
     setNumItems(numItems() + 1);
   }
@@ -177,22 +204,25 @@ void KeyValueFile::setInternal(uint64_t bucket, std::string_view key,
   // add
   auto myOffset = nextDataOffset();
   auto dt = data() + myOffset;
-  Item::write(dt, nextOffset, key, value);
+  Item::write(dt, nextLink, key, value);
   setNextDataOffset(dt - data());
 
   // link
+  auto myLink = makeLink(myOffset, fingerprint);
   if (prevOffset == 0) {
     // write to table
-    setTableOffset(bucket, myOffset);
+    setTableLink(bucket, myLink);
   } else {
     // write to item
     Item itPrev(data(), prevOffset);
-    itPrev.setNextOffset(myOffset);
+    itPrev.setNextLink(myLink);
   }
+  refreshSlot(bucket);
 }
 
-void KeyValueFile::removeInternal(uint64_t bucket, std::string_view key) {
-  auto pair = findInternal(bucket, key);
+void KeyValueFile::removeInternal(uint64_t bucket, uint16_t fingerprint,
+                                  std::string_view key) {
+  auto pair = findInternal(bucket, fingerprint, key);
   if (!pair.second.valid()) {
     return;
   }
@@ -202,12 +232,13 @@ void KeyValueFile::removeInternal(uint64_t bucket, std::string_view key) {
 
   if (pair.first == 0) {
     // table
-    setTableOffset(bucket, pair.second.nextOffset());
+    setTableLink(bucket, pair.second.nextLink());
   } else {
     // item
     Item itPrev(data(), pair.first);
-    itPrev.setNextOffset(pair.second.nextOffset());
+    itPrev.setNextLink(pair.second.nextLink());
   }
+  refreshSlot(bucket);
 }
 
 KeyValueFile::Item KeyValueFile::firstItem(uint64_t bucket) const {
@@ -215,16 +246,28 @@ KeyValueFile::Item KeyValueFile::firstItem(uint64_t bucket) const {
   return Item(data(), offset);
 }
 
+// Slot has links to first two items, so for most keys only matching item is
+// read. Returns offset of previous item and item.
 std::pair<uint64_t, KeyValueFile::Item>
-KeyValueFile::findInternal(uint64_t bucket, std::string_view key) const {
-  auto it = firstItem(bucket);
-  uint64_t prevOffset = 0;
-  while (it.valid()) {
-    if (it.key() == key) {
+KeyValueFile::findInternal(uint64_t bucket, uint16_t fingerprint,
+                           std::string_view key) const {
+  auto link = tableLink(bucket);
+  if (link == 0) {
+    return {0, KeyValueFile::Item()};
+  }
+  Item first(data(), linkOffset(link));
+  if (linkFingerprint(link) == fingerprint && first.key() == key) {
+    return {0, first};
+  }
+  uint64_t prevOffset = first.offset();
+  link = secondLink(bucket);
+  while (link != 0) {
+    Item it(data(), linkOffset(link));
+    if (linkFingerprint(link) == fingerprint && it.key() == key) {
       return {prevOffset, it};
     }
     prevOffset = it.offset();
-    it = it.next();
+    link = it.nextLink();
   }
   return {0, KeyValueFile::Item()};
 }
@@ -258,6 +301,8 @@ KeyValueFile::bulkRead(const std::byte*& dt) {
 }
 
 void KeyValueFile::bulkStart(size_t numThreads) {
+  auto lock = lockCompaction();
+  abortCompaction();
   assert(!importing_);
   std::unique_ptr<ImportingData> dt(new ImportingData());
   dt->numItems = numItems();
@@ -300,9 +345,7 @@ void KeyValueFile::bulkInsertEnlarge(size_t nthThread, size_t numThreads) {
       pair.second = 0;
     }
 
-    uint64_t contentSize =
-        nextDataOffset() - 100 - numBuckets() * sizeof(uint64_t) - wasted();
-    changeTable(numBuckets(), contentSize);
+    changeTable(numBuckets(), contentSize());
     importing_->wasted = wasted();
     assert(importing_->numItems == numItems());
   }
@@ -331,8 +374,9 @@ void KeyValueFile::bulkInsert(uint64_t bucket, std::string_view key,
     }
   }
 
-  auto pair = findInternal(bucket, key);
-  uint64_t prevOffset, nextOffset;
+  auto fingerprint = calcFingerprint(calcHash(key));
+  auto pair = findInternal(bucket, fingerprint, key);
+  uint64_t prevOffset, nextLink;
   if (pair.second.valid()) {
     // exists
     auto currentSize = pair.second.value().size();
@@ -346,10 +390,10 @@ void KeyValueFile::bulkInsert(uint64_t bucket, std::string_view key,
     }
     importing_->wasted += currentSize;
     prevOffset = pair.first;
-    nextOffset = pair.second.nextOffset();
+    nextLink = pair.second.nextLink();
   } else {
     prevOffset = 0;
-    nextOffset = tableOffset(bucket);
+    nextLink = tableLink(bucket);
     // change numitems
     importing_->numItems++;
   }
@@ -357,18 +401,20 @@ void KeyValueFile::bulkInsert(uint64_t bucket, std::string_view key,
   // add
   auto myOffset = importing_->dataRange[nthThread].first;
   std::byte* dt3 = data() + myOffset;
-  Item::write(dt3, nextOffset, key, value);
+  Item::write(dt3, nextLink, key, value);
   importing_->dataRange[nthThread].first += itemSize;
 
   // link
+  auto myLink = makeLink(myOffset, fingerprint);
   if (prevOffset == 0) {
     // write to table
-    setTableOffset(bucket, myOffset);
+    setTableLink(bucket, myLink);
   } else {
     // write to item
     Item itPrev(data(), prevOffset);
-    itPrev.setNextOffset(myOffset);
+    itPrev.setNextLink(myLink);
   }
+  refreshSlot(bucket);
 }
 
 void KeyValueFile::bulkRemove(uint64_t bucket, std::string_view key,
@@ -376,7 +422,7 @@ void KeyValueFile::bulkRemove(uint64_t bucket, std::string_view key,
                               size_t numThreads) {
   std::lock_guard lock1(importing_->mutex_);
 
-  auto pair = findInternal(bucket, key);
+  auto pair = findInternal(bucket, calcFingerprint(calcHash(key)), key);
   if (!pair.second.valid()) {
     return;
   }
@@ -386,12 +432,13 @@ void KeyValueFile::bulkRemove(uint64_t bucket, std::string_view key,
 
   if (pair.first == 0) {
     // table
-    setTableOffset(bucket, pair.second.nextOffset());
+    setTableLink(bucket, pair.second.nextLink());
   } else {
     // item
     Item itPrev(data(), pair.first);
-    itPrev.setNextOffset(pair.second.nextOffset());
+    itPrev.setNextLink(pair.second.nextLink());
   }
+  refreshSlot(bucket);
 }
 
 bool KeyValueFile::bulkIsInThread(uint64_t bucket, size_t nthThread,
@@ -417,12 +464,37 @@ uint64_t KeyValueFile::calcHash(std::string_view key) {
   return CityHash64((const char*)key.data(), key.size());
 }
 
-uint64_t KeyValueFile::calcBucketFromHash(uint64_t hash, uint64_t numBuckets2) {
-  return hash % numBuckets2;
+// Linear hashing, table has base * 2^level + split buckets. Buckets before
+// split are already divided by table twice as big.
+uint64_t KeyValueFile::calcBucketFromHash(uint64_t hash,
+                                          uint64_t numBuckets2) const {
+  // locked table is not split, header isn't read while import threads remap
+  // file
+  if (locked_) {
+    return hash % numBuckets2;
+  }
+  uint64_t size = baseBuckets();
+  while (size * 2 <= numBuckets2) {
+    size *= 2;
+  }
+  auto bucket = hash % size;
+  if (bucket < numBuckets2 - size) {
+    bucket = hash % (size * 2);
+  }
+  return bucket;
 }
 
 uint64_t KeyValueFile::calcBucket(std::string_view key) const {
-  return calcBucketFromHash(calcHash(key), numBuckets());
+  return bucketFromHash(calcHash(key));
+}
+
+uint64_t KeyValueFile::bucketFromHash(uint64_t hash) const {
+  uint64_t size = baseBuckets() << tableLevel();
+  auto bucket = hash % size;
+  if (bucket < tableSplit()) {
+    bucket = hash % (size * 2);
+  }
+  return bucket;
 }
 
 std::byte* KeyValueFile::data() const {
@@ -434,22 +506,55 @@ std::byte* KeyValueFile::data() const {
 }
 
 uint64_t KeyValueFile::tableOffset(uint64_t bucket) const {
-  std::byte* dt = data();
-  dt += 100;
-  dt += bucket * sizeof(uint64_t);
+  return linkOffset(tableLink(bucket));
+}
+
+uint64_t KeyValueFile::tableLink(uint64_t bucket) const {
   uint64_t n;
-  std::memcpy(&n, dt, sizeof(n));
+  std::memcpy(&n, data() + slotOffset(bucket), sizeof(n));
   return n;
 }
-void KeyValueFile::setTableOffset(uint64_t bucket, uint64_t offset) const {
-  std::byte* dt = data();
-  dt += 100;
-  dt += bucket * sizeof(uint64_t);
+void KeyValueFile::setTableLink(uint64_t bucket, uint64_t link) const {
+  std::memcpy(data() + slotOffset(bucket), &link, sizeof(link));
+}
 
-  std::memcpy(dt, &offset, sizeof(offset));
+uint64_t KeyValueFile::secondLink(uint64_t bucket) const {
+  uint64_t n;
+  std::memcpy(&n, data() + slotOffset(bucket) + sizeof(uint64_t), sizeof(n));
+  return n;
+}
+
+// copies link of second item to slot, must be called after chain is changed
+void KeyValueFile::refreshSlot(uint64_t bucket) const {
+  auto link = tableLink(bucket);
+  uint64_t second = 0;
+  if (link != 0) {
+    second = Item(data(), linkOffset(link)).nextLink();
+  }
+  std::memcpy(data() + slotOffset(bucket) + sizeof(uint64_t), &second,
+              sizeof(second));
+}
+
+uint64_t KeyValueFile::slotOffset(uint64_t bucket) const {
+  auto base = baseBuckets();
+  if (bucket < base) {
+    return HeaderSize + bucket * SlotSize;
+  }
+  // extent of level k has buckets from base * 2^k to base * 2^(k+1)
+  uint64_t level = 0;
+  uint64_t start = base;
+  while (bucket >= start * 2) {
+    start *= 2;
+    level++;
+  }
+  return extentOffset(level) + (bucket - start) * SlotSize;
 }
 
 uint64_t KeyValueFile::numBuckets() const {
+  return (baseBuckets() << tableLevel()) + tableSplit();
+}
+
+uint64_t KeyValueFile::baseBuckets() const {
   uint64_t n;
   std::memcpy(&n, data() + 1 * sizeof(uint64_t), sizeof(n));
   if (n == 0) {
@@ -458,6 +563,127 @@ uint64_t KeyValueFile::numBuckets() const {
   return n;
 }
 
+uint64_t KeyValueFile::tableLevel() const {
+  uint64_t n;
+  std::memcpy(&n, data() + 5 * sizeof(uint64_t), sizeof(n));
+  return n;
+}
+
+void KeyValueFile::setTableLevel(uint64_t level) {
+  std::memcpy(data() + 5 * sizeof(uint64_t), &level, sizeof(uint64_t));
+}
+
+uint64_t KeyValueFile::tableSplit() const {
+  uint64_t n;
+  std::memcpy(&n, data() + 6 * sizeof(uint64_t), sizeof(n));
+  return n;
+}
+
+void KeyValueFile::setTableSplit(uint64_t split) {
+  std::memcpy(data() + 6 * sizeof(uint64_t), &split, sizeof(uint64_t));
+}
+
+uint64_t KeyValueFile::extentOffset(uint64_t level) const {
+  uint64_t n;
+  std::memcpy(&n, data() + (7 + level) * sizeof(uint64_t), sizeof(n));
+  return n;
+}
+
+void KeyValueFile::setExtentOffset(uint64_t level, uint64_t offset) {
+  std::memcpy(data() + (7 + level) * sizeof(uint64_t), &offset,
+              sizeof(uint64_t));
+}
+
+uint64_t KeyValueFile::tableBytes() const {
+  auto base = baseBuckets();
+  uint64_t n = base * SlotSize;
+  for (uint64_t i = 0; i < MaxTableLevels && extentOffset(i) != 0; ++i) {
+    n += (base << i) * SlotSize;
+  }
+  return n;
+}
+
+// size of items without wasted space
+uint64_t KeyValueFile::contentSize() const {
+  return nextDataOffset() - HeaderSize - tableBytes() - wasted();
+}
+
+// Items of bucket at split are divided between it and new bucket at the end.
+// Only links are changed, items stay where they are.
+void KeyValueFile::splitBucket() {
+  auto level = tableLevel();
+  if (level >= MaxTableLevels) {
+    return;
+  }
+  auto split = tableSplit();
+  uint64_t size = baseBuckets() << level;
+  if (extentOffset(level) == 0) {
+    // slots for buckets of next level, kept when table shrinks
+    auto bytes = size * SlotSize;
+    ensureFreeSpace(bytes);
+    auto offset = nextDataOffset();
+    setNextDataOffset(offset + bytes);
+    setExtentOffset(level, offset);
+  }
+
+  uint64_t head1 = 0;
+  uint64_t head2 = 0;
+  auto link = tableLink(split);
+  while (link != 0) {
+    Item it(data(), linkOffset(link));
+    auto next = it.nextLink();
+    if (calcHash(it.key()) % (size * 2) == split) {
+      it.setNextLink(head1);
+      head1 = link;
+    } else {
+      it.setNextLink(head2);
+      head2 = link;
+    }
+    link = next;
+  }
+  setTableLink(split, head1);
+  setTableLink(size + split, head2);
+  refreshSlot(split);
+  refreshSlot(size + split);
+
+  if (split + 1 == size) {
+    setTableLevel(level + 1);
+    setTableSplit(0);
+  } else {
+    setTableSplit(split + 1);
+  }
+}
+
+// last bucket is appended to bucket it was split from
+void KeyValueFile::mergeBucket() {
+  auto level = tableLevel();
+  auto split = tableSplit();
+  if (split == 0) {
+    if (level == 0) {
+      return;
+    }
+    level--;
+    split = baseBuckets() << level;
+  }
+  split--;
+  uint64_t size = baseBuckets() << level;
+
+  auto last = tableLink(size + split);
+  if (last != 0) {
+    Item it(data(), linkOffset(last));
+    while (it.nextOffset() != 0) {
+      it = it.next();
+    }
+    it.setNextLink(tableLink(split));
+    setTableLink(split, last);
+    refreshSlot(split);
+  }
+  setTableLink(size + split, 0);
+  refreshSlot(size + split);
+  setTableLevel(level);
+  setTableSplit(split);
+}
+
 uint64_t KeyValueFile::nextDataOffset() const {
   uint64_t n;
   std::memcpy(&n, data() + 3 * sizeof(uint64_t), sizeof(n));
@@ -489,21 +715,21 @@ void KeyValueFile::setWasted(uint64_t w) {
 }
 
 void KeyValueFile::optimize() {
+  auto lock = lockCompaction();
+  abortCompaction();
   locked_ = false;
 
+  // rebuild also joins table extents with base table
   double fact = (double)numItems() / (double)numBuckets();
-  if (fact > 1.05 || fact < 0.6) {
+  if (fact > 1.05 || fact < 0.6 ||
+      tableBytes() != numBuckets() * SlotSize) {
     uint64_t tabSize = findTabSizePrime(numItems() / 0.8);
-    uint64_t contentSize =
-        nextDataOffset() - 100 - numBuckets() * sizeof(uint64_t) - wasted();
-    changeTable(tabSize, contentSize);
+    changeTable(tabSize, contentSize());
     return;
   }
 
   if (wasted() > 500000) {
-    uint64_t contentSize =
-        nextDataOffset() - 100 - numBuckets() * sizeof(uint64_t) - wasted();
-    changeTable(numBuckets(), contentSize);
+    changeTable(numBuckets(), contentSize());
     return;
   }
 
@@ -515,18 +741,23 @@ void KeyValueFile::optimize() {
 }
 
 void KeyValueFile::lockTableForNumItems(uint64_t n) {
+  auto lock = lockCompaction();
+  abortCompaction();
   locked_ = true;
 
   double fact = (double)n / (double)numBuckets();
-  if (fact < 0.9 && fact > 0.6) {
+  if (fact < 0.9 && fact > 0.6 && tableLevel() == 0 && tableSplit() == 0) {
     return;
   }
 
-  auto pth = tmpFilePath();
   uint64_t tabSize = findTabSizePrime(n / 0.8);
-  uint64_t contentSize =
-      file_.size() - 100 - numBuckets() * sizeof(uint64_t) - wasted();
-  changeTable(tabSize, contentSize);
+  uint64_t bodySize = file_.size() - HeaderSize - tableBytes() - wasted();
+  changeTable(tabSize, bodySize);
+  // rebuilt table has no wasted space
+  if (importing_) {
+    importing_->numItems = numItems();
+    importing_->wasted = wasted();
+  }
 }
 
 void KeyValueFile::unlockTable() { locked_ = false; }
@@ -572,48 +803,33 @@ void KeyValueFile::ensureFreeSpace(size_t additional) {
   openFile();
 }
 
+// table grows and shrinks by one bucket, never rebuilt at once
 void KeyValueFile::ensureTableSize(int64_t additional) {
-  if (locked_) {
+  // buckets are copied in order while compacting
+  if (locked_ || (compaction_ && compaction_->target)) {
     return;
   }
 
   uint64_t num = numItems() + additional;
-  double fact = (double)num / (double)numBuckets();
-  if (fact <= 1.4 && fact >= 0.3) {
-    return;
+  while (num > numBuckets() && tableLevel() < MaxTableLevels) {
+    splitBucket();
   }
-  if (fact < 1 && numBuckets() <= 101) {
-    return;
-  }
-
-  auto pth = tmpFilePath();
-  uint64_t tabSize;
-  if (fact > 1) {
-    // incresing
-    tabSize = findTabSizePrimeDouble(num * 1.8);
-  } else {
-    // decreasing
-    tabSize = findTabSizePrimeDouble(num);
-  }
-  if (tabSize == numBuckets()) {
-    return;
+  while (num < numBuckets() * 0.3 && numBuckets() > baseBuckets()) {
+    mergeBucket();
   }
-  auto contentSize = file_.size() - numBuckets() * sizeof(uint64_t);
-
-  changeTable(tabSize, contentSize);
 }
 
 void KeyValueFile::ensureOptimalWaste() {
-  if (locked_) {
+  // with compactor space is reclaimed in background
+  if (locked_ || compaction_) {
     return;
   }
   if (wasted() < 30'000'000) {
     return;
   }
 
-  auto pth = tmpFilePath();
-  uint64_t contentSize = file_.size() - 100 - numBuckets() * sizeof(uint64_t);
-  changeTable(numBuckets(), contentSize);
+  uint64_t bodySize = file_.size() - HeaderSize - tableBytes();
+  changeTable(numBuckets(), bodySize);
 }
 
 fs::path KeyValueFile::tmpFilePath() const {
@@ -651,7 +867,7 @@ bool KeyValueFile::isFileVersionOk(const fs::path& pth) {
     throw std::runtime_error("Cant open file");
   }
 
-  if (f.size() < 100) {
+  if (f.size() < HeaderSize) {
     f.close();
     return false;
   }
@@ -665,15 +881,15 @@ bool KeyValueFile::isFileVersionOk(const fs::path& pth) {
   return ok;
 }
 
-void KeyValueFile::changeTable(uint64_t tabSize, uint64_t contentSize) {
+void KeyValueFile::changeTable(uint64_t tabSize, uint64_t bodySize) {
   if (buffer_) {
     throw std::runtime_error("cant change table when using buffer");
   }
+  abortCompaction();
 
   // for buffer only use absolutely necesary   -freeSpace -waste
-  size_t newSizeContent =
-      nextDataOffset() - 100 - numBuckets() * sizeof(uint64_t) - wasted();
-  auto newSize = 100 + tabSize * sizeof(uint64_t) + newSizeContent;
+  size_t newSizeContent = contentSize();
+  auto newSize = HeaderSize + tabSize * SlotSize + newSizeContent;
   bool isEnoughRam = newSize < (availableMemory() - 100000000) * 0.9;
 
   std::unique_ptr<std::byte[]> buffer2;
@@ -684,7 +900,7 @@ void KeyValueFile::changeTable(uint64_t tabSize, uint64_t contentSize) {
   // check if new failed - use disk
   if (!buffer2) {
     auto pth = tmpFilePath();
-    createFile(pth, tabSize, contentSize);
+    createFile(pth, tabSize, bodySize);
     {
       KeyValueFile tmp(pth);
       tmp.locked_ = true;
@@ -697,10 +913,10 @@ void KeyValueFile::changeTable(uint64_t tabSize, uint64_t contentSize) {
   }
 
   {
-    std::memset(buffer2.get(), 0, 100 + tabSize * sizeof(uint64_t));
+    std::memset(buffer2.get(), 0, HeaderSize + tabSize * SlotSize);
 
     uint64_t numWasted = 0;
-    uint64_t nextDataOffset2 = 100 + tabSize * sizeof(uint64_t);
+    uint64_t nextDataOffset2 = HeaderSize + tabSize * SlotSize;
     uint64_t numItems = 0;
 
     // version number must allways be in little endian format
@@ -732,14 +948,15 @@ void KeyValueFile::changeTable(uint64_t tabSize, uint64_t contentSize) {
     tmp.set(*this);
   }
 
-  file_.close();
-
-  auto newSize2 = 100 + tabSize * sizeof(uint64_t) + contentSize;
-  fs::resize_file(path_, newSize2);
+  // new file replaces old one at once, crash leaves one of them
+  auto pth = tmpFilePath();
+  { std::ofstream output(pth.string()); }
+  auto newSize2 = HeaderSize + tabSize * SlotSize + bodySize;
+  fs::resize_file(pth, newSize2);
 
   {
     boost::iostreams::mapped_file file;
-    file.open(path_);
+    file.open(pth);
     if (!file.is_open()) {
       throw std::runtime_error("Cant open file2");
     }
@@ -748,23 +965,57 @@ void KeyValueFile::changeTable(uint64_t tabSize, uint64_t contentSize) {
     file.close();
   }
 
+  file_.close();
+  fs::rename(pth, path_);
   openFile();
 }
 
 void KeyValueFile::clear() {
+  auto lock = lockCompaction();
+  abortCompaction();
   file_.close();
   createFile(path_);
   openFile();
 }
 
-const size_t primesDoubleForTabSize[] = {
-    101,       191,       359,       673,        1249,       2311,
-    4283,      7927,      14669,     27143,      50221,      92921,
-    171917,    318077,    588463,    1088657,    2014027,    3725951,
-    6893011,   12752071,  23591333,  43644023,   80741447,   149371709,
-    276337673, 511224709, 945765721, 1749666587, 3236883239, 5988234011};
-const size_t primesDoubleForTabSizeNum =
-    sizeof(primesDoubleForTabSize) / sizeof(size_t);
+bool KeyValueFile::compactStep(uint64_t minWasted, size_t maxBytes) {
+  auto lock = lockCompaction();
+  return compaction_->step(*this, minWasted, maxBytes);
+}
+
+void KeyValueFile::setCompactor(Compactor* compactor,
+                                std::shared_mutex* readersMutex) {
+  Compaction<KeyValueFile>::setCompactor(compaction_, *this, compactor,
+                                         readersMutex);
+}
+
+std::unique_ptr<KeyValueFile>
+KeyValueFile::createCompactTarget(const fs::path& pth) {
+  createFile(pth, findTabSizePrime(numItems() / 0.8), contentSize());
+  return std::unique_ptr<KeyValueFile>(new KeyValueFile(pth));
+}
+
+size_t KeyValueFile::copyBucketToCompacted(uint64_t bucket) {
+  size_t n = 0;
+  auto it = firstItem(bucket);
+  while (it.valid()) {
+    compaction_->target->set(it.key(), it.value());
+    n += it.calcSize();
+    it = it.next();
+  }
+  return n;
+}
+
+size_t KeyValueFile::copyToCompacted(std::string_view key) {
+  auto value = get(key);
+  if (value.data()) {
+    compaction_->target->set(key, value);
+  } else {
+    compaction_->target->remove(key);
+  }
+  return key.size() + value.size();
+}
+
 const size_t primesForTabSize[] = {
     101,        113,        127,        149,        167,        191,
     211,        233,        257,        283,        313,        347,
@@ -806,14 +1057,19 @@ inline size_t KeyValueFile::findTabSizePrime(size_t minNum) {
   }
   throw std::runtime_error("KeyValueFile findTabSizePrime() too big table");
 }
-inline size_t KeyValueFile::findTabSizePrimeDouble(size_t minNum) {
-  for (size_t i = 0; i < primesDoubleForTabSizeNum; ++i) {
-    if (primesDoubleForTabSize[i] > minNum) {
-      return primesDoubleForTabSize[i];
-    }
+// writes changed pages of mapped file to disk
+void KeyValueFile::flush() {
+  if (buffer_ || !file_.is_open()) {
+    return;
+  }
+#ifdef _WIN32
+  bool ok = FlushViewOfFile(file_.data(), 0) != 0;
+#else
+  bool ok = msync(file_.data(), file_.size(), MS_SYNC) == 0;
+#endif
+  if (!ok) {
+    throw std::runtime_error("Cant flush file");
   }
-  throw std::runtime_error(
-      "KeyValueFile findTabSizePrimeDouble() too big table");
 }
 
 uint64_t KeyValueFile::availableMemory() {
@@ -1,5 +1,7 @@
+#include <search/Compactor.hpp>
 #include <search/KeyValueFileList.hpp>
 
+#include <algorithm>
 #include <boost/endian/conversion.hpp>
 #include <city.h>
 #include <cstring>
@@ -12,6 +14,7 @@
 #ifdef _WIN32
 #include <windows.h>
 #else
+#include <sys/mman.h>
 #include <unistd.h>
 #endif
 
@@ -22,9 +25,13 @@ namespace Search {
 #define BulkReserve 1'000'000 // 1Mb
 
 const uint64_t KeyValueFileList::Version;
+const size_t KeyValueFileList::MaxBlockCapacity;
+const uint16_t KeyValueFileList::ItemBlock::BitmapFlag;
+const size_t KeyValueFileList::ItemBlock::BitmapSize;
 
 KeyValueFileList::KeyValueFileList(const fs::path& path)
-    : path_(path), locked_(false), buffer_(nullptr), importing_(nullptr) {
+    : path_(path), locked_(false), buffer_(nullptr), bufferSize_(0),
+      importing_(nullptr) {
   if (!path.empty()) {
     if (!fs::is_regular_file(path_)) {
       // create empty file
@@ -35,6 +42,9 @@ KeyValueFileList::KeyValueFileList(const fs::path& path)
 }
 
 KeyValueFileList::~KeyValueFileList() {
+  if (compaction_ && compaction_->compactor) {
+    compaction_->compactor->remove(*this);
+  }
   if (importing_) {
     delete importing_;
     importing_ = nullptr;
@@ -105,28 +115,26 @@ bool KeyValueFileList::isFileVersionOk(const fs::path& pth) {
   return ok;
 }
 
-void KeyValueFileList::set(const std::string& key, const Bytes& value) {
-  set(std::string_view(key), makeStringView(value));
-}
-
-void KeyValueFileList::set(std::string_view key, BytesView value) {
+void KeyValueFileList::set(std::string_view key, uint64_t value) {
+  auto lock = lockCompaction();
   ensureTableSize(1);
   auto bucket = calcBucket(key);
-  auto itemSize = ItemKey::calcSize(key) + ItemValue::calcSize(value);
-  ensureFreeSpace(itemSize);
+  ensureFreeSpace(maxInsertSize(key));
   setInternal(bucket, key, value);
+  markChanged(key);
   ensureOptimalWaste();
 }
 
 void KeyValueFileList::set(const KeyValueFileList& db2) {
+  auto lock = lockCompaction();
+  abortCompaction();
   ensureTableSize(db2.numKeys());
 
   auto num1 = numBuckets();
   auto num2 = db2.numBuckets();
+  std::vector<uint64_t> values;
   for (uint64_t i = 0; i < num2; ++i) {
     auto itKey = db2.firstKey(i);
-    ensureFreeSpace(itKey.calcSize());
-
     while (itKey.valid()) {
       uint64_t bucket;
       if (num1 == num2) {
@@ -135,12 +143,13 @@ void KeyValueFileList::set(const KeyValueFileList& db2) {
         bucket = calcBucket(itKey.key());
       }
 
-      auto itValue = itKey.value();
-      while (itValue.valid()) {
-        ensureFreeSpace(itValue.calcSize());
-        setInternal(bucket, itKey.key(), itValue.value());
-        itValue = itValue.next();
+      values.clear();
+      auto itBlock = itKey.block();
+      while (itBlock.valid()) {
+        itBlock.values(values);
+        itBlock = itBlock.next();
       }
+      setAllInternal(bucket, itKey.key(), values);
       itKey = itKey.next();
     }
   }
@@ -148,168 +157,466 @@ void KeyValueFileList::set(const KeyValueFileList& db2) {
   ensureOptimalWaste();
 }
 
-std::vector<BytesView> KeyValueFileList::get(std::string_view key) const {
+void KeyValueFileList::set(std::string_view key,
+                           const std::vector<uint64_t>& values) {
+  assert(std::is_sorted(values.begin(), values.end()));
+  auto lock = lockCompaction();
+  ensureTableSize(1);
+  setAllInternal(calcBucket(key), key, values);
+  markChanged(key);
+  ensureOptimalWaste();
+}
+
+std::vector<uint64_t> KeyValueFileList::get(std::string_view key) const {
   return getWithBucket(calcBucket(key), key);
 }
 
-std::vector<BytesView>
+std::vector<uint64_t>
 KeyValueFileList::getWithBucket(uint64_t bucket, std::string_view key) const {
-  auto itKey = firstKey(bucket);
-  while (itKey.valid()) {
-    if (itKey.key() == key) {
-      std::vector<BytesView> arr;
-      auto itValue = itKey.value();
-      while (itValue.valid()) {
-        arr.push_back(itValue.value());
-        itValue = itValue.next();
+  auto itKey = findKey(bucket, key).second;
+  if (!itKey.valid()) {
+    return {};
+  }
+  std::vector<uint64_t> arr;
+  auto itBlock = itKey.block();
+  while (itBlock.valid()) {
+    itBlock.values(arr);
+    itBlock = itBlock.next();
+  }
+  return arr;
+}
+
+std::vector<uint64_t> KeyValueFileList::getInRanges(
+    std::string_view key,
+    const std::vector<std::pair<uint64_t, uint64_t>>& ranges) const {
+  auto itKey = findKey(calcBucket(key), key).second;
+  if (!itKey.valid()) {
+    return {};
+  }
+  std::vector<uint64_t> arr;
+  std::vector<uint64_t> values;
+  size_t r = 0;
+  auto itBlock = itKey.block();
+  while (itBlock.valid() && r < ranges.size()) {
+    auto next = itBlock.next();
+    // skip block if all its values are before the range
+    if (next.valid() && next.firstValue() <= ranges[r].first) {
+      itBlock = next;
+      continue;
+    }
+    if (itBlock.isBitmap()) {
+      auto last = itBlock.bitmapBase() | 0xFFFF;
+      while (r < ranges.size() && ranges[r].first <= last) {
+        itBlock.bitmapValues(ranges[r].first, ranges[r].second, arr);
+        if (ranges[r].second > last) {
+          // range continues in next block
+          break;
+        }
+        r++;
       }
-      return arr;
+      itBlock = next;
+      continue;
     }
-    itKey = itKey.next();
+    values.clear();
+    itBlock.values(values);
+    for (auto value : values) {
+      while (r < ranges.size() && ranges[r].second < value) {
+        r++;
+      }
+      if (r == ranges.size()) {
+        break;
+      }
+      if (ranges[r].first <= value) {
+        arr.push_back(value);
+      }
+    }
+    itBlock = next;
+  }
+  return arr;
+}
+
+uint64_t KeyValueFileList::count(std::string_view key) const {
+  auto itKey = findKey(calcBucket(key), key).second;
+  if (!itKey.valid()) {
+    return 0;
   }
-  return {};
+  return itKey.numValues();
 }
 
-std::vector<BytesView> KeyValueFileList::get(const std::string& key2) const {
-  return get(std::string_view(key2));
+Bitmap KeyValueFileList::getBitmap(std::string_view key) const {
+  Bitmap res;
+  auto itKey = findKey(calcBucket(key), key).second;
+  if (!itKey.valid()) {
+    return res;
+  }
+  std::vector<uint64_t> values;
+  uint64_t words[Bitmap::ContainerWords];
+  for (auto itBlock = itKey.block(); itBlock.valid();
+       itBlock = itBlock.next()) {
+    if (itBlock.isBitmap()) {
+      for (size_t i = 0; i < Bitmap::ContainerWords; ++i) {
+        words[i] = itBlock.bitmapWord(i);
+      }
+      res.appendWords(itBlock.bitmapBase() >> 16, words);
+      continue;
+    }
+    values.clear();
+    itBlock.values(values);
+    for (auto value : values) {
+      res.add(value);
+    }
+  }
+  return res;
 }
 
-bool KeyValueFileList::exists(std::string_view key, BytesView value) const {
+bool KeyValueFileList::exists(std::string_view key, uint64_t value) const {
   return existsWithBucket(calcBucket(key), key, value);
 }
 
 bool KeyValueFileList::existsWithBucket(uint64_t bucket, std::string_view key,
-                                        BytesView value) const {
-  auto itKey = firstKey(bucket);
-  while (itKey.valid()) {
-    if (itKey.key() == key) {
-      auto itValue = itKey.value();
-      while (itValue.valid()) {
-        if (itValue.value() == value) {
-          return true;
-        }
-        itValue = itValue.next();
-      }
-      return false;
-    }
-    itKey = itKey.next();
+                                        uint64_t value) const {
+  auto itKey = findKey(bucket, key).second;
+  if (!itKey.valid()) {
+    return false;
   }
-  return false;
+  auto itBlock = findBlock(itKey, value).second;
+  if (itBlock.isBitmap()) {
+    return itBlock.inBitmap(value) && itBlock.bitmapTest(value);
+  }
+  std::vector<uint64_t> values;
+  itBlock.values(values);
+  return std::binary_search(values.begin(), values.end(), value);
 }
 
-void KeyValueFileList::remove(std::string_view key, BytesView value) {
+void KeyValueFileList::remove(std::string_view key, uint64_t value) {
+  auto lock = lockCompaction();
   auto bucket = calcBucket(key);
+  // removing first value in block can make it bigger
+  ensureFreeSpace(maxInsertSize(key));
   removeInternal(bucket, key, value);
+  markChanged(key);
   ensureOptimalWaste();
 }
 
-void KeyValueFileList::remove(const std::string& key2, const Bytes& value2) {
-  auto key = std::string_view(key2);
-  auto value = makeStringView(value2);
-  return remove(key, value);
+void KeyValueFileList::setInternal(uint64_t bucket, std::string_view key,
+                                   uint64_t value, size_t nthThread) {
+  auto itKey = findKey(bucket, key).second;
+  if (!itKey.valid()) {
+    // key doesnt exist
+    auto blockOffset = writeBlock(0, numBytesSize(value), &value, &value + 1,
+                                  nthThread);
+    auto keyOffset = allocate(ItemKey::calcSize(key), nthThread);
+    std::byte* dt = data() + keyOffset;
+    ItemKey::write(dt, tableOffset(bucket), key, blockOffset, 1);
+    setTableOffset(bucket, keyOffset);
+    changeNumKeys(1);
+    changeNumItems(1);
+    return;
+  }
+
+  auto added = [&]() {
+    itKey.setNumValues(itKey.numValues() + 1);
+    changeNumItems(1);
+  };
+
+  auto pair = findBlock(itKey, value);
+  auto prevBlockOffset = pair.first;
+  auto itBlock = pair.second;
+  if (!itBlock.isBitmap()) {
+    // value can be in range of next bitmap, before its first value
+    auto itNext = itBlock.next();
+    if (itNext.valid() && itNext.isBitmap() && itNext.inBitmap(value)) {
+      prevBlockOffset = itBlock.offset();
+      itBlock = itNext;
+    }
+  } else if (!itBlock.inBitmap(value)) {
+    if (value < itBlock.bitmapBase()) {
+      // before first block
+      auto offset = writeBlock(itBlock.offset(), numBytesSize(value), &value,
+                               &value + 1, nthThread);
+      itKey.setBlockOffset(offset);
+      added();
+      return;
+    }
+    // after bitmap, add to next block
+    auto itNext = itBlock.next();
+    if (!itNext.valid() || itNext.isBitmap()) {
+      auto offset = writeBlock(itBlock.nextOffset(), numBytesSize(value),
+                               &value, &value + 1, nthThread);
+      itBlock.setNextOffset(offset);
+      added();
+      return;
+    }
+    prevBlockOffset = itBlock.offset();
+    itBlock = itNext;
+  }
+
+  if (itBlock.isBitmap()) {
+    if (itBlock.bitmapTest(value)) {
+      // value exists
+      return;
+    }
+    itBlock.bitmapChange(value, true);
+    added();
+    return;
+  }
+
+  std::vector<uint64_t> values;
+  values.reserve(itBlock.numValues() + 1);
+  itBlock.values(values);
+  auto ptr = std::lower_bound(values.begin(), values.end(), value);
+  if (ptr != values.end() && *ptr == value) {
+    // value exists
+    return;
+  }
+  bool isAppend = ptr == values.end() && !itBlock.next().valid();
+  values.insert(ptr, value);
+  bool isSplit =
+      storeBlock(itKey, prevBlockOffset, itBlock, values, isAppend, nthThread);
+  added();
+  if (isSplit) {
+    convertToBitmap(itKey, value, nthThread);
+  }
 }
 
-void KeyValueFileList::setInternal(uint64_t bucket, std::string_view key,
-                                   BytesView value) {
-  uint64_t keyOffset = 0;
-  bool valueExists = false;
-  auto it = firstKey(bucket);
-  while (it.valid()) {
-    if (it.key() == key) {
-      keyOffset = it.offset();
-      auto it2 = it.value();
-      while (it2.valid()) {
-        if (it2.value() == value) {
-          valueExists = true;
-          break;
+void KeyValueFileList::removeInternal(uint64_t bucket, std::string_view key,
+                                      uint64_t value, size_t nthThread) {
+  // find key
+  auto pairKey = findKey(bucket, key);
+  auto itKey = pairKey.second;
+  if (!itKey.valid()) {
+    return;
+  }
+
+  // find value
+  auto pair = findBlock(itKey, value);
+  auto itBlock = pair.second;
+  std::vector<uint64_t> values;
+  if (itBlock.isBitmap()) {
+    if (!itBlock.inBitmap(value) || !itBlock.bitmapTest(value)) {
+      return;
+    }
+    itBlock.bitmapChange(value, false);
+    itKey.setNumValues(itKey.numValues() - 1);
+    changeNumItems(-1);
+
+    auto num = itBlock.numValues();
+    if (num > 0) {
+      // sparse bitmap is stored as list again
+      if (num <= ItemBlock::BitmapSize / 2) {
+        itBlock.values(values);
+        if (ItemBlock::calcValuesSize(values.data(),
+                                      values.data() + values.size()) <=
+            ItemBlock::BitmapSize / 2) {
+          convertFromBitmap(itKey, pair.first, itBlock, values, nthThread);
         }
-        it2 = it2.next();
       }
-      break;
+      return;
+    }
+  } else {
+    values.reserve(itBlock.numValues());
+    itBlock.values(values);
+    auto ptr = std::lower_bound(values.begin(), values.end(), value);
+    if (ptr == values.end() || *ptr != value) {
+      return;
+    }
+    values.erase(ptr);
+    itKey.setNumValues(itKey.numValues() - 1);
+    changeNumItems(-1);
+
+    if (!values.empty()) {
+      storeBlock(itKey, pair.first, itBlock, values, false, nthThread);
+      return;
     }
-    it = it.next();
-  }
-  if (valueExists) {
-    return;
   }
 
-  uint64_t nextValueOffset = keyOffset != 0 ? it.valueOffset() : 0;
+  // remove block
+  unlinkBlock(itKey, pair.first, itBlock);
 
-  // add value
-  auto valueOffset = nextDataOffset();
-  auto dt = data() + valueOffset;
-  ItemValue::write(dt, nextValueOffset, value);
-  setNextDataOffset(dt - data());
-  setNumItems(numItems() + 1);
+  // does key have any more values?
+  if (itKey.block().valid()) {
+    return;
+  }
 
-  if (keyOffset != 0) {
-    // key exists
-    it.setValueOffset(valueOffset);
+  // remove key
+  if (pairKey.first == 0) {
+    setTableOffset(bucket, itKey.nextOffset());
   } else {
-    // key doesnt exist
-    keyOffset = nextDataOffset();
-    dt = data() + keyOffset;
-    ItemKey::write(dt, tableOffset(bucket), key, valueOffset);
-    setNextDataOffset(dt - data());
-    setNumKeys(numKeys() + 1);
-    setTableOffset(bucket, keyOffset);
+    ItemKey it2(data(), pairKey.first);
+    it2.setNextOffset(itKey.nextOffset());
   }
+  addWasted(itKey.calcSize());
+  changeNumKeys(-1);
 }
 
-void KeyValueFileList::removeInternal(uint64_t bucket, std::string_view key,
-                                      BytesView value) {
-  // find key
-  size_t prevKeyOffset = 0;
-  auto itKey = firstKey(bucket);
-  for (;;) {
-    if (!itKey.valid()) {
+void KeyValueFileList::setAllInternal(uint64_t bucket, std::string_view key,
+                                      const std::vector<uint64_t>& values) {
+  if (values.empty()) {
+    return;
+  }
+  if (findKey(bucket, key).second.valid()) {
+    for (auto value : values) {
+      ensureFreeSpace(maxInsertSize(key));
+      setInternal(bucket, key, value);
+    }
+    return;
+  }
+
+  auto plans = planBlocks(values.data(), values.data() + values.size());
+  ensureFreeSpace(ItemKey::calcSize(key) + calcBlocksSize(plans));
+  auto blockOffset = writeBlocks(values.data(), plans, 0, 0);
+
+  auto keyOffset = allocate(ItemKey::calcSize(key), 0);
+  std::byte* dt = data() + keyOffset;
+  ItemKey::write(dt, tableOffset(bucket), key, blockOffset, values.size());
+  setTableOffset(bucket, keyOffset);
+  changeNumKeys(1);
+  changeNumItems(values.size());
+}
+
+std::vector<KeyValueFileList::BlockPlan>
+KeyValueFileList::planBlocks(const uint64_t* begin, const uint64_t* end) {
+  std::vector<BlockPlan> plans;
+
+  // split into full blocks
+  auto addList = [&](const uint64_t* first, const uint64_t* last) {
+    if (first == last) {
       return;
     }
-    if (itKey.key() == key) {
-      break;
+    size_t start = first - begin;
+    size_t capacity = 0;
+    uint64_t prev = 0;
+    for (auto it = first; it != last; ++it) {
+      size_t i = it - begin;
+      auto s = numBytesSize(*it - (i == start ? 0 : prev));
+      if (capacity + s > MaxBlockCapacity) {
+        plans.push_back({start, i, capacity, false});
+        start = i;
+        capacity = numBytesSize(*it);
+      } else {
+        capacity += s;
+      }
+      prev = *it;
     }
-    prevKeyOffset = itKey.offset();
-    itKey = itKey.next();
+    plans.push_back({start, (size_t)(last - begin), capacity, false});
+  };
+
+  // dense ranges of 2^16 values become bitmaps
+  auto listStart = begin;
+  for (auto it = begin; it != end;) {
+    auto rangeEnd = std::upper_bound(it, end, *it | 0xFFFF);
+    // difference in range takes at most 4 bytes
+    if ((size_t)(rangeEnd - it) > ItemBlock::BitmapSize / 4 &&
+        ItemBlock::calcValuesSize(it, rangeEnd) > ItemBlock::BitmapSize) {
+      addList(listStart, it);
+      plans.push_back({(size_t)(it - begin), (size_t)(rangeEnd - begin),
+                       ItemBlock::BitmapSize, true});
+      listStart = rangeEnd;
+    }
+    it = rangeEnd;
   }
+  addList(listStart, end);
+  return plans;
+}
 
-  // find value
-  auto prevValueOffset = 0;
-  auto itValue = itKey.value();
-  for (;;) {
-    if (!itValue.valid()) {
-      return;
+size_t KeyValueFileList::calcBlocksSize(const std::vector<BlockPlan>& plans) {
+  size_t s = 0;
+  for (const auto& plan : plans) {
+    s += ItemBlock::calcSize(plan.capacity);
+  }
+  return s;
+}
+
+uint64_t KeyValueFileList::writeBlocks(const uint64_t* values,
+                                       const std::vector<BlockPlan>& plans,
+                                       uint64_t nextOffset, size_t nthThread) {
+  // write from last to first, so that each block knows its next
+  for (size_t i = plans.size(); i > 0; --i) {
+    const auto& plan = plans[i - 1];
+    if (plan.isBitmap) {
+      auto offset =
+          allocate(ItemBlock::calcSize(ItemBlock::BitmapSize), nthThread);
+      std::byte* dt = data() + offset;
+      ItemBlock::writeBitmap(dt, nextOffset, values + plan.begin,
+                             values + plan.end);
+      nextOffset = offset;
+    } else {
+      nextOffset = writeBlock(nextOffset, plan.capacity, values + plan.begin,
+                              values + plan.end, nthThread);
     }
-    if (itValue.value() == value) {
+  }
+  return nextOffset;
+}
+
+void KeyValueFileList::convertToBitmap(ItemKey& itKey, uint64_t value,
+                                       size_t nthThread) {
+  uint64_t first = value & ~(uint64_t)0xFFFF;
+  uint64_t last = value | 0xFFFF;
+
+  // first block which can have values from range
+  uint64_t prevOffset = 0;
+  auto itBlock = itKey.block();
+  for (;;) {
+    auto itNext = itBlock.next();
+    if (!itNext.valid() || itNext.firstValue() > first) {
       break;
     }
-    prevValueOffset = itValue.offset();
-    itValue = itValue.next();
+    prevOffset = itBlock.offset();
+    itBlock = itNext;
   }
 
-  // remove value
-  if (prevValueOffset != 0) {
-    ItemValue itPrev(data(), prevValueOffset);
-    itPrev.setNextOffset(itValue.nextOffset());
-  } else {
-    itKey.setValueOffset(itValue.nextOffset());
+  // are there enough values to fill bitmap
+  std::vector<ItemBlock> blocks;
+  size_t used = 0;
+  for (auto it = itBlock; it.valid() && it.firstValue() <= last;
+       it = it.next()) {
+    if (it.isBitmap()) {
+      return;
+    }
+    blocks.push_back(it);
+    used += it.used();
+  }
+  if (used <= ItemBlock::BitmapSize) {
+    return;
   }
-  setWasted(wasted() + itValue.calcSize());
-  setNumItems(numItems() - 1);
 
-  // does key have any more values?
-  if (itKey.value().valid()) {
+  std::vector<uint64_t> values;
+  for (const auto& it : blocks) {
+    it.values(values);
+  }
+  auto plans = planBlocks(values.data(), values.data() + values.size());
+  if (std::none_of(plans.begin(), plans.end(),
+                   [](const BlockPlan& p) { return p.isBitmap; })) {
     return;
   }
+  auto offset = writeBlocks(values.data(), plans, blocks.back().nextOffset(),
+                            nthThread);
+  if (prevOffset == 0) {
+    itKey.setBlockOffset(offset);
+  } else {
+    ItemBlock itPrev(data(), prevOffset);
+    itPrev.setNextOffset(offset);
+  }
+  for (const auto& it : blocks) {
+    addWasted(it.calcSize());
+  }
+}
 
-  // remove key
-  if (prevKeyOffset == 0) {
-    setTableOffset(bucket, itKey.nextOffset());
+void KeyValueFileList::convertFromBitmap(ItemKey& itKey,
+                                         uint64_t prevBlockOffset,
+                                         const ItemBlock& itBlock,
+                                         const std::vector<uint64_t>& values,
+                                         size_t nthThread) {
+  auto plans = planBlocks(values.data(), values.data() + values.size());
+  auto offset =
+      writeBlocks(values.data(), plans, itBlock.nextOffset(), nthThread);
+  if (prevBlockOffset == 0) {
+    itKey.setBlockOffset(offset);
   } else {
-    ItemKey it2(data(), prevKeyOffset);
-    it2.setNextOffset(itKey.nextOffset());
+    ItemBlock itPrev(data(), prevBlockOffset);
+    itPrev.setNextOffset(offset);
   }
-  setWasted(wasted() + itKey.calcSize());
-  setNumKeys(numKeys() - 1);
+  addWasted(itBlock.calcSize());
 }
 
 KeyValueFileList::ItemKey KeyValueFileList::firstKey(uint64_t bucket) const {
@@ -318,54 +625,180 @@ KeyValueFileList::ItemKey KeyValueFileList::firstKey(uint64_t bucket) const {
   return ItemKey(data(), offset);
 }
 
+std::pair<uint64_t, KeyValueFileList::ItemKey>
+KeyValueFileList::findKey(uint64_t bucket, std::string_view key) const {
+  uint64_t prevOffset = 0;
+  auto itKey = firstKey(bucket);
+  while (itKey.valid()) {
+    if (itKey.key() == key) {
+      return {prevOffset, itKey};
+    }
+    prevOffset = itKey.offset();
+    itKey = itKey.next();
+  }
+  return {0, ItemKey()};
+}
+
+std::pair<uint64_t, KeyValueFileList::ItemBlock>
+KeyValueFileList::findBlock(const ItemKey& itKey, uint64_t value) const {
+  // last block whose first value is not bigger than value
+  uint64_t prevOffset = 0;
+  auto itBlock = itKey.block();
+  for (;;) {
+    auto itNext = itBlock.next();
+    if (!itNext.valid() || itNext.firstValue() > value) {
+      return {prevOffset, itBlock};
+    }
+    prevOffset = itBlock.offset();
+    itBlock = itNext;
+  }
+}
+
+bool KeyValueFileList::storeBlock(ItemKey& itKey, uint64_t prevBlockOffset,
+                                  ItemBlock itBlock,
+                                  const std::vector<uint64_t>& values,
+                                  bool isAppend, size_t nthThread) {
+  const uint64_t* begin = values.data();
+  const uint64_t* end = values.data() + values.size();
+  if (itBlock.setValues(begin, end)) {
+    return false;
+  }
+
+  auto size = ItemBlock::calcValuesSize(begin, end);
+  uint64_t newOffset;
+  bool isSplit = size > MaxBlockCapacity;
+  if (!isSplit) {
+    // move to bigger block
+    size_t capacity = std::max<size_t>(itBlock.capacity() * 2, size);
+    capacity = std::min<size_t>(capacity, MaxBlockCapacity);
+    newOffset =
+        writeBlock(itBlock.nextOffset(), capacity, begin, end, nthThread);
+    addWasted(itBlock.calcSize());
+  } else {
+    // split in half, appended value gets its own block so that full blocks
+    // stay full
+    auto middle = isAppend ? end - 1 : begin + values.size() / 2;
+    size_t capacity = std::max<size_t>(
+        MaxBlockCapacity, ItemBlock::calcValuesSize(middle, end));
+    auto secondOffset =
+        writeBlock(itBlock.nextOffset(), capacity, middle, end, nthThread);
+    if (itBlock.setValues(begin, middle)) {
+      itBlock.setNextOffset(secondOffset);
+      return true;
+    }
+    capacity = std::max<size_t>(MaxBlockCapacity,
+                                ItemBlock::calcValuesSize(begin, middle));
+    newOffset = writeBlock(secondOffset, capacity, begin, middle, nthThread);
+    addWasted(itBlock.calcSize());
+  }
+
+  // link
+  if (prevBlockOffset == 0) {
+    itKey.setBlockOffset(newOffset);
+  } else {
+    ItemBlock itPrev(data(), prevBlockOffset);
+    itPrev.setNextOffset(newOffset);
+  }
+  return isSplit;
+}
+
+uint64_t KeyValueFileList::writeBlock(uint64_t nextOffset, size_t capacity,
+                                      const uint64_t* begin,
+                                      const uint64_t* end, size_t nthThread) {
+  auto offset = allocate(ItemBlock::calcSize(capacity), nthThread);
+  std::byte* dt = data() + offset;
+  ItemBlock::write(dt, nextOffset, capacity, begin, end);
+  return offset;
+}
+
+void KeyValueFileList::unlinkBlock(ItemKey& itKey, uint64_t prevBlockOffset,
+                                   const ItemBlock& itBlock) {
+  if (prevBlockOffset == 0) {
+    itKey.setBlockOffset(itBlock.nextOffset());
+  } else {
+    ItemBlock itPrev(data(), prevBlockOffset);
+    itPrev.setNextOffset(itBlock.nextOffset());
+  }
+  addWasted(itBlock.calcSize());
+}
+
+uint64_t KeyValueFileList::allocate(size_t size, size_t nthThread) {
+  if (importing_) {
+    // caller ensured there is enough space in range
+    auto& range = importing_->dataRange[nthThread];
+    assert(range.first + size <= range.second);
+    auto offset = range.first;
+    range.first += size;
+    return offset;
+  }
+  auto offset = nextDataOffset();
+  setNextDataOffset(offset + size);
+  return offset;
+}
+
+size_t KeyValueFileList::maxInsertSize(std::string_view key) {
+  // new key or block split followed by conversion to bitmap
+  return ItemKey::calcSize(key) +
+         4 * ItemBlock::calcSize(MaxBlockCapacity + sizeof(uint64_t)) +
+         ItemBlock::calcSize(ItemBlock::BitmapSize);
+}
+
+void KeyValueFileList::changeNumItems(int64_t diff) {
+  if (importing_) {
+    importing_->numItems += diff;
+  } else {
+    setNumItems(numItems() + diff);
+  }
+}
+
+void KeyValueFileList::changeNumKeys(int64_t diff) {
+  if (importing_) {
+    importing_->numKeys += diff;
+  } else {
+    setNumKeys(numKeys() + diff);
+  }
+}
+
+void KeyValueFileList::addWasted(uint64_t w) {
+  if (importing_) {
+    importing_->wasted += w;
+  } else {
+    setWasted(wasted() + w);
+  }
+}
+
 void KeyValueFileList::bulkWrite(std::ofstream& out, std::string_view key,
-                                 BytesView value) {
+                                 uint64_t value) {
   uint64_t hash = calcHash(key);
   out.write((const char*)&hash, sizeof(hash));
 
-  // key len
-  auto len = ItemKey::calcSize(key);
-  auto len2 = writeSizeString(len);
-  out.write((const char*)len2.data(), len2.size());
-
   // key
-  Bytes buff(len, (std::byte)'\0');
-  std::byte* buff2 = &buff[0];
-  ItemKey::write(buff2, 0, key, 0);
-  out.write((const char*)buff.data(), buff.size());
-
-  // value len
-  len = ItemValue::calcSize(value);
-  len2 = writeSizeString(len);
-  out.write((const char*)len2.data(), len2.size());
+  auto len = writeSizeString(key.size());
+  out.write((const char*)len.data(), len.size());
+  out.write(key.data(), key.size());
 
   // value
-  buff = Bytes(len, (std::byte)'\0');
-  buff2 = &buff[0];
-  ItemValue::write(buff2, 0, value);
-  out.write((const char*)buff.data(), buff.size());
+  auto value2 = writeSizeString(value);
+  out.write((const char*)value2.data(), value2.size());
 }
 
-std::tuple<uint64_t, std::string_view, BytesView>
+std::tuple<uint64_t, std::string_view, uint64_t>
 KeyValueFileList::bulkRead(const std::byte*& dt) {
   uint64_t hash;
   std::memcpy(&hash, dt, sizeof(hash));
   dt += sizeof(hash);
 
   auto len = readSize(dt);
-  std::byte* dt2 = (std::byte*)dt;
-  ItemKey itKey(dt2, 0);
-  dt += len;
-
-  len = readSize(dt);
-  dt2 = (std::byte*)dt;
-  ItemValue itValue(dt2, 0);
+  std::string_view key((const char*)dt, len);
   dt += len;
 
-  return {hash, itKey.key(), itValue.value()};
+  auto value = readSize(dt);
+  return {hash, key, value};
 }
 
 void KeyValueFileList::bulkStart(size_t numThreads) {
+  auto lock = lockCompaction();
+  abortCompaction();
   assert(!importing_);
   std::unique_ptr<ImportingData> dt(new ImportingData());
   dt->numItems = numItems();
@@ -428,9 +861,9 @@ void KeyValueFileList::bulkInsertEnlarge(size_t nthThread, size_t numThreads) {
 }
 
 void KeyValueFileList::bulkInsert(uint64_t bucket, std::string_view key,
-                                  BytesView value, size_t nthThread,
+                                  uint64_t value, size_t nthThread,
                                   size_t numThreads) {
-  auto itemSize = ItemKey::calcSize(key) + ItemValue::calcSize(value);
+  auto itemSize = maxInsertSize(key);
   if (itemSize > BulkReserve) {
     throw std::runtime_error("Too big");
   }
@@ -441,101 +874,21 @@ void KeyValueFileList::bulkInsert(uint64_t bucket, std::string_view key,
     bulkInsertEnlarge(nthThread, numThreads);
   }
 
-  uint64_t keyOffset = 0;
-  bool valueExists = false;
-  auto it = firstKey(bucket);
-  while (it.valid()) {
-    if (it.key() == key) {
-      keyOffset = it.offset();
-
-      break;
-    }
-    it = it.next();
-  }
-  if (valueExists) {
-    return;
-  }
-
-  uint64_t nextValueOffset = keyOffset != 0 ? it.valueOffset() : 0;
-
-  // add value
-  auto valueOffset = importing_->dataRange[nthThread].first;
-  auto dt = data() + valueOffset;
-  ItemValue::write(dt, nextValueOffset, value);
-  importing_->dataRange[nthThread].first += dt - data() - valueOffset;
-  importing_->numItems++;
-
-  if (keyOffset != 0) {
-    // key exists
-    it.setValueOffset(valueOffset);
-  } else {
-    // key doesnt exist
-    keyOffset = importing_->dataRange[nthThread].first;
-    dt = data() + keyOffset;
-    ItemKey::write(dt, tableOffset(bucket), key, valueOffset);
-    importing_->dataRange[nthThread].first += dt - data() - keyOffset;
-    importing_->numKeys++;
-    setTableOffset(bucket, keyOffset);
-  }
+  setInternal(bucket, key, value, nthThread);
 }
 
 void KeyValueFileList::bulkRemove(uint64_t bucket, std::string_view key,
-                                  BytesView value, size_t nthThread,
+                                  uint64_t value, size_t nthThread,
                                   size_t numThreads) {
-  std::lock_guard lock1(importing_->mutex_);
-
-  // find key
-  size_t prevKeyOffset = 0;
-  auto itKey = firstKey(bucket);
-  for (;;) {
-    if (!itKey.valid()) {
-      return;
-    }
-    if (itKey.key() == key) {
-      break;
-    }
-    prevKeyOffset = itKey.offset();
-    itKey = itKey.next();
-  }
-
-  // find value
-  auto prevValueOffset = 0;
-  auto itValue = itKey.value();
-  for (;;) {
-    if (!itValue.valid()) {
-      return;
-    }
-    if (itValue.value() == value) {
-      break;
-    }
-    prevValueOffset = itValue.offset();
-    itValue = itValue.next();
-  }
-
-  // remove value
-  if (prevValueOffset != 0) {
-    ItemValue itPrev(data(), prevValueOffset);
-    itPrev.setNextOffset(itValue.nextOffset());
-  } else {
-    itKey.setValueOffset(itValue.nextOffset());
-  }
-  importing_->wasted += itValue.calcSize();
-  importing_->numItems--;
+  auto itemSize = maxInsertSize(key);
 
-  // does key have any more values?
-  if (itKey.value().valid()) {
-    return;
+  std::lock_guard lock1(importing_->mutex_);
+  if (itemSize > importing_->dataRange[nthThread].second -
+                     importing_->dataRange[nthThread].first) {
+    bulkInsertEnlarge(nthThread, numThreads);
   }
 
-  // remove key
-  if (prevKeyOffset == 0) {
-    setTableOffset(bucket, itKey.nextOffset());
-  } else {
-    ItemKey it2(data(), prevKeyOffset);
-    it2.setNextOffset(itKey.nextOffset());
-  }
-  importing_->wasted += itKey.calcSize();
-  importing_->numKeys--;
+  removeInternal(bucket, key, value, nthThread);
 }
 
 bool KeyValueFileList::bulkIsInThread(uint64_t bucket, size_t nthThread,
@@ -644,6 +997,8 @@ void KeyValueFileList::setWasted(uint64_t w) {
 }
 
 void KeyValueFileList::optimize() {
+  auto lock = lockCompaction();
+  abortCompaction();
   locked_ = false;
 
   double fact = (double)numKeys() / (double)numBuckets();
@@ -670,6 +1025,8 @@ void KeyValueFileList::optimize() {
 }
 
 void KeyValueFileList::lockTableForNumKeys(uint64_t n) {
+  auto lock = lockCompaction();
+  abortCompaction();
   locked_ = true;
 
   double fact = (double)n / (double)numBuckets();
@@ -682,22 +1039,33 @@ void KeyValueFileList::lockTableForNumKeys(uint64_t n) {
   uint64_t contentSize =
       file_.size() - 100 - numBuckets() * sizeof(uint64_t) - wasted();
   changeTable(tabSize, contentSize);
+  // rebuilt table has no wasted space
+  if (importing_) {
+    importing_->numItems = numItems();
+    importing_->numKeys = numKeys();
+    importing_->wasted = wasted();
+  }
 }
 
 void KeyValueFileList::unlockTable() { locked_ = false; }
 
-std::vector<std::pair<std::string_view, BytesView>>
+std::vector<std::pair<std::string_view, uint64_t>>
 KeyValueFileList::allDocuments() const {
-  std::vector<std::pair<std::string_view, BytesView>> arr;
+  std::vector<std::pair<std::string_view, uint64_t>> arr;
   arr.reserve(numItems());
+  std::vector<uint64_t> values;
   auto numB = numBuckets();
   for (uint64_t i = 0; i < numB; ++i) {
     auto itKey = firstKey(i);
     while (itKey.valid()) {
-      auto itValue = itKey.value();
-      while (itValue.valid()) {
-        arr.push_back({itKey.key(), itValue.value()});
-        itValue = itValue.next();
+      values.clear();
+      auto itBlock = itKey.block();
+      while (itBlock.valid()) {
+        itBlock.values(values);
+        itBlock = itBlock.next();
+      }
+      for (auto value : values) {
+        arr.push_back({itKey.key(), value});
       }
       itKey = itKey.next();
     }
@@ -705,8 +1073,25 @@ KeyValueFileList::allDocuments() const {
   return arr;
 }
 
+std::vector<std::string_view> KeyValueFileList::allKeys() const {
+  std::vector<std::string_view> arr;
+  arr.reserve(numKeys());
+  auto numB = numBuckets();
+  for (uint64_t i = 0; i < numB; ++i) {
+    auto itKey = firstKey(i);
+    while (itKey.valid()) {
+      arr.push_back(itKey.key());
+      itKey = itKey.next();
+    }
+  }
+  return arr;
+}
+
 void KeyValueFileList::ensureFreeSpace(size_t additional) {
   if (buffer_) {
+    if (nextDataOffset() + additional > bufferSize_) {
+      throw std::runtime_error("KeyValueFileList buffer too small");
+    }
     return;
   }
 
@@ -732,7 +1117,8 @@ void KeyValueFileList::ensureFreeSpace(size_t additional) {
 }
 
 void KeyValueFileList::ensureTableSize(int64_t additional) {
-  if (locked_) {
+  // buckets are copied in order while compacting
+  if (locked_ || (compaction_ && compaction_->target)) {
     return;
   }
 
@@ -763,7 +1149,8 @@ void KeyValueFileList::ensureTableSize(int64_t additional) {
 }
 
 void KeyValueFileList::ensureOptimalWaste() {
-  if (locked_) {
+  // with compactor space is reclaimed in background
+  if (locked_ || compaction_) {
     return;
   }
   if (wasted() < 30'000'000) {
@@ -801,10 +1188,13 @@ void KeyValueFileList::changeTable(uint64_t tabSize, uint64_t contentSize) {
   if (buffer_) {
     throw std::runtime_error("cant change table when using buffer");
   }
+  abortCompaction();
 
   // for buffer only use absolutely necesary   -freeSpace -waste
-  size_t newSizeContent =
-      nextDataOffset() - 100 - numBuckets() * sizeof(uint64_t) - wasted();
+  // blocks are repacked, each key can start with one whole value more
+  size_t newSizeContent = nextDataOffset() - 100 -
+                          numBuckets() * sizeof(uint64_t) - wasted() +
+                          numKeys() * sizeof(uint64_t);
   auto newSize = 100 + tabSize * sizeof(uint64_t) + newSizeContent;
   bool isEnoughRam = newSize < (availableMemory() - 100000000) * 0.9;
 
@@ -862,17 +1252,20 @@ void KeyValueFileList::changeTable(uint64_t tabSize, uint64_t contentSize) {
     KeyValueFileList tmp(p2);
     tmp.locked_ = true;
     tmp.buffer_ = buffer2.get();
+    tmp.bufferSize_ = newSize;
     tmp.set(*this);
+    newSize = tmp.nextDataOffset();
   }
 
-  file_.close();
-
+  // new file replaces old one at once, crash leaves one of them
+  auto pth = tmpFilePath();
+  { std::ofstream output(pth.string()); }
   auto newSize2 = 100 + tabSize * sizeof(uint64_t) + contentSize;
-  fs::resize_file(path_, newSize2);
+  fs::resize_file(pth, std::max<size_t>(newSize2, newSize));
 
   {
     boost::iostreams::mapped_file file;
-    file.open(path_);
+    file.open(pth);
     if (!file.is_open()) {
       throw std::runtime_error("Cant open file2");
     }
@@ -881,15 +1274,83 @@ void KeyValueFileList::changeTable(uint64_t tabSize, uint64_t contentSize) {
     file.close();
   }
 
+  file_.close();
+  fs::rename(pth, path_);
   openFile();
 }
 
 void KeyValueFileList::clear() {
+  auto lock = lockCompaction();
+  abortCompaction();
   file_.close();
   createFile(path_);
   openFile();
 }
 
+bool KeyValueFileList::compactStep(uint64_t minWasted, size_t maxBytes) {
+  auto lock = lockCompaction();
+  return compaction_->step(*this, minWasted, maxBytes);
+}
+
+void KeyValueFileList::setCompactor(Compactor* compactor,
+                                    std::shared_mutex* readersMutex) {
+  Compaction<KeyValueFileList>::setCompactor(compaction_, *this, compactor,
+                                             readersMutex);
+}
+
+std::unique_ptr<KeyValueFileList>
+KeyValueFileList::createCompactTarget(const fs::path& pth) {
+  uint64_t contentSize = nextDataOffset() - 100 -
+                         numBuckets() * sizeof(uint64_t) - wasted() +
+                         numKeys() * sizeof(uint64_t);
+  createFile(pth, findTabSizePrime(numKeys() / 0.8), contentSize);
+  return std::unique_ptr<KeyValueFileList>(new KeyValueFileList(pth));
+}
+
+size_t KeyValueFileList::copyBucketToCompacted(uint64_t bucket) {
+  size_t n = 0;
+  std::vector<uint64_t> values;
+  auto itKey = firstKey(bucket);
+  while (itKey.valid()) {
+    values.clear();
+    auto itBlock = itKey.block();
+    while (itBlock.valid()) {
+      itBlock.values(values);
+      itBlock = itBlock.next();
+    }
+    compaction_->target->set(itKey.key(), values);
+    n += itKey.key().size() + values.size() * sizeof(uint64_t);
+    itKey = itKey.next();
+  }
+  return n;
+}
+
+// values in compacted file are changed to current ones
+size_t KeyValueFileList::copyToCompacted(std::string_view key) {
+  auto& target = *compaction_->target;
+  auto values = get(key);
+  auto old = target.get(key);
+  if (old.empty()) {
+    if (!values.empty()) {
+      target.set(key, values);
+    }
+    return key.size() + values.size() * sizeof(uint64_t);
+  }
+  std::vector<uint64_t> diff;
+  std::set_difference(old.begin(), old.end(), values.begin(), values.end(),
+                      std::back_inserter(diff));
+  for (auto value : diff) {
+    target.remove(key, value);
+  }
+  diff.clear();
+  std::set_difference(values.begin(), values.end(), old.begin(), old.end(),
+                      std::back_inserter(diff));
+  for (auto value : diff) {
+    target.set(key, value);
+  }
+  return key.size() + values.size() * sizeof(uint64_t);
+}
+
 const size_t primesDoubleForTabSize[] = {
     101,       191,       359,       673,        1249,       2311,
     4283,      7927,      14669,     27143,      50221,      92921,
@@ -949,6 +1410,21 @@ inline size_t KeyValueFileList::findTabSizePrimeDouble(size_t minNum) {
       "KeyValueFileList findTabSizePrimeDouble() too big table");
 }
 
+// writes changed pages of mapped file to disk
+void KeyValueFileList::flush() {
+  if (buffer_ || !file_.is_open()) {
+    return;
+  }
+#ifdef _WIN32
+  bool ok = FlushViewOfFile(file_.data(), 0) != 0;
+#else
+  bool ok = msync(file_.data(), file_.size(), MS_SYNC) == 0;
+#endif
+  if (!ok) {
+    throw std::runtime_error("Cant flush file");
+  }
+}
+
 uint64_t KeyValueFileList::availableMemory() {
   static uint64_t mem = 0;
   if (mem == 0) {
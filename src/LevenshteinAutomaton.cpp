@@ -0,0 +1,113 @@
+#include <search/LevenshteinAutomaton.hpp>
+
+#include <search/Tokenize.hpp>
+
+#include <algorithm>
+
+namespace Search {
+
+LevenshteinAutomaton::LevenshteinAutomaton(std::string_view token,
+                                           uint8_t maxDistance,
+                                           size_t prefixLen)
+    : maxDistance_(maxDistance) {
+  std::vector<size_t> ends;
+  decode(token, token_, &ends);
+  if (prefixLen > 0 && !ends.empty()) {
+    prefix_ = token.substr(0, ends[std::min(prefixLen, ends.size()) - 1]);
+  }
+}
+
+void LevenshteinAutomaton::decode(std::string_view txt,
+                                  std::vector<uint32_t>& chars,
+                                  std::vector<size_t>* ends) {
+  chars.clear();
+  for (size_t i = 0; i < txt.size();) {
+    size_t l = std::min<size_t>(std::max<uint8_t>(charLen(txt[i]), 1),
+                                txt.size() - i);
+    uint32_t ch = 0;
+    for (size_t k = 0; k < l; ++k) {
+      ch = (ch << 8) | (uint8_t)txt[i + k];
+    }
+    chars.push_back(ch);
+    i += l;
+    if (ends) {
+      ends->push_back(i);
+    }
+  }
+}
+
+std::vector<std::pair<std::string, uint8_t>>
+LevenshteinAutomaton::find(const TSeek& seek) const {
+  std::vector<std::pair<std::string, uint8_t>> res;
+  size_t n = token_.size();
+  // distances bigger than max are same
+  uint8_t over = maxDistance_ + 1;
+  // row of each character of token in dictionary, one after another
+  std::vector<uint8_t> rows;
+  for (size_t j = 0; j <= n; ++j) {
+    rows.push_back((uint8_t)std::min<size_t>(j, over));
+  }
+  std::vector<uint32_t> done;
+  std::vector<uint32_t> chars;
+  std::vector<size_t> ends;
+
+  std::string key = prefix_;
+  std::string token;
+  while (seek(key, token)) {
+    if (token.compare(0, prefix_.size(), prefix_) != 0) {
+      break;
+    }
+    ends.clear();
+    decode(token, chars, &ends);
+
+    // rows of shared characters are same
+    size_t same = 0;
+    while (same < done.size() && same < chars.size() &&
+           done[same] == chars[same]) {
+      same++;
+    }
+    done.resize(same);
+    rows.resize((same + 1) * (n + 1));
+
+    bool skip = false;
+    for (size_t d = same; d < chars.size(); ++d) {
+      rows.resize(rows.size() + n + 1, over);
+      const uint8_t* prev = &rows[d * (n + 1)];
+      uint8_t* row = &rows[(d + 1) * (n + 1)];
+      row[0] = (uint8_t)std::min<size_t>(d + 1, over);
+      uint8_t best = row[0];
+      // only diagonal band can be within distance
+      size_t lo = d + 1 > maxDistance_ ? d + 1 - maxDistance_ : 1;
+      size_t hi = std::min(n, d + 1 + maxDistance_);
+      for (size_t j = lo; j <= hi; ++j) {
+        uint8_t x = prev[j - 1] + (token_[j - 1] == chars[d] ? 0 : 1);
+        x = std::min<uint8_t>(x, prev[j] + 1);
+        x = std::min<uint8_t>(x, row[j - 1] + 1);
+        row[j] = std::min(x, over);
+        best = std::min(best, row[j]);
+      }
+      done.push_back(chars[d]);
+      if (best == over) {
+        // after all tokens with these characters, bytes of utf8 are never
+        // 0xFF
+        key = token.substr(0, ends[d]);
+        key.back() = (char)((uint8_t)key.back() + 1);
+        skip = true;
+        break;
+      }
+    }
+    if (skip) {
+      continue;
+    }
+    uint8_t dist = rows.back();
+    if (dist <= maxDistance_) {
+      res.push_back({token, dist});
+    }
+    // tokens have no zero bytes
+    key = token;
+    key += '\0';
+  }
+  return res;
+}
+
+} // namespace Search
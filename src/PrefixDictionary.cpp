@@ -0,0 +1,303 @@
+#include <search/PrefixDictionary.hpp>
+
+#include <search/CompressSize.hpp>
+#include <search/LevenshteinAutomaton.hpp>
+#include <search/Types.hpp>
+
+#include <algorithm>
+#include <boost/endian/conversion.hpp>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+
+namespace Search {
+
+const uint64_t PrefixDictionary::Version;
+const uint64_t PrefixDictionary::HeaderSize;
+const size_t PrefixDictionary::BlockSize;
+
+PrefixDictionary::PrefixDictionary(const fs::path& path) : path_(path) {
+  if (fs::is_regular_file(path_)) {
+    openFile();
+  }
+}
+
+bool PrefixDictionary::isFileVersionOk(const fs::path& path) {
+  if (!fs::is_regular_file(path)) {
+    return true;
+  }
+  if (fs::file_size(path) < HeaderSize) {
+    return false;
+  }
+  boost::iostreams::mapped_file_source f;
+  f.open(path.string());
+  if (!f.is_open() || f.data() == nullptr) {
+    throw std::runtime_error("Cant open file");
+  }
+  uint64_t ver;
+  std::memcpy(&ver, f.data(), sizeof(ver));
+  ver = boost::endian::little_to_native<uint64_t>(ver);
+  f.close();
+  return ver == Version;
+}
+
+void PrefixDictionary::add(std::string_view token) {
+  if (!contains(token)) {
+    added_.emplace(token);
+  }
+}
+
+bool PrefixDictionary::contains(std::string_view token) const {
+  if (added_.find(token) != added_.end()) {
+    return true;
+  }
+  // smallest token with prefix is token itself
+  bool found = false;
+  forEachInFile(token, [&](const std::string& tk) {
+    found = tk == token;
+    return false;
+  });
+  return found;
+}
+
+std::vector<std::string>
+PrefixDictionary::findPrefix(std::string_view prefix) const {
+  std::vector<std::string> inFile;
+  forEachInFile(prefix, [&](const std::string& tk) {
+    inFile.push_back(tk);
+    return true;
+  });
+  std::vector<std::string> res;
+  res.reserve(inFile.size());
+  auto it = added_.lower_bound(prefix);
+  auto end = it;
+  while (end != added_.end() &&
+         std::string_view(*end).substr(0, prefix.size()) == prefix) {
+    ++end;
+  }
+  // added tokens are not in file
+  std::merge(std::make_move_iterator(inFile.begin()),
+             std::make_move_iterator(inFile.end()), it, end,
+             std::back_inserter(res));
+  return res;
+}
+
+void PrefixDictionary::reset(std::vector<std::string> tokens) {
+  std::sort(tokens.begin(), tokens.end());
+  tokens.erase(std::unique(tokens.begin(), tokens.end()), tokens.end());
+  added_.clear();
+  if (path_.empty()) {
+    added_.insert(tokens.begin(), tokens.end());
+    return;
+  }
+  writeFile(tokens);
+}
+
+void PrefixDictionary::flush() {
+  if (path_.empty() || (added_.empty() && file_.is_open())) {
+    return;
+  }
+  auto tokens = findPrefix({});
+  added_.clear();
+  writeFile(tokens);
+}
+
+void PrefixDictionary::clear() {
+  added_.clear();
+  if (!path_.empty()) {
+    writeFile({});
+  }
+}
+
+size_t PrefixDictionary::size() const {
+  return (file_.is_open() ? headerValue(1) : 0) + added_.size();
+}
+
+uint64_t PrefixDictionary::headerValue(size_t i) const {
+  uint64_t value;
+  std::memcpy(&value, file_.data() + i * sizeof(uint64_t), sizeof(value));
+  return boost::endian::little_to_native<uint64_t>(value);
+}
+
+uint64_t PrefixDictionary::numBlocks() const {
+  return file_.is_open() ? headerValue(2) : 0;
+}
+
+const std::byte* PrefixDictionary::block(uint64_t i) const {
+  uint64_t offset;
+  std::memcpy(&offset, file_.data() + HeaderSize + i * sizeof(uint64_t),
+              sizeof(offset));
+  offset = boost::endian::little_to_native<uint64_t>(offset);
+  return (const std::byte*)file_.data() + offset;
+}
+
+std::string_view PrefixDictionary::firstToken(uint64_t i) const {
+  const std::byte* dt = block(i);
+  auto size = readSize(dt);
+  return {(const char*)dt, size};
+}
+
+uint64_t PrefixDictionary::findBlock(std::string_view token) const {
+  // first block with first token not before token
+  uint64_t lo = 0;
+  uint64_t hi = numBlocks();
+  while (lo < hi) {
+    auto mid = lo + (hi - lo) / 2;
+    if (firstToken(mid) < token) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo == 0 ? 0 : lo - 1;
+}
+
+void PrefixDictionary::startBlock(Cursor& cur, uint64_t i) const {
+  cur.block = i;
+  cur.index = 0;
+  cur.data = block(i);
+  auto size = readSize(cur.data);
+  cur.token.assign((const char*)cur.data, size);
+  cur.data += size;
+}
+
+bool PrefixDictionary::next(Cursor& cur) const {
+  uint64_t n =
+      std::min<uint64_t>(BlockSize, headerValue(1) - cur.block * BlockSize);
+  if (cur.index + 1 == n) {
+    if (cur.block + 1 == numBlocks()) {
+      return false;
+    }
+    startBlock(cur, cur.block + 1);
+    return true;
+  }
+  cur.index++;
+  size_t shared = readSize(cur.data);
+  size_t size = readSize(cur.data);
+  cur.token.resize(shared);
+  cur.token.append((const char*)cur.data, size);
+  cur.data += size;
+  return true;
+}
+
+bool PrefixDictionary::seek(Cursor& cur, std::string_view key) const {
+  uint64_t num = numBlocks();
+  if (num == 0) {
+    return false;
+  }
+  // blocks are skipped by binary search
+  if (cur.data == nullptr ||
+      (cur.block + 1 < num && firstToken(cur.block + 1) <= key)) {
+    startBlock(cur, findBlock(key));
+  }
+  while (cur.token < key) {
+    if (!next(cur)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void PrefixDictionary::forEachInFile(
+    std::string_view prefix,
+    const std::function<bool(const std::string&)>& func) const {
+  Cursor cur;
+  if (!seek(cur, prefix)) {
+    return;
+  }
+  do {
+    if (std::string_view(cur.token).substr(0, prefix.size()) != prefix) {
+      return;
+    }
+    if (!func(cur.token)) {
+      return;
+    }
+  } while (next(cur));
+}
+
+std::vector<std::pair<std::string, uint8_t>>
+PrefixDictionary::findFuzzy(std::string_view token, uint8_t maxDistance,
+                            size_t prefixLen) const {
+  LevenshteinAutomaton automaton(token, maxDistance, prefixLen);
+  Cursor cur;
+  bool isEnd = false;
+  return automaton.find([&](std::string_view key, std::string& res) {
+    // smaller of tokens in file and added tokens
+    isEnd = isEnd || !seek(cur, key);
+    auto it = added_.lower_bound(key);
+    if (isEnd && it == added_.end()) {
+      return false;
+    }
+    if (isEnd || (it != added_.end() && *it < cur.token)) {
+      res = *it;
+    } else {
+      res = cur.token;
+    }
+    return true;
+  });
+}
+
+void PrefixDictionary::openFile() {
+  file_.open(path_.string());
+  if (!file_.is_open() || file_.data() == nullptr) {
+    throw std::runtime_error("PrefixDictionary::openFile() Cant open file");
+  }
+  if (file_.size() < HeaderSize || headerValue(0) != Version) {
+    file_.close();
+    throw std::runtime_error("PrefixDictionary::openFile() Different version");
+  }
+}
+
+void PrefixDictionary::writeFile(const std::vector<std::string>& tokens) {
+  uint64_t num = (tokens.size() + BlockSize - 1) / BlockSize;
+  std::vector<uint64_t> header{Version, tokens.size(), num};
+  std::vector<uint64_t> offsets;
+  offsets.reserve(num);
+  Bytes data;
+  uint64_t start = HeaderSize + num * sizeof(uint64_t);
+  for (size_t i = 0; i < tokens.size(); ++i) {
+    const auto& token = tokens[i];
+    size_t shared = 0;
+    if (i % BlockSize == 0) {
+      offsets.push_back(start + data.size());
+    } else {
+      const auto& prev = tokens[i - 1];
+      auto n = std::min(prev.size(), token.size());
+      while (shared < n && prev[shared] == token[shared]) {
+        shared++;
+      }
+      data += writeSizeString(shared);
+    }
+    data += writeSizeString(token.size() - shared);
+    data.append((const std::byte*)token.data() + shared,
+                token.size() - shared);
+  }
+
+  // new file replaces old one at once
+  auto pth = path_;
+  pth += ".tmp";
+  {
+    std::ofstream out(pth.string(), std::ios::binary | std::ios::trunc);
+    if (!out.is_open()) {
+      throw std::runtime_error("PrefixDictionary::writeFile() Cant open file");
+    }
+    for (auto value : header) {
+      value = boost::endian::native_to_little<uint64_t>(value);
+      out.write((const char*)&value, sizeof(value));
+    }
+    for (auto value : offsets) {
+      value = boost::endian::native_to_little<uint64_t>(value);
+      out.write((const char*)&value, sizeof(value));
+    }
+    out.write((const char*)data.data(), data.size());
+    if (!out) {
+      throw std::runtime_error("PrefixDictionary::writeFile() Cant write");
+    }
+  }
+  file_.close();
+  fs::rename(pth, path_);
+  openFile();
+}
+
+} // namespace Search
@@ -0,0 +1,236 @@
+#include <search/Query.hpp>
+
+#include <search/Tokenize.hpp>
+
+#include <utility>
+
+namespace Search {
+
+void QueryNode::positiveTokens(std::vector<std::string>& res) const {
+  if (type == Not) {
+    return;
+  }
+  res.insert(res.end(), tokens.begin(), tokens.end());
+  for (const auto& child : children) {
+    child.positiveTokens(res);
+  }
+}
+
+bool QueryNode::hasPrefix(std::string_view token) const {
+  if (type == Not) {
+    return false;
+  }
+  if (type == Prefix) {
+    return tokens.front() == token;
+  }
+  for (const auto& child : children) {
+    if (child.hasPrefix(token)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+std::string QueryNode::key() const {
+  // type, tokens ended by zero and children ended by type
+  const char types[] = "tp\"&|-";
+  std::string res(1, types[type]);
+  for (const auto& token : tokens) {
+    res += token;
+    res += '\0';
+  }
+  for (const auto& child : children) {
+    res += child.key();
+  }
+  if (!children.empty()) {
+    res += types[type];
+  }
+  return res;
+}
+
+namespace {
+
+// Recursive descent, mistakes of user like missing parenthesis or operator
+// without operand are skipped.
+class QueryParser {
+  // deeper groups and repeated NOT are read as words
+  static const size_t MaxDepth = 32;
+
+  std::string_view txt_;
+  size_t pos_ = 0;
+  size_t depth_ = 0;
+
+  static bool isSpace(char ch) {
+    return ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r';
+  }
+
+  static bool isWordEnd(char ch) {
+    return isSpace(ch) || ch == '(' || ch == ')' || ch == '"';
+  }
+
+  static std::optional<QueryNode> combine(QueryNode::Type type,
+                                          std::vector<QueryNode> arr) {
+    if (arr.empty()) {
+      return std::nullopt;
+    }
+    if (arr.size() == 1) {
+      return std::move(arr.front());
+    }
+    // same operators are one node, so all its children are ordered by cost
+    QueryNode res{type, {}, {}};
+    for (auto& node : arr) {
+      if (node.type == type) {
+        for (auto& child : node.children) {
+          res.children.push_back(std::move(child));
+        }
+      } else {
+        res.children.push_back(std::move(node));
+      }
+    }
+    return res;
+  }
+
+  bool isEnd() {
+    while (pos_ < txt_.size() && isSpace(txt_[pos_])) {
+      pos_++;
+    }
+    return pos_ >= txt_.size();
+  }
+
+  std::string_view word() const {
+    size_t end = pos_;
+    while (end < txt_.size() && !isWordEnd(txt_[end])) {
+      end++;
+    }
+    return txt_.substr(pos_, end - pos_);
+  }
+
+  bool acceptKeyword(std::string_view keyword) {
+    if (isEnd() || word() != keyword) {
+      return false;
+    }
+    pos_ += keyword.size();
+    return true;
+  }
+
+  std::optional<QueryNode> parseOr() {
+    std::vector<QueryNode> arr;
+    do {
+      if (auto node = parseAnd()) {
+        arr.push_back(std::move(*node));
+      }
+    } while (acceptKeyword("OR"));
+    return combine(QueryNode::Or, std::move(arr));
+  }
+
+  std::optional<QueryNode> parseAnd() {
+    std::vector<QueryNode> arr;
+    while (!isEnd() && txt_[pos_] != ')' && word() != "OR") {
+      if (acceptKeyword("AND")) {
+        continue;
+      }
+      if (auto node = parseUnary()) {
+        arr.push_back(std::move(*node));
+      }
+    }
+    return combine(QueryNode::And, std::move(arr));
+  }
+
+  std::optional<QueryNode> parseUnary() {
+    bool isMinus = txt_[pos_] == '-' && pos_ + 1 < txt_.size() &&
+                   !isSpace(txt_[pos_ + 1]) && txt_[pos_ + 1] != ')';
+    if (depth_ >= MaxDepth || !(isMinus || acceptKeyword("NOT"))) {
+      return parsePrimary();
+    }
+    if (isMinus) {
+      pos_++;
+    }
+    if (isEnd() || txt_[pos_] == ')') {
+      return std::nullopt;
+    }
+    depth_++;
+    auto node = parseUnary();
+    depth_--;
+    if (!node) {
+      return std::nullopt;
+    }
+    QueryNode res{QueryNode::Not, {}, {}};
+    res.children.push_back(std::move(*node));
+    return res;
+  }
+
+  std::optional<QueryNode> parsePrimary() {
+    if (txt_[pos_] == '(' && depth_ < MaxDepth) {
+      pos_++;
+      depth_++;
+      auto node = parseOr();
+      depth_--;
+      // group without closing parenthesis ends with query
+      if (!isEnd() && txt_[pos_] == ')') {
+        pos_++;
+      }
+      return node;
+    }
+    if (txt_[pos_] == '"') {
+      auto end = txt_.find('"', pos_ + 1);
+      // phrase without closing quote ends with query
+      bool isClosed = end != std::string_view::npos;
+      auto tokens = tokenize(
+          txt_.substr(pos_ + 1, isClosed ? end - pos_ - 1 : end));
+      pos_ = isClosed ? end + 1 : txt_.size();
+      if (tokens.size() <= 1) {
+        return leaves(std::move(tokens), false);
+      }
+      return QueryNode{QueryNode::Phrase, std::move(tokens), {}};
+    }
+    auto txt = word();
+    if (txt.empty()) {
+      // parenthesis too deep
+      txt = txt_.substr(pos_, 1);
+    }
+    pos_ += txt.size();
+    bool isPrefix = false;
+    while (txt.size() > 1 && txt.back() == '*') {
+      txt.remove_suffix(1);
+      isPrefix = true;
+    }
+    return leaves(tokenize(txt), isPrefix);
+  }
+
+  // word can have several tokens, last one is prefix
+  static std::optional<QueryNode> leaves(std::vector<std::string> tokens,
+                                         bool isPrefix) {
+    std::vector<QueryNode> arr;
+    for (size_t i = 0; i < tokens.size(); ++i) {
+      auto type = isPrefix && i + 1 == tokens.size() ? QueryNode::Prefix
+                                                      : QueryNode::Token;
+      arr.push_back({type, {std::move(tokens[i])}, {}});
+    }
+    return combine(QueryNode::And, std::move(arr));
+  }
+
+public:
+  explicit QueryParser(std::string_view txt) : txt_(txt) {}
+
+  std::optional<QueryNode> parse() {
+    std::vector<QueryNode> arr;
+    while (!isEnd()) {
+      if (auto node = parseOr()) {
+        arr.push_back(std::move(*node));
+      }
+      // parenthesis without opening one
+      if (!isEnd() && txt_[pos_] == ')') {
+        pos_++;
+      }
+    }
+    return combine(QueryNode::And, std::move(arr));
+  }
+};
+
+} // namespace
+
+std::optional<QueryNode> parseQuery(std::string_view txt) {
+  return QueryParser(txt).parse();
+}
+
+} // namespace Search
@@ -0,0 +1,54 @@
+#include <search/ThreadPool.hpp>
+
+#include <algorithm>
+
+namespace Search {
+
+ThreadPool::ThreadPool(size_t numThreads) : stop_(false) {
+  for (size_t i = 0; i < numThreads; ++i) {
+    threads_.emplace_back(&ThreadPool::run, this);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  cv_.notify_all();
+  for (auto& th : threads_) {
+    th.join();
+  }
+}
+
+ThreadPool& ThreadPool::shared() {
+  static ThreadPool pool(
+      std::max<size_t>(1, std::thread::hardware_concurrency()));
+  return pool;
+}
+
+void ThreadPool::post(std::function<void()> task) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    tasks_.push_back(std::move(task));
+  }
+  cv_.notify_one();
+}
+
+void ThreadPool::run() {
+  for (;;) {
+    std::function<void()> task;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cv_.wait(lock, [this]() { return stop_ || !tasks_.empty(); });
+      if (tasks_.empty()) {
+        return;
+      }
+      task = std::move(tasks_.front());
+      tasks_.pop_front();
+    }
+    task();
+  }
+}
+
+} // namespace Search
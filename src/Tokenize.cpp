@@ -144,6 +144,28 @@ std::vector<std::string> tokenize(const std::string& txt) {
   return res;
 }
 
+std::vector<std::vector<std::string>> tokenizePhrases(std::string_view txt) {
+  std::vector<std::vector<std::string>> arr;
+  size_t pos = 0;
+  for (;;) {
+    auto start = txt.find('"', pos);
+    if (start == std::string_view::npos) {
+      break;
+    }
+    auto end = txt.find('"', start + 1);
+    if (end == std::string_view::npos) {
+      // quote is not closed yet
+      break;
+    }
+    auto tks = tokenize(txt.substr(start + 1, end - start - 1));
+    if (!tks.empty()) {
+      arr.push_back(std::move(tks));
+    }
+    pos = end + 1;
+  }
+  return arr;
+}
+
 std::string joinTokens(const std::vector<std::string>& tokens) {
   std::string txt;
   for (const auto& tk : tokens) {
@@ -178,6 +200,13 @@ std::vector<std::string> splitTokens(std::string_view txt) {
   return arr;
 }
 
+size_t countTokens(std::string_view txt) {
+  if (txt.empty()) {
+    return 0;
+  }
+  return 1 + std::count(txt.begin(), txt.end(), ' ');
+}
+
 bool tokensOverlap(std::string_view all, std::string_view search) {
   size_t pos = 0;
   while (pos < all.size()) {
@@ -0,0 +1,226 @@
+#include <search/CompressSize.hpp>
+#include <search/WriteAheadLog.hpp>
+
+#include <city.h>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace Search {
+
+const size_t WriteAheadLog::MaxPending;
+const uint8_t WriteAheadLog::StateRecord;
+
+/*
+- - - - - - - - - - -
+Group structure:
+- - - - - - - - - - -
+ * size of records (8)
+ * hash of records (8)
+ * records: type (1), key size, key, value size, value
+- - - - - - - - - - -
+*/
+static const size_t GroupHeaderSize = 2 * sizeof(uint64_t);
+
+namespace {
+
+void syncFile(const fs::path& pth) {
+  std::FILE* f = std::fopen(pth.string().c_str(), "rb+");
+  if (!f) {
+    throw std::runtime_error("WriteAheadLog::syncFile() Cant open file");
+  }
+#ifdef _WIN32
+  int res = _commit(_fileno(f));
+#else
+  int res = fsync(fileno(f));
+#endif
+  std::fclose(f);
+  if (res != 0) {
+    throw std::runtime_error("WriteAheadLog::syncFile() Cant sync file");
+  }
+}
+
+} // namespace
+
+WriteAheadLog::WriteAheadLog(const fs::path& path,
+                             const std::vector<fs::path>& files)
+    : path_(path), files_(files), file_(nullptr), size_(0),
+      needsReplay_(false) {
+  open();
+  // log is clean when its last record is clean state
+  bool isClean = false;
+  bool hasRecords = false;
+  readGroups([&](uint8_t type, std::string_view, BytesView value) {
+    if (type == StateRecord) {
+      isClean = value.size() == 1 && value[0] == (std::byte)1;
+    } else {
+      isClean = false;
+      hasRecords = true;
+    }
+  });
+  needsReplay_ = !isClean && hasRecords;
+  // files are changed only after log isn't clean anymore
+  appendState(false);
+}
+
+WriteAheadLog::~WriteAheadLog() {
+  try {
+    commit();
+  } catch (...) {
+  }
+  if (file_) {
+    std::fclose(file_);
+  }
+}
+
+void WriteAheadLog::open() {
+  file_ = std::fopen(path_.string().c_str(), "ab");
+  if (!file_) {
+    throw std::runtime_error("Cant open log file");
+  }
+  size_ = fs::file_size(path_);
+}
+
+void WriteAheadLog::append(uint8_t type, std::string_view key,
+                           BytesView value) {
+  pending_.push_back((std::byte)type);
+  pending_ += writeSizeString(key.size());
+  pending_.append((const std::byte*)key.data(), key.size());
+  pending_ += writeSizeString(value.size());
+  pending_ += value;
+  if (pending_.size() >= MaxPending) {
+    commit();
+  }
+}
+
+void WriteAheadLog::commit() {
+  if (pending_.empty()) {
+    return;
+  }
+  uint64_t header[2];
+  header[0] = pending_.size();
+  header[1] = CityHash64((const char*)pending_.data(), pending_.size());
+  // one write for whole group
+  pending_.insert(0, (const std::byte*)header, GroupHeaderSize);
+  if (std::fwrite(pending_.data(), 1, pending_.size(), file_) !=
+          pending_.size() ||
+      std::fflush(file_) != 0) {
+    throw std::runtime_error("Cant write log file");
+  }
+  size_ += pending_.size();
+  pending_.clear();
+}
+
+void WriteAheadLog::sync() {
+  commit();
+#ifdef _WIN32
+  int res = _commit(_fileno(file_));
+#else
+  int res = fsync(fileno(file_));
+#endif
+  if (res != 0) {
+    throw std::runtime_error("Cant sync log file");
+  }
+}
+
+void WriteAheadLog::checkpoint() {
+  commit();
+  // only pages not written yet are synced
+  for (const auto& file : files_) {
+    if (fs::is_regular_file(file)) {
+      syncFile(file);
+    }
+  }
+  truncate();
+}
+
+void WriteAheadLog::close() {
+  commit();
+  appendState(true);
+}
+
+void WriteAheadLog::truncate() {
+  pending_.clear();
+  std::fclose(file_);
+  file_ = std::fopen(path_.string().c_str(), "wb");
+  if (!file_) {
+    throw std::runtime_error("Cant open log file");
+  }
+  size_ = 0;
+  // records are in synced files now
+  sync();
+}
+
+void WriteAheadLog::appendState(bool isClean) {
+  const std::byte value = (std::byte)(isClean ? 1 : 0);
+  append(StateRecord, {}, BytesView(&value, 1));
+  sync();
+}
+
+void WriteAheadLog::replay(
+    const std::function<void(uint8_t, std::string_view, BytesView)>& func) {
+  commit();
+  readGroups([&](uint8_t type, std::string_view key, BytesView value) {
+    if (type != StateRecord) {
+      func(type, key, value);
+    }
+  });
+}
+
+void WriteAheadLog::readGroups(
+    const std::function<void(uint8_t, std::string_view, BytesView)>& func) {
+  std::vector<std::byte> dt(size_);
+  {
+    std::ifstream in(path_.string(), std::ios::binary);
+    in.read((char*)dt.data(), dt.size());
+    dt.resize(in.gcount());
+  }
+
+  size_t pos = 0;
+  while (pos + GroupHeaderSize <= dt.size()) {
+    uint64_t header[2];
+    std::memcpy(header, dt.data() + pos, GroupHeaderSize);
+    if (header[0] > dt.size() - pos - GroupHeaderSize) {
+      break;
+    }
+    const std::byte* ptr = dt.data() + pos + GroupHeaderSize;
+    const std::byte* end = ptr + header[0];
+    if (CityHash64((const char*)ptr, header[0]) != header[1]) {
+      break;
+    }
+    while (ptr < end) {
+      auto type = (uint8_t)*ptr++;
+      auto sKey = readSize(ptr);
+      std::string_view key((const char*)ptr, sKey);
+      ptr += sKey;
+      auto sValue = readSize(ptr);
+      BytesView value(ptr, sValue);
+      ptr += sValue;
+      func(type, key, value);
+    }
+    pos = end - dt.data();
+  }
+
+  if (pos < dt.size()) {
+    // torn group is removed, so new groups are readable
+    std::fclose(file_);
+    fs::resize_file(path_, pos);
+    open();
+  }
+}
+
+void WriteAheadLog::removeFiles(const fs::path& path) {
+  std::error_code ec;
+  fs::remove(path, ec);
+}
+
+} // namespace Search
@@ -316,14 +316,10 @@ void test_search(const fs::path& output) {
     auto start = std::chrono::high_resolution_clock::now();
     SearchSettings<Doc> sett;
     sett.query = q;
+    sett.limit = 20;
     auto results3 = findMany<TSearchDb>({&db}, sett, cmp1, cmp2);
-    size_t i = 0;
     for (const auto& res : results3) {
       std::cout << res.doc.docId() << "\t" << res.doc.title() << "\n";
-      i++;
-      if (i == 20) {
-        break;
-      }
     }
 
     auto finish = std::chrono::high_resolution_clock::now();
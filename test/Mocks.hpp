@@ -2,6 +2,7 @@
 #include <search/Db.hpp>
 #include <search/FileStore.hpp>
 #include <search/FindMany.hpp>
+#include <search/KeyValueFileList.hpp>
 
 #include <gtest/gtest.h>
 #include <gmock/gmock.h>
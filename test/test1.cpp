@@ -1,7 +1,20 @@
 #include "Mocks.hpp"
+#include <search/Bitmap.hpp>
+#include <search/Compactor.hpp>
 #include <search/DocSimple.hpp>
+#include <search/Intersect.hpp>
+#include <search/SearchCursor.hpp>
+#include <search/SegmentStore.hpp>
 
 #include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <set>
+#include <shared_mutex>
+#include <sstream>
 #include <vector>
 
 namespace fs = std::filesystem;
@@ -68,3 +81,1366 @@ TEST_F(DbSimpleTest, Add3) {
   db.add(DocSimple(2, "ghi jkl"));
   EXPECT_EQ(search("abc ghi"), TRes{});
 }
+
+TEST_F(TestSearch, KeyValueFileListBlocks) {
+  KeyValueFileList db(path() / "list");
+  std::vector<uint64_t> expected;
+  for (uint64_t i = 0; i < 2000; ++i) {
+    db.set("abc", i * 7 % 2003);
+    expected.push_back(i * 7 % 2003);
+  }
+  db.set("abc", 7);
+  for (uint64_t i = 0; i < 2000; i += 3) {
+    db.remove("abc", i * 7 % 2003);
+    expected.erase(std::find(expected.begin(), expected.end(), i * 7 % 2003));
+  }
+  std::sort(expected.begin(), expected.end());
+  EXPECT_EQ(db.get("abc"), expected);
+  EXPECT_EQ(db.numItems(), expected.size());
+  EXPECT_EQ(db.count("abc"), expected.size());
+  std::vector<uint64_t> inRanges;
+  std::copy_if(expected.begin(), expected.end(), std::back_inserter(inRanges),
+               [](uint64_t v) { return v <= 1 || (v >= 100 && v <= 110); });
+  EXPECT_EQ(db.getInRanges("abc", {{0, 1}, {100, 110}}), inRanges);
+  db.optimize();
+  EXPECT_EQ(db.get("abc"), expected);
+  EXPECT_EQ(db.get("abd"), std::vector<uint64_t>{});
+}
+
+TEST_F(TestSearch, IntersectSorted) {
+  std::vector<uint32_t> a, b;
+  for (uint32_t i = 0; i < 1000; ++i) {
+    a.push_back(i * 3);
+    b.push_back(i * 5);
+  }
+  std::vector<uint32_t> expected;
+  std::set_intersection(a.begin(), a.end(), b.begin(), b.end(),
+                        std::back_inserter(expected));
+  auto a2 = a;
+  intersectSorted(a2, b);
+  EXPECT_EQ(a2, expected);
+
+  // galloping
+  std::vector<uint32_t> small = {0, 15, 16, 2985, 4000};
+  intersectSorted(small, a);
+  EXPECT_EQ(small, (std::vector<uint32_t>{0, 15, 2985}));
+  auto big = b;
+  intersectSorted(big, std::vector<uint32_t>{5, 6, 4995});
+  EXPECT_EQ(big, (std::vector<uint32_t>{5, 4995}));
+}
+
+TEST_F(TestSearch, BitmapOps) {
+  std::vector<uint64_t> a, b;
+  for (uint64_t i = 0; i < 200000; i += 3) {
+    a.push_back(i);
+  }
+  for (uint64_t i = 50000; i < 60000; ++i) {
+    b.push_back(i);
+  }
+  b.push_back(1'000'000);
+  auto ba = Bitmap::fromSorted(a.data(), a.data() + a.size());
+  auto bb = Bitmap::fromSorted(b.data(), b.data() + b.size());
+  bb.optimize();
+  EXPECT_EQ(bb.containers()[0].type, Bitmap::Container::Type::Run);
+
+  std::vector<uint64_t> expected;
+  std::set_intersection(a.begin(), a.end(), b.begin(), b.end(),
+                        std::back_inserter(expected));
+  EXPECT_EQ(bitmapAnd(ba, bb).values<uint64_t>(), expected);
+  expected.clear();
+  std::set_union(a.begin(), a.end(), b.begin(), b.end(),
+                 std::back_inserter(expected));
+  EXPECT_EQ(bitmapOr(ba, bb).values<uint64_t>(), expected);
+  expected.clear();
+  std::set_difference(a.begin(), a.end(), b.begin(), b.end(),
+                      std::back_inserter(expected));
+  EXPECT_EQ(bitmapAndNot(ba, bb).values<uint64_t>(), expected);
+  EXPECT_EQ(bitmapAndNot(ba, bb).cardinality(), expected.size());
+}
+
+TEST_F(TestSearch, KeyValueFileListBitmap) {
+  KeyValueFileList db(path() / "list");
+  std::vector<uint64_t> expected;
+  for (uint64_t i = 0; i < 100000; ++i) {
+    if (i % 4 != 0) {
+      db.set("abc", i);
+      expected.push_back(i);
+    }
+  }
+  EXPECT_EQ(db.get("abc"), expected);
+  EXPECT_EQ(db.getBitmap("abc").values<uint64_t>(), expected);
+  auto size = db.fileSize();
+  db.optimize();
+  EXPECT_LT(db.fileSize(), size);
+  EXPECT_EQ(db.get("abc"), expected);
+  EXPECT_TRUE(db.exists("abc", 99999));
+  EXPECT_FALSE(db.exists("abc", 99996));
+
+  // sparse again
+  std::vector<uint64_t> expected2;
+  for (auto value : expected) {
+    if (value % 100 != 1) {
+      db.remove("abc", value);
+    } else {
+      expected2.push_back(value);
+    }
+  }
+  EXPECT_EQ(db.get("abc"), expected2);
+  EXPECT_EQ(db.count("abc"), expected2.size());
+}
+
+TEST_F(TestSearch, SegmentStore) {
+  typedef Db<SegmentStore<DocSimple>> TSearchDb;
+  typedef std::vector<DocSimple::TId> TRes;
+  auto search = [](TSearchDb& db, std::string_view query) {
+    SearchSettings<DocSimple> sett;
+    sett.query = query;
+    CompIsWhole<Result<DocSimple>> cmp1;
+    auto result = findMany<TSearchDb>({&db}, sett, cmp1);
+    TRes arr;
+    for (const auto& res : result) {
+      arr.push_back(res.id);
+    }
+    std::sort(arr.begin(), arr.end());
+    return arr;
+  };
+
+  {
+    SegmentStore<DocSimple> store(path() / "seg", 2, 2);
+    TSearchDb db(store);
+    for (uint32_t i = 1; i <= 9; ++i) {
+      db.add(DocSimple(i, "abc doc" + std::to_string(i)));
+    }
+    db.add(DocSimple(3, "def doc3"));
+    db.remove(4);
+    // buffers may still be written on background thread
+    EXPECT_EQ(search(db, "abc"), (TRes{1, 2, 5, 6, 7, 8, 9}));
+    EXPECT_EQ(store.sizeDocuments(), 8u);
+    store.waitForMerges();
+    EXPECT_LT(store.numSegments(), 4u);
+    EXPECT_EQ(search(db, "abc"), (TRes{1, 2, 5, 6, 7, 8, 9}));
+    EXPECT_EQ(search(db, "def doc3"), TRes{3});
+    EXPECT_EQ(search(db, "doc4"), TRes{});
+  }
+
+  // segments and tombstones are loaded again
+  SegmentStore<DocSimple> store(path() / "seg", 2, 2);
+  TSearchDb db(store);
+  EXPECT_EQ(store.sizeDocuments(), 8u);
+  EXPECT_EQ(search(db, "abc"), (TRes{1, 2, 5, 6, 7, 8, 9}));
+  store.optimize();
+  EXPECT_EQ(store.numSegments(), 1u);
+  EXPECT_EQ(search(db, "doc"), (TRes{1, 2, 3, 5, 6, 7, 8, 9}));
+}
+
+TEST_F(TestSearch, KeyValueFileGrowth) {
+  KeyValueFile db(path() / "docs");
+  auto value = [](size_t i) {
+    auto txt = std::to_string(i * 31);
+    return Bytes((const std::byte*)txt.data(),
+                 (const std::byte*)txt.data() + txt.size());
+  };
+  for (size_t i = 0; i < 20000; ++i) {
+    db.set("key" + std::to_string(i), value(i));
+  }
+  // table grows by one bucket at a time
+  EXPECT_GE(db.numBuckets(), db.numItems());
+  EXPECT_LT(db.numBuckets(), db.numItems() * 2);
+  for (size_t i = 0; i < 20000; ++i) {
+    auto res = db.get("key" + std::to_string(i));
+    ASSERT_EQ(Bytes(res.data(), res.data() + res.size()), value(i));
+  }
+
+  for (size_t i = 100; i < 20000; ++i) {
+    db.remove("key" + std::to_string(i));
+  }
+  std::string key0 = "key0";
+  db.set(key0, value(1));
+  EXPECT_LT(db.numBuckets(), 1000u);
+  auto res = db.get(key0);
+  EXPECT_EQ(Bytes(res.data(), res.data() + res.size()), value(1));
+  EXPECT_EQ(db.allDocuments().size(), 100u);
+}
+
+TEST_F(DbSimpleTest, BulkRepeated) {
+  // table is rebuilt at start of each import
+  for (DocSimple::TId round = 0; round < 3; ++round) {
+    auto writers = db.bulkWriters(3);
+    for (DocSimple::TId i = 0; i < 1000; ++i) {
+      auto id = round * 700 + i + 1;
+      writers[id % 3].add(DocSimple(id, "abc " + std::to_string(id)));
+    }
+    db.bulkAdd(writers);
+  }
+  EXPECT_EQ(store.sizeDocuments(), 2400u);
+  EXPECT_EQ(search("abc").size(), 2400u);
+  EXPECT_EQ(search("1500").size(), 1u);
+}
+
+TEST_F(TestSearch, Compactor) {
+  Compactor::Settings settings;
+  settings.minWasted = 10000;
+  settings.bytesPerStep = 2000;
+  // compaction is run by compactAll
+  settings.interval = std::chrono::hours(1);
+  Compactor compactor(settings);
+
+  KeyValueFile db(path() / "docs");
+  KeyValueFileList db2(path() / "tokens");
+  // first file is replaced by compactor, second one on next write
+  std::shared_mutex readersMutex;
+  compactor.add(db, &readersMutex);
+  compactor.add(db2);
+  auto value = [](size_t i, size_t round) {
+    std::string txt(10 + round, 'a' + (char)(i % 26));
+    return Bytes((const std::byte*)txt.data(),
+                 (const std::byte*)txt.data() + txt.size());
+  };
+  for (size_t round = 0; round < 5; ++round) {
+    for (size_t i = 0; i < 3000; ++i) {
+      auto key = "key" + std::to_string(i);
+      db.set(key, value(i, round));
+      std::vector<uint64_t> values;
+      for (size_t k = 0; k < 20; ++k) {
+        values.push_back(i + k * (round + 1));
+      }
+      for (auto v : db2.get(key)) {
+        db2.remove(key, v);
+      }
+      db2.set(key, values);
+    }
+  }
+  ASSERT_GE(db.wasted(), settings.minWasted);
+  ASSERT_GE(db2.wasted(), settings.minWasted);
+  compactor.compactAll();
+  EXPECT_LT(db.wasted(), settings.minWasted);
+  EXPECT_GE(db2.wasted(), settings.minWasted);
+  std::string key0 = "key0";
+  db2.remove(key0, 0);
+  EXPECT_LT(db2.wasted(), settings.minWasted);
+
+  for (size_t i = 0; i < 3000; ++i) {
+    auto key = "key" + std::to_string(i);
+    auto res = db.get(key);
+    ASSERT_EQ(Bytes(res.data(), res.data() + res.size()), value(i, 4));
+    if (i > 0) {
+      ASSERT_EQ(db2.get(key).size(), 20u);
+      ASSERT_EQ(db2.get(key)[1], i + 5);
+    }
+  }
+  EXPECT_EQ(db2.get(key0).size(), 19u);
+  compactor.remove(db);
+  compactor.remove(db2);
+}
+
+TEST_F(TestSearch, KeyValueFileLongChains) {
+  KeyValueFile db(path() / "docs");
+  // small locked table, most keys are behind links in slot
+  db.lockTableForNumItems(5);
+  for (size_t i = 0; i < 600; ++i) {
+    auto txt = std::to_string(i);
+    db.set("key" + txt, BytesView((const std::byte*)txt.data(), txt.size()));
+  }
+  for (size_t i = 0; i < 600; i += 3) {
+    db.remove("key" + std::to_string(i));
+  }
+  for (size_t i = 0; i < 600; ++i) {
+    auto res = db.get("key" + std::to_string(i));
+    if (i % 3 == 0) {
+      ASSERT_EQ(res.data(), nullptr);
+    } else {
+      auto txt = std::to_string(i);
+      ASSERT_EQ(std::string((const char*)res.data(), res.size()), txt);
+    }
+    ASSERT_EQ(db.get("other" + std::to_string(i)).data(), nullptr);
+  }
+  EXPECT_EQ(db.numItems(), 400u);
+}
+
+TEST_F(TestSearch, FileStoreLog) {
+  typedef Db<FileStore<DocSimple>> TSearchDb;
+  auto base = path() / "db";
+  {
+    // store is not destroyed, like at crash of process
+    auto store = new FileStore<DocSimple>(base, true);
+    auto db = new TSearchDb(*store);
+    db->add(DocSimple(1, "abc def"));
+    store->checkpoint();
+    db->add(DocSimple(2, "abc ghi"));
+    db->add(DocSimple(3, "jkl"));
+    db->remove(1);
+    store->sync();
+  }
+  {
+    FileStore<DocSimple> store(base, true);
+    TSearchDb db(store);
+    EXPECT_FALSE(store.findDoc(1));
+    EXPECT_TRUE(store.findDoc(2));
+    EXPECT_TRUE(store.findDoc(3));
+    EXPECT_EQ(store.tokenCount("abc"), 1u);
+    EXPECT_EQ(store.tokenCount("jkl"), 1u);
+    EXPECT_EQ(store.sumDocLengths(), 3u);
+    db.add(DocSimple(5, "jkl mno"));
+  }
+  // closed cleanly, files are used as they are
+  FileStore<DocSimple> store(base, true);
+  EXPECT_TRUE(store.findDoc(2));
+  EXPECT_TRUE(store.findDoc(5));
+  EXPECT_EQ(store.tokenCount("jkl"), 2u);
+  // counted from documents, not stored
+  EXPECT_EQ(store.sumDocLengths(), 5u);
+}
+
+TEST_F(TestSearch, FileStoreCheckpoint) {
+  typedef Db<FileStore<DocSimple>> TSearchDb;
+  auto base = path() / "db";
+  FileStore<DocSimple> store(base, true);
+  TSearchDb db(store);
+  for (uint32_t i = 1; i <= 3000; ++i) {
+    db.add(DocSimple(i, "abc doc" + std::to_string(i)));
+  }
+  store.checkpoint();
+  EXPECT_GT(store.fileSize(), 100'000u);
+  db.add(DocSimple(3001, "def"));
+  store.checkpoint();
+  // files aren't copied, only log is emptied
+  std::set<std::string> names;
+  for (const auto& entry : fs::directory_iterator(path())) {
+    names.insert(entry.path().filename().string());
+  }
+  std::set<std::string> expected{"db.docs", "db.tokens", "db.dict",
+                                 "db.wal"};
+  EXPECT_EQ(names, expected);
+  EXPECT_EQ(fs::file_size(base.string() + ".wal"), 0u);
+  EXPECT_EQ(store.tokenCount("def"), 1u);
+}
+
+TEST_F(DbSimpleTest, ConcurrentQueries) {
+  std::atomic<bool> done(false);
+  std::atomic<size_t> numQueries(0);
+  std::vector<std::thread> readers;
+  for (int t = 0; t < 4; ++t) {
+    readers.emplace_back([&] {
+      while (!done) {
+        SearchSettings<DocSimple> sett;
+        sett.query = "abc";
+        auto res = findMany<TSearchDb>({&db}, sett);
+        for (const auto& r : res) {
+          ASSERT_EQ(r.tokens.at(0).substr(0, 3), "abc");
+        }
+        numQueries++;
+      }
+    });
+  }
+  for (uint32_t i = 1; i <= 300; ++i) {
+    db.add(DocSimple(i, "abc doc" + std::to_string(i)));
+    if (i % 3 == 0) {
+      db.remove(i - 1);
+    }
+  }
+  done = true;
+  for (auto& th : readers) {
+    th.join();
+  }
+  EXPECT_GT(numQueries.load(), 0u);
+  EXPECT_EQ(db.generation(), 400u);
+  EXPECT_EQ(search("abc").size(), 200u);
+}
+
+TEST_F(DbSimpleTest, Page) {
+  for (uint32_t i = 1; i <= 30; ++i) {
+    auto txt = i % 4 == 0 ? "abc def" : "abc x" + std::to_string(i) + " def";
+    db.add(DocSimple(i, txt));
+  }
+  auto all = search("abc def");
+  ASSERT_EQ(all.size(), 30u);
+
+  SearchSettings<DocSimple> sett;
+  sett.query = "abc def";
+  sett.offset = 5;
+  sett.limit = 10;
+  CompIsWhole<Result<DocSimple>> cmp1;
+  CompWordsTogether<Result<DocSimple>> cmp2;
+  auto res = findMany<TSearchDb>({&db}, sett, cmp1, cmp2);
+  ASSERT_EQ(res.size(), 10u);
+  for (size_t i = 0; i < res.size(); ++i) {
+    EXPECT_EQ(res[i].id, all[i + 5]);
+    EXPECT_EQ(res[i].index, i);
+  }
+  // page from cache is numbered same
+  QueryCache<DocSimple> cache(1 << 20);
+  sett.cache = &cache;
+  for (int n = 0; n < 2; ++n) {
+    auto res2 = findMany<TSearchDb>({&db}, sett, cmp1, cmp2);
+    ASSERT_EQ(res2.size(), res.size());
+    for (size_t i = 0; i < res2.size(); ++i) {
+      EXPECT_EQ(res2[i].id, res[i].id);
+      EXPECT_EQ(res2[i].index, i);
+    }
+  }
+  EXPECT_EQ(cache.hits(), 1u);
+  sett.cache = nullptr;
+
+  // without comparators only page is loaded
+  sett.offset = 25;
+  res = findMany<TSearchDb>({&db}, sett);
+  ASSERT_EQ(res.size(), 5u);
+  EXPECT_EQ(res[0].id, 26u);
+  EXPECT_EQ(res[4].id, 30u);
+}
+
+TEST_F(DbSimpleTest, RemovedDocument) {
+  db.add(DocSimple(1, "abc def"));
+  db.add(DocSimple(2, "abc ghi"));
+  // postings still have document, like when it is removed after match
+  store.removeDoc(1);
+  SearchSettings<DocSimple> sett;
+  sett.query = "abc";
+  CompWordsTogether<Result<DocSimple>> cmp1;
+  auto res = findMany<TSearchDb>({&db}, sett, cmp1);
+  ASSERT_EQ(res.size(), 1u);
+  EXPECT_EQ(res[0].id, 2u);
+  CompPriorityTextsCallback<Result<DocSimple>> cmp2(
+      [](const DocSimple&, std::vector<uint8_t>&) {});
+  res = findMany<TSearchDb>({&db}, sett, cmp2);
+  ASSERT_EQ(res.size(), 1u);
+  EXPECT_EQ(res[0].id, 2u);
+}
+
+TEST_F(DbSimpleTest, BM25) {
+  db.add(DocSimple(1, "abc abc abc def"));
+  db.add(DocSimple(2, "abc def ghi jkl mno pqr"));
+  db.add(DocSimple(3, "abc xyz"));
+  db.add(DocSimple(4, "def"));
+  EXPECT_EQ(store.sumDocLengths(), 13u);
+  EXPECT_EQ(store.tokenFreqCount("abc"), 3u);
+
+  SearchSettings<DocSimple> sett;
+  sett.query = "abc";
+  CompBM25<Result<DocSimple>> cmp;
+  auto res = findMany<TSearchDb>({&db}, sett, cmp);
+  ASSERT_EQ(res.size(), 3u);
+  EXPECT_EQ(res[0].id, 1u);
+  EXPECT_EQ(res[1].id, 3u);
+  EXPECT_EQ(res[2].id, 2u);
+  EXPECT_GT(res[2].scores[0], 0.0f);
+  EXPECT_EQ(res[0].doc.docId(), 1u);
+
+  // only first document is loaded
+  sett.offset = 1;
+  sett.limit = 1;
+  res = findMany<TSearchDb>({&db}, sett, cmp);
+  ASSERT_EQ(res.size(), 1u);
+  EXPECT_EQ(res[0].id, 3u);
+
+  db.add(DocSimple(1, "def"));
+  db.remove(3);
+  EXPECT_EQ(store.sumDocLengths(), 8u);
+  EXPECT_EQ(store.tokenFreqCount("abc"), 1u);
+  EXPECT_EQ(store.tokenFreqCount("def"), 3u);
+
+  // bulk import keeps same statistics
+  FileStore<DocSimple> store2(path() / "bulk");
+  TSearchDb db2(store2);
+  auto writers = db2.bulkWriters(2);
+  writers[0].add(DocSimple(1, "def"));
+  writers[1].add(DocSimple(2, "abc def ghi jkl mno pqr"));
+  writers[1].add(DocSimple(4, "def"));
+  db2.bulkAdd(writers);
+  EXPECT_EQ(store2.sumDocLengths(), 8u);
+  EXPECT_EQ(store2.tokenFreqCount("def"), 3u);
+  auto freqs = store2.findTokenFreqs("def", {1, 2, 3, 4});
+  ASSERT_EQ(freqs.size(), 3u);
+  EXPECT_EQ(freqs[1].docId, 2u);
+  EXPECT_EQ(freqs[1].freq, 1u);
+  EXPECT_EQ(freqs[1].docLength, 6u);
+}
+
+TEST_F(DbSimpleTest, Positions) {
+  db.settings.positions = true;
+  db.add(DocSimple(1, "new york city"));
+  db.add(DocSimple(2, "york is new"));
+  db.add(DocSimple(3, "new big york"));
+
+  SearchSettings<DocSimple> sett;
+  sett.query = "\"new york\"";
+  // quotes are ignored without phraseQuery
+  auto res = findMany<TSearchDb>({&db}, sett);
+  EXPECT_EQ(res.size(), 3u);
+  sett.phraseQuery = true;
+  res = findMany<TSearchDb>({&db}, sett);
+  ASSERT_EQ(res.size(), 1u);
+  EXPECT_EQ(res[0].id, 1u);
+
+  sett.query = "york is";
+  CompProximity<Result<DocSimple>> cmp;
+  res = findMany<TSearchDb>({&db}, sett, cmp);
+  ASSERT_EQ(res.size(), 1u);
+  EXPECT_EQ(res[0].scores[0], 2.0f);
+  sett.query = "big york new";
+  res = findMany<TSearchDb>({&db}, sett, cmp);
+  ASSERT_EQ(res.size(), 1u);
+  EXPECT_EQ(res[0].scores[0], 2.0f);
+  sett.query = "new york";
+  res = findMany<TSearchDb>({&db}, sett, cmp);
+  ASSERT_EQ(res.size(), 3u);
+  EXPECT_EQ(res[0].id, 1u);
+
+  // positions of changed document are replaced
+  db.add(DocSimple(3, "a new york"));
+  db.remove(1);
+  sett.query = "\"new york\"";
+  res = findMany<TSearchDb>({&db}, sett);
+  ASSERT_EQ(res.size(), 1u);
+  EXPECT_EQ(res[0].id, 3u);
+
+  // without positions tokens of documents are checked
+  typedef Db<MemoryStore<DocSimple>> TMemoryDb;
+  MemoryStore<DocSimple> store2;
+  TMemoryDb db2(store2);
+  db2.add(DocSimple(1, "new york city"));
+  db2.add(DocSimple(3, "new big york"));
+  auto res2 = findMany<TMemoryDb>({&db2}, sett);
+  ASSERT_EQ(res2.size(), 1u);
+  EXPECT_EQ(res2[0].id, 1u);
+}
+
+// id of 6 bytes doesn't fit values of positions
+class DocWide {
+public:
+  typedef uint64_t TId;
+  typedef std::array<std::byte, 6> TIdSerialized;
+
+private:
+  DocSimple doc_;
+  TId id_;
+
+public:
+  DocWide(TId id, const std::string& text) : doc_(0, text), id_(id) {}
+  DocWide(TId id, BytesView dt) : doc_(0, dt), id_(id) {}
+
+  Bytes serialize() const { return doc_.serialize(); }
+  static TIdSerialized serializeId(TId id) {
+    TIdSerialized arr;
+    std::memcpy(&arr[0], &id, arr.size());
+    return arr;
+  }
+  static TId deserializeId(const TIdSerialized& arr) {
+    TId id = 0;
+    std::memcpy(&id, &arr[0], arr.size());
+    return id;
+  }
+  TId docId() const { return id_; }
+  std::vector<std::string> allTexts() const { return doc_.allTexts(); }
+};
+
+TEST_F(TestSearch, PositionsWideIds) {
+  static_assert(!FileStore<DocWide>::StoresPositions);
+  typedef Db<FileStore<DocWide>> TWideDb;
+  FileStore<DocWide> store(path() / "wide");
+  TWideDb db(store);
+  // tokens of documents are checked instead of positions
+  db.settings.positions = true;
+  db.add(DocWide(1ull << 40, "new york city"));
+  db.add(DocWide(2, "york is new"));
+  db.add(DocWide(3, "new big york"));
+
+  SearchSettings<DocWide> sett;
+  sett.query = "\"new york\"";
+  sett.phraseQuery = true;
+  auto res = findMany<TWideDb>({&db}, sett);
+  ASSERT_EQ(res.size(), 1u);
+  EXPECT_EQ(res[0].id, 1ull << 40);
+
+  sett.query = "big york new";
+  CompProximity<Result<DocWide>> cmp;
+  res = findMany<TWideDb>({&db}, sett, cmp);
+  ASSERT_EQ(res.size(), 1u);
+  EXPECT_EQ(res[0].scores[0], 2.0f);
+}
+
+TEST_F(DbSimpleTest, BlockMax) {
+  std::mt19937 gen(7);
+  auto randomDoc = [&](DocSimple::TId id) {
+    std::string txt;
+    size_t n = 1 + gen() % 12;
+    for (size_t i = 0; i < n; ++i) {
+      // first words are more common
+      auto w = std::min(gen() % 40, gen() % 40);
+      txt += "w" + std::to_string(w) + " ";
+    }
+    return DocSimple(id, txt);
+  };
+  for (DocSimple::TId id = 1; id <= 1500; ++id) {
+    db.add(randomDoc(id));
+  }
+
+  auto compare = [&](const std::string& query, bool matchAny) {
+    SearchSettings<DocSimple> sett;
+    sett.query = query;
+    sett.matchAnyToken = matchAny;
+    sett.autocomplete = false;
+    sett.offset = 3;
+    sett.limit = 10;
+    CompBM25<Result<DocSimple>> cmp;
+    auto res = findMany<TSearchDb>({&db}, sett, cmp);
+    {
+      auto lock = db.lockRead();
+      EXPECT_TRUE(db.findTopBM25(sett, 13, lock, 1.2f, 0.75f));
+    }
+    // filter scores all matches
+    sett.funcFilter = [](const Result<DocSimple>&) { return true; };
+    auto res2 = findMany<TSearchDb>({&db}, sett, cmp);
+    ASSERT_EQ(res.size(), res2.size()) << query;
+    for (size_t i = 0; i < res.size(); ++i) {
+      EXPECT_EQ(res[i].id, res2[i].id) << query;
+      EXPECT_EQ(res[i].scores[0], res2[i].scores[0]) << query;
+    }
+  };
+  auto compareAll = [&]() {
+    for (bool matchAny : {false, true}) {
+      compare("w0 w5", matchAny);
+      compare("w1 w2 w30", matchAny);
+      compare("w39 w0", matchAny);
+      compare("w3", matchAny);
+    }
+  };
+  compareAll();
+
+  // bounds of changed blocks are calculated again
+  for (DocSimple::TId id = 1; id <= 1500; id += 7) {
+    db.remove(id);
+  }
+  for (DocSimple::TId id = 2; id <= 1500; id += 5) {
+    db.add(randomDoc(id));
+  }
+  compareAll();
+  for (const auto& bm : store.findTokenBlockMax("w0")) {
+    EXPECT_GT(bm.maxFreq, 0u);
+  }
+}
+
+TEST_F(TestSearch, FindManyDbs) {
+  typedef Db<MemoryStore<DocSimple>> TMemoryDb;
+  MemoryStore<DocSimple> store0, store1, store2;
+  TMemoryDb db0(store0), db1(store1), db2(store2);
+  db0.add(DocSimple(1, "red apple"));
+  db0.add(DocSimple(2, "apple"));
+  db1.add(DocSimple(1, "apple pie apple"));
+  db1.add(DocSimple(3, "green"));
+  db2.add(DocSimple(5, "apple tree"));
+  db2.add(DocSimple(6, "red apple"));
+  std::vector<const TMemoryDb*> dbs{&db0, &db1, &db2};
+
+  // page continues over dbs in their order
+  SearchSettings<DocSimple> sett;
+  sett.query = "apple";
+  sett.offset = 1;
+  sett.limit = 3;
+  auto res = findMany<TMemoryDb>(dbs, sett);
+  ASSERT_EQ(res.size(), 3u);
+  EXPECT_EQ(res[0].dbIndex, 0u);
+  EXPECT_EQ(res[0].id, 2u);
+  EXPECT_EQ(res[1].dbIndex, 1u);
+  EXPECT_EQ(res[2].dbIndex, 2u);
+  EXPECT_EQ(res[2].id, 5u);
+
+  // best of each db are merged, equal ones keep order of dbs
+  sett.query = "red apple";
+  sett.matchAnyToken = true;
+  sett.funcFilter = [](const Result<DocSimple>& res) { return res.id != 2; };
+  CompWordsTogether<Result<DocSimple>> cmp;
+  res = findMany<TMemoryDb>(dbs, sett, cmp);
+  ASSERT_EQ(res.size(), 3u);
+  EXPECT_EQ(res[0].dbIndex, 2u);
+  EXPECT_EQ(res[0].id, 6u);
+  EXPECT_EQ(res[1].dbIndex, 1u);
+  EXPECT_EQ(res[2].dbIndex, 2u);
+  EXPECT_EQ(res[2].id, 5u);
+
+  SearchManager manager;
+  sett.manager = &manager;
+  manager.cancel();
+  EXPECT_THROW(findMany<TMemoryDb>(dbs, sett, cmp), SearchCanceledException);
+  manager.reset();
+  EXPECT_EQ(findMany<TMemoryDb>(dbs, sett, cmp).size(), 3u);
+}
+
+TEST_F(DbSimpleTest, LoadThreads) {
+  for (DocSimple::TId id = 1; id <= 3000; ++id) {
+    db.add(DocSimple(id, "abc " + std::to_string(id % 7) + " " +
+                             std::to_string(id % 13)));
+  }
+  SearchSettings<DocSimple> sett;
+  sett.query = "abc 3";
+  sett.matchAnyToken = true;
+  sett.funcFilter = [](const Result<DocSimple>& res) {
+    return res.id % 5 != 0;
+  };
+  sett.offset = 10;
+  sett.limit = 100;
+  CompWordsTogether<Result<DocSimple>> cmp1;
+  CompBM25<Result<DocSimple>> cmp2;
+  auto res = findMany<TSearchDb>({&db}, sett, cmp1, cmp2);
+  ASSERT_EQ(res.size(), 100u);
+
+  // chunks of documents are loaded in threads of pool
+  ThreadPool pool(3);
+  sett.pool = &pool;
+  sett.loadThreads = 0;
+  auto res2 = findMany<TSearchDb>({&db}, sett, cmp1, cmp2);
+  ASSERT_EQ(res2.size(), res.size());
+  for (size_t i = 0; i < res.size(); ++i) {
+    EXPECT_EQ(res2[i].id, res[i].id);
+    EXPECT_EQ(res2[i].scores[0], res[i].scores[0]);
+  }
+}
+
+TEST_F(DbSimpleTest, DocViews) {
+  for (DocSimple::TId id = 1; id <= 2500; ++id) {
+    db.add(DocSimple(id, "abc " + std::to_string(id % 11) + " d" +
+                             std::to_string(id % 17)));
+  }
+  for (DocSimple::TId id = 1; id <= 2500; id += 9) {
+    db.remove(id);
+  }
+  SearchSettings<DocSimple> sett;
+  sett.query = "abc 4 d";
+  sett.matchAnyToken = true;
+  sett.offset = 30;
+  sett.limit = 50;
+  CompIsWhole<Result<DocSimple>> cmp1;
+  CompWordsTogether<Result<DocSimple>> cmp2;
+  CompBM25<Result<DocSimple>> cmp3;
+  // sorted in store, only page is loaded
+  auto res = findMany<TSearchDb>({&db}, sett, cmp1, cmp2, cmp3);
+  ASSERT_EQ(res.size(), 50u);
+
+  // filter loads all documents
+  sett.funcFilter = [](const Result<DocSimple>&) { return true; };
+  auto res2 = findMany<TSearchDb>({&db}, sett, cmp1, cmp2, cmp3);
+  ASSERT_EQ(res2.size(), res.size());
+  for (size_t i = 0; i < res.size(); ++i) {
+    EXPECT_EQ(res[i].id, res2[i].id);
+    EXPECT_EQ(res[i].doc.allTexts(), res2[i].doc.allTexts());
+    EXPECT_EQ(res[i].tokens, res2[i].tokens);
+    EXPECT_EQ(res[i].scores[0], res2[i].scores[0]);
+  }
+
+  auto view = store.findDocView(res[0].id);
+  ASSERT_TRUE(view.has_value());
+  EXPECT_EQ(view->tokens(), res[0].tokens);
+  EXPECT_EQ(view->doc(res[0].id).allTexts(), res[0].doc.allTexts());
+  EXPECT_FALSE(store.findDocView(1).has_value());
+}
+
+TEST_F(DbSimpleTest, QueryCache) {
+  for (DocSimple::TId id = 1; id <= 200; ++id) {
+    db.add(DocSimple(id, "abc " + std::to_string(id % 10)));
+  }
+  QueryCache<DocSimple> cache(1 << 20);
+  SearchSettings<DocSimple> sett;
+  sett.query = "abc 3";
+  sett.matchAnyToken = true;
+  sett.limit = 10;
+  sett.cache = &cache;
+  CompWordsTogether<Result<DocSimple>> cmp;
+  auto res = findMany<TSearchDb>({&db}, sett, cmp);
+  auto res2 = findMany<TSearchDb>({&db}, sett, cmp);
+  EXPECT_EQ(cache.misses(), 1u);
+  EXPECT_EQ(cache.hits(), 1u);
+  ASSERT_EQ(res.size(), 10u);
+  ASSERT_EQ(res2.size(), res.size());
+  for (size_t i = 0; i < res.size(); ++i) {
+    EXPECT_EQ(res2[i].id, res[i].id);
+    EXPECT_EQ(res2[i].doc.allTexts(), res[i].doc.allTexts());
+  }
+  EXPECT_EQ(res[0].id, 3u);
+
+  // write changes generation of db
+  db.remove(3);
+  auto res3 = findMany<TSearchDb>({&db}, sett, cmp);
+  EXPECT_EQ(cache.misses(), 2u);
+  ASSERT_FALSE(res3.empty());
+  EXPECT_EQ(res3[0].id, 13u);
+
+  // comparators with other parameters have own pages, callback isn't cached
+  CompBM25<Result<DocSimple>> cmpScore;
+  CompBM25<Result<DocSimple>> cmpScore2(2.0f, 0.5f);
+  findMany<TSearchDb>({&db}, sett, cmpScore);
+  findMany<TSearchDb>({&db}, sett, cmpScore2);
+  EXPECT_EQ(cache.misses(), 4u);
+  CompPriorityTextsCallback<Result<DocSimple>> cmpCallback(
+      [](const DocSimple&, std::vector<uint8_t>&) {});
+  findMany<TSearchDb>({&db}, sett, cmpCallback);
+  findMany<TSearchDb>({&db}, sett, cmpCallback);
+  EXPECT_EQ(cache.misses(), 4u);
+  EXPECT_EQ(cache.hits(), 1u);
+
+  // settings of db are part of key
+  db.settings.autocomplete = false;
+  findMany<TSearchDb>({&db}, sett, cmp);
+  EXPECT_EQ(cache.misses(), 5u);
+  db.settings.autocomplete = true;
+
+  // least recently used pages are removed
+  QueryCache<DocSimple> small(4000, 2);
+  sett.cache = &small;
+  for (size_t offset = 0; offset < 100; ++offset) {
+    sett.offset = offset;
+    findMany<TSearchDb>({&db}, sett, cmp);
+    EXPECT_LE(small.sizeInBytes(), 4000u);
+  }
+  EXPECT_GT(small.sizeInBytes(), 0u);
+
+  // db created at address of destroyed one doesn't get its pages
+  typedef Db<MemoryStore<DocSimple>> TMemoryDb;
+  MemoryStore<DocSimple> store2, store3;
+  std::optional<TMemoryDb> db2(std::in_place, store2);
+  db2->add(DocSimple(1, "abc 3"));
+  sett.offset = 0;
+  sett.cache = &cache;
+  auto res4 = findMany<TMemoryDb>({&*db2}, sett, cmp);
+  ASSERT_EQ(res4.size(), 1u);
+  const auto* address = &*db2;
+  db2.reset();
+  db2.emplace(store3);
+  ASSERT_EQ(&*db2, address);
+  db2->add(DocSimple(7, "abc 3"));
+  auto res5 = findMany<TMemoryDb>({&*db2}, sett, cmp);
+  ASSERT_EQ(res5.size(), 1u);
+  EXPECT_EQ(res5[0].id, 7u);
+}
+
+TEST_F(DbSimpleTest, SearchCursor) {
+  for (DocSimple::TId id = 1; id <= 2000; ++id) {
+    db.add(DocSimple(id, "abc " + std::to_string(id % 7) + " x" +
+                             std::to_string(id % 5)));
+  }
+  for (DocSimple::TId id = 1; id <= 2000; id += 11) {
+    db.remove(id);
+  }
+  SearchSettings<DocSimple> sett;
+  sett.query = "abc 3 x";
+  sett.matchAnyToken = true;
+  typedef CompWordsTogether<Result<DocSimple>> TCmp1;
+  typedef CompBM25<Result<DocSimple>> TCmp2;
+  TCmp1 cmp1;
+  TCmp2 cmp2;
+  auto all = findMany<TSearchDb>({&db}, sett, cmp1, cmp2);
+  ASSERT_GT(all.size(), 1000u);
+
+  // batches in same order as findMany
+  SearchCursor<TSearchDb, TCmp1, TCmp2> cursor({&db}, sett, cmp1, cmp2);
+  std::vector<DocSimple::TId> ids;
+  std::string token;
+  while (!cursor.done()) {
+    for (const auto& r : cursor.next(300)) {
+      ids.push_back(r.id);
+    }
+    if (ids.size() == 600) {
+      token = cursor.token();
+    }
+  }
+  ASSERT_EQ(ids.size(), all.size());
+  for (size_t i = 0; i < all.size(); ++i) {
+    EXPECT_EQ(ids[i], all[i].id);
+  }
+
+  // other cursor continues from token
+  SearchCursor<TSearchDb, TCmp1, TCmp2> cursor2({&db}, sett, cmp1, cmp2);
+  cursor2.resume(token);
+  auto res = cursor2.next(100);
+  ASSERT_EQ(res.size(), 100u);
+  for (size_t i = 0; i < res.size(); ++i) {
+    EXPECT_EQ(res[i].id, all[600 + i].id);
+    EXPECT_EQ(res[i].scores[0], all[600 + i].scores[0]);
+  }
+  EXPECT_THROW(cursor2.resume("xyz"), std::runtime_error);
+
+  // results are searched again after write, keys of CompBM25 would change
+  auto all1 = findMany<TSearchDb>({&db}, sett, cmp1);
+  SearchCursor<TSearchDb, TCmp1> cursor3({&db}, sett, cmp1);
+  cursor3.next(100);
+  db.remove(all1[150].id);
+  res = cursor3.next(100);
+  ASSERT_EQ(res.size(), 100u);
+  EXPECT_EQ(res[49].id, all1[149].id);
+  EXPECT_EQ(res[50].id, all1[151].id);
+}
+
+TEST_F(DbSimpleTest, AutocompleteMaxLen) {
+  FileStore<DocSimple> store2(path() / "short");
+  TSearchDb db2(store2);
+  db2.settings.autocompleteMaxLen = 3;
+  for (DocSimple::TId id = 1; id <= 300; ++id) {
+    auto txt = "čokolada" + std::to_string(id % 30) + " abcdef" +
+               std::to_string(id % 7);
+    db.add(DocSimple(id, txt));
+    db2.add(DocSimple(id, txt));
+  }
+  db.remove(12);
+  db2.remove(12);
+
+  // prefixes longer than 3 bytes are checked in index
+  const char* queries[] = {"ab", "abc", "abcdef1", "čo", "čok", "čokolada2",
+                           "abcdef3 čokolada1", "čokoladax", "abcdefg"};
+  for (auto query : queries) {
+    EXPECT_EQ(search(query), [&] {
+      SearchSettings<DocSimple> sett;
+      sett.query = query;
+      CompIsWhole<Result<DocSimple>> cmp1;
+      CompWordsTogether<Result<DocSimple>> cmp2;
+      TRes arr;
+      for (const auto& r : findMany<TSearchDb>({&db2}, sett, cmp1, cmp2)) {
+        arr.push_back(r.id);
+      }
+      return arr;
+    }()) << query;
+  }
+  EXPECT_EQ(search("čokolada2").size(), 110u);
+
+  // BM25 is answered from index
+  SearchSettings<DocSimple> sett;
+  sett.query = "abcdef3 čokolada1";
+  tokenizeQuery(sett);
+  auto lock = db2.lockRead();
+  EXPECT_TRUE(db2.findTopBM25(sett, 10, lock, 1.2f, 0.75f).has_value());
+}
+
+TEST_F(DbSimpleTest, PrefixDictionary) {
+  auto writers = db.bulkWriters(2);
+  auto store2 = std::make_unique<FileStore<DocSimple>>(path() / "dict");
+  auto db2 = std::make_unique<TSearchDb>(*store2);
+  db2->settings.prefixDictionary = true;
+  auto writers2 = db2->bulkWriters(2);
+  for (DocSimple::TId id = 1; id <= 5000; ++id) {
+    auto txt = "abc" + std::to_string(id % 50) + " x" + std::to_string(id);
+    writers[id % 2].add(DocSimple(id, txt));
+    writers2[id % 2].add(DocSimple(id, txt));
+  }
+  db.bulkAdd(writers);
+  db2->bulkAdd(writers2);
+  db.add(DocSimple(7, "banana split"));
+  db2->add(DocSimple(7, "banana split"));
+  db.remove(8);
+  db2->remove(8);
+  // only whole tokens and their frequencies are stored
+  EXPECT_LT(store2->sizeTokens() * 2, store.sizeTokens());
+
+  auto find = [](TSearchDb& db, std::string_view query, bool bm25) {
+    SearchSettings<DocSimple> sett;
+    sett.query = query;
+    sett.limit = 30;
+    CompWordsTogether<Result<DocSimple>> cmp1;
+    CompBM25<Result<DocSimple>> cmp2;
+    auto res = bm25 ? findMany<TSearchDb>({&db}, sett, cmp2)
+                    : findMany<TSearchDb>({&db}, sett, cmp1, cmp2);
+    std::vector<std::pair<DocSimple::TId, float>> arr;
+    for (const auto& r : res) {
+      arr.push_back({r.id, r.scores[0]});
+    }
+    return arr;
+  };
+  // abc has all documents and is read as bitmap
+  const char* queries[] = {"abc", "abc1", "abc12", "x49", "ban", "x7 abc",
+                           "split ba", "abc3 x30", "abcd", "q"};
+  for (auto query : queries) {
+    for (bool bm25 : {false, true}) {
+      EXPECT_EQ(find(db, query, bm25), find(*db2, query, bm25)) << query;
+    }
+  }
+  EXPECT_EQ(find(*db2, "ban", false).size(), 1u);
+  EXPECT_EQ(find(*db2, "x499", false).size(), 11u);
+
+  // dictionary is saved, missing one is built from tokens
+  auto expected = find(*db2, "abc4", false);
+  for (bool removeDict : {false, true}) {
+    db2.reset();
+    store2.reset();
+    if (removeDict) {
+      fs::remove(path() / "dict.dict");
+    }
+    store2 = std::make_unique<FileStore<DocSimple>>(path() / "dict");
+    db2 = std::make_unique<TSearchDb>(*store2);
+    db2->settings.prefixDictionary = true;
+    EXPECT_EQ(find(*db2, "abc4", false), expected);
+    EXPECT_EQ(store2->findTokensWithPrefix("banan"),
+              std::vector<std::string>{"banana"});
+  }
+}
+
+TEST_F(DbSimpleTest, Fuzzy) {
+  // characters of utf8 token
+  auto chars = [](const std::string& txt) {
+    std::vector<std::string> arr;
+    for (size_t i = 0; i < txt.size(); i += charLen(txt[i])) {
+      arr.push_back(txt.substr(i, charLen(txt[i])));
+    }
+    return arr;
+  };
+  auto distance = [&](const std::string& a2, const std::string& b2) {
+    auto a = chars(a2);
+    auto b = chars(b2);
+    std::vector<size_t> row(b.size() + 1);
+    for (size_t j = 0; j <= b.size(); ++j) {
+      row[j] = j;
+    }
+    for (size_t i = 1; i <= a.size(); ++i) {
+      auto prev = row;
+      row[0] = i;
+      for (size_t j = 1; j <= b.size(); ++j) {
+        row[j] = std::min({prev[j] + 1, row[j - 1] + 1,
+                           prev[j - 1] + (a[i - 1] == b[j - 1] ? 0 : 1)});
+      }
+    }
+    return row.back();
+  };
+
+  std::mt19937 rng(7);
+  const char* letters[] = {"a", "b", "c", "d", "č"};
+  auto randomToken = [&] {
+    std::string txt;
+    for (size_t n = 1 + rng() % 6; n > 0; --n) {
+      txt += letters[rng() % 5];
+    }
+    return txt;
+  };
+  MemoryStore<DocSimple> store2;
+  Db<MemoryStore<DocSimple>> db2(store2);
+  auto writers = db.bulkWriters(2);
+  for (DocSimple::TId id = 1; id <= 4000; ++id) {
+    DocSimple doc(id, randomToken() + " " + randomToken());
+    // later documents are in memory of dictionary
+    if (id <= 3000) {
+      writers[id % 2].add(doc);
+    }
+    db2.add(doc);
+  }
+  db.bulkAdd(writers);
+  for (DocSimple::TId id = 3001; id <= 4000; ++id) {
+    db.add(store2.findDoc(id)->first);
+  }
+
+  auto all = store.findTokensWithPrefix("");
+  EXPECT_EQ(all, store2.findTokensWithPrefix(""));
+  for (size_t q = 0; q < 15; ++q) {
+    auto token = randomToken();
+    for (uint8_t dist : {1, 2}) {
+      for (size_t prefixLen : {0, 1, 2}) {
+        std::vector<std::pair<std::string, uint8_t>> expected;
+        for (const auto& tk : all) {
+          auto d = distance(token, tk);
+          auto a = chars(token);
+          auto b = chars(tk);
+          size_t p = std::min(prefixLen, a.size());
+          bool samePrefix = b.size() >= p && std::equal(a.begin(),
+                                                        a.begin() + p,
+                                                        b.begin());
+          if (d <= dist && samePrefix) {
+            expected.push_back({tk, (uint8_t)d});
+          }
+        }
+        EXPECT_EQ(store.findTokensFuzzy(token, dist, prefixLen), expected)
+            << token;
+        EXPECT_EQ(store2.findTokensFuzzy(token, dist, prefixLen), expected)
+            << token;
+      }
+    }
+  }
+
+  // closest tokens are first
+  db.add(DocSimple(5001, "banana split"));
+  db.add(DocSimple(5002, "bananas split"));
+  db.add(DocSimple(5003, "banama split"));
+  SearchSettings<DocSimple> sett;
+  sett.query = "banama split";
+  sett.autocomplete = false;
+  CompFuzzy<Result<DocSimple>> cmp;
+  EXPECT_EQ(findMany<TSearchDb>({&db}, sett, cmp).size(), 1u);
+  sett.fuzzyDistance = 2;
+  auto res = findMany<TSearchDb>({&db}, sett, cmp);
+  ASSERT_EQ(res.size(), 3u);
+  EXPECT_EQ(res[0].id, 5003u);
+  EXPECT_EQ(res[1].id, 5001u);
+  EXPECT_EQ(res[1].scores[0], 1.0f);
+  EXPECT_EQ(res[2].id, 5002u);
+  EXPECT_EQ(res[2].scores[0], 2.0f);
+}
+
+TEST_F(DbSimpleTest, BooleanQuery) {
+  // AND binds stronger than OR, mistakes are skipped
+  auto key = [](std::string_view query) { return parseQuery(query)->key(); };
+  EXPECT_EQ(key("a OR b c"), key("a OR (b AND c)"));
+  EXPECT_EQ(key("-(a OR \"b c\") d*"), key("NOT (a OR \"b c\") AND d*"));
+  EXPECT_EQ(key("((a AND NOT b"), key("a -b"));
+  EXPECT_NE(key("\"b*\""), key("b*"));
+  EXPECT_EQ(parseQuery("a OR b c")->children[1].type, QueryNode::And);
+  EXPECT_FALSE(parseQuery("NOT ) OR"));
+
+  std::mt19937 rng(5);
+  const char* words[] = {"alpha", "beta", "gamma", "delta", "epsilon", "zeta"};
+  std::vector<std::vector<std::string>> docs(1);
+  auto writers = db.bulkWriters(2);
+  for (DocSimple::TId id = 1; id <= 9000; ++id) {
+    std::vector<std::string> tokens{"w" + std::to_string(id % 50)};
+    for (size_t i = 0; i < 4; ++i) {
+      tokens.push_back(words[rng() % 6]);
+    }
+    std::shuffle(tokens.begin(), tokens.end(), rng);
+    writers[id % 2].add(DocSimple(id, joinTokens(tokens)));
+    docs.push_back(std::move(tokens));
+  }
+  db.bulkAdd(writers);
+
+  // query applied to tokens of each document
+  std::function<bool(const std::vector<std::string>&, const QueryNode&)>
+      matches = [&](const auto& tokens, const QueryNode& node) {
+        switch (node.type) {
+        case QueryNode::Token:
+          return std::count(tokens.begin(), tokens.end(), node.tokens[0]) > 0;
+        case QueryNode::Prefix:
+          return std::any_of(tokens.begin(), tokens.end(), [&](auto& tk) {
+            return tk.compare(0, node.tokens[0].size(), node.tokens[0]) == 0;
+          });
+        case QueryNode::Phrase:
+          return std::search(tokens.begin(), tokens.end(),
+                             node.tokens.begin(),
+                             node.tokens.end()) != tokens.end();
+        case QueryNode::Not:
+          return !matches(tokens, node.children[0]);
+        case QueryNode::Or:
+          return std::any_of(node.children.begin(), node.children.end(),
+                             [&](auto& c) { return matches(tokens, c); });
+        default:
+          return std::all_of(node.children.begin(), node.children.end(),
+                             [&](auto& c) { return matches(tokens, c); });
+        }
+      };
+
+  // long lists are combined as bitmaps, short ones by postings
+  for (const char* query :
+       {"alpha beta", "alpha OR beta", "alpha -beta", "alpha AND NOT beta",
+        "(alpha OR beta) -gamma", "alpha (beta OR -gamma)",
+        "\"alpha beta\" OR delta", "alp* -\"beta gamma\"", "NOT alpha delta",
+        "alpha OR beta OR gamma -delta -epsilon", "(alpha OR w1*) zeta",
+        "-(alpha OR beta) gamma", "nothere OR alpha", "alpha nothere",
+        "w7 -alpha", "w1* (beta OR gamma)", "\"w3 alpha\"", "w4 --alpha",
+        "alpha OR -beta", "-alpha", "-alpha -w1*", "NOT (alpha OR beta)"}) {
+    SearchSettings<DocSimple> sett;
+    sett.query = query;
+    sett.booleanQuery = true;
+    ASSERT_TRUE(tokenizeQuery(sett));
+    TRes expected;
+    for (DocSimple::TId id = 1; id <= 9000; ++id) {
+      if (matches(docs[id], *sett.queryTree)) {
+        expected.push_back(id);
+      }
+    }
+    EXPECT_EQ(db.findMatchAll(sett), expected) << query;
+  }
+
+  // query only of NOT excludes from all documents
+  SearchSettings<DocSimple> sett;
+  sett.query = "-alpha -beta";
+  sett.booleanQuery = true;
+  auto resNot = findMany<TSearchDb>({&db}, sett);
+  ASSERT_FALSE(resNot.empty());
+  for (const auto& r : resNot) {
+    EXPECT_EQ(std::count(docs[r.id].begin(), docs[r.id].end(), "alpha"), 0);
+    EXPECT_EQ(std::count(docs[r.id].begin(), docs[r.id].end(), "beta"), 0);
+  }
+
+  // ranked by scores from index, excluded tokens are not scored
+  sett.query = "w1 -alpha -beta gamma";
+  sett.limit = 10;
+  CompBM25<Result<DocSimple>> cmp;
+  auto res = findMany<TSearchDb>({&db}, sett, cmp);
+  ASSERT_EQ(res.size(), 10u);
+  for (const auto& r : res) {
+    EXPECT_EQ(std::count(docs[r.id].begin(), docs[r.id].end(), "w1"), 1);
+    EXPECT_EQ(std::count(docs[r.id].begin(), docs[r.id].end(), "alpha"), 0);
+    EXPECT_GT(r.scores[0], 0.0f);
+  }
+}
+
+// text starts with tenant and time of document
+class DocTenant : public DocSimple {
+public:
+  using DocSimple::DocSimple;
+
+  std::vector<int64_t> attributes() const {
+    std::istringstream in(allTexts()[0]);
+    int64_t tenant = 0, time = 0;
+    in >> tenant >> time;
+    return {tenant, time};
+  }
+};
+
+TEST_F(TestSearch, AttributeFilters) {
+  typedef Db<FileStore<DocTenant>> TTenantDb;
+  typedef Db<MemoryStore<DocTenant>> TMemoryDb;
+  auto pth = path() / "tenants";
+  auto store = std::make_unique<FileStore<DocTenant>>(pth);
+  auto db = std::make_unique<TTenantDb>(*store);
+  MemoryStore<DocTenant> store2;
+  TMemoryDb db2(store2);
+
+  std::mt19937 rng(3);
+  const char* words[] = {"apple", "banana", "cherry"};
+  std::map<DocTenant::TId, std::string> docs;
+  auto writers = db->bulkWriters(2);
+  for (DocTenant::TId id = 1; id <= 6000; ++id) {
+    auto txt = std::to_string(rng() % 5) + " " +
+               std::to_string(rng() % 1000) + " " + words[rng() % 3] + " " +
+               words[rng() % 3];
+    // later documents are added one by one
+    if (id <= 4000) {
+      writers[id % 2].add(DocTenant(id, txt));
+    }
+    docs[id] = txt;
+    db2.add(DocTenant(id, txt));
+  }
+  db->bulkAdd(writers);
+  for (DocTenant::TId id = 4001; id <= 6000; ++id) {
+    db->add(DocTenant(id, docs[id]));
+  }
+  for (DocTenant::TId id = 1; id <= 100; ++id) {
+    db->remove(id);
+    db2.remove(id);
+    docs.erase(id);
+  }
+  docs[200] = "9 5 apple";
+  db->add(DocTenant(200, docs[200]));
+  db2.add(DocTenant(200, docs[200]));
+  // sparse id and smallest value
+  const DocTenant::TId bigId = 4'000'000'000u;
+  docs[bigId] = "-9223372036854775808 5 apple";
+  db->add(DocTenant(bigId, docs[bigId]));
+  db2.add(DocTenant(bigId, docs[bigId]));
+  EXPECT_LT(fs::file_size(pth.string() + ".attrs"), 1'000'000u);
+
+  std::vector<std::vector<AttributeFilter>> filterSets{
+      {AttributeFilter::eq(0, 9)},
+      {AttributeFilter::eq(0, 2), AttributeFilter::range(1, 100, 120)},
+      {AttributeFilter::in(0, {1, 3}), AttributeFilter::range(1, 0, 900)},
+      {AttributeFilter::range(1, 0, 1000)},
+      {AttributeFilter::in(0, {})},
+      {AttributeFilter::eq(2, 0)},
+      {AttributeFilter::eq(0, std::numeric_limits<int64_t>::min())}};
+  auto check = [&](const auto& db, size_t n) {
+    for (const auto& filters : filterSets) {
+      for (const char* query : {"apple", "apple banana", "cherry -apple"}) {
+        for (bool isBoolean : {false, true}) {
+          SearchSettings<DocTenant> sett;
+          sett.query = query;
+          sett.booleanQuery = isBoolean;
+          sett.filters = filters;
+          ASSERT_TRUE(tokenizeQuery(sett));
+          std::vector<DocTenant::TId> expected;
+          for (const auto& pair : docs) {
+            auto attrs = DocTenant(pair.first, pair.second).attributes();
+            bool ok = true;
+            for (const auto& f : filters) {
+              ok = ok && f.column < attrs.size() && f.matches(attrs[f.column]);
+            }
+            if (ok) {
+              expected.push_back(pair.first);
+            }
+          }
+          // same as matches without filters which pass them
+          auto sett2 = sett;
+          sett2.filters.clear();
+          intersectSorted(expected, db.findMatchAll(sett2));
+          EXPECT_EQ(db.findMatchAll(sett), expected) << query << " " << n;
+        }
+      }
+    }
+  };
+  check(*db, 0);
+  check(db2, 1);
+
+  // top of scores from index is same as when all documents are scored
+  SearchSettings<DocTenant> sett;
+  sett.query = "apple";
+  sett.limit = 10;
+  sett.filters = filterSets[2];
+  CompBM25<Result<DocTenant>> cmp;
+  auto res = findMany<TTenantDb>({db.get()}, sett, cmp);
+  sett.filters.clear();
+  sett.funcFilter = [&](const Result<DocTenant>& r) {
+    auto attrs = r.doc.attributes();
+    return (attrs[0] == 1 || attrs[0] == 3) && attrs[1] <= 900;
+  };
+  auto res2 = findMany<TTenantDb>({db.get()}, sett, cmp);
+  ASSERT_EQ(res.size(), 10u);
+  ASSERT_EQ(res2.size(), 10u);
+  for (size_t i = 0; i < res.size(); ++i) {
+    EXPECT_EQ(res[i].id, res2[i].id);
+  }
+
+  // columns are saved and rebuilt from documents when file is missing
+  for (bool removeFile : {false, true}) {
+    db.reset();
+    store.reset();
+    if (removeFile) {
+      fs::remove(pth.string() + ".attrs");
+    }
+    store = std::make_unique<FileStore<DocTenant>>(pth);
+    db = std::make_unique<TTenantDb>(*store);
+    check(*db, 2);
+  }
+}
+
+template <class TComp>
+struct CompWithoutKey {
+  TComp comp;
+  template <class TArr, class TSett>
+  void init(const TArr& all, const TSett& sett) {
+    comp.init(all, sett);
+  }
+  void clean() {}
+  template <class TRes>
+  int compare(const TRes& d1, const TRes& d2) const {
+    return comp.compare(d1, d2);
+  }
+};
+
+TEST_F(TestSearch, SortKeys) {
+  typedef Result<DocSimple> TRes;
+  const char* texts[] = {"abc def", "def abc", "abc x def", "abc", "x y"};
+  std::vector<TRes> arr;
+  for (uint32_t i = 0; i < 20000; ++i) {
+    std::string txt = texts[(i * 7919) % 5];
+    arr.emplace_back(0, i, i, DocSimple(i, txt), tokenize(txt));
+  }
+  auto arr2 = arr;
+  SearchSettings<DocSimple> sett;
+  sett.tokens = {"abc", "def"};
+  sett.tokensJoined = joinTokens(sett.tokens);
+
+  CompIsWhole<TRes> cmp1;
+  CompWordsTogether<TRes> cmp2;
+  sortDocs(arr, sett, cmp1, cmp2);
+  CompWithoutKey<CompIsWhole<TRes>> cmp3;
+  CompWithoutKey<CompWordsTogether<TRes>> cmp4;
+  sortDocs(arr2, sett, cmp3, cmp4);
+  ASSERT_EQ(arr.size(), arr2.size());
+  for (size_t i = 0; i < arr.size(); ++i) {
+    ASSERT_EQ(arr[i].id, arr2[i].id);
+  }
+
+  // callback is called from one thread, its exception reaches caller
+  std::mutex mutex;
+  std::set<std::thread::id> threads;
+  CompPriorityTextsCallback<TRes> cmp5(
+      [&](const DocSimple& doc, std::vector<uint8_t>&) {
+        std::lock_guard<std::mutex> lock(mutex);
+        threads.insert(std::this_thread::get_id());
+        if (doc.docId() == 19999) {
+          throw std::runtime_error("callback failed");
+        }
+      });
+  EXPECT_THROW(sortDocs(arr, sett, cmp5), std::runtime_error);
+  EXPECT_EQ(threads.size(), 1u);
+}